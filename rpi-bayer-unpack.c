@@ -0,0 +1,74 @@
+/*
+ * Unpacking of raw 10-bit Bayer rows from the camera
+ *
+ * Every 5 byte group is spread to four 16 bit lanes with a table lookup,
+ * once for the high bytes and once for the byte of the low bits, which is
+ * then shifted right by 0, 2, 4 and 6 bits per lane. NEON is used when
+ * compiled for it (add -mfpu=neon to CFLAGS on Raspberry Pi 2 and newer)
+ * and SSSE3 on x86 for the byte shuffles, which SSE2 doesn't have.
+ */
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BAYER_USE_NEON
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define BAYER_USE_SSSE3
+#endif
+
+#include "rpi-bayer-unpack.hpp"
+
+void unpack_raw10_row(const unsigned char *src, uint16_t *dst, int width)
+{
+    int i = 0;
+    const unsigned char *p;
+#if defined(BAYER_USE_NEON)
+    static const uint8_t hi_index[8] = { 0, 1, 2, 3, 5, 6, 7, 8 };
+    static const uint8_t lo_index[8] = { 4, 4, 4, 4, 9, 9, 9, 9 };
+    static const int16_t lo_shift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+    uint8x8_t hi_tbl = vld1_u8(hi_index), lo_tbl = vld1_u8(lo_index);
+    int16x8_t shift = vld1q_s16(lo_shift);
+    uint16x8_t mask = vdupq_n_u16(3);
+    // 8 pixels from 10 bytes per step, the 16 byte loads must stay inside the row
+    for(; i + 16 <= width; i += 8) {
+        uint8x8x2_t in;
+        in.val[0] = vld1_u8(src + i / 4 * 5);
+        in.val[1] = vld1_u8(src + i / 4 * 5 + 8);
+        uint16x8_t hi = vshll_n_u8(vtbl2_u8(in, hi_tbl), 2);
+        uint16x8_t lo = vandq_u16(vshlq_u16(vmovl_u8(vtbl2_u8(in, lo_tbl)), shift), mask);
+        vst1q_u16(dst + i, vorrq_u16(hi, lo));
+    }
+#elif defined(BAYER_USE_SSSE3)
+    __m128i hi_shuffle = _mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1);
+    __m128i lo_shuffle = _mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1);
+    // No per lane shifts, multiply the low bits to bits 7:6 and shift them down
+    __m128i lo_scale = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+    __m128i mask = _mm_set1_epi16(3);
+    for(; i + 16 <= width; i += 8) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i / 4 * 5));
+        __m128i hi = _mm_slli_epi16(_mm_shuffle_epi8(in, hi_shuffle), 2);
+        __m128i lo = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(in, lo_shuffle), lo_scale), 6), mask);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(hi, lo));
+    }
+#endif
+    for(; i < width; i += 4) {
+        p = src + i / 4 * 5;
+        dst[i]     = (p[0] << 2) | (p[4] & 3);
+        dst[i + 1] = (p[1] << 2) | ((p[4] >> 2) & 3);
+        dst[i + 2] = (p[2] << 2) | ((p[4] >> 4) & 3);
+        dst[i + 3] = (p[3] << 2) | (p[4] >> 6);
+    }
+}
+
+void bin_raw10_rows(const unsigned char *src0, const unsigned char *src1, unsigned char *dst, int width)
+{
+    const unsigned char *p0, *p1;
+    int i;
+
+    for(i = 0; i < width; i += 4) {
+        p0 = src0 + i / 4 * 5;
+        p1 = src1 + i / 4 * 5;
+        dst[i / 2]     = (p0[0] + p0[1] + p1[0] + p1[1] + 2) >> 2;
+        dst[i / 2 + 1] = (p0[2] + p0[3] + p1[2] + p1[3] + 2) >> 2;
+    }
+}
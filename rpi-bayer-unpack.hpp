@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * Unpacking of raw 10-bit Bayer rows from the camera
+ *
+ * The sensor packs 4 pixels in to 5 bytes: the high 8 bits of each pixel
+ * followed by a byte holding the low 2 bits of all four, pixel 0 in the
+ * lowest bits. Widths are multiples of 4.
+ */
+#include <stdint.h>
+
+// Bytes of a packed row without the stride padding
+#define RAW10_ROW_BYTES(width)          ((width) / 4 * 5)
+
+// Unpack width pixels of a packed row to 16 bit samples of 0 .. 1023
+extern void unpack_raw10_row(const unsigned char *src, uint16_t *dst, int width);
+// Bin two packed rows of width pixels to width / 2 8 bit samples, each the
+// mean of the high 8 bits of a 2x2 Bayer quad, i.e. a gray preview
+extern void bin_raw10_rows(const unsigned char *src0, const unsigned char *src1, unsigned char *dst, int width);
@@ -0,0 +1,418 @@
+/*
+ * Camera pipeline handing the frames out to the calling process
+ *
+ * The pipeline is the one of rpi-camera-dump-yuv: the camera video output
+ * port buffers are read by us and the preview output port is tunneled to a
+ * null sink. Filled buffers are queued by the callback and taken by
+ * camera_capture_next() in the caller's thread.
+ */
+
+#include <errno.h>
+#include <time.h>
+
+#include "rpi-camera-capture.hpp"
+
+#define CAMERA_CAPTURE_TEARDOWN_TIMEOUT_MS      1000
+
+// OMX calls this handler for all the events it emits
+static OMX_ERRORTYPE event_handler(
+        OMX_HANDLETYPE hComponent,
+        OMX_PTR pAppData,
+        OMX_EVENTTYPE eEvent,
+        OMX_U32 nData1,
+        OMX_U32 nData2,
+        OMX_PTR pEventData) {
+
+    dump_event(hComponent, eEvent, nData1, nData2);
+
+    camera_capture *cc = (camera_capture *)pAppData;
+
+    switch(eEvent) {
+        case OMX_EventCmdComplete:
+            vcos_semaphore_wait(&cc->sync_.handler_lock);
+            if(nData1 == OMX_CommandFlush) {
+                cc->sync_.flushed = 1;
+            }
+            vcos_semaphore_post(&cc->sync_.handler_lock);
+            omx_command_complete(hComponent, nData1, nData2);
+            break;
+        case OMX_EventParamOrConfigChanged:
+            vcos_semaphore_wait(&cc->sync_.handler_lock);
+            if(nData2 == OMX_IndexParamCameraDeviceNumber) {
+                cc->cammodule_.camera_ready = 1;
+            }
+            vcos_semaphore_post(&cc->sync_.handler_lock);
+            break;
+        case OMX_EventError:
+            omx_die(nData1, "error event received");
+            break;
+        default:
+            break;
+    }
+
+    return OMX_ErrorNone;
+}
+
+// Called by OMX when the camera component has filled
+// an output buffer with captured video data
+static OMX_ERRORTYPE fill_output_buffer_done_handler(
+        OMX_HANDLETYPE hComponent,
+        OMX_PTR pAppData,
+        OMX_BUFFERHEADERTYPE* pBuffer) {
+    camera_capture *cc = (camera_capture *)pAppData;
+    pthread_mutex_lock(&cc->lock);
+    cc->filled[(cc->filled_head + cc->filled_count) % CAMERA_CAPTURE_MAX_BUFFERS] = pBuffer;
+    cc->filled_count++;
+    cc->cammodule_.camera_output_buffer_time = monotonic_time_us();
+    pthread_cond_signal(&cc->cond);
+    pthread_mutex_unlock(&cc->lock);
+    return OMX_ErrorNone;
+}
+
+static OMX_CALLBACKTYPE callbacks = {
+    .EventHandler   = event_handler,
+    .FillBufferDone = fill_output_buffer_done_handler,
+};
+
+// Hand a buffer back to the camera to be filled
+static void refill(camera_capture *cc, OMX_BUFFERHEADERTYPE *buf)
+{
+    OMX_ERRORTYPE r;
+    if((r = OMX_FillThisBuffer(cc->cammodule_.camera, buf)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
+    }
+}
+
+// Oldest filled buffer or NULL if none arrived before the deadline
+static OMX_BUFFERHEADERTYPE *take_filled(camera_capture *cc, const struct timespec *deadline)
+{
+    OMX_BUFFERHEADERTYPE *buf = NULL;
+    pthread_mutex_lock(&cc->lock);
+    while(cc->filled_count == 0) {
+        if(deadline == NULL) {
+            pthread_cond_wait(&cc->cond, &cc->lock);
+        } else if(pthread_cond_timedwait(&cc->cond, &cc->lock, deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if(cc->filled_count > 0) {
+        buf = cc->filled[cc->filled_head];
+        cc->filled_head = (cc->filled_head + 1) % CAMERA_CAPTURE_MAX_BUFFERS;
+        cc->filled_count--;
+    }
+    pthread_mutex_unlock(&cc->lock);
+    return buf;
+}
+
+// Free pool frame or -1 if the caller holds all of them
+static int acquire_pool_frame(camera_capture *cc)
+{
+    int i, frame = -1;
+    pthread_mutex_lock(&cc->lock);
+    for(i = 0; i < CAMERA_CAPTURE_POOL_FRAMES; i++) {
+        if(!cc->pool_held[i]) {
+            cc->pool_held[i] = 1;
+            frame = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cc->lock);
+    return frame;
+}
+
+void camera_capture_open(camera_capture *cc, int width, int height, int framerate, int buffers)
+{
+    OMX_ERRORTYPE r;
+    int i;
+
+    memset(cc, 0, sizeof(*cc));
+    cc->assembling = -1;
+    cc->frame_start = 1;
+    if(buffers < 1 || buffers > CAMERA_CAPTURE_MAX_BUFFERS) {
+        die("Number of camera buffers must be 1 .. %d", CAMERA_CAPTURE_MAX_BUFFERS);
+    }
+
+    bcm_host_init();
+    if((r = OMX_Init()) != OMX_ErrorNone) {
+        omx_die(r, "OMX initalization failed");
+    }
+    if(vcos_semaphore_create(&cc->sync_.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
+        die("Failed to create handler lock semaphore");
+    }
+    pthread_mutex_init(&cc->lock, NULL);
+    pthread_cond_init(&cc->cond, NULL);
+
+    init_component_handle("camera", &cc->cammodule_.camera, cc, &callbacks);
+    init_component_handle("null_sink", &cc->null_sink, cc, &callbacks);
+
+    say("Configuring camera...");
+    if((r = config_omx_camera(&cc->cammodule_, width, height, framerate, -1)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to configure camera");
+    }
+
+    // Ask for buffers holding whole frames, the camera may insist on slices
+    OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
+    OMX_INIT_STRUCTURE(camera_portdef);
+    camera_portdef.nPortIndex = 71;
+    if((r = OMX_GetParameter(cc->cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for camera video output port 71");
+    }
+    camera_portdef.format.video.nSliceHeight = (height + 15) & ~15;
+    camera_portdef.nBufferCountActual = buffers;
+    if((r = OMX_SetParameter(cc->cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        say("Camera doesn't take whole frame buffers, error 0x%08x, falling back to slices", r);
+        OMX_INIT_STRUCTURE(camera_portdef);
+        camera_portdef.nPortIndex = 71;
+        if((r = OMX_GetParameter(cc->cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to get port definition for camera video output port 71");
+        }
+        camera_portdef.nBufferCountActual = buffers;
+        if((r = OMX_SetParameter(cc->cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to set buffer count for camera video output port 71");
+        }
+    }
+
+    // Tunnel camera preview output port and null sink input port
+    say("Setting up tunnel from camera preview output port 70 to null sink input port 240...");
+    if((r = OMX_SetupTunnel(cc->cammodule_.camera, 70, cc->null_sink, 240)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to setup tunnel between camera preview output port 70 and null sink input port 240");
+    }
+
+    // Switch components to idle state
+    say("Switching state of the camera component to idle...");
+    if((r = OMX_SendCommand(cc->cammodule_.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the camera component to idle");
+    }
+    block_until_state_changed(cc->cammodule_.camera, OMX_StateIdle);
+    say("Switching state of the null sink component to idle...");
+    if((r = OMX_SendCommand(cc->null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the null sink component to idle");
+    }
+    block_until_state_changed(cc->null_sink, OMX_StateIdle);
+
+    // Enable ports
+    say("Enabling ports...");
+    if((r = OMX_SendCommand(cc->cammodule_.camera, OMX_CommandPortEnable, 73, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable camera input port 73");
+    }
+    block_until_port_changed(cc->cammodule_.camera, 73, OMX_TRUE);
+    if((r = OMX_SendCommand(cc->cammodule_.camera, OMX_CommandPortEnable, 70, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable camera preview output port 70");
+    }
+    block_until_port_changed(cc->cammodule_.camera, 70, OMX_TRUE);
+    if((r = OMX_SendCommand(cc->cammodule_.camera, OMX_CommandPortEnable, 71, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable camera video output port 71");
+    }
+    block_until_port_changed(cc->cammodule_.camera, 71, OMX_TRUE);
+    if((r = OMX_SendCommand(cc->null_sink, OMX_CommandPortEnable, 240, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable null sink input port 240");
+    }
+    block_until_port_changed(cc->null_sink, 240, OMX_TRUE);
+
+    // Allocate camera input buffer and video output buffers
+    say("Allocating buffers...");
+    OMX_INIT_STRUCTURE(camera_portdef);
+    camera_portdef.nPortIndex = 73;
+    if((r = OMX_GetParameter(cc->cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for camera input port 73");
+    }
+    if((r = OMX_AllocateBuffer(cc->cammodule_.camera, &cc->cammodule_.camera_ppBuffer_in, 73, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to allocate buffer for camera input port 73");
+    }
+    OMX_INIT_STRUCTURE(camera_portdef);
+    camera_portdef.nPortIndex = 71;
+    if((r = OMX_GetParameter(cc->cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for camera video output port 71");
+    }
+    cc->buffer_count = camera_portdef.nBufferCountActual;
+    if(cc->buffer_count > CAMERA_CAPTURE_MAX_BUFFERS) {
+        die("Camera wants %d buffers, at most %d supported", cc->buffer_count, CAMERA_CAPTURE_MAX_BUFFERS);
+    }
+    for(i = 0; i < cc->buffer_count; i++) {
+        if((r = OMX_AllocateBuffer(cc->cammodule_.camera, &cc->buffers[i], 71, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer %d for camera video output port 71", i);
+        }
+    }
+
+    get_i420_frame_info(camera_portdef.format.video.nFrameWidth, camera_portdef.format.video.nFrameHeight,
+        camera_portdef.format.video.nStride, camera_portdef.format.video.nSliceHeight, &cc->frame_info);
+    get_i420_frame_info(cc->frame_info.buf_stride, cc->frame_info.buf_slice_height, -1, -1, &cc->buf_info);
+    dump_frame_info("Destination frame", &cc->frame_info);
+    dump_frame_info("Source buffer", &cc->buf_info);
+    cc->whole_frames = cc->frame_info.buf_slice_height >= cc->frame_info.height;
+    if(cc->whole_frames) {
+        say("Handing out frames in place in %d camera buffers of %d bytes", cc->buffer_count, camera_portdef.nBufferSize);
+    } else {
+        cc->unpack = get_i420_unpack_fn(&cc->frame_info, &cc->buf_info);
+        for(i = 0; i < CAMERA_CAPTURE_POOL_FRAMES; i++) {
+            if((cc->pool[i] = malloc(cc->frame_info.size)) == NULL) {
+                die("Failed to allocate memory for frame pool");
+            }
+        }
+        say("Unpacking slices of %d rows to a pool of %d frames with the routine for %s frames",
+            cc->buf_info.height, CAMERA_CAPTURE_POOL_FRAMES, dump_i420_unpack_fn(cc->unpack));
+    }
+
+    // Switch state of the components prior to starting the capture
+    say("Switching state of the camera component to executing...");
+    if((r = OMX_SendCommand(cc->cammodule_.camera, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the camera component to executing");
+    }
+    block_until_state_changed(cc->cammodule_.camera, OMX_StateExecuting);
+    say("Switching state of the null sink component to executing...");
+    if((r = OMX_SendCommand(cc->null_sink, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the null sink component to executing");
+    }
+    block_until_state_changed(cc->null_sink, OMX_StateExecuting);
+
+    // Start capturing video with the camera
+    say("Switching on capture on camera video output port 71...");
+    OMX_CONFIG_PORTBOOLEANTYPE capture;
+    OMX_INIT_STRUCTURE(capture);
+    capture.nPortIndex = 71;
+    capture.bEnabled = OMX_TRUE;
+    if((r = OMX_SetParameter(cc->cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch on capture on camera video output port 71");
+    }
+    for(i = 0; i < cc->buffer_count; i++) {
+        refill(cc, cc->buffers[i]);
+    }
+}
+
+int camera_capture_next(camera_capture *cc, camera_frame *frame, int timeout_ms)
+{
+    OMX_BUFFERHEADERTYPE *buf;
+    struct timespec deadline;
+    int i, end_of_frame, valid_spans_y;
+
+    if(timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    while(1) {
+        if((buf = take_filled(cc, timeout_ms >= 0 ? &deadline : NULL)) == NULL) {
+            return 0;
+        }
+        end_of_frame = (buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) != 0;
+
+        // The frame is handed out in the camera buffer as it is
+        if(cc->whole_frames) {
+            if(buf->nFilledLen == 0 || !end_of_frame) {
+                refill(cc, buf);
+                continue;
+            }
+            frame->buffer = buf;
+            frame->pool_frame = -1;
+            for(i = 0; i < 3; i++) {
+                frame->planes[i] = buf->pBuffer + buf->nOffset + cc->buf_info.p_offset[i];
+                frame->strides[i] = cc->buf_info.p_stride[i];
+            }
+            break;
+        }
+
+        // Unpack the slice and hand the buffer straight back, a frame
+        // starting while all the pool frames are held is dropped
+        if(cc->frame_start) {
+            cc->slice_num = 0;
+            if((cc->assembling = acquire_pool_frame(cc)) < 0) {
+                cc->frames_dropped++;
+            }
+        }
+        if(cc->assembling >= 0 && buf->nFilledLen > 0) {
+            valid_spans_y = cc->buf_info.height - (end_of_frame ? cc->frame_info.buf_extra_padding : 0);
+            cc->unpack(cc->pool[cc->assembling], buf->pBuffer + buf->nOffset,
+                &cc->frame_info, &cc->buf_info, cc->slice_num, valid_spans_y);
+        }
+        cc->slice_num++;
+        cc->frame_start = end_of_frame;
+        if(!end_of_frame || cc->assembling < 0) {
+            refill(cc, buf);
+            continue;
+        }
+        frame->buffer = NULL;
+        frame->pool_frame = cc->assembling;
+        for(i = 0; i < 3; i++) {
+            frame->planes[i] = cc->pool[cc->assembling] + cc->frame_info.p_offset[i];
+            frame->strides[i] = cc->frame_info.p_stride[i];
+        }
+        cc->assembling = -1;
+        break;
+    }
+
+    frame->sequence = ++cc->sequence;
+    frame->timestamp = omx_ticks_to_int64(buf->nTimeStamp);
+    frame->width = cc->frame_info.width;
+    frame->height = cc->frame_info.height;
+    if(frame->buffer == NULL) {
+        refill(cc, buf);
+    }
+    cc->frames++;
+    return 1;
+}
+
+void camera_capture_release(camera_capture *cc, camera_frame *frame)
+{
+    if(frame->buffer != NULL) {
+        refill(cc, frame->buffer);
+        frame->buffer = NULL;
+    } else if(frame->pool_frame >= 0) {
+        pthread_mutex_lock(&cc->lock);
+        cc->pool_held[frame->pool_frame] = 0;
+        pthread_mutex_unlock(&cc->lock);
+        frame->pool_frame = -1;
+    }
+}
+
+void camera_capture_close(camera_capture *cc)
+{
+    OMX_ERRORTYPE r;
+    int i;
+
+    say("Captured %lu frames, %lu dropped while all the pool frames were held", cc->frames, cc->frames_dropped);
+
+    // Stop capturing, the buffers still with the camera are returned by the flush
+    OMX_CONFIG_PORTBOOLEANTYPE capture;
+    OMX_INIT_STRUCTURE(capture);
+    capture.nPortIndex = 71;
+    capture.bEnabled = OMX_FALSE;
+    if((r = OMX_SetParameter(cc->cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch off capture on camera video output port 71");
+    }
+
+    // Flush, disable and stop the components at once
+    teardown_component components[2];
+    memset(components, 0, sizeof(components));
+    components[0].component = cc->cammodule_.camera;
+    components[0].name = "camera";
+    teardown_add_port(&components[0], 73, cc->cammodule_.camera_ppBuffer_in);
+    teardown_add_port(&components[0], 70, NULL);
+    teardown_add_port_buffers(&components[0], 71, cc->buffers, cc->buffer_count);
+    components[1].component = cc->null_sink;
+    components[1].name = "null sink";
+    teardown_add_port(&components[1], 240, NULL);
+    teardown_components(components, 2, CAMERA_CAPTURE_TEARDOWN_TIMEOUT_MS);
+
+    // Free the component handles
+    if((r = OMX_FreeHandle(cc->cammodule_.camera)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to free camera component handle");
+    }
+    if((r = OMX_FreeHandle(cc->null_sink)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to free null sink component handle");
+    }
+
+    for(i = 0; i < CAMERA_CAPTURE_POOL_FRAMES; i++) {
+        free(cc->pool[i]);
+    }
+    pthread_cond_destroy(&cc->cond);
+    pthread_mutex_destroy(&cc->lock);
+    vcos_semaphore_delete(&cc->sync_.handler_lock);
+    if((r = OMX_Deinit()) != OMX_ErrorNone) {
+        omx_die(r, "OMX de-initalization failed");
+    }
+}
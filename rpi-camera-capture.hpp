@@ -0,0 +1,174 @@
+#pragma once
+
+/*
+ * Pulling I420 frames from the camera video output port straight in to the
+ * calling process, for programs embedding the camera instead of reading the
+ * output of rpi-camera-dump-yuv
+ *
+ * If the camera accepts a slice height covering the whole frame, each camera
+ * buffer holds a complete frame and it's handed out in place. Otherwise the
+ * slices are unpacked in to a small pool of frames. Either way a frame stays
+ * valid until it's released, and the camera drops frames while the caller
+ * holds on to all of them.
+ *
+ * C++ programs get a session object and move-only frame views releasing the
+ * frame on destruction, see the end of this header.
+ */
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "rpi-i420-framing.hpp"
+#include "rpi-camera-params.hpp"
+
+#define CAMERA_CAPTURE_MAX_BUFFERS      8
+// Frames the slices are unpacked to when the camera doesn't deliver whole frames
+#define CAMERA_CAPTURE_POOL_FRAMES      3
+
+// A frame taken from the camera, valid until released
+typedef struct
+{
+    uint64_t sequence;
+    // nTimeStamp of the camera buffer, microseconds
+    int64_t timestamp;
+    int width;
+    int height;
+    // Y, U and V planes
+    const unsigned char *planes[3];
+    int strides[3];
+    // Camera buffer the frame is in, or the pool frame it was unpacked to
+    OMX_BUFFERHEADERTYPE *buffer;
+    int pool_frame;
+} camera_frame;
+
+typedef struct
+{
+    appctx_sync sync_;
+    OmxCameraModule cammodule_;
+    OMX_HANDLETYPE null_sink;
+
+    i420_frame_info frame_info;
+    i420_frame_info buf_info;
+    // Each camera buffer holds a whole frame handed out in place
+    int whole_frames;
+    i420_unpack_fn unpack;
+
+    OMX_BUFFERHEADERTYPE *buffers[CAMERA_CAPTURE_MAX_BUFFERS];
+    int buffer_count;
+    // Buffers filled by the camera in order, waiting to be taken
+    OMX_BUFFERHEADERTYPE *filled[CAMERA_CAPTURE_MAX_BUFFERS];
+    int filled_head;
+    int filled_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    unsigned char *pool[CAMERA_CAPTURE_POOL_FRAMES];
+    int pool_held[CAMERA_CAPTURE_POOL_FRAMES];
+    // Pool frame being assembled, -1 when dropping the rest of the frame
+    int assembling;
+    int slice_num;
+    int frame_start;
+
+    uint64_t sequence;
+
+    // Counters
+    unsigned long frames;
+    unsigned long frames_dropped;
+} camera_capture;
+
+// Set up the camera and start capturing. buffers is the number of camera
+// buffers, i.e. how many frames the caller can hold at once when the
+// buffers hold whole frames. Fails by exiting like the rest of the demos.
+extern void camera_capture_open(camera_capture *cc, int width, int height, int framerate, int buffers);
+// Take the next frame, waiting up to timeout_ms for it or forever if
+// negative. Returns 1 if a frame was taken and 0 on timeout.
+extern int camera_capture_next(camera_capture *cc, camera_frame *frame, int timeout_ms);
+// Give the frame back to the camera or the pool, its planes mustn't be
+// touched afterwards. May be called from any thread.
+extern void camera_capture_release(camera_capture *cc, camera_frame *frame);
+// Stop capturing and free everything, all the frames must have been released
+extern void camera_capture_close(camera_capture *cc);
+
+#ifdef __cplusplus
+}
+
+namespace rpi {
+
+// Frame held until the view is destroyed or reset
+class camera_frame_view
+{
+public:
+    camera_frame_view() : capture_(nullptr), frame_() {}
+    camera_frame_view(camera_capture *capture, const camera_frame &frame) : capture_(capture), frame_(frame) {}
+    camera_frame_view(camera_frame_view &&other) noexcept : capture_(other.capture_), frame_(other.frame_)
+    {
+        other.capture_ = nullptr;
+    }
+    camera_frame_view &operator=(camera_frame_view &&other) noexcept
+    {
+        if(this != &other) {
+            reset();
+            capture_ = other.capture_;
+            frame_ = other.frame_;
+            other.capture_ = nullptr;
+        }
+        return *this;
+    }
+    camera_frame_view(const camera_frame_view &) = delete;
+    camera_frame_view &operator=(const camera_frame_view &) = delete;
+    ~camera_frame_view() { reset(); }
+
+    // False if no frame arrived in time
+    explicit operator bool() const { return capture_ != nullptr; }
+    const unsigned char *plane(int i) const { return frame_.planes[i]; }
+    int stride(int i) const { return frame_.strides[i]; }
+    int width() const { return frame_.width; }
+    int height() const { return frame_.height; }
+    int64_t timestamp() const { return frame_.timestamp; }
+    uint64_t sequence() const { return frame_.sequence; }
+
+    void reset()
+    {
+        if(capture_ != nullptr) {
+            camera_capture_release(capture_, &frame_);
+            capture_ = nullptr;
+        }
+    }
+
+private:
+    camera_capture *capture_;
+    camera_frame frame_;
+};
+
+// The camera pipeline, the frame views must be gone before it's destroyed
+class camera_session
+{
+public:
+    camera_session(int width, int height, int framerate, int buffers = 3)
+    {
+        camera_capture_open(&capture_, width, height, framerate, buffers);
+    }
+    ~camera_session() { camera_capture_close(&capture_); }
+    // The address is handed to OMX as the callback data
+    camera_session(const camera_session &) = delete;
+    camera_session &operator=(const camera_session &) = delete;
+
+    camera_frame_view next_frame(int timeout_ms = -1)
+    {
+        camera_frame frame;
+        if(camera_capture_next(&capture_, &frame, timeout_ms) > 0) {
+            return camera_frame_view(&capture_, frame);
+        }
+        return camera_frame_view();
+    }
+    const camera_capture &capture() const { return capture_; }
+
+private:
+    camera_capture capture_;
+};
+
+}
+#endif
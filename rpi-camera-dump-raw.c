@@ -0,0 +1,427 @@
+/*
+ * Short intro about this program:
+ *
+ * `rpi-camera-dump-raw` records raw 10-bit Bayer sensor data using the
+ * RaspiCam module and dumps it to `stdout`, before any of the processing
+ * done by the ISP of the camera.
+ *
+ *     $ ./rpi-camera-dump-raw >test.raw
+ *
+ * `rpi-camera-dump-raw` uses `camera` and `null_sink` components like
+ * `rpi-camera-dump-yuv`, with the `camera` video output port switched to
+ * OMX_COLOR_FormatRawBayer10bit. The frames are written as the packed rows
+ * of 4 pixels in 5 bytes without the stride padding by default. If
+ * RAW_UNPACK is enabled below, they are unpacked to 16-bit little endian
+ * samples instead.
+ *
+ * If RAW_PREVIEW is enabled below, every RAW_PREVIEW_INTERVAL frame is also
+ * binned 2x2 to a gray 8-bit frame of half the size and dumped to file
+ * descriptor RAW_PREVIEW_FD, e.g.
+ *
+ *     $ ./rpi-camera-dump-raw >test.raw 3>test-preview.gray
+ *
+ * Please see README.mdwn for more detailed description of this
+ * OpenMAX IL demos for Raspberry Pi bundle.
+ *
+ */
+
+#include "rpi-i420-framing.hpp"
+#include "rpi-camera-params.hpp"
+#include "rpi-video-params.hpp"
+#include "rpi-output-queue.hpp"
+#include "rpi-bayer-unpack.hpp"
+
+// Hard coded parameters for the raw output
+#define RAW_UNPACK                      0                        // 16-bit samples instead of packed rows
+#define RAW_PREVIEW                     0
+#define RAW_PREVIEW_INTERVAL            5                        // every nth frame
+#define RAW_PREVIEW_FD                  3
+#define TEARDOWN_TIMEOUT_MS             1000                     // per teardown step
+
+// Hard coded parameters for the output queue
+#define OUTPUT_QUEUE_LENGTH             4                        // frames
+#define OUTPUT_QUEUE_POLICY             OUTPUT_QUEUE_DROP_OLDEST // output_queue_policy
+
+// Global variable used by the signal handler and capture loop
+static int want_quit = 0;
+
+// Our application context passed around
+// the main routine and callback handlers
+typedef struct
+{
+    appctx_sync sync_ ;
+    OmxCameraModule cammodule_;
+
+    // null_sink module
+    OMX_HANDLETYPE null_sink;
+
+    FILE *fd_out;
+    FILE *fd_preview;
+
+    // Queues drained by the writer threads
+    output_queue out_queue_;
+    output_queue preview_queue_;
+} appctx;
+
+// Global signal handler for trapping SIGINT, SIGTERM, and SIGQUIT
+static void signal_handler(int signal) {
+    want_quit = 1;
+}
+
+// OMX calls this handler for all the events it emits
+static OMX_ERRORTYPE event_handler(
+        OMX_HANDLETYPE hComponent,
+        OMX_PTR pAppData,
+        OMX_EVENTTYPE eEvent,
+        OMX_U32 nData1,
+        OMX_U32 nData2,
+        OMX_PTR pEventData) {
+
+    dump_event(hComponent, eEvent, nData1, nData2);
+
+    appctx *ctx = (appctx *)pAppData;
+
+    switch(eEvent) {
+        case OMX_EventCmdComplete:
+            vcos_semaphore_wait(&ctx->sync_.handler_lock);
+            if(nData1 == OMX_CommandFlush) {
+                ctx->sync_.flushed = 1;
+            }
+            vcos_semaphore_post(&ctx->sync_.handler_lock);
+            omx_command_complete(hComponent, nData1, nData2);
+            break;
+        case OMX_EventParamOrConfigChanged:
+            vcos_semaphore_wait(&ctx->sync_.handler_lock);
+            if(nData2 == OMX_IndexParamCameraDeviceNumber) {
+                ctx->cammodule_.camera_ready = 1;
+            }
+            vcos_semaphore_post(&ctx->sync_.handler_lock);
+            break;
+        case OMX_EventError:
+            omx_die(nData1, "error event received");
+            break;
+        default:
+            break;
+    }
+
+    return OMX_ErrorNone;
+}
+
+// Called by OMX when the camera component has filled
+// the output buffer with captured raw data
+static OMX_ERRORTYPE fill_output_buffer_done_handler(
+        OMX_HANDLETYPE hComponent,
+        OMX_PTR pAppData,
+        OMX_BUFFERHEADERTYPE* pBuffer) {
+    appctx *ctx = ((appctx*)pAppData);
+    vcos_semaphore_wait(&ctx->sync_.handler_lock);
+    // The main loop can now flush the buffer to output file
+    ctx->cammodule_.camera_output_buffer_available = 1;
+    vcos_semaphore_post(&ctx->sync_.handler_lock);
+    return OMX_ErrorNone;
+}
+
+int main(int argc, char **argv) {
+    bcm_host_init();
+
+    OMX_ERRORTYPE r;
+
+    if((r = OMX_Init()) != OMX_ErrorNone) {
+        omx_die(r, "OMX initalization failed");
+    }
+
+    // Init context
+    appctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    if(vcos_semaphore_create(&ctx.sync_.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
+        die("Failed to create handler lock semaphore");
+    }
+
+    // Init component handles
+    OMX_CALLBACKTYPE callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.EventHandler   = event_handler;
+    callbacks.FillBufferDone = fill_output_buffer_done_handler;
+
+    init_component_handle("camera", &ctx.cammodule_.camera , &ctx, &callbacks);
+    init_component_handle("null_sink", &ctx.null_sink, &ctx, &callbacks);
+
+    say("Configuring camera...");
+    if((r = config_omx_camera(&ctx.cammodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE, -1)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to configure camera");
+    }
+    if((r = config_omx_camera_raw(&ctx.cammodule_)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to configure camera for raw Bayer output");
+    }
+
+    // Null sink input port definition is done automatically upon tunneling
+
+    // Tunnel camera preview output port and null sink input port
+    say("Setting up tunnel from camera preview output port 70 to null sink input port 240...");
+    if((r = OMX_SetupTunnel(ctx.cammodule_.camera, 70, ctx.null_sink, 240)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to setup tunnel between camera preview output port 70 and null sink input port 240");
+    }
+
+    // Switch components to idle state
+    say("Switching state of the camera component to idle...");
+    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the camera component to idle");
+    }
+    block_until_state_changed(ctx.cammodule_.camera, OMX_StateIdle);
+    say("Switching state of the null sink component to idle...");
+    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the null sink component to idle");
+    }
+    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
+
+    // Enable ports
+    say("Enabling ports...");
+    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortEnable, 73, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable camera input port 73");
+    }
+    block_until_port_changed(ctx.cammodule_.camera, 73, OMX_TRUE);
+    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortEnable, 70, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable camera preview output port 70");
+    }
+    block_until_port_changed(ctx.cammodule_.camera, 70, OMX_TRUE);
+    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortEnable, 71, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable camera video output port 71");
+    }
+    block_until_port_changed(ctx.cammodule_.camera, 71, OMX_TRUE);
+    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortEnable, 240, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to enable null sink input port 240");
+    }
+    block_until_port_changed(ctx.null_sink, 240, OMX_TRUE);
+
+    // Allocate camera input and video output buffers,
+    // buffers for tunneled ports are allocated internally by OMX
+    say("Allocating buffers...");
+    OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
+    OMX_INIT_STRUCTURE(camera_portdef);
+    camera_portdef.nPortIndex = 73;
+    if((r = OMX_GetParameter(ctx.cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for camera input port 73");
+    }
+    if((r = OMX_AllocateBuffer(ctx.cammodule_.camera, &ctx.cammodule_.camera_ppBuffer_in, 73, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to allocate buffer for camera input port 73");
+    }
+    camera_portdef.nPortIndex = 71;
+    if((r = OMX_GetParameter(ctx.cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for camera video output port 71");
+    }
+    if((r = OMX_AllocateBuffer(ctx.cammodule_.camera, &ctx.cammodule_.camera_ppBuffer_out, 71, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to allocate buffer for camera video output port 71");
+    }
+
+    // Just use stdout for output
+    say("Opening input and output files...");
+    ctx.fd_out = stdout;
+
+    // Switch state of the components prior to starting
+    // the video capture loop
+    say("Switching state of the camera component to executing...");
+    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the camera component to executing");
+    }
+    block_until_state_changed(ctx.cammodule_.camera, OMX_StateExecuting);
+    say("Switching state of the null sink component to executing...");
+    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the null sink component to executing");
+    }
+    block_until_state_changed(ctx.null_sink, OMX_StateExecuting);
+
+    // Start capturing video with the camera
+    say("Switching on capture on camera video output port 71...");
+    OMX_CONFIG_PORTBOOLEANTYPE capture;
+    OMX_INIT_STRUCTURE(capture);
+    capture.nPortIndex = 71;
+    capture.bEnabled = OMX_TRUE;
+    if((r = OMX_SetParameter(ctx.cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch on capture on camera video output port 71");
+    }
+
+    say("Configured port definition for camera video output port 71");
+    dump_port(ctx.cammodule_.camera, 71, OMX_FALSE);
+
+    // Geometry of the raw frames
+    int width = camera_portdef.format.video.nFrameWidth;
+    int height = camera_portdef.format.video.nFrameHeight;
+    int buf_stride = camera_portdef.format.video.nStride;
+    int slice_height = camera_portdef.format.video.nSliceHeight > 0 ? camera_portdef.format.video.nSliceHeight : height;
+    size_t row_bytes = RAW_UNPACK ? width * sizeof(uint16_t) : RAW10_ROW_BYTES(width);
+    size_t frame_size = row_bytes * height;
+    size_t preview_size = (size_t)(width / 2) * (height / 2);
+    if(camera_portdef.format.video.eColorFormat != OMX_COLOR_FormatRawBayer10bit) {
+        die("Camera emits %s instead of raw Bayer data", dump_color_format(camera_portdef.format.video.eColorFormat));
+    }
+    if(width % 4 != 0 || (slice_height % 2 != 0 && slice_height != height) || buf_stride < RAW10_ROW_BYTES(width)) {
+        die("Unsupported raw frame geometry %dx%d, stride %d, slice height %d", width, height, buf_stride, slice_height);
+    }
+    say("Dumping %dx%d raw frames of %d bytes as %s, %d rows per buffer of stride %d",
+        width, height, frame_size, RAW_UNPACK ? "16-bit samples" : "packed 10-bit rows", slice_height, buf_stride);
+
+    output_queue_init(&ctx.out_queue_, "Raw frame", fileno(ctx.fd_out), OUTPUT_QUEUE_LENGTH, frame_size, OUTPUT_QUEUE_POLICY);
+    output_queue_item *frame_item = output_queue_acquire(&ctx.out_queue_);
+    // Queue item for the binned preview, only acquired for the frames to be tapped
+    output_queue_item *preview_item = NULL;
+    if(RAW_PREVIEW) {
+        say("Opening preview output file descriptor %d...", RAW_PREVIEW_FD);
+        if((ctx.fd_preview = fdopen(RAW_PREVIEW_FD, "w")) == NULL) {
+            die("Failed to open preview output file descriptor %d: %s", RAW_PREVIEW_FD, strerror(errno));
+        }
+        output_queue_init(&ctx.preview_queue_, "Raw preview", fileno(ctx.fd_preview), OUTPUT_QUEUE_LENGTH, preview_size, OUTPUT_QUEUE_POLICY);
+    }
+
+    // Some counters
+    int frame_num = 1, buf_num = 0, frame_row = 0, rows, row;
+    // For unpack memory copy operation
+    const unsigned char *buf_start, *src;
+    // For controlling the loop
+    int quit_detected = 0, quit_in_frame_boundry = 0, need_next_buffer_to_be_filled = 1;
+
+    say("Enter capture loop, press Ctrl-C to quit...");
+
+    signal(SIGINT,  signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGQUIT, signal_handler);
+
+    while(1) {
+        // fill_output_buffer_done_handler() has marked that there's
+        // a buffer for us to flush
+        if(ctx.cammodule_.camera_output_buffer_available) {
+            // Don't exit the loop in the middle of a frame
+            if(want_quit && !quit_detected) {
+                say("Exit signal detected, waiting for next frame boundry before exiting...");
+                quit_detected = 1;
+                quit_in_frame_boundry = ctx.cammodule_.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+            }
+            if(quit_detected &&
+                    (quit_in_frame_boundry ^
+                    (ctx.cammodule_.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME))) {
+                say("Frame boundry reached, exiting loop...");
+                break;
+            }
+            // Start of the OMX buffer data
+            buf_start = ctx.cammodule_.camera_ppBuffer_out->pBuffer
+                + ctx.cammodule_.camera_ppBuffer_out->nOffset;
+            // The last buffer of a frame may hold fewer rows
+            rows = height - frame_row < slice_height ? height - frame_row : slice_height;
+            if(RAW_PREVIEW && buf_num == 0 && (frame_num - 1) % RAW_PREVIEW_INTERVAL == 0) {
+                preview_item = output_queue_acquire(&ctx.preview_queue_);
+            }
+            for(row = 0; row < rows; row++) {
+                src = buf_start + (size_t)row * buf_stride;
+                if(RAW_UNPACK) {
+                    unpack_raw10_row(src, (uint16_t *)(frame_item->data + (frame_row + row) * row_bytes), width);
+                } else {
+                    // Strip the stride padding
+                    memcpy(frame_item->data + (frame_row + row) * row_bytes, src, row_bytes);
+                }
+                // Bin each pair of rows while they're still in the cache
+                if(preview_item != NULL && row % 2 == 1) {
+                    bin_raw10_rows(src - buf_stride, src,
+                        (unsigned char *)preview_item->data + (size_t)(frame_row + row) / 2 * (width / 2), width);
+                }
+            }
+            frame_row += rows;
+            buf_num++;
+            say("Read %d bytes from buffer %d of frame %d, copied %d rows",
+                ctx.cammodule_.camera_ppBuffer_out->nFilledLen, buf_num, frame_num, rows);
+            if(ctx.cammodule_.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+                if(frame_row != height) {
+                    die("Frame rows read %d don't match the frame height %d", frame_row, height);
+                }
+                say("Captured frame %d, queuing %d bytes", frame_num, frame_size);
+                if(preview_item != NULL) {
+                    preview_item->len = preview_size;
+                    preview_item->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+                    preview_item->timestamp = omx_ticks_to_int64(ctx.cammodule_.camera_ppBuffer_out->nTimeStamp);
+                    output_queue_commit(&ctx.preview_queue_, preview_item);
+                    preview_item = NULL;
+                }
+                frame_item->len = frame_size;
+                frame_item->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+                frame_item->timestamp = omx_ticks_to_int64(ctx.cammodule_.camera_ppBuffer_out->nTimeStamp);
+                output_queue_commit(&ctx.out_queue_, frame_item);
+                frame_item = output_queue_acquire(&ctx.out_queue_);
+                frame_num++;
+                buf_num = 0;
+                frame_row = 0;
+            } else if(frame_row >= height) {
+                die("Frame %d has more than %d rows", frame_num, height);
+            }
+            need_next_buffer_to_be_filled = 1;
+        }
+        // Buffer flushed, request a new buffer to be filled by the camera component
+        if(need_next_buffer_to_be_filled) {
+            need_next_buffer_to_be_filled = 0;
+            ctx.cammodule_.camera_output_buffer_available = 0;
+            if((r = OMX_FillThisBuffer(ctx.cammodule_.camera, ctx.cammodule_.camera_ppBuffer_out)) != OMX_ErrorNone) {
+                omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
+            }
+        }
+        // Would be better to use signaling here but hey this works too
+        usleep(10);
+    }
+    say("Cleaning up...");
+
+    // Restore signal handlers
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+
+    // Stop capturing video with the camera
+    OMX_INIT_STRUCTURE(capture);
+    capture.nPortIndex = 71;
+    capture.bEnabled = OMX_FALSE;
+    if((r = OMX_SetParameter(ctx.cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch off capture on camera video output port 71");
+    }
+
+    // Return the last full buffer back to the camera component
+    if((r = OMX_FillThisBuffer(ctx.cammodule_.camera, ctx.cammodule_.camera_ppBuffer_out)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
+    }
+
+    // Flush, disable and stop all the components at once
+    teardown_component components[2];
+    memset(components, 0, sizeof(components));
+    components[0].component = ctx.cammodule_.camera;
+    components[0].name = "camera";
+    teardown_add_port(&components[0], 73, ctx.cammodule_.camera_ppBuffer_in);
+    teardown_add_port(&components[0], 70, NULL);
+    teardown_add_port(&components[0], 71, ctx.cammodule_.camera_ppBuffer_out);
+    components[1].component = ctx.null_sink;
+    components[1].name = "null sink";
+    teardown_add_port(&components[1], 240, NULL);
+    teardown_components(components, 2, TEARDOWN_TIMEOUT_MS);
+
+    // Free the component handles
+    if((r = OMX_FreeHandle(ctx.cammodule_.camera)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to free camera component handle");
+    }
+    if((r = OMX_FreeHandle(ctx.null_sink)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to free null sink component handle");
+    }
+
+    // Exit
+    output_queue_discard(&ctx.out_queue_, frame_item);
+    output_queue_destroy(&ctx.out_queue_);
+    fclose(ctx.fd_out);
+    if(RAW_PREVIEW) {
+        if(preview_item != NULL) {
+            output_queue_discard(&ctx.preview_queue_, preview_item);
+        }
+        output_queue_destroy(&ctx.preview_queue_);
+        fclose(ctx.fd_preview);
+    }
+
+    vcos_semaphore_delete(&ctx.sync_.handler_lock);
+    if((r = OMX_Deinit()) != OMX_ErrorNone) {
+        omx_die(r, "OMX de-initalization failed");
+    }
+
+    say("Exit!");
+
+    return 0;
+}
@@ -25,6 +25,48 @@
  * dumped to stdout and `camera` preview output port is tunneled to `null_sink`
  * input port.
  *
+ * The camera fills CAPTURE_BUFFERS video output buffers in turn. Each buffer
+ * is handed back to the camera as soon as its slice has been unpacked, and
+ * if UNPACK_THREADS is set the slices are unpacked on that many threads
+ * instead of the capture loop.
+ *
+ * Complete frames are written to `stdout` by a separate thread through a
+ * bounded queue. If the output can't keep up with the camera, the oldest or
+ * the newest queued frame is dropped according to OUTPUT_QUEUE_POLICY and
+ * each drop is reported.
+ *
+ * The frames are emitted as I420 by default, OUTPUT_COLOR_FORMAT below selects
+ * NV12, YUY2 or GRAY8 instead. The conversion is done while unpacking.
+ * If CROP is enabled, only the region of interest is unpacked and dumped.
+ *
+ * If FRAME_BUS is enabled below, the frames are unpacked straight in to a ring
+ * of FRAME_BUS_SLOTS frames in POSIX shared memory instead of being written
+ * to `stdout`. Any number of local processes can map the ring and read the
+ * latest frames in place, see `rpi-frame-bus-read` for an example, e.g.
+ *
+ *     $ ./rpi-camera-dump-yuv &
+ *     $ ./rpi-frame-bus-read >test.yuv
+ *
+ * If DOWNSCALE is enabled below, every DOWNSCALE_FRAME_INTERVAL frame is also
+ * downscaled by 2, 4 or 8 while its slices are unpacked and the resulting
+ * I420 or gray frames are dumped to file descriptor DOWNSCALE_FD, e.g.
+ *
+ *     $ ./rpi-camera-dump-yuv >test.yuv 3>test-small.yuv
+ *
+ * If DEDUP is enabled below, frames of a static scene aren't written. The luma
+ * plane of each frame is downscaled while unpacking and compared block by block
+ * against the last written frame, and the frame is skipped if too few blocks
+ * have changed, but at most DEDUP_MAX_SKIP frames in a row. The index and the
+ * timestamp of each written frame are recorded in DEDUP_INDEX_PATH so that the
+ * timing can be rebuilt.
+ *
+ * If COMPRESS is enabled below, the frames are compressed losslessly on
+ * COMPRESS_THREADS threads before they are written, `rpi-yuv-decompress`
+ * turns them back to raw frames, e.g.
+ *
+ *     $ ./rpi-camera-dump-yuv >test.yuvz
+ *     $ ./rpi-yuv-decompress <test.yuvz >test.yuv
+ *
  * Please see README.mdwn for more detailed description of this
  * OpenMAX IL demos for Raspberry Pi bundle.
  *
@@ -33,6 +75,68 @@
 #include "rpi-i420-framing.hpp"
 #include "rpi-camera-params.hpp"
 #include "rpi-video-params.hpp"
+#include "rpi-output-queue.hpp"
+#include "rpi-yuv-scale.hpp"
+#include "rpi-yuv-convert.hpp"
+#include "rpi-frame-bus-publish.hpp"
+#include "rpi-realtime.hpp"
+#include "rpi-motion-detect.hpp"
+#include "rpi-yuv-compress.hpp"
+#include "rpi-unpack-pool.hpp"
+
+// Output pixel format, OMX_COLOR_FormatYUV420Planar (I420), OMX_COLOR_FormatYUV420SemiPlanar (NV12),
+// OMX_COLOR_FormatYCbYCr (YUY2) or OMX_COLOR_FormatL8 (GRAY8)
+#define OUTPUT_COLOR_FORMAT             OMX_COLOR_FormatYUV420Planar
+
+// Hard coded region of interest, corner and size must be even
+#define CROP                            0
+#define CROP_X                          640
+#define CROP_Y                          360
+#define CROP_WIDTH                      640
+#define CROP_HEIGHT                     360
+
+// Hard coded real-time parameters for the capture loop and the writer threads
+#define LOOP_CPU                        -1                      // CPU core, -1 for any
+#define WRITER_CPU                      -1                      // CPU core, -1 for any
+#define LOOP_FIFO_PRIORITY              0                       // SCHED_FIFO 1 .. 99, 0 for default
+#define LOCK_MEMORY                     0                       // mlockall
+#define JITTER_LATE_US                  10000                   // report later buffers, 0 for none
+#define TEARDOWN_TIMEOUT_MS             1000                    // per teardown step
+
+// Hard coded parameters for the capture pipeline
+#define CAPTURE_BUFFERS                 1                       // camera video output buffers in flight
+#define CAPTURE_MAX_BUFFERS             UNPACK_POOL_MAX_JOBS
+#define UNPACK_THREADS                  0                       // 1 .. UNPACK_POOL_MAX_THREADS, 0 for the capture loop
+
+// Hard coded parameters for the output queue
+#define OUTPUT_QUEUE_LENGTH             4                        // frames
+#define OUTPUT_QUEUE_POLICY             OUTPUT_QUEUE_DROP_OLDEST // output_queue_policy
+
+// Hard coded parameters for the shared memory frame bus
+#define FRAME_BUS                       0
+#define FRAME_BUS_NAME                  FRAME_BUS_DEFAULT_NAME
+#define FRAME_BUS_SLOTS                 4                        // frames
+
+// Hard coded parameters for the downscaled output
+#define DOWNSCALE                       0
+#define DOWNSCALE_SHIFT                 3                        // factor 1 << shift, 1 .. 3
+#define DOWNSCALE_FILTER                DOWNSCALE_FILTER_BOX     // downscale_filter
+#define DOWNSCALE_GRAY                  0                        // Y plane only
+#define DOWNSCALE_FRAME_INTERVAL        5                        // every nth frame
+#define DOWNSCALE_FD                    3
+
+// Hard coded parameters for skipping the frames of a static scene
+#define DEDUP                           0
+#define DEDUP_SHIFT                     2                        // compare luma downscaled by 1 << shift
+#define DEDUP_BLOCK_THRESHOLD           512                      // SAD of a block of downscaled luma
+#define DEDUP_MIN_BLOCKS                2                        // changed blocks to write the frame
+#define DEDUP_MAX_SKIP                  30                       // frames skipped in a row at most
+#define DEDUP_INDEX_PATH                "dump-yuv.idx"           // written frame index and timestamp
+
+// Hard coded parameters for the compressed output
+#define COMPRESS                        0
+#define COMPRESS_THREADS                3                        // 1 .. YUV_COMPRESS_MAX_THREADS
+#define COMPRESS_BAND_ROWS              64                       // rows of a plane compressed as a unit
 
 // Global variable used by the signal handler and capture loop
 static int want_quit = 0;
@@ -47,10 +151,51 @@ typedef struct
     // null_sink module
     OMX_HANDLETYPE null_sink;
 
+    // Camera video output buffers and the filled ones in the order they arrived
+    OMX_BUFFERHEADERTYPE *buffers[CAPTURE_MAX_BUFFERS];
+    int buffer_count;
+    OMX_BUFFERHEADERTYPE *filled[CAPTURE_MAX_BUFFERS];
+    int64_t filled_time[CAPTURE_MAX_BUFFERS];
+    int filled_head;
+    int filled_count;
+
+    // Frame the slices are unpacked to and its layout
+    const i420_frame_info *frame_info;
+    const i420_frame_info *buf_info;
+    const yuv_output_info *output_info;
+    i420_unpack_fn unpack;
+    unsigned char *frame;
+    unpack_pool unpack_pool_;
+
     // stdin/out
     //FILE *fd_in;
     FILE *fd_out;
+    FILE *fd_downscaled;
+
+    // Queues drained by the writer threads
+    output_queue out_queue_;
+    output_queue downscaled_queue_;
+
+    // Shared memory ring replacing the output queue
+    frame_bus_publisher bus_;
+
+    // Writer of the output queue compressing the frames
+    yuv_compressor compressor_;
 
+    i420_downscaler downscaler_;
+
+    // Downscaled luma of the current frame compared against the last written one
+    i420_downscaler dedup_scaler_;
+    unsigned char *dedup_thumb;
+    motion_detector dedup_;
+    int dedup_run;
+    unsigned long frames_skipped;
+    // Index records of the written frames
+    FILE *fd_index;
+    unsigned long frames_indexed;
+
+    // Delays from camera output buffer callback to the capture loop
+    jitter_stats jitter_;
 } appctx;
 
 // Global signal handler for trapping SIGINT, SIGTERM, and SIGQUIT
@@ -78,6 +223,7 @@ static OMX_ERRORTYPE event_handler(
                 ctx->sync_.flushed = 1;
             }
             vcos_semaphore_post(&ctx->sync_.handler_lock);
+            omx_command_complete(hComponent, nData1, nData2);
             break;
         case OMX_EventParamOrConfigChanged:
             vcos_semaphore_wait(&ctx->sync_.handler_lock);
@@ -105,15 +251,96 @@ static OMX_ERRORTYPE fill_output_buffer_done_handler(
     appctx *ctx = ((appctx*)pAppData);
     vcos_semaphore_wait(&ctx->sync_.handler_lock);
     // The main loop can now flush the buffer to output file
-    ctx->cammodule_.camera_output_buffer_available = 1;
+    ctx->filled[(ctx->filled_head + ctx->filled_count) % CAPTURE_MAX_BUFFERS] = pBuffer;
+    ctx->filled_time[(ctx->filled_head + ctx->filled_count) % CAPTURE_MAX_BUFFERS] = monotonic_time_us();
+    ctx->filled_count++;
     vcos_semaphore_post(&ctx->sync_.handler_lock);
     return OMX_ErrorNone;
 }
 
+// Oldest buffer filled by the camera or NULL if there's none
+static OMX_BUFFERHEADERTYPE *take_filled(appctx *ctx, int64_t *filled_time) {
+    OMX_BUFFERHEADERTYPE *buffer = NULL;
+    vcos_semaphore_wait(&ctx->sync_.handler_lock);
+    if(ctx->filled_count > 0) {
+        buffer = ctx->filled[ctx->filled_head];
+        *filled_time = ctx->filled_time[ctx->filled_head];
+        ctx->filled_head = (ctx->filled_head + 1) % CAPTURE_MAX_BUFFERS;
+        ctx->filled_count--;
+    }
+    vcos_semaphore_post(&ctx->sync_.handler_lock);
+    return buffer;
+}
+
+// Hand a buffer back to the camera to be filled
+static void refill(appctx *ctx, OMX_BUFFERHEADERTYPE *buffer) {
+    OMX_ERRORTYPE r;
+    if((r = OMX_FillThisBuffer(ctx->cammodule_.camera, buffer)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
+    }
+}
+
+// Unpack or convert the slice_num:th slice of the current frame from
+// a camera buffer, called by the capture loop or the unpack threads
+static size_t unpack_buffer(void *arg, const OMX_BUFFERHEADERTYPE *buffer, int slice_num, int valid_spans_y) {
+    appctx *ctx = (appctx *)arg;
+    // Start of the OMX buffer data
+    const unsigned char *buf_start = buffer->pBuffer + buffer->nOffset;
+
+    if(CROP || OUTPUT_COLOR_FORMAT != OMX_COLOR_FormatYUV420Planar) {
+        // Convert the plane spans straight to the output format,
+        // slices outside the crop rectangle aren't touched at all
+        return convert_i420_slice(ctx->output_info, buf_start, ctx->buf_info,
+            slice_num * ctx->buf_info->height, valid_spans_y, ctx->frame);
+    }
+    // Unpack Y, U, and V plane spans from the buffer to the I420 frame
+    return ctx->unpack(
+        // Destination starts from the beginning of the frame
+        ctx->frame,
+        // Source starts from the beginning of the OMX component buffer
+        buf_start,
+        ctx->frame_info, ctx->buf_info,
+        // Plane spans copied from the previous buffers
+        slice_num,
+        valid_spans_y);
+}
+
+// Called by the writer thread after a frame has been written
+static void record_written_frame(void *arg, const output_queue_item *item) {
+    appctx *ctx = (appctx *)arg;
+    fprintf(ctx->fd_index, "%lu %lld\n", ctx->frames_indexed++, (long long)item->timestamp);
+}
+
+// Compare the downscaled luma of the frame just captured against the last
+// written frame, returns 1 if the frame is to be skipped
+static int dedup_skip_frame(appctx *ctx) {
+    motion_detector *md = &ctx->dedup_;
+    int y;
+
+    for(y = 0; y < md->height; y++) {
+        memcpy(md->luma + y * md->stride, ctx->dedup_thumb + y * ctx->dedup_scaler_.info.p_stride[0], md->width);
+    }
+    if(md->have_background && ctx->dedup_run < DEDUP_MAX_SKIP
+            && motion_detector_compare(md) < DEDUP_MIN_BLOCKS) {
+        ctx->dedup_run++;
+        ctx->frames_skipped++;
+        return 1;
+    }
+    motion_detector_set_background(md);
+    ctx->dedup_run = 0;
+    return 0;
+}
+
 int main(int argc, char **argv) {
     bcm_host_init();
 
+    // Page faults in the capture loop would show up as jitter
+    if(LOCK_MEMORY) {
+        lock_memory();
+    }
+
     OMX_ERRORTYPE r;
+    int i;
 
     if((r = OMX_Init()) != OMX_ErrorNone) {
         omx_die(r, "OMX initalization failed");
@@ -136,7 +363,24 @@ int main(int argc, char **argv) {
     init_component_handle("null_sink", &ctx.null_sink, &ctx, &callbacks);
 
     say("Configuring camera...");
-    config_omx_camera(&ctx.cammodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE);
+    if((r = config_omx_camera(&ctx.cammodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE, -1)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to configure camera");
+    }
+
+    // Ask for more video output buffers to keep the camera busy while
+    // the previous slices are still being unpacked
+    OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
+    if(CAPTURE_BUFFERS > 1) {
+        OMX_INIT_STRUCTURE(camera_portdef);
+        camera_portdef.nPortIndex = 71;
+        if((r = OMX_GetParameter(ctx.cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to get port definition for camera video output port 71");
+        }
+        camera_portdef.nBufferCountActual = CAPTURE_BUFFERS;
+        if((r = OMX_SetParameter(ctx.cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to set buffer count for camera video output port 71");
+        }
+    }
  
     say("Configuring null sink...");
 
@@ -185,7 +429,6 @@ int main(int argc, char **argv) {
     // Allocate camera input and video output buffers,
     // buffers for tunneled ports are allocated internally by OMX
     say("Allocating buffers...");
-    OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
     OMX_INIT_STRUCTURE(camera_portdef);
     camera_portdef.nPortIndex = 73;
     if((r = OMX_GetParameter(ctx.cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
@@ -198,8 +441,14 @@ int main(int argc, char **argv) {
     if((r = OMX_GetParameter(ctx.cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for camera vіdeo output port 71");
     }
-    if((r = OMX_AllocateBuffer(ctx.cammodule_.camera, &ctx.cammodule_.camera_ppBuffer_out, 71, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for camera video output port 71");
+    ctx.buffer_count = camera_portdef.nBufferCountActual;
+    if(ctx.buffer_count > CAPTURE_MAX_BUFFERS) {
+        die("Camera wants %d buffers, at most %d supported", ctx.buffer_count, CAPTURE_MAX_BUFFERS);
+    }
+    for(i = 0; i < ctx.buffer_count; i++) {
+        if((r = OMX_AllocateBuffer(ctx.cammodule_.camera, &ctx.buffers[i], 71, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer %d for camera video output port 71", i);
+        }
     }
 
     // Just use stdout for output
@@ -243,27 +492,91 @@ int main(int argc, char **argv) {
     get_i420_frame_info(frame_info.buf_stride, frame_info.buf_slice_height, -1, -1, &buf_info);
     dump_frame_info("Destination frame", &frame_info);
     dump_frame_info("Source buffer", &buf_info);
-
-    // Buffer representing an I420 frame where to unpack
-    // the fragmented Y, U, and V plane spans from the OMX buffers
-    char *frame = calloc(1, frame_info.size);
-    if(frame == NULL) {
-        die("Failed to allocate frame buffer");
+    // Strides, offsets and copy sizes are compile time constants for the common frame sizes
+    i420_unpack_fn unpack = get_i420_unpack_fn(&frame_info, &buf_info);
+    say("Unpacking I420 frames with the routine for %s frames", dump_i420_unpack_fn(unpack));
+    yuv_output_info output_info;
+    get_yuv_output_info(OUTPUT_COLOR_FORMAT, frame_info.width, frame_info.height, &output_info);
+    if(CROP) {
+        crop_yuv_output_info(&output_info, frame_info.width, frame_info.height, CROP_X, CROP_Y, CROP_WIDTH, CROP_HEIGHT);
+    }
+    dump_yuv_output_info("Destination frame", &output_info);
+
+    // Queue item or frame bus slot representing an output frame where
+    // to unpack the fragmented Y, U, and V plane spans from the OMX buffers
+    output_queue_item *frame_item = NULL;
+    ctx.frame_info = &frame_info;
+    ctx.buf_info = &buf_info;
+    ctx.output_info = &output_info;
+    ctx.unpack = unpack;
+    if(FRAME_BUS) {
+        frame_bus_publisher_init(&ctx.bus_, FRAME_BUS_NAME, FRAME_BUS_SLOTS, &output_info);
+        ctx.frame = frame_bus_begin(&ctx.bus_);
+    } else {
+        output_queue_init(&ctx.out_queue_, "Frame", fileno(ctx.fd_out), OUTPUT_QUEUE_LENGTH, output_info.size, OUTPUT_QUEUE_POLICY);
+        if(COMPRESS) {
+            yuv_compressor_init(&ctx.compressor_, &output_info, COMPRESS_THREADS, COMPRESS_BAND_ROWS);
+            output_queue_set_writer(&ctx.out_queue_, yuv_compressor_write, &ctx.compressor_);
+        }
+        frame_item = output_queue_acquire(&ctx.out_queue_);
+        ctx.frame = (unsigned char *)frame_item->data;
+    }
+    if(UNPACK_THREADS > 0) {
+        unpack_pool_init(&ctx.unpack_pool_, UNPACK_THREADS, ctx.cammodule_.camera, unpack_buffer, &ctx);
+    }
+    // Queue item for the downscaled frame, only acquired for the frames to be tapped
+    output_queue_item *downscaled_item = NULL;
+    if(DOWNSCALE) {
+        i420_downscaler_init(&ctx.downscaler_, frame_info.width, frame_info.height, frame_info.buf_slice_height,
+            DOWNSCALE_SHIFT, DOWNSCALE_FILTER, DOWNSCALE_GRAY);
+        say("Opening downscaled output file descriptor %d...", DOWNSCALE_FD);
+        if((ctx.fd_downscaled = fdopen(DOWNSCALE_FD, "w")) == NULL) {
+            die("Failed to open downscaled output file descriptor %d: %s", DOWNSCALE_FD, strerror(errno));
+        }
+        output_queue_init(&ctx.downscaled_queue_, "Downscaled frame", fileno(ctx.fd_downscaled), OUTPUT_QUEUE_LENGTH, ctx.downscaler_.info.size, OUTPUT_QUEUE_POLICY);
+    }
+    if(DEDUP) {
+        i420_downscaler_init(&ctx.dedup_scaler_, frame_info.width, frame_info.height, frame_info.buf_slice_height,
+            DEDUP_SHIFT, DOWNSCALE_FILTER_BOX, 1);
+        if((ctx.dedup_thumb = malloc(ctx.dedup_scaler_.info.size)) == NULL) {
+            die("Failed to allocate memory for the downscaled luma plane");
+        }
+        motion_detector_init(&ctx.dedup_, ctx.dedup_scaler_.info.width, ctx.dedup_scaler_.info.height,
+            DEDUP_BLOCK_THRESHOLD, DEDUP_MIN_BLOCKS, 1);
+        // Slots of the frame bus carry the timestamps already
+        if(!FRAME_BUS) {
+            say("Opening frame index file %s...", DEDUP_INDEX_PATH);
+            if((ctx.fd_index = fopen(DEDUP_INDEX_PATH, "w")) == NULL) {
+                die("Failed to open frame index file %s: %s", DEDUP_INDEX_PATH, strerror(errno));
+            }
+            output_queue_set_written_hook(&ctx.out_queue_, record_written_frame, &ctx);
+        }
     }
 
     // Some counters
     int frame_num = 1, buf_num = 0;
-    size_t output_written, frame_bytes = 0, buf_size, buf_bytes_read = 0, buf_bytes_copied;
-    int i;
-    // I420 spec: U and V plane span size half of the size of the Y plane span size
-    int max_spans_y = buf_info.height, max_spans_uv = max_spans_y / 2;
+    size_t frame_bytes = 0, buf_size, buf_bytes_read = 0, buf_bytes_copied;
+    int max_spans_y = buf_info.height;
     int valid_spans_y, valid_spans_uv;
     // For unpack memory copy operation
     unsigned char *buf_start;
-    int max_spans, valid_spans;
-    int dst_offset, src_offset, span_size;
+    // The buffer being processed, its flags and timestamp are saved
+    // as it may be refilled by the camera before the frame is queued
+    OMX_BUFFERHEADERTYPE *buffer;
+    OMX_U32 buf_flags;
+    int64_t buf_timestamp, buf_filled_time;
     // For controlling the loop
-    int quit_detected = 0, quit_in_frame_boundry = 0, need_next_buffer_to_be_filled = 1;
+    int quit_detected = 0, quit_in_frame_boundry = 0;
+
+    if(!FRAME_BUS) {
+        set_thread_cpu(ctx.out_queue_.writer, "Frame writer", WRITER_CPU);
+    }
+    if(DOWNSCALE) {
+        set_thread_cpu(ctx.downscaled_queue_.writer, "Downscaled frame writer", WRITER_CPU);
+    }
+    set_thread_cpu(pthread_self(), "Capture loop", LOOP_CPU);
+    set_thread_fifo_priority("Capture loop", LOOP_FIFO_PRIORITY);
+    jitter_stats_init(&ctx.jitter_, "Camera output", JITTER_LATE_US);
 
     say("Enter capture loop, press Ctrl-C to quit...");
 
@@ -271,104 +584,129 @@ int main(int argc, char **argv) {
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
 
+    // Request all the buffers to be filled by the camera component
+    for(i = 0; i < ctx.buffer_count; i++) {
+        refill(&ctx, ctx.buffers[i]);
+    }
+
     while(1) {
-        // fill_output_buffer_done_handler() has marked that there's
-        // a buffer for us to flush
-        if(ctx.cammodule_.camera_output_buffer_available) {
-            // Print a message if the user wants to quit, but don't exit
-            // the loop until we are certain that we have processed
-            // a full frame till end of the frame. This way we should always
-            // avoid corruption of the last encoded at the expense of
-            // small delay in exiting.
-            if(want_quit && !quit_detected) {
-                say("Exit signal detected, waiting for next frame boundry before exiting...");
-                quit_detected = 1;
-                quit_in_frame_boundry = ctx.cammodule_.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
-            }
-            if(quit_detected &&
-                    (quit_in_frame_boundry ^
-                    (ctx.cammodule_.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME))) {
-                say("Frame boundry reached, exiting loop...");
-                break;
+        // fill_output_buffer_done_handler() has queued the buffers
+        // for us to flush in the order they were filled
+        if((buffer = take_filled(&ctx, &buf_filled_time)) == NULL) {
+            // Would be better to use signaling here but hey this works too
+            usleep(10);
+            continue;
+        }
+        jitter_stats_add(&ctx.jitter_, monotonic_time_us() - buf_filled_time);
+        buf_flags = buffer->nFlags;
+        buf_timestamp = omx_ticks_to_int64(buffer->nTimeStamp);
+        // Print a message if the user wants to quit, but don't exit
+        // the loop until we are certain that we have processed
+        // a full frame till end of the frame. This way we should always
+        // avoid corruption of the last encoded at the expense of
+        // small delay in exiting.
+        if(want_quit && !quit_detected) {
+            say("Exit signal detected, waiting for next frame boundry before exiting...");
+            quit_detected = 1;
+            quit_in_frame_boundry = buf_flags & OMX_BUFFERFLAG_ENDOFFRAME;
+        }
+        if(quit_detected &&
+                (quit_in_frame_boundry ^
+                (buf_flags & OMX_BUFFERFLAG_ENDOFFRAME))) {
+            say("Frame boundry reached, exiting loop...");
+            break;
+        }
+        // Start of the OMX buffer data
+        buf_start = buffer->pBuffer + buffer->nOffset;
+        // Size of the OMX buffer data;
+        buf_size = buffer->nFilledLen;
+        buf_bytes_read += buf_size;
+        buf_bytes_copied = 0;
+        // Detect the possibly non-full buffer in the last buffer of a frame
+        valid_spans_y = max_spans_y
+            - ((buf_flags & OMX_BUFFERFLAG_ENDOFFRAME)
+                ? frame_info.buf_extra_padding
+                : 0);
+        // I420 spec: U and V plane span size half of the size of the Y plane span size
+        valid_spans_uv = valid_spans_y / 2;
+        // Downscale the slice straight from the buffer before unpacking it,
+        // the source stays in the cache for the unpack copy
+        if(DOWNSCALE && buf_num == 0 && (frame_num - 1) % DOWNSCALE_FRAME_INTERVAL == 0) {
+            downscaled_item = output_queue_acquire(&ctx.downscaled_queue_);
+        }
+        if(downscaled_item != NULL) {
+            i420_downscale_slice(&ctx.downscaler_, buf_start, &buf_info,
+                buf_num * max_spans_y, valid_spans_y, (unsigned char *)downscaled_item->data);
+        }
+        if(DEDUP) {
+            i420_downscale_slice(&ctx.dedup_scaler_, buf_start, &buf_info,
+                buf_num * max_spans_y, valid_spans_y, ctx.dedup_thumb);
+        }
+        if(UNPACK_THREADS > 0) {
+            // The unpack thread hands the buffer back to the camera
+            unpack_pool_submit(&ctx.unpack_pool_, buffer, buf_num, valid_spans_y);
+            say("Read %d bytes from buffer %d of frame %d, unpacking %d Y spans and %d U/V spans available",
+                buf_size, buf_num + 1, frame_num, valid_spans_y, valid_spans_uv);
+        } else {
+            buf_bytes_copied = unpack_buffer(&ctx, buffer, buf_num, valid_spans_y);
+            // Buffer flushed, request it to be filled again by the camera component
+            refill(&ctx, buffer);
+            say("Read %d bytes from buffer %d of frame %d, copied %d bytes from %d Y spans and %d U/V spans available",
+                buf_size, buf_num + 1, frame_num, buf_bytes_copied, valid_spans_y, valid_spans_uv);
+        }
+        frame_bytes += buf_bytes_copied;
+        buf_num++;
+        if(buf_flags & OMX_BUFFERFLAG_ENDOFFRAME) {
+            // Wait for the slices still being unpacked
+            if(UNPACK_THREADS > 0) {
+                frame_bytes += unpack_pool_drain(&ctx.unpack_pool_);
             }
-            // Start of the OMX buffer data
-            buf_start = ctx.cammodule_.camera_ppBuffer_out->pBuffer
-                + ctx.cammodule_.camera_ppBuffer_out->nOffset;
-            // Size of the OMX buffer data;
-            buf_size = ctx.cammodule_.camera_ppBuffer_out->nFilledLen;
-            buf_bytes_read += buf_size;
-            buf_bytes_copied = 0;
-            // Detect the possibly non-full buffer in the last buffer of a frame
-            valid_spans_y = max_spans_y
-                - ((ctx.cammodule_.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME)
-                    ? frame_info.buf_extra_padding
-                    : 0);
-            // I420 spec: U and V plane span size half of the size of the Y plane span size
-            valid_spans_uv = valid_spans_y / 2;
-            // Unpack Y, U, and V plane spans from the buffer to the I420 frame
-            for(i = 0; i < 3; i++) {
-                // Number of maximum and valid spans for this plane
-                max_spans   = (i == 0 ? max_spans_y   : max_spans_uv);
-                valid_spans = (i == 0 ? valid_spans_y : valid_spans_uv);
-                dst_offset =
-                    // Start of the plane span in the I420 frame
-                    frame_info.p_offset[i] +
-                    // Plane spans copied from the previous buffers
-                    (buf_num * frame_info.p_stride[i] * max_spans);
-                src_offset =
-                    // Start of the plane span in the buffer
-                    buf_info.p_offset[i];
-                span_size =
-                    // Plane span size multiplied by the available spans in the buffer
-                    frame_info.p_stride[i] * valid_spans;
-                memcpy(
-                    // Destination starts from the beginning of the frame and move forward by offset
-                    frame + dst_offset,
-                    // Source starts from the beginning of the OMX component buffer and move forward by offset
-                    buf_start + src_offset,
-                    // The final plane span size, possible padding at the end of
-                    // the plane span section in the buffer isn't included
-                    // since the size is based on the final frame plane span size
-                    span_size);
-                buf_bytes_copied += span_size;
+            // Queue the complete I420 frame to be dumped
+            say("Captured frame %d, %d packed bytes read, %d bytes unpacked, queuing %d unpacked frame bytes",
+                frame_num, buf_bytes_read, frame_bytes, output_info.size);
+            if(frame_bytes != output_info.size) {
+                die("Frame bytes read %d doesn't match the frame size %d",
+                    frame_bytes, output_info.size);
             }
-            frame_bytes += buf_bytes_copied;
-            buf_num++;
-            say("Read %d bytes from buffer %d of frame %d, copied %d bytes from %d Y spans and %d U/V spans available",
-                buf_size, buf_num, frame_num, buf_bytes_copied, valid_spans_y, valid_spans_uv);
-            if(ctx.cammodule_.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
-                // Dump the complete I420 frame
-                say("Captured frame %d, %d packed bytes read, %d bytes unpacked, writing %d unpacked frame bytes",
-                    frame_num, buf_bytes_read, frame_bytes, frame_info.size);
-                if(frame_bytes != frame_info.size) {
-                    die("Frame bytes read %d doesn't match the frame size %d",
-                        frame_bytes, frame_info.size);
-                }
-                output_written = fwrite(frame, 1, frame_info.size, ctx.fd_out);
-                if(output_written != frame_info.size) {
-                    die("Failed to write to output file: Requested to write %d bytes, but only %d bytes written: %s",
-                        frame_info.size, output_written, strerror(errno));
-                }
-                frame_num++;
-                buf_num = 0;
-                buf_bytes_read = 0;
-                frame_bytes = 0;
-                memset(frame, 0, frame_info.size);
+            if(downscaled_item != NULL) {
+                downscaled_item->len = ctx.downscaler_.info.size;
+                downscaled_item->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+                downscaled_item->timestamp = buf_timestamp;
+                output_queue_commit(&ctx.downscaled_queue_, downscaled_item);
+                downscaled_item = NULL;
             }
-            need_next_buffer_to_be_filled = 1;
-        }
-        // Buffer flushed, request a new buffer to be filled by the camera component
-        if(need_next_buffer_to_be_filled) {
-            need_next_buffer_to_be_filled = 0;
-            ctx.cammodule_.camera_output_buffer_available = 0;
-            if((r = OMX_FillThisBuffer(ctx.cammodule_.camera, ctx.cammodule_.camera_ppBuffer_out)) != OMX_ErrorNone) {
-                omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
+            // No need to clear the next frame, every byte of it
+            // is overwritten as verified by the check above
+            if(DEDUP && dedup_skip_frame(&ctx)) {
+                // Unpack the next frame over the skipped one
+                say("Skipping frame %d, scene unchanged in %d frames", frame_num, ctx.dedup_run);
+            } else if(FRAME_BUS) {
+                frame_bus_publish(&ctx.bus_, buf_timestamp);
+                ctx.frame = frame_bus_begin(&ctx.bus_);
+            } else {
+                frame_item->len = output_info.size;
+                frame_item->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+                frame_item->timestamp = buf_timestamp;
+                output_queue_commit(&ctx.out_queue_, frame_item);
+                frame_item = output_queue_acquire(&ctx.out_queue_);
+                ctx.frame = (unsigned char *)frame_item->data;
             }
+            frame_num++;
+            buf_num = 0;
+            buf_bytes_read = 0;
+            frame_bytes = 0;
         }
-        // Would be better to use signaling here but hey this works too
-        usleep(10);
     }
     say("Cleaning up...");
+    dump_jitter_stats(&ctx.jitter_);
+    if(DEDUP) {
+        say("Skipped %lu of %d frames of a static scene", ctx.frames_skipped, frame_num - 1);
+    }
+    dump_thread_rusage("Capture loop");
+    // The slices of the unfinished frame are unpacked and their buffers handed back
+    if(UNPACK_THREADS > 0) {
+        unpack_pool_destroy(&ctx.unpack_pool_);
+    }
 
     // Restore signal handlers
     signal(SIGINT,  SIG_DFL);
@@ -383,72 +721,23 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to switch off capture on camera video output port 71");
     }
 
-    // Return the last full buffer back to the camera component
-    if((r = OMX_FillThisBuffer(ctx.cammodule_.camera, ctx.cammodule_.camera_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
-    }
-
-    // Flush the buffers on each component
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 73, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera input port 73");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 70, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera preview output port 70");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 71, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera video output port 71");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandFlush, 240, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of null sink input port 240");
-    }
-    block_until_flushed(&ctx.sync_);
-
-    // Disable all the ports
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 73, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera input port 73");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 73, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 70, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera preview output port 70");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 70, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 71, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera video output port 71");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 71, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortDisable, 240, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable null sink input port 240");
-    }
-    block_until_port_changed(ctx.null_sink, 240, OMX_FALSE);
-
-    // Free all the buffers
-    if((r = OMX_FreeBuffer(ctx.cammodule_.camera, 73, ctx.cammodule_.camera_ppBuffer_in)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for camera input port 73");
-    }
-    if((r = OMX_FreeBuffer(ctx.cammodule_.camera, 71, ctx.cammodule_.camera_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for camera video output port 71");
-    }
-
-    // Transition all the components to idle and then to loaded states
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to idle");
-    }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to idle");
-    }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to loaded");
-    }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateLoaded);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to loaded");
-    }
-    block_until_state_changed(ctx.null_sink, OMX_StateLoaded);
+    // Return the last full buffer and the ones filled after it back to the camera component
+    do {
+        refill(&ctx, buffer);
+    } while((buffer = take_filled(&ctx, &buf_filled_time)) != NULL);
+
+    // Flush, disable and stop all the components at once
+    teardown_component components[2];
+    memset(components, 0, sizeof(components));
+    components[0].component = ctx.cammodule_.camera;
+    components[0].name = "camera";
+    teardown_add_port(&components[0], 73, ctx.cammodule_.camera_ppBuffer_in);
+    teardown_add_port(&components[0], 70, NULL);
+    teardown_add_port_buffers(&components[0], 71, ctx.buffers, ctx.buffer_count);
+    components[1].component = ctx.null_sink;
+    components[1].name = "null sink";
+    teardown_add_port(&components[1], 240, NULL);
+    teardown_components(components, 2, TEARDOWN_TIMEOUT_MS);
 
     // Free the component handles
     if((r = OMX_FreeHandle(ctx.cammodule_.camera)) != OMX_ErrorNone) {
@@ -459,8 +748,34 @@ int main(int argc, char **argv) {
     }
 
     // Exit
+    if(FRAME_BUS) {
+        frame_bus_publisher_destroy(&ctx.bus_);
+    } else {
+        output_queue_discard(&ctx.out_queue_, frame_item);
+        output_queue_destroy(&ctx.out_queue_);
+        if(COMPRESS) {
+            // The writer thread is gone, the index goes after the last frame
+            yuv_compressor_destroy(&ctx.compressor_, fileno(ctx.fd_out));
+        }
+    }
     fclose(ctx.fd_out);
-    free(frame);
+    if(DOWNSCALE) {
+        if(downscaled_item != NULL) {
+            output_queue_discard(&ctx.downscaled_queue_, downscaled_item);
+        }
+        output_queue_destroy(&ctx.downscaled_queue_);
+        fclose(ctx.fd_downscaled);
+        i420_downscaler_destroy(&ctx.downscaler_);
+    }
+    if(DEDUP) {
+        // The writer thread is gone, all the index records are in
+        if(ctx.fd_index != NULL) {
+            fclose(ctx.fd_index);
+        }
+        motion_detector_destroy(&ctx.dedup_);
+        free(ctx.dedup_thumb);
+        i420_downscaler_destroy(&ctx.dedup_scaler_);
+    }
 
     vcos_semaphore_delete(&ctx.sync_.handler_lock);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
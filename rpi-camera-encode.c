@@ -39,6 +39,59 @@
  * encoded video is read from the buffer of `video_encode` output port and dumped
  * to `stdout`.
  *
+ * If ENCODE_SUBSTREAM is enabled below, `camera` preview output port is
+ * instead configured to a low resolution and frame rate and tunneled to a
+ * second `video_encode` instance. The H.264 substream it produces is dumped
+ * to file descriptor SUBSTREAM_FD alongside the main stream, e.g.
+ *
+ *     $ ./rpi-camera-encode >test.h264 3>test-sub.h264
+ *
+ * If MOTION_DETECT is enabled below, `camera` preview output port is instead
+ * configured to a tiny resolution and its buffers are read by the program.
+ * The luma plane of each preview frame is compared against a running
+ * background and the encoded stream is only written out while there's
+ * motion, including pre-roll and post-roll around it.
+ *
+ * If SNAPSHOT is enabled below, `camera` preview output port is instead
+ * configured to a thumbnail resolution and its buffers are read by the
+ * program. On SIGUSR1 the next complete preview frame is passed to an
+ * `image_encode` component and the resulting JPEG is atomically written to
+ * SNAPSHOT_PATH. Camera video output port and the H.264 stream are not
+ * touched, e.g.
+ *
+ *     $ ./rpi-camera-encode >test.h264 &
+ *     $ kill -USR1 %1
+ *
+ * If STREAM_SERVER is enabled below, the main stream is served to any number
+ * of local clients connecting to the Unix domain socket at STREAM_SERVER_PATH
+ * instead of being written to `stdout`. A joining client is first sent the
+ * stream headers and the current GOP, e.g.
+ *
+ *     $ ./rpi-camera-encode &
+ *     $ socat -u UNIX-CONNECT:/tmp/rpi-camera-encode.sock - >test.h264
+ *
+ * Writing to `stdout` is done by a separate thread through a bounded queue,
+ * so a blocking output never stalls the encoder. When the queue is full,
+ * whole GOPs are dropped up to the next key frame and each drop is reported.
+ *
+ * If OUTPUT_AVCC is enabled below, the writer thread splits the Annex B
+ * stream in to NAL units and writes each one prefixed with its length as a
+ * 4 byte big endian integer instead of a start code.
+ *
+ * If LOW_LATENCY is enabled below, the encoder splits the frames in to slices
+ * of SLICE_MB_ROWS macroblock rows and emits each NAL unit in a buffer of its
+ * own, which is queued for writing as soon as it arrives. The latency from the
+ * capture timestamp of each frame to its first slice and to the whole frame
+ * having been written is reported on exit.
+ *
+ * If WATCHDOG is enabled below, a component error, a failed buffer request or
+ * no encoder output for WATCHDOG_STALL_FRAMES frame periods makes the program
+ * tear down and rebuild all the components in place instead of exiting. The
+ * output keeps going to the same file descriptors, with an end of sequence
+ * NAL unit marking where the stream restarts with a key frame. A rebuild
+ * that fails or times out is torn down and tried again after a back off. The
+ * downtime of each recovery is reported.
+ *
  * Please see README.mdwn for more detailed description of this
  * OpenMAX IL demos for Raspberry Pi bundle.
  *
@@ -47,9 +100,80 @@
 #include "rpi-i420-framing.hpp"
 #include "rpi-camera-params.hpp"
 #include "rpi-video-params.hpp"
+#include "rpi-output-queue.hpp"
+#include "rpi-motion-detect.hpp"
+#include "rpi-image-params.hpp"
+#include "rpi-nal-framing.hpp"
+#include "rpi-stream-server.hpp"
+#include "rpi-realtime.hpp"
+#include "rpi-latency.hpp"
+
+#include <semaphore.h>
+
+// Hard coded real-time parameters for the capture and encode loop and the writer threads
+#define LOOP_CPU                        -1                      // CPU core, -1 for any
+#define WRITER_CPU                      -1                      // CPU core, -1 for any
+#define LOOP_FIFO_PRIORITY              0                       // SCHED_FIFO 1 .. 99, 0 for default
+#define LOCK_MEMORY                     0                       // mlockall
+#define JITTER_LATE_US                  10000                   // report later buffers, 0 for none
+
+// Hard coded parameters for the low latency slice output
+#define LOW_LATENCY                     0
+#define SLICE_MB_ROWS                   17                      // 4 slices per 1080p frame
+
+// Hard coded parameters for shutting down on exit signal
+#define SHUTDOWN_DEADLINE_MS            2000                    // exit anyway after this
+#define DRAIN_IDLE_MS                   (2000 / VIDEO_FRAMERATE) // no encoder output for two frames
+#define TEARDOWN_TIMEOUT_MS             1000                    // per teardown step
+#define BUILD_TIMEOUT_MS                3000                    // per build step, including camera ready
+
+// Hard coded parameters for recovering from a stalled or failed pipeline
+#define WATCHDOG                        0
+#define WATCHDOG_STALL_FRAMES           15                      // frame periods without encoder output
+#define WATCHDOG_STARTUP_MS             5000                    // allowed for the first buffer after (re)building
+#define WATCHDOG_MAX_RETRIES            5                       // recoveries in a row without output, then exit
+#define WATCHDOG_BACKOFF_MS             500                     // before rebuilding again, doubled on each failure
+
+// Hard coded parameters for the output queues
+#define OUTPUT_QUEUE_LENGTH             64                      // encoder buffers
+#define OUTPUT_QUEUE_POLICY             OUTPUT_QUEUE_DROP_GOP   // output_queue_policy
+#define OUTPUT_AVCC                     0                       // 4 byte length prefixed NAL units
+
+// Hard coded parameters for serving the main stream to local clients
+#define STREAM_SERVER                   0
+#define STREAM_SERVER_PATH              "/tmp/rpi-camera-encode.sock"
+#define STREAM_CLIENT_QUEUE_LENGTH      64                      // encoder buffers
+#define STREAM_GOP_CACHE_LENGTH         256                     // encoder buffers
+
+// Hard coded parameters for the substream encoded from camera preview output
+#define ENCODE_SUBSTREAM                0
+#define SUBSTREAM_WIDTH                 640
+#define SUBSTREAM_HEIGHT                360
+#define SUBSTREAM_FRAMERATE             VIDEO_FRAMERATE
+#define SUBSTREAM_BITRATE               1000000
+#define SUBSTREAM_FD                    3
+
+// Hard coded parameters for recording only when motion is detected
+#define MOTION_DETECT                   0
+#define MOTION_WIDTH                    160
+#define MOTION_HEIGHT                   120
+#define MOTION_BLOCK_THRESHOLD          768                     // SAD of 8x8 luma block
+#define MOTION_MIN_BLOCKS               3                       // blocks over threshold
+#define MOTION_BACKGROUND_INTERVAL      4                       // frames
+#define MOTION_PREROLL_MS               3000
+#define MOTION_POSTROLL_MS              5000
+
+// Hard coded parameters for JPEG snapshots from camera preview output
+#define SNAPSHOT                        0
+#define SNAPSHOT_WIDTH                  640
+#define SNAPSHOT_HEIGHT                 360
+#define SNAPSHOT_QUALITY                80                      // 1 .. 100
+#define SNAPSHOT_PATH                   "snapshot.jpg"
+#define SNAPSHOT_SLICE_TIMEOUT_MS       200                     // for the image encoder input buffer
 
 // Global variable used by the signal handler and capture/encoding loop
 static int want_quit = 0;
+static int want_snapshot = 0;
 
 // Our application context passed around
 // the main routine and callback handlers
@@ -64,9 +188,69 @@ typedef struct {
     // null_sink module
     OMX_HANDLETYPE null_sink;
 
+    // Substream encoder module fed by camera preview output port
+    OmxEncoderModule subencodermodule_;
+
+    // Component and input port camera preview output port is tunneled to,
+    // either null sink or substream encoder
+    OMX_HANDLETYPE preview_sink;
+    OMX_U32 preview_sink_port;
+
     // stdin/out
     //FILE *fd_in;
     FILE *fd_out;
+    FILE *fd_sub;
+
+    // Queues drained by the writer threads
+    output_queue out_queue_;
+    output_queue sub_queue_;
+
+    // Annex B to length prefixed NAL unit conversion done by the writers
+    avcc_framer out_framer_;
+    avcc_framer sub_framer_;
+
+    // Unix domain socket server replacing stdout for the main stream
+    stream_server server_;
+
+    // Delays from encoder output buffer callback to the capture loop
+    jitter_stats jitter_;
+
+    // Posted by the encoder output buffer callback in low latency mode
+    sem_t loop_wakeup;
+    // Capture to output latency measured by the main stream writer
+    capture_latency latency_;
+
+    // Motion detection from camera preview output
+    motion_detector detector_;
+    motion_gate gate_;
+
+    // JPEG encoder fed with camera preview frames on request
+    OmxImageEncoderModule imgencodermodule_;
+    int snapshot_pending;
+    int snapshot_capturing;
+    int snapshot_encoding;
+    int snapshot_disabled;
+    int64_t snapshot_requested;
+    int64_t snapshot_started;
+    char *snapshot_data;
+    size_t snapshot_len;
+    size_t snapshot_alloc_len;
+    unsigned long snapshots;
+
+    // Callbacks the component handles are created with
+    OMX_CALLBACKTYPE callbacks;
+    // Camera preview output port definition when its buffers are read by us
+    OMX_PARAM_PORTDEFINITIONTYPE preview_portdef;
+
+    // Error event or failed OMX call in the capture loop, the pipeline is
+    // rebuilt in place when WATCHDOG is enabled
+    OMX_ERRORTYPE pipeline_error;
+    // Time of the last encoder output buffer before the recovery in
+    // progress, 0 when there's none
+    int64_t recovery_started;
+    unsigned long recoveries;
+    int64_t downtime_total;
+    int64_t downtime_max;
 } appctx;
 
 // Global signal handler for trapping SIGINT, SIGTERM, and SIGQUIT
@@ -74,6 +258,11 @@ static void signal_handler(int signal) {
     want_quit = 1;
 }
 
+// Signal handler for SIGUSR1 requesting a snapshot
+static void snapshot_signal_handler(int signal) {
+    want_snapshot = 1;
+}
+
 // OMX calls this handler for all the events it emits
 static OMX_ERRORTYPE event_handler(
         OMX_HANDLETYPE hComponent,
@@ -94,6 +283,7 @@ static OMX_ERRORTYPE event_handler(
                 ctx->sync_.flushed = 1;
             }
             vcos_semaphore_post(&ctx->sync_.handler_lock);
+            omx_command_complete(hComponent, nData1, nData2);
             break;
         case OMX_EventParamOrConfigChanged:
             vcos_semaphore_wait(&ctx->sync_.handler_lock);
@@ -102,8 +292,25 @@ static OMX_ERRORTYPE event_handler(
             }
             vcos_semaphore_post(&ctx->sync_.handler_lock);
             break;
+        case OMX_EventBufferFlag:
+            vcos_semaphore_wait(&ctx->sync_.handler_lock);
+            if(hComponent == ctx->encodermodule_.encoder && nData1 == 201 && (nData2 & OMX_BUFFERFLAG_EOS)) {
+                ctx->encodermodule_.encoder_output_eos = 1;
+            }
+            if(hComponent == ctx->subencodermodule_.encoder && nData1 == 201 && (nData2 & OMX_BUFFERFLAG_EOS)) {
+                ctx->subencodermodule_.encoder_output_eos = 1;
+            }
+            vcos_semaphore_post(&ctx->sync_.handler_lock);
+            break;
         case OMX_EventError:
-            omx_die(nData1, "error event received");
+            if(!WATCHDOG) {
+                omx_die(nData1, "error event received");
+            }
+            vcos_semaphore_wait(&ctx->sync_.handler_lock);
+            if(ctx->pipeline_error == OMX_ErrorNone) {
+                ctx->pipeline_error = nData1;
+            }
+            vcos_semaphore_post(&ctx->sync_.handler_lock);
             break;
         default:
             break;
@@ -122,107 +329,287 @@ static OMX_ERRORTYPE fill_output_buffer_done_handler(
     appctx *ctx = ((appctx*)pAppData);
     vcos_semaphore_wait(&ctx->sync_.handler_lock);
     // The main loop can now flush the buffer to output file
-    ctx->encodermodule_.encoder_output_buffer_available = 1;
+    if(hComponent == ctx->subencodermodule_.encoder) {
+        ctx->subencodermodule_.encoder_output_buffer_available = 1;
+    } else if(hComponent == ctx->cammodule_.camera) {
+        ctx->cammodule_.camera_preview_buffer_available = 1;
+    } else if(hComponent == ctx->imgencodermodule_.encoder) {
+        ctx->imgencodermodule_.encoder_output_buffer_available = 1;
+    } else {
+        ctx->encodermodule_.encoder_output_buffer_available = 1;
+        ctx->encodermodule_.encoder_output_buffer_time = monotonic_time_us();
+        if(LOW_LATENCY) {
+            sem_post(&ctx->loop_wakeup);
+        }
+    }
     vcos_semaphore_post(&ctx->sync_.handler_lock);
     return OMX_ErrorNone;
 }
 
-int main(int argc, char **argv)
+// Called by OMX when the image encoder component has consumed
+// the preview frame slice in its input buffer
+static OMX_ERRORTYPE empty_input_buffer_done_handler(
+        OMX_HANDLETYPE hComponent,
+        OMX_PTR pAppData,
+        OMX_BUFFERHEADERTYPE* pBuffer)
 {
-    bcm_host_init();
+    appctx *ctx = ((appctx*)pAppData);
+    vcos_semaphore_wait(&ctx->sync_.handler_lock);
+    ctx->imgencodermodule_.encoder_input_buffer_needed = 1;
+    vcos_semaphore_post(&ctx->sync_.handler_lock);
+    return OMX_ErrorNone;
+}
 
-    OMX_ERRORTYPE r;
+// Output queue writer converting the encoded stream to AVCC framing
+static size_t write_avcc(void *arg, int fd, const output_queue_item *item)
+{
+    return avcc_framer_write((avcc_framer *)arg, fd, (const unsigned char *)item->data, item->len, item->nFlags);
+}
 
-    if((r = OMX_Init()) != OMX_ErrorNone) {
-        omx_die(r, "OMX initalization failed");
-    }
+// End of sequence NAL unit written in to the streams where the pipeline was
+// rebuilt, the next picture is the key frame of the new encoder. Pushed as a
+// complete buffer with OMX_BUFFERFLAG_DISCONTINUITY, which marks it as not
+// being part of any frame.
+#define END_OF_SEQUENCE_FLAGS (OMX_BUFFERFLAG_ENDOFFRAME | OMX_BUFFERFLAG_DISCONTINUITY)
+static const unsigned char end_of_sequence[] = { 0x00, 0x00, 0x00, 0x01, 0x0a };
 
-    // Init context
-    appctx ctx;
-    memset(&ctx, 0, sizeof(ctx));
-    if(vcos_semaphore_create(&ctx.sync_.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
-        die("Failed to create handler lock semaphore");
+// Output queue hook recording when the slices of each frame have been written
+static void record_latency(void *arg, const output_queue_item *item)
+{
+    capture_latency_add((capture_latency *)arg, item->timestamp, item->nFlags);
+}
+
+// Wait for the next encoder output buffer, but no longer than timeout_us
+// so that the other buffers are still served in time
+static void wait_loop_wakeup(appctx *ctx, int64_t timeout_us)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += timeout_us * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000;
+    ts.tv_nsec %= 1000000000;
+    while(sem_timedwait(&ctx->loop_wakeup, &ts) != 0 && errno == EINTR);
+}
+
+// Write the completed JPEG next to SNAPSHOT_PATH and rename it in place
+// so that whoever is polling the file never sees a partial image
+static void write_snapshot(appctx *ctx)
+{
+    char tmp_path[sizeof(SNAPSHOT_PATH) + 4];
+    FILE *fd;
+    int64_t now = monotonic_time_us();
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", SNAPSHOT_PATH);
+    if((fd = fopen(tmp_path, "w")) == NULL) {
+        die("Failed to open snapshot file %s: %s", tmp_path, strerror(errno));
+    }
+    if(fwrite(ctx->snapshot_data, 1, ctx->snapshot_len, fd) != ctx->snapshot_len) {
+        die("Failed to write snapshot file %s: %s", tmp_path, strerror(errno));
     }
+    if(fclose(fd) != 0) {
+        die("Failed to close snapshot file %s: %s", tmp_path, strerror(errno));
+    }
+    if(rename(tmp_path, SNAPSHOT_PATH) != 0) {
+        die("Failed to rename snapshot file %s to %s: %s", tmp_path, SNAPSHOT_PATH, strerror(errno));
+    }
+    ctx->snapshots++;
+    say("Snapshot %lu written to %s, %d bytes, latency %.1f ms (%.1f ms waiting for frame, %.1f ms encoding)",
+        ctx->snapshots, SNAPSHOT_PATH, ctx->snapshot_len,
+        (double)(now - ctx->snapshot_requested) / 1000.0,
+        (double)(ctx->snapshot_started - ctx->snapshot_requested) / 1000.0,
+        (double)(now - ctx->snapshot_started) / 1000.0);
+}
 
-    // Init component handles
-    OMX_CALLBACKTYPE callbacks;
-    memset(&callbacks, 0, sizeof(callbacks));
-    callbacks.EventHandler   = event_handler;
-    callbacks.FillBufferDone = fill_output_buffer_done_handler;
+// Create, configure and start all the components up to switching on the
+// capture, also used to rebuild the pipeline in place on recovery. Reports
+// and returns the first error, a failed step is given up on after
+// BUILD_TIMEOUT_MS and whatever was built is left for destroy_pipeline()
+static OMX_ERRORTYPE build_pipeline(appctx *ctx)
+{
+    OMX_ERRORTYPE r;
 
-    init_component_handle("camera", &ctx.cammodule_.camera , &ctx, &callbacks);
-    init_component_handle("video_encode", &ctx.encodermodule_.encoder, &ctx, &callbacks);
-    init_component_handle("null_sink", &ctx.null_sink, &ctx, &callbacks);
+    if((r = try_init_component_handle("camera", &ctx->cammodule_.camera , ctx, &ctx->callbacks, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return r;
+    }
+    if((r = try_init_component_handle("video_encode", &ctx->encodermodule_.encoder, ctx, &ctx->callbacks, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return r;
+    }
+    if(ENCODE_SUBSTREAM) {
+        if((r = try_init_component_handle("video_encode", &ctx->subencodermodule_.encoder, ctx, &ctx->callbacks, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return r;
+        }
+        ctx->preview_sink = ctx->subencodermodule_.encoder;
+        ctx->preview_sink_port = 200;
+    } else if(MOTION_DETECT || SNAPSHOT) {
+        // Camera preview output buffers are read by us
+        ctx->preview_sink = NULL;
+        if(SNAPSHOT) {
+            if((r = try_init_component_handle("image_encode", &ctx->imgencodermodule_.encoder, ctx, &ctx->callbacks, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+                return r;
+            }
+        }
+    } else {
+        if((r = try_init_component_handle("null_sink", &ctx->null_sink, ctx, &ctx->callbacks, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return r;
+        }
+        ctx->preview_sink = ctx->null_sink;
+        ctx->preview_sink_port = 240;
+    }
 
     say("Configuring camera...");
-    config_omx_camera(&ctx.cammodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE);
+    if((r = config_omx_camera(&ctx->cammodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return r;
+    }
+    if(LOW_LATENCY) {
+        if((r = config_omx_camera_stc_timestamps(&ctx->cammodule_)) != OMX_ErrorNone) {
+            return r;
+        }
+    }
     
     say("Configuring encoder...");
     OMX_U32 stride = VIDEO_WIDTH;
-    config_omx_encoder_out(&ctx.encodermodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE, stride, VIDEO_BITRATE);
+    default_omx_encoder_config(&ctx->encodermodule_.config);
+    if((r = config_omx_encoder_out(&ctx->encodermodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE, stride, VIDEO_BITRATE)) != OMX_ErrorNone) {
+        return r;
+    }
+    if(LOW_LATENCY) {
+        if((r = config_omx_encoder_low_latency(&ctx->encodermodule_, SLICE_MB_ROWS)) != OMX_ErrorNone) {
+            return r;
+        }
+    }
+
+    if(ENCODE_SUBSTREAM) {
+        // Camera preview output is downscaled by the ISP, no need
+        // to waste bandwidth on a full resolution preview stream
+        say("Configuring camera preview output for substream...");
+        if((r = config_omx_camera_preview(&ctx->cammodule_, SUBSTREAM_WIDTH, SUBSTREAM_HEIGHT, SUBSTREAM_FRAMERATE)) != OMX_ErrorNone) {
+            return r;
+        }
 
-    say("Configuring null sink...");
+        say("Configuring substream encoder...");
+        if((r = config_omx_encoder_out(&ctx->subencodermodule_, SUBSTREAM_WIDTH, SUBSTREAM_HEIGHT, SUBSTREAM_FRAMERATE, SUBSTREAM_WIDTH, SUBSTREAM_BITRATE)) != OMX_ErrorNone) {
+            return r;
+        }
 
-    say("Default port definition for null sink input port 240");
-    dump_port(ctx.null_sink, 240, OMX_TRUE);
+        // Tunnel camera preview output port and substream encoder input port
+        say("Setting up tunnel from camera preview output port 70 to substream encoder input port 200...");
+        if((r = OMX_SetupTunnel(ctx->cammodule_.camera, 70, ctx->subencodermodule_.encoder, 200)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to setup tunnel between camera preview output port 70 and substream encoder input port 200");
+        }
+    } else if(MOTION_DETECT) {
+        say("Configuring camera preview output for motion detection...");
+        if((r = config_omx_camera_preview(&ctx->cammodule_, MOTION_WIDTH, MOTION_HEIGHT, VIDEO_FRAMERATE)) != OMX_ErrorNone) {
+            return r;
+        }
+    } else if(SNAPSHOT) {
+        say("Configuring camera preview output for snapshots...");
+        if((r = config_omx_camera_preview(&ctx->cammodule_, SNAPSHOT_WIDTH, SNAPSHOT_HEIGHT, VIDEO_FRAMERATE)) != OMX_ErrorNone) {
+            return r;
+        }
 
-    // Null sink input port definition is done automatically upon tunneling
+        // Image encoder input takes the preview buffers as they are
+        say("Configuring image encoder...");
+        OMX_PARAM_PORTDEFINITIONTYPE snapshot_portdef;
+        OMX_INIT_STRUCTURE(snapshot_portdef);
+        snapshot_portdef.nPortIndex = 70;
+        if((r = OMX_GetParameter(ctx->cammodule_.camera, OMX_IndexParamPortDefinition, &snapshot_portdef)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to get port definition for camera preview output port 70");
+        }
+        if((r = config_omx_image_encoder(&ctx->imgencodermodule_, SNAPSHOT_WIDTH, SNAPSHOT_HEIGHT,
+                snapshot_portdef.format.video.nStride, snapshot_portdef.format.video.nSliceHeight, SNAPSHOT_QUALITY)) != OMX_ErrorNone) {
+            return r;
+        }
+    } else {
+        say("Configuring null sink...");
+
+        say("Default port definition for null sink input port 240");
+        dump_port(ctx->null_sink, 240, OMX_TRUE);
 
-    // Tunnel camera preview output port and null sink input port
-    say("Setting up tunnel from camera preview output port 70 to null sink input port 240...");
-    if((r = OMX_SetupTunnel(ctx.cammodule_.camera, 70, ctx.null_sink, 240)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to setup tunnel between camera preview output port 70 and null sink input port 240");
+        // Null sink input port definition is done automatically upon tunneling
+
+        // Tunnel camera preview output port and null sink input port
+        say("Setting up tunnel from camera preview output port 70 to null sink input port 240...");
+        if((r = OMX_SetupTunnel(ctx->cammodule_.camera, 70, ctx->null_sink, 240)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to setup tunnel between camera preview output port 70 and null sink input port 240");
+        }
     }
 
     // Tunnel camera video output port and encoder input port
     say("Setting up tunnel from camera video output port 71 to encoder input port 200...");
-    if((r = OMX_SetupTunnel(ctx.cammodule_.camera, 71, ctx.encodermodule_.encoder, 200)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to setup tunnel between camera video output port 71 and encoder input port 200");
+    if((r = OMX_SetupTunnel(ctx->cammodule_.camera, 71, ctx->encodermodule_.encoder, 200)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to setup tunnel between camera video output port 71 and encoder input port 200");
     }
 
     // Switch components to idle state
     say("Switching state of the camera component to idle...");
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to idle");
+    if((r = OMX_SendCommand(ctx->cammodule_.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone
+            || (r = wait_for_state_change(ctx->cammodule_.camera, OMX_StateIdle, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to switch state of the camera component to idle");
     }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateIdle);
     say("Switching state of the encoder component to idle...");
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to idle");
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone
+            || (r = wait_for_state_change(ctx->encodermodule_.encoder, OMX_StateIdle, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to switch state of the encoder component to idle");
     }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateIdle);
-    say("Switching state of the null sink component to idle...");
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to idle");
+    if(ctx->preview_sink != NULL) {
+        say("Switching state of the preview sink component to idle...");
+        if((r = OMX_SendCommand(ctx->preview_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone
+                || (r = wait_for_state_change(ctx->preview_sink, OMX_StateIdle, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to switch state of the preview sink component to idle");
+        }
+    }
+    if(SNAPSHOT) {
+        say("Switching state of the image encoder component to idle...");
+        if((r = OMX_SendCommand(ctx->imgencodermodule_.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone
+                || (r = wait_for_state_change(ctx->imgencodermodule_.encoder, OMX_StateIdle, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to switch state of the image encoder component to idle");
+        }
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
 
     // Enable ports
     say("Enabling ports...");
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortEnable, 73, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to enable camera input port 73");
+    if((r = OMX_SendCommand(ctx->cammodule_.camera, OMX_CommandPortEnable, 73, NULL)) != OMX_ErrorNone
+            || (r = wait_for_port_change(ctx->cammodule_.camera, 73, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to enable camera input port 73");
     }
-    block_until_port_changed(ctx.cammodule_.camera, 73, OMX_TRUE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortEnable, 70, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to enable camera preview output port 70");
+    if((r = OMX_SendCommand(ctx->cammodule_.camera, OMX_CommandPortEnable, 70, NULL)) != OMX_ErrorNone
+            || (r = wait_for_port_change(ctx->cammodule_.camera, 70, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to enable camera preview output port 70");
     }
-    block_until_port_changed(ctx.cammodule_.camera, 70, OMX_TRUE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortEnable, 71, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to enable camera video output port 71");
+    if((r = OMX_SendCommand(ctx->cammodule_.camera, OMX_CommandPortEnable, 71, NULL)) != OMX_ErrorNone
+            || (r = wait_for_port_change(ctx->cammodule_.camera, 71, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to enable camera video output port 71");
     }
-    block_until_port_changed(ctx.cammodule_.camera, 71, OMX_TRUE);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortEnable, 200, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to enable encoder input port 200");
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandPortEnable, 200, NULL)) != OMX_ErrorNone
+            || (r = wait_for_port_change(ctx->encodermodule_.encoder, 200, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to enable encoder input port 200");
     }
-    block_until_port_changed(ctx.encodermodule_.encoder, 200, OMX_TRUE);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortEnable, 201, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to enable encoder output port 201");
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandPortEnable, 201, NULL)) != OMX_ErrorNone
+            || (r = wait_for_port_change(ctx->encodermodule_.encoder, 201, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to enable encoder output port 201");
+    }
+    if(ctx->preview_sink != NULL) {
+        if((r = OMX_SendCommand(ctx->preview_sink, OMX_CommandPortEnable, ctx->preview_sink_port, NULL)) != OMX_ErrorNone
+                || (r = wait_for_port_change(ctx->preview_sink, ctx->preview_sink_port, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to enable preview sink input port %d", ctx->preview_sink_port);
+        }
     }
-    block_until_port_changed(ctx.encodermodule_.encoder, 201, OMX_TRUE);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortEnable, 240, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to enable null sink input port 240");
+    if(ENCODE_SUBSTREAM) {
+        if((r = OMX_SendCommand(ctx->subencodermodule_.encoder, OMX_CommandPortEnable, 201, NULL)) != OMX_ErrorNone
+                || (r = wait_for_port_change(ctx->subencodermodule_.encoder, 201, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to enable substream encoder output port 201");
+        }
+    }
+    if(SNAPSHOT) {
+        if((r = OMX_SendCommand(ctx->imgencodermodule_.encoder, OMX_CommandPortEnable, 340, NULL)) != OMX_ErrorNone
+                || (r = wait_for_port_change(ctx->imgencodermodule_.encoder, 340, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to enable image encoder input port 340");
+        }
+        if((r = OMX_SendCommand(ctx->imgencodermodule_.encoder, OMX_CommandPortEnable, 341, NULL)) != OMX_ErrorNone
+                || (r = wait_for_port_change(ctx->imgencodermodule_.encoder, 341, OMX_TRUE, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to enable image encoder output port 341");
+        }
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_TRUE);
 
     // Allocate camera input buffer and encoder output buffer,
     // buffers for tunneled ports are allocated internally by OMX
@@ -230,43 +617,88 @@ int main(int argc, char **argv)
     OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
     OMX_INIT_STRUCTURE(camera_portdef);
     camera_portdef.nPortIndex = 73;
-    if((r = OMX_GetParameter(ctx.cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for camera input port 73");
+    if((r = OMX_GetParameter(ctx->cammodule_.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to get port definition for camera input port 73");
     }
-    if((r = OMX_AllocateBuffer(ctx.cammodule_.camera, &ctx.cammodule_.camera_ppBuffer_in, 73, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for camera input port 73");
+    if((r = OMX_AllocateBuffer(ctx->cammodule_.camera, &ctx->cammodule_.camera_ppBuffer_in, 73, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to allocate buffer for camera input port 73");
     }
     OMX_PARAM_PORTDEFINITIONTYPE encoder_portdef;
     OMX_INIT_STRUCTURE(encoder_portdef);
     encoder_portdef.nPortIndex = 201;
-    if((r = OMX_GetParameter(ctx.encodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for encoder output port 201");
+    if((r = OMX_GetParameter(ctx->encodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to get port definition for encoder output port 201");
     }
-    if((r = OMX_AllocateBuffer(ctx.encodermodule_.encoder, &ctx.encodermodule_.encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for encoder output port 201");
+    if((r = OMX_AllocateBuffer(ctx->encodermodule_.encoder, &ctx->encodermodule_.encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to allocate buffer for encoder output port 201");
+    }
+    if(ENCODE_SUBSTREAM) {
+        OMX_INIT_STRUCTURE(encoder_portdef);
+        encoder_portdef.nPortIndex = 201;
+        if((r = OMX_GetParameter(ctx->subencodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to get port definition for substream encoder output port 201");
+        }
+        if((r = OMX_AllocateBuffer(ctx->subencodermodule_.encoder, &ctx->subencodermodule_.encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to allocate buffer for substream encoder output port 201");
+        }
+    }
+    OMX_INIT_STRUCTURE(ctx->preview_portdef);
+    if(MOTION_DETECT || SNAPSHOT) {
+        ctx->preview_portdef.nPortIndex = 70;
+        if((r = OMX_GetParameter(ctx->cammodule_.camera, OMX_IndexParamPortDefinition, &ctx->preview_portdef)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to get port definition for camera preview output port 70");
+        }
+        if((r = OMX_AllocateBuffer(ctx->cammodule_.camera, &ctx->cammodule_.camera_ppBuffer_preview, 70, NULL, ctx->preview_portdef.nBufferSize)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to allocate buffer for camera preview output port 70");
+        }
+    }
+    if(SNAPSHOT) {
+        OMX_PARAM_PORTDEFINITIONTYPE image_encoder_portdef;
+        OMX_INIT_STRUCTURE(image_encoder_portdef);
+        image_encoder_portdef.nPortIndex = 340;
+        if((r = OMX_GetParameter(ctx->imgencodermodule_.encoder, OMX_IndexParamPortDefinition, &image_encoder_portdef)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to get port definition for image encoder input port 340");
+        }
+        if((r = OMX_AllocateBuffer(ctx->imgencodermodule_.encoder, &ctx->imgencodermodule_.encoder_ppBuffer_in, 340, NULL, image_encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to allocate buffer for image encoder input port 340");
+        }
+        OMX_INIT_STRUCTURE(image_encoder_portdef);
+        image_encoder_portdef.nPortIndex = 341;
+        if((r = OMX_GetParameter(ctx->imgencodermodule_.encoder, OMX_IndexParamPortDefinition, &image_encoder_portdef)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to get port definition for image encoder output port 341");
+        }
+        if((r = OMX_AllocateBuffer(ctx->imgencodermodule_.encoder, &ctx->imgencodermodule_.encoder_ppBuffer_out, 341, NULL, image_encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to allocate buffer for image encoder output port 341");
+        }
+        ctx->imgencodermodule_.encoder_input_buffer_needed = 1;
     }
-
-    // Just use stdout for output
-    say("Opening output file...");
-    ctx.fd_out = stdout;
 
     // Switch state of the components prior to starting
     // the video capture and encoding loop
     say("Switching state of the camera component to executing...");
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to executing");
+    if((r = OMX_SendCommand(ctx->cammodule_.camera, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone
+            || (r = wait_for_state_change(ctx->cammodule_.camera, OMX_StateExecuting, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to switch state of the camera component to executing");
     }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateExecuting);
     say("Switching state of the encoder component to executing...");
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to executing");
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone
+            || (r = wait_for_state_change(ctx->encodermodule_.encoder, OMX_StateExecuting, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to switch state of the encoder component to executing");
+    }
+    if(ctx->preview_sink != NULL) {
+        say("Switching state of the preview sink component to executing...");
+        if((r = OMX_SendCommand(ctx->preview_sink, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone
+                || (r = wait_for_state_change(ctx->preview_sink, OMX_StateExecuting, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to switch state of the preview sink component to executing");
+        }
     }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateExecuting);
-    say("Switching state of the null sink component to executing...");
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to executing");
+    if(SNAPSHOT) {
+        say("Switching state of the image encoder component to executing...");
+        if((r = OMX_SendCommand(ctx->imgencodermodule_.encoder, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone
+                || (r = wait_for_state_change(ctx->imgencodermodule_.encoder, OMX_StateExecuting, BUILD_TIMEOUT_MS)) != OMX_ErrorNone) {
+            return omx_fail(r, "Failed to switch state of the image encoder component to executing");
+        }
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateExecuting);
 
     // Start capturing video with the camera
     say("Switching on capture on camera video output port 71...");
@@ -274,192 +706,597 @@ int main(int argc, char **argv)
     OMX_INIT_STRUCTURE(capture);
     capture.nPortIndex = 71;
     capture.bEnabled = OMX_TRUE;
-    if((r = OMX_SetParameter(ctx.cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch on capture on camera video output port 71");
+    if((r = OMX_SetParameter(ctx->cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to switch on capture on camera video output port 71");
     }
 
     say("Configured port definition for camera input port 73");
-    dump_port(ctx.cammodule_.camera, 73, OMX_FALSE);
+    dump_port(ctx->cammodule_.camera, 73, OMX_FALSE);
     say("Configured port definition for camera preview output port 70");
-    dump_port(ctx.cammodule_.camera, 70, OMX_FALSE);
+    dump_port(ctx->cammodule_.camera, 70, OMX_FALSE);
     say("Configured port definition for camera video output port 71");
-    dump_port(ctx.cammodule_.camera, 71, OMX_FALSE);
+    dump_port(ctx->cammodule_.camera, 71, OMX_FALSE);
     say("Configured port definition for encoder input port 200");
-    dump_port(ctx.encodermodule_.encoder, 200, OMX_FALSE);
+    dump_port(ctx->encodermodule_.encoder, 200, OMX_FALSE);
     say("Configured port definition for encoder output port 201");
-    dump_port(ctx.encodermodule_.encoder, 201, OMX_FALSE);
-    say("Configured port definition for null sink input port 240");
-    dump_port(ctx.null_sink, 240, OMX_FALSE);
+    dump_port(ctx->encodermodule_.encoder, 201, OMX_FALSE);
+    if(ctx->preview_sink != NULL) {
+        say("Configured port definition for preview sink input port %d", ctx->preview_sink_port);
+        dump_port(ctx->preview_sink, ctx->preview_sink_port, OMX_FALSE);
+    }
+    if(ENCODE_SUBSTREAM) {
+        say("Configured port definition for substream encoder output port 201");
+        dump_port(ctx->subencodermodule_.encoder, 201, OMX_FALSE);
+    }
+    if(SNAPSHOT) {
+        say("Configured port definition for image encoder input port 340");
+        dump_port(ctx->imgencodermodule_.encoder, 340, OMX_FALSE);
+        say("Configured port definition for image encoder output port 341");
+        dump_port(ctx->imgencodermodule_.encoder, 341, OMX_FALSE);
+    }
+    return OMX_ErrorNone;
+}
+
+// A component that failed may refuse to be freed, which only leaks it when
+// recovering
+static void free_handle(OMX_HANDLETYPE hComponent, const char *name, int recovering)
+{
+    OMX_ERRORTYPE r;
+    if((r = OMX_FreeHandle(hComponent)) != OMX_ErrorNone) {
+        if(!recovering) {
+            omx_die(r, "Failed to free %s component handle", name);
+        }
+        say("Failed to free %s component handle: error 0x%08x", name, r);
+    }
+}
+
+// Tear down all the components and free their handles
+static void destroy_pipeline(appctx *ctx, int recovering)
+{
+    // Flush, disable and stop all the components at once
+    teardown_component components[4];
+    int component_count = 0;
+    memset(components, 0, sizeof(components));
+    if(ctx->cammodule_.camera != NULL) {
+        components[component_count].component = ctx->cammodule_.camera;
+        components[component_count].name = "camera";
+        teardown_add_port(&components[component_count], 73, ctx->cammodule_.camera_ppBuffer_in);
+        teardown_add_port(&components[component_count], 70, MOTION_DETECT || SNAPSHOT ? ctx->cammodule_.camera_ppBuffer_preview : NULL);
+        teardown_add_port(&components[component_count], 71, NULL);
+        component_count++;
+    }
+    if(ctx->encodermodule_.encoder != NULL) {
+        components[component_count].component = ctx->encodermodule_.encoder;
+        components[component_count].name = "encoder";
+        teardown_add_port(&components[component_count], 200, NULL);
+        teardown_add_port(&components[component_count], 201, ctx->encodermodule_.encoder_ppBuffer_out);
+        component_count++;
+    }
+    if(ctx->preview_sink != NULL) {
+        components[component_count].component = ctx->preview_sink;
+        components[component_count].name = "preview sink";
+        teardown_add_port(&components[component_count], ctx->preview_sink_port, NULL);
+        if(ENCODE_SUBSTREAM) {
+            teardown_add_port(&components[component_count], 201, ctx->subencodermodule_.encoder_ppBuffer_out);
+        }
+        component_count++;
+    }
+    if(ctx->imgencodermodule_.encoder != NULL) {
+        components[component_count].component = ctx->imgencodermodule_.encoder;
+        components[component_count].name = "image encoder";
+        teardown_add_port(&components[component_count], 340, ctx->imgencodermodule_.encoder_ppBuffer_in);
+        teardown_add_port(&components[component_count], 341, ctx->imgencodermodule_.encoder_ppBuffer_out);
+        component_count++;
+    }
+    teardown_components(components, component_count, TEARDOWN_TIMEOUT_MS);
+
+    // Free the component handles, a failed build may have left some out
+    if(ctx->cammodule_.camera != NULL) {
+        free_handle(ctx->cammodule_.camera, "camera", recovering);
+    }
+    if(ctx->encodermodule_.encoder != NULL) {
+        free_handle(ctx->encodermodule_.encoder, "encoder", recovering);
+    }
+    if(ctx->preview_sink != NULL) {
+        free_handle(ctx->preview_sink, "preview sink", recovering);
+    }
+    if(ctx->imgencodermodule_.encoder != NULL) {
+        free_handle(ctx->imgencodermodule_.encoder, "image encoder", recovering);
+    }
+}
+
+// Fail on an error in the capture loop, or leave it for the watchdog to
+// recover from
+static void pipeline_failed(appctx *ctx, OMX_ERRORTYPE r, const char *message)
+{
+    if(!WATCHDOG) {
+        omx_die(r, "%s", message);
+    }
+    say("%s: error 0x%08x", message, r);
+    if(ctx->pipeline_error == OMX_ErrorNone) {
+        ctx->pipeline_error = r;
+    }
+}
+
+// Pass a buffer of the main stream to whichever consumer is configured
+static void push_main_stream(appctx *ctx, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp)
+{
+    if(MOTION_DETECT) {
+        motion_gate_push(&ctx->gate_, data, len, nFlags, timestamp);
+    } else if(STREAM_SERVER) {
+        stream_server_push(&ctx->server_, data, len, nFlags, timestamp);
+    } else if(output_queue_push(&ctx->out_queue_, data, len, nFlags, timestamp)) {
+        say("Read from output buffer and queued to output file %d/%d", len, ctx->encodermodule_.encoder_ppBuffer_out->nAllocLen);
+    }
+}
+
+// Rebuild the component graph in place, the output queues and file
+// descriptors are kept as they are and the gap is marked in the streams.
+// A failed rebuild is torn down and tried again after a growing back off.
+static void recover_pipeline(appctx *ctx, int64_t last_output_time)
+{
+    OMX_ERRORTYPE r;
+    int attempt;
+    int64_t timestamp = omx_ticks_to_int64(ctx->encodermodule_.encoder_ppBuffer_out->nTimeStamp);
+    int64_t start = monotonic_time_us();
+
+    ctx->recoveries++;
+    if(ctx->recovery_started == 0) {
+        ctx->recovery_started = last_output_time;
+    }
+    say("Rebuilding the pipeline, recovery %lu...", ctx->recoveries);
+
+    // Whatever was in progress in the encoders is lost, the writers drop
+    // the partial NAL unit on the discontinuity
+    push_main_stream(ctx, end_of_sequence, sizeof(end_of_sequence), END_OF_SEQUENCE_FLAGS, timestamp);
+    if(ENCODE_SUBSTREAM) {
+        output_queue_push(&ctx->sub_queue_, end_of_sequence, sizeof(end_of_sequence), END_OF_SEQUENCE_FLAGS, timestamp);
+    }
+    if(ctx->snapshot_capturing || ctx->snapshot_encoding) {
+        say("Snapshot interrupted, taking it again after recovery");
+        ctx->snapshot_capturing = 0;
+        ctx->snapshot_encoding = 0;
+        ctx->snapshot_pending = 1;
+    }
+
+    for(attempt = 1; ; attempt++) {
+        destroy_pipeline(ctx, 1);
+        memset(&ctx->cammodule_, 0, sizeof(ctx->cammodule_));
+        memset(&ctx->encodermodule_, 0, sizeof(ctx->encodermodule_));
+        memset(&ctx->subencodermodule_, 0, sizeof(ctx->subencodermodule_));
+        memset(&ctx->imgencodermodule_, 0, sizeof(ctx->imgencodermodule_));
+        ctx->null_sink = NULL;
+        ctx->preview_sink = NULL;
+        while(sem_trywait(&ctx->loop_wakeup) == 0);
+        ctx->pipeline_error = OMX_ErrorNone;
+        if((r = build_pipeline(ctx)) == OMX_ErrorNone) {
+            // Errors reported by the components while building
+            r = ctx->pipeline_error;
+        }
+        if(r == OMX_ErrorNone) {
+            break;
+        }
+        if(attempt >= WATCHDOG_MAX_RETRIES) {
+            omx_die(r, "Failed to rebuild the pipeline %d times, giving up", attempt);
+        }
+        int backoff_ms = WATCHDOG_BACKOFF_MS << (attempt - 1);
+        say("Failed to rebuild the pipeline: error 0x%08x, trying again in %d ms", r, backoff_ms);
+        usleep(backoff_ms * 1000);
+    }
+    say("Pipeline rebuilt in %lld ms after %d attempts", (long long)(monotonic_time_us() - start) / 1000, attempt);
+}
+
+int main(int argc, char **argv)
+{
+    bcm_host_init();
+
+    // Page faults in the capture loop would show up as jitter
+    if(LOCK_MEMORY) {
+        lock_memory();
+    }
+
+    OMX_ERRORTYPE r;
+
+    if((r = OMX_Init()) != OMX_ErrorNone) {
+        omx_die(r, "OMX initalization failed");
+    }
+
+    // Init context
+    appctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    if(vcos_semaphore_create(&ctx.sync_.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
+        die("Failed to create handler lock semaphore");
+    }
+    if(sem_init(&ctx.loop_wakeup, 0, 0) != 0) {
+        die("Failed to create loop wakeup semaphore: %s", strerror(errno));
+    }
+
+    // Init component handles
+    ctx.callbacks.EventHandler   = event_handler;
+    ctx.callbacks.FillBufferDone = fill_output_buffer_done_handler;
+    ctx.callbacks.EmptyBufferDone = empty_input_buffer_done_handler;
+
+    if(ENCODE_SUBSTREAM + MOTION_DETECT + SNAPSHOT > 1) {
+        die("Camera preview output port can be used for only one of substream, motion detection or snapshots");
+    }
+
+    if((r = build_pipeline(&ctx)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to build the pipeline");
+    }
+
+    // Just use stdout for output
+    say("Opening output file...");
+    ctx.fd_out = stdout;
+    output_queue_init(&ctx.out_queue_, "Main stream", fileno(ctx.fd_out), OUTPUT_QUEUE_LENGTH, ctx.encodermodule_.encoder_ppBuffer_out->nAllocLen, OUTPUT_QUEUE_POLICY);
+    if(OUTPUT_AVCC) {
+        avcc_framer_init(&ctx.out_framer_);
+        output_queue_set_writer(&ctx.out_queue_, write_avcc, &ctx.out_framer_);
+    }
+    if(LOW_LATENCY) {
+        capture_latency_init(&ctx.latency_);
+        output_queue_set_written_hook(&ctx.out_queue_, record_latency, &ctx.latency_);
+    }
+    if(ENCODE_SUBSTREAM) {
+        say("Opening substream output file descriptor %d...", SUBSTREAM_FD);
+        if((ctx.fd_sub = fdopen(SUBSTREAM_FD, "w")) == NULL) {
+            die("Failed to open substream output file descriptor %d: %s", SUBSTREAM_FD, strerror(errno));
+        }
+        output_queue_init(&ctx.sub_queue_, "Substream", fileno(ctx.fd_sub), OUTPUT_QUEUE_LENGTH, ctx.subencodermodule_.encoder_ppBuffer_out->nAllocLen, OUTPUT_QUEUE_POLICY);
+        if(OUTPUT_AVCC) {
+            avcc_framer_init(&ctx.sub_framer_);
+            output_queue_set_writer(&ctx.sub_queue_, write_avcc, &ctx.sub_framer_);
+        }
+    }
+    if(STREAM_SERVER) {
+        stream_server_init(&ctx.server_, STREAM_SERVER_PATH, STREAM_CLIENT_QUEUE_LENGTH, STREAM_GOP_CACHE_LENGTH);
+    }
+    if(MOTION_DETECT) {
+        motion_detector_init(&ctx.detector_, MOTION_WIDTH, MOTION_HEIGHT, MOTION_BLOCK_THRESHOLD, MOTION_MIN_BLOCKS, MOTION_BACKGROUND_INTERVAL);
+        motion_gate_init(&ctx.gate_, &ctx.out_queue_, MOTION_PREROLL_MS, MOTION_POSTROLL_MS);
+    }
+
+    set_thread_cpu(ctx.out_queue_.writer, "Main stream writer", WRITER_CPU);
+    if(ENCODE_SUBSTREAM) {
+        set_thread_cpu(ctx.sub_queue_.writer, "Substream writer", WRITER_CPU);
+    }
+    if(STREAM_SERVER) {
+        set_thread_cpu(ctx.server_.thread, "Stream server", WRITER_CPU);
+    }
+    set_thread_cpu(pthread_self(), "Capture loop", LOOP_CPU);
+    set_thread_fifo_priority("Capture loop", LOOP_FIFO_PRIORITY);
+    jitter_stats_init(&ctx.jitter_, "Encoder output", JITTER_LATE_US);
 
     say("Enter capture and encode loop, press Ctrl-C to quit...");
 
-    int quit_detected = 0, quit_in_keyframe = 0, need_next_buffer_to_be_filled = 1;
-    size_t output_written;
+    int quit_detected = 0, need_next_buffer_to_be_filled = 1, end_of_frame = 1, encoder_drained = 0;
+    // For draining the substream up to the end of the main stream
+    int sub_end_of_frame = 1;
+    int64_t last_frame_timestamp = 0, sub_last_timestamp = 0, sub_last_output_time = 0;
+    int64_t last_output_time = monotonic_time_us(), stall_us;
+    // The camera takes a while to deliver the first frame
+    int64_t stall_limit_us = (int64_t)WATCHDOG_STARTUP_MS * 1000;
+    // Recoveries in a row without any encoder output in between
+    int recovery_retries = 0;
+    OMX_CONFIG_PORTBOOLEANTYPE capture;
+    int need_next_sub_buffer_to_be_filled = ENCODE_SUBSTREAM;
+    int need_next_preview_buffer_to_be_filled = MOTION_DETECT || SNAPSHOT;
+    OMX_BUFFERHEADERTYPE *buf;
+    // Preview luma rows copied so far for the current frame
+    int preview_row = 0, preview_rows, motion_blocks, row;
+    int preview_frame_start = 1;
+    int64_t snapshot_deadline;
 
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
+    if(SNAPSHOT) {
+        signal(SIGUSR1, snapshot_signal_handler);
+    }
 
     while(1) {
+        // Stop capturing as soon as the user wants to quit and only drain
+        // the frames already in the encoder instead of running up to the
+        // next key frame. Whatever happens in draining and cleaning up,
+        // the process exits within SHUTDOWN_DEADLINE_MS.
+        if(want_quit && !quit_detected) {
+            say("Exit signal detected, stopping capture and draining the encoder...");
+            quit_detected = 1;
+            last_output_time = monotonic_time_us();
+            set_shutdown_deadline(SHUTDOWN_DEADLINE_MS);
+            OMX_INIT_STRUCTURE(capture);
+            capture.nPortIndex = 71;
+            capture.bEnabled = OMX_FALSE;
+            if((r = OMX_SetParameter(ctx.cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
+                omx_die(r, "Failed to switch off capture on camera video output port 71");
+            }
+        }
         // fill_output_buffer_done_handler() has marked that there's
         // a buffer for us to flush
-        if(ctx.encodermodule_.encoder_output_buffer_available) {
-            // Print a message if the user wants to quit, but don't exit
-            // the loop until we are certain that we have processed
-            // a full frame till end of the frame, i.e. we're at the end
-            // of the current key frame if processing one or until
-            // the next key frame is detected. This way we should always
-            // avoid corruption of the last encoded at the expense of
-            // small delay in exiting.
-            if(want_quit && !quit_detected) {
-                say("Exit signal detected, waiting for next key frame boundry before exiting...");
-                quit_detected = 1;
-                quit_in_keyframe = ctx.encodermodule_.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_SYNCFRAME;
+        if(!encoder_drained && ctx.encodermodule_.encoder_output_buffer_available) {
+            jitter_stats_add(&ctx.jitter_, monotonic_time_us() - ctx.encodermodule_.encoder_output_buffer_time);
+            // Queue buffer to be flushed to output file, the writer
+            // thread drops whole GOPs if it can't keep up
+            buf = ctx.encodermodule_.encoder_ppBuffer_out;
+            push_main_stream(&ctx, buf->pBuffer + buf->nOffset, buf->nFilledLen, buf->nFlags, omx_ticks_to_int64(buf->nTimeStamp));
+            // Downtime lasts from the last buffer before the failure
+            // to the first one from the rebuilt pipeline
+            if(ctx.recovery_started != 0) {
+                stall_us = ctx.encodermodule_.encoder_output_buffer_time - ctx.recovery_started;
+                ctx.downtime_total += stall_us;
+                if(stall_us > ctx.downtime_max) {
+                    ctx.downtime_max = stall_us;
+                }
+                say("Recovered after %lld ms of downtime", (long long)stall_us / 1000);
+                ctx.recovery_started = 0;
+                recovery_retries = 0;
             }
-            if(quit_detected && (quit_in_keyframe ^ (ctx.encodermodule_.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_SYNCFRAME))) {
-                say("Key frame boundry reached, exiting loop...");
-                break;
+            end_of_frame = (buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) != 0;
+            last_output_time = ctx.encodermodule_.encoder_output_buffer_time;
+            stall_limit_us = (int64_t)WATCHDOG_STALL_FRAMES * 1000000 / VIDEO_FRAMERATE;
+            if(end_of_frame) {
+                last_frame_timestamp = omx_ticks_to_int64(buf->nTimeStamp);
             }
-            // Flush buffer to output file
-            output_written = fwrite(ctx.encodermodule_.encoder_ppBuffer_out->pBuffer + ctx.encodermodule_.encoder_ppBuffer_out->nOffset, 1, ctx.encodermodule_.encoder_ppBuffer_out->nFilledLen, ctx.fd_out);
-            if(output_written != ctx.encodermodule_.encoder_ppBuffer_out->nFilledLen) {
-                die("Failed to write to output file: %s", strerror(errno));
+            if(quit_detected && (buf->nFlags & OMX_BUFFERFLAG_EOS)) {
+                say("End of stream received from the encoder");
+                encoder_drained = 1;
+            } else {
+                need_next_buffer_to_be_filled = 1;
             }
-            say("Read from output buffer and wrote to output file %d/%d", ctx.encodermodule_.encoder_ppBuffer_out->nFilledLen, ctx.encodermodule_.encoder_ppBuffer_out->nAllocLen);
-            need_next_buffer_to_be_filled = 1;
+        }
+        // The camera doesn't always pass EOS down the tunnel when capture
+        // is switched off, the encoder is drained once it has been idle
+        // for a while after a complete frame
+        if(quit_detected && !encoder_drained && end_of_frame && !need_next_buffer_to_be_filled
+                && (ctx.encodermodule_.encoder_output_eos || monotonic_time_us() - last_output_time > DRAIN_IDLE_MS * 1000)) {
+            say("Encoder drained in %lld ms", (long long)(monotonic_time_us() - last_output_time) / 1000);
+            encoder_drained = 1;
         }
         // Buffer flushed, request a new buffer to be filled by the encoder component
         if(need_next_buffer_to_be_filled) {
             need_next_buffer_to_be_filled = 0;
             ctx.encodermodule_.encoder_output_buffer_available = 0;
             if((r = OMX_FillThisBuffer(ctx.encodermodule_.encoder, ctx.encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-                omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+                pipeline_failed(&ctx, r, "Failed to request filling of the output buffer on encoder output port 201");
+            }
+        }
+        // Same for the substream, there's no need to care about
+        // key frame boundaries since it's just a side product
+        if(ctx.subencodermodule_.encoder_output_buffer_available) {
+            buf = ctx.subencodermodule_.encoder_ppBuffer_out;
+            output_queue_push(&ctx.sub_queue_, buf->pBuffer + buf->nOffset, buf->nFilledLen, buf->nFlags, omx_ticks_to_int64(buf->nTimeStamp));
+            sub_end_of_frame = (buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) != 0;
+            sub_last_timestamp = omx_ticks_to_int64(buf->nTimeStamp);
+            sub_last_output_time = monotonic_time_us();
+            need_next_sub_buffer_to_be_filled = 1;
+        }
+        // Capture isn't switched off on the preview port, so the substream
+        // encoder is drained once it has passed the time of the last frame
+        // of the main stream, passed EOS through or been idle for a while,
+        // always after a complete frame
+        if(encoder_drained) {
+            if(!ENCODE_SUBSTREAM) {
+                say("Exiting loop...");
+                break;
+            }
+            if(sub_end_of_frame && (ctx.subencodermodule_.encoder_output_eos || sub_last_timestamp >= last_frame_timestamp
+                    || monotonic_time_us() - sub_last_output_time > DRAIN_IDLE_MS * 1000)) {
+                say("Substream encoder drained, exiting loop...");
+                break;
+            }
+        }
+        if(need_next_sub_buffer_to_be_filled) {
+            need_next_sub_buffer_to_be_filled = 0;
+            ctx.subencodermodule_.encoder_output_buffer_available = 0;
+            if((r = OMX_FillThisBuffer(ctx.subencodermodule_.encoder, ctx.subencodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
+                pipeline_failed(&ctx, r, "Failed to request filling of the output buffer on substream encoder output port 201");
+            }
+        }
+        // Snapshot requests arriving while one is being taken are merged
+        if(want_snapshot) {
+            want_snapshot = 0;
+            if(ctx.snapshot_disabled) {
+                say("Snapshots disabled after the image encoder stalled, ignoring request");
+            } else if(ctx.snapshot_pending || ctx.snapshot_capturing || ctx.snapshot_encoding) {
+                say("Snapshot already in progress, ignoring request");
+            } else {
+                ctx.snapshot_pending = 1;
+                ctx.snapshot_requested = monotonic_time_us();
+            }
+        }
+        // Pass the first complete preview frame after the request to the
+        // image encoder, slice by slice as it's emitted by the camera
+        if(SNAPSHOT && ctx.cammodule_.camera_preview_buffer_available) {
+            buf = ctx.cammodule_.camera_ppBuffer_preview;
+            if(ctx.snapshot_pending && preview_frame_start && buf->nFilledLen > 0) {
+                ctx.snapshot_pending = 0;
+                ctx.snapshot_capturing = 1;
+                ctx.snapshot_started = monotonic_time_us();
+                ctx.snapshot_len = 0;
+                ctx.imgencodermodule_.encoder_output_buffer_available = 0;
+                if((r = OMX_FillThisBuffer(ctx.imgencodermodule_.encoder, ctx.imgencodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
+                    pipeline_failed(&ctx, r, "Failed to request filling of the output buffer on image encoder output port 341");
+                }
+            }
+            if(ctx.snapshot_capturing) {
+                if(buf->nFilledLen > ctx.imgencodermodule_.encoder_ppBuffer_in->nAllocLen) {
+                    die("Preview buffer of %d bytes doesn't fit in image encoder input buffer of %d bytes",
+                        buf->nFilledLen, ctx.imgencodermodule_.encoder_ppBuffer_in->nAllocLen);
+                }
+                // The encoder consumes a slice in no time, but don't
+                // let a stalled one hold up the capture loop
+                snapshot_deadline = monotonic_time_us() + SNAPSHOT_SLICE_TIMEOUT_MS * 1000;
+                while(!ctx.imgencodermodule_.encoder_input_buffer_needed && monotonic_time_us() < snapshot_deadline) {
+                    usleep(100);
+                }
+                if(!ctx.imgencodermodule_.encoder_input_buffer_needed) {
+                    if(WATCHDOG) {
+                        // The snapshot is taken again after recovery
+                        pipeline_failed(&ctx, OMX_ErrorTimeout, "Image encoder input buffer still busy, snapshot stalled");
+                    } else {
+                        say("Image encoder input buffer still busy, snapshot abandoned and snapshots disabled");
+                        ctx.snapshot_capturing = 0;
+                        ctx.snapshot_disabled = 1;
+                    }
+                } else {
+                    ctx.imgencodermodule_.encoder_input_buffer_needed = 0;
+                    memcpy(ctx.imgencodermodule_.encoder_ppBuffer_in->pBuffer, buf->pBuffer + buf->nOffset, buf->nFilledLen);
+                    ctx.imgencodermodule_.encoder_ppBuffer_in->nOffset = 0;
+                    ctx.imgencodermodule_.encoder_ppBuffer_in->nFilledLen = buf->nFilledLen;
+                    ctx.imgencodermodule_.encoder_ppBuffer_in->nFlags = buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+                    if((r = OMX_EmptyThisBuffer(ctx.imgencodermodule_.encoder, ctx.imgencodermodule_.encoder_ppBuffer_in)) != OMX_ErrorNone) {
+                        pipeline_failed(&ctx, r, "Failed to request emptying of the input buffer on image encoder input port 340");
+                    }
+                    if(buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+                        ctx.snapshot_capturing = 0;
+                        ctx.snapshot_encoding = 1;
+                    }
+                }
+            }
+            preview_frame_start = (buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) != 0;
+            need_next_preview_buffer_to_be_filled = 1;
+        }
+        // Collect the JPEG data, it may span several output buffers
+        if(ctx.imgencodermodule_.encoder_output_buffer_available) {
+            ctx.imgencodermodule_.encoder_output_buffer_available = 0;
+            buf = ctx.imgencodermodule_.encoder_ppBuffer_out;
+            if(ctx.snapshot_len + buf->nFilledLen > ctx.snapshot_alloc_len) {
+                ctx.snapshot_alloc_len = ctx.snapshot_len + buf->nFilledLen;
+                if((ctx.snapshot_data = realloc(ctx.snapshot_data, ctx.snapshot_alloc_len)) == NULL) {
+                    die("Failed to allocate memory for snapshot");
+                }
+            }
+            memcpy(ctx.snapshot_data + ctx.snapshot_len, buf->pBuffer + buf->nOffset, buf->nFilledLen);
+            ctx.snapshot_len += buf->nFilledLen;
+            if(buf->nFlags & (OMX_BUFFERFLAG_ENDOFFRAME | OMX_BUFFERFLAG_EOS)) {
+                write_snapshot(&ctx);
+                ctx.snapshot_encoding = 0;
+            } else if((r = OMX_FillThisBuffer(ctx.imgencodermodule_.encoder, ctx.imgencodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
+                pipeline_failed(&ctx, r, "Failed to request filling of the output buffer on image encoder output port 341");
+            }
+        }
+        // Collect the Y plane spans of the preview frame, the luma plane
+        // is in the beginning of each buffer in packed planar format
+        if(MOTION_DETECT && ctx.cammodule_.camera_preview_buffer_available) {
+            buf = ctx.cammodule_.camera_ppBuffer_preview;
+            preview_rows = ctx.preview_portdef.format.video.nSliceHeight;
+            if(preview_rows == 0 || preview_row + preview_rows > MOTION_HEIGHT) {
+                preview_rows = MOTION_HEIGHT - preview_row;
+            }
+            if(buf->nFilledLen > 0) {
+                for(row = 0; row < preview_rows; row++) {
+                    memcpy(ctx.detector_.luma + (preview_row + row) * ctx.detector_.stride,
+                        buf->pBuffer + buf->nOffset + row * ctx.preview_portdef.format.video.nStride,
+                        MOTION_WIDTH);
+                }
+                preview_row += preview_rows;
+            }
+            if(buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+                motion_blocks = motion_detector_process(&ctx.detector_);
+                motion_gate_update(&ctx.gate_, motion_blocks >= MOTION_MIN_BLOCKS);
+                preview_row = 0;
             }
+            need_next_preview_buffer_to_be_filled = 1;
+        }
+        if(need_next_preview_buffer_to_be_filled) {
+            need_next_preview_buffer_to_be_filled = 0;
+            ctx.cammodule_.camera_preview_buffer_available = 0;
+            if((r = OMX_FillThisBuffer(ctx.cammodule_.camera, ctx.cammodule_.camera_ppBuffer_preview)) != OMX_ErrorNone) {
+                pipeline_failed(&ctx, r, "Failed to request filling of the output buffer on camera preview output port 70");
+            }
+        }
+        // Rebuild the pipeline if a component has failed or the encoder
+        // has stopped producing output, most likely as the camera has
+        // stopped delivering frames. Give up if it keeps on failing.
+        if(WATCHDOG && !quit_detected) {
+            stall_us = monotonic_time_us() - last_output_time;
+            if(ctx.pipeline_error == OMX_ErrorNone && stall_us > stall_limit_us) {
+                say("No encoder output for %lld ms, pipeline stalled", (long long)stall_us / 1000);
+                ctx.pipeline_error = OMX_ErrorTimeout;
+            }
+            if(ctx.pipeline_error != OMX_ErrorNone) {
+                say("Pipeline failed with error 0x%08x", ctx.pipeline_error);
+                if(++recovery_retries > WATCHDOG_MAX_RETRIES) {
+                    die("Pipeline failed %d times in a row, giving up", recovery_retries);
+                }
+                recover_pipeline(&ctx, last_output_time);
+                last_output_time = monotonic_time_us();
+                stall_limit_us = (int64_t)WATCHDOG_STARTUP_MS * 1000;
+                need_next_buffer_to_be_filled = 1;
+                end_of_frame = 1;
+                need_next_sub_buffer_to_be_filled = ENCODE_SUBSTREAM;
+                sub_end_of_frame = 1;
+                need_next_preview_buffer_to_be_filled = MOTION_DETECT || SNAPSHOT;
+                preview_row = 0;
+                preview_frame_start = 1;
+                continue;
+            }
+        }
+        // Would be better to use signaling here but hey this works too,
+        // in low latency mode the encoder output buffers wake us up
+        if(LOW_LATENCY) {
+            wait_loop_wakeup(&ctx, 1000);
+        } else {
+            usleep(1000);
         }
-        // Would be better to use signaling here but hey this works too
-        usleep(1000);
     }
     say("Cleaning up...");
+    dump_jitter_stats(&ctx.jitter_);
+    dump_thread_rusage("Capture loop");
 
     // Restore signal handlers
     signal(SIGINT,  SIG_DFL);
     signal(SIGTERM, SIG_DFL);
     signal(SIGQUIT, SIG_DFL);
-
-    // Stop capturing video with the camera
-    OMX_INIT_STRUCTURE(capture);
-    capture.nPortIndex = 71;
-    capture.bEnabled = OMX_FALSE;
-    if((r = OMX_SetParameter(ctx.cammodule_.camera, OMX_IndexConfigPortCapturing, &capture)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch off capture on camera video output port 71");
-    }
-
-    // Return the last full buffer back to the encoder component
-    ctx.encodermodule_.encoder_ppBuffer_out->nFlags = OMX_BUFFERFLAG_EOS;
-    if((r = OMX_FillThisBuffer(ctx.encodermodule_.encoder, ctx.encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
-    }
-
-    // Flush the buffers on each component
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 73, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera input port 73");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 70, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera preview output port 70");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 71, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera video output port 71");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandFlush, 200, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of encoder input port 200");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandFlush, 201, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of encoder output port 201");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandFlush, 240, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of null sink input port 240");
+    if(SNAPSHOT) {
+        signal(SIGUSR1, SIG_DFL);
     }
-    block_until_flushed(&ctx.sync_);
 
-    // Disable all the ports
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 73, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera input port 73");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 73, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 70, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera preview output port 70");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 70, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 71, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera video output port 71");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 71, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortDisable, 200, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable encoder input port 200");
-    }
-    block_until_port_changed(ctx.encodermodule_.encoder, 200, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortDisable, 201, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable encoder output port 201");
-    }
-    block_until_port_changed(ctx.encodermodule_.encoder, 201, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortDisable, 240, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable null sink input port 240");
+    // Return the last full buffer back to the encoder component unless
+    // the loop ended while waiting for it to be filled
+    if(ctx.encodermodule_.encoder_output_buffer_available) {
+        if((r = OMX_FillThisBuffer(ctx.encodermodule_.encoder, ctx.encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+        }
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_FALSE);
 
-    // Free all the buffers
-    if((r = OMX_FreeBuffer(ctx.cammodule_.camera, 73, ctx.cammodule_.camera_ppBuffer_in)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for camera input port 73");
+    destroy_pipeline(&ctx, 0);
+    if(SNAPSHOT) {
+        say("Took %lu snapshots", ctx.snapshots);
+        free(ctx.snapshot_data);
     }
-    if((r = OMX_FreeBuffer(ctx.encodermodule_.encoder, 201, ctx.encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder output port 201");
+    if(WATCHDOG) {
+        say("Recovered %lu times, downtime %lld ms in total and %lld ms at most",
+            ctx.recoveries, (long long)ctx.downtime_total / 1000, (long long)ctx.downtime_max / 1000);
     }
 
-    // Transition all the components to idle and then to loaded states
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to idle");
-    }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to idle");
-    }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to idle");
-    }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to loaded");
-    }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateLoaded);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to loaded");
-    }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateLoaded);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to loaded");
+    // Exit
+    if(MOTION_DETECT) {
+        motion_gate_destroy(&ctx.gate_);
+        motion_detector_destroy(&ctx.detector_);
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateLoaded);
-
-    // Free the component handles
-    if((r = OMX_FreeHandle(ctx.cammodule_.camera)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free camera component handle");
+    if(STREAM_SERVER) {
+        stream_server_destroy(&ctx.server_);
     }
-    if((r = OMX_FreeHandle(ctx.encodermodule_.encoder)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free encoder component handle");
+    output_queue_destroy(&ctx.out_queue_);
+    if(OUTPUT_AVCC) {
+        avcc_framer_flush(&ctx.out_framer_, fileno(ctx.fd_out));
+        avcc_framer_destroy(&ctx.out_framer_);
     }
-    if((r = OMX_FreeHandle(ctx.null_sink)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free null sink component handle");
+    if(LOW_LATENCY) {
+        dump_capture_latency(&ctx.latency_);
+        capture_latency_destroy(&ctx.latency_);
     }
-
-    // Exit
     fclose(ctx.fd_out);
+    if(ENCODE_SUBSTREAM) {
+        output_queue_destroy(&ctx.sub_queue_);
+        if(OUTPUT_AVCC) {
+            avcc_framer_flush(&ctx.sub_framer_, fileno(ctx.fd_sub));
+            avcc_framer_destroy(&ctx.sub_framer_);
+        }
+        fclose(ctx.fd_sub);
+    }
 
+    sem_destroy(&ctx.loop_wakeup);
     vcos_semaphore_delete(&ctx.sync_.handler_lock);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
         omx_die(r, "OMX de-initalization failed");
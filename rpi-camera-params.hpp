@@ -24,8 +24,20 @@ typedef struct
     OMX_HANDLETYPE camera;
     OMX_BUFFERHEADERTYPE *camera_ppBuffer_in;
     OMX_BUFFERHEADERTYPE *camera_ppBuffer_out;
+    OMX_BUFFERHEADERTYPE *camera_ppBuffer_preview;
     int camera_ready;
     int camera_output_buffer_available;
+    // When the last output buffer was filled, CLOCK_MONOTONIC microseconds
+    int64_t camera_output_buffer_time;
+    int camera_preview_buffer_available;
 } OmxCameraModule;
 
-extern void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 cam_height, OMX_U32 cam_framerate);
+// The configuration functions report and return the first error. config_omx_camera()
+// waits at most ready_timeout_ms for the camera to become ready, or forever if negative
+extern OMX_ERRORTYPE config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 cam_height, OMX_U32 cam_framerate, int ready_timeout_ms);
+extern OMX_ERRORTYPE config_omx_camera_preview(OmxCameraModule *cammodule, OMX_U32 preview_width, OMX_U32 preview_height, OMX_U32 preview_framerate);
+// Switch the camera video output port to packed 10-bit Bayer data,
+// call after config_omx_camera()
+extern OMX_ERRORTYPE config_omx_camera_raw(OmxCameraModule *cammodule);
+// Buffer timestamps from the VideoCore system timer, see rpi-latency.hpp
+extern OMX_ERRORTYPE config_omx_camera_stc_timestamps(OmxCameraModule *cammodule);
@@ -42,6 +42,7 @@
 
 
 #define DISPLAY_DEVICE                  0
+#define TEARDOWN_TIMEOUT_MS             1000                    // per teardown step
 
 // Global variable used by the signal handler and capture/encoding loop
 static int want_quit = 0;
@@ -81,6 +82,7 @@ static OMX_ERRORTYPE event_handler(
                 ctx->sync_.flushed = 1;
             }
             vcos_semaphore_post(&ctx->sync_.handler_lock);
+            omx_command_complete(hComponent, nData1, nData2);
             break;
         case OMX_EventParamOrConfigChanged:
             vcos_semaphore_wait(&ctx->sync_.handler_lock);
@@ -129,7 +131,9 @@ int main(int argc, char **argv) {
         die("Failed to get display size");
     }
     say("Configuring camera...");
-    config_omx_camera(&ctx.cammodule_, screen_width/2, screen_height/2, VIDEO_FRAMERATE);
+    if((r = config_omx_camera(&ctx.cammodule_, screen_width/2, screen_height/2, VIDEO_FRAMERATE, -1)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to configure camera");
+    }
 
     say("Configuring render...");
     say("Default port definition for render input port 90");
@@ -289,79 +293,21 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to switch off capture on camera video output port 71");
     }
 
-    // Flush the buffers on each component
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 73, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera input port 73");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 70, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera preview output port 70");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandFlush, 71, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of camera video output port 71");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.render, OMX_CommandFlush, 90, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of render input port 90");
-    }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandFlush, 240, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of null sink input port 240");
-    }
-    block_until_flushed(&ctx.sync_);
-
-    // Disable all the ports
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 73, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera input port 73");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 73, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 70, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera preview output port 70");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 70, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandPortDisable, 71, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable camera video output port 71");
-    }
-    block_until_port_changed(ctx.cammodule_.camera, 71, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.render, OMX_CommandPortDisable, 90, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable render input port 90");
-    }
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortDisable, 240, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable null sink input port 240");
-    }
-    block_until_port_changed(ctx.null_sink, 240, OMX_FALSE);
-
-    // Free all the buffers
-    if((r = OMX_FreeBuffer(ctx.cammodule_.camera, 73, ctx.cammodule_.camera_ppBuffer_in)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for camera input port 73");
-    }
-
-    // Transition all the components to idle and then to loaded states
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to idle");
-    }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.render, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the render component to idle");
-    }
-    block_until_state_changed(ctx.render, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to idle");
-    }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.cammodule_.camera, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the camera component to loaded");
-    }
-    block_until_state_changed(ctx.cammodule_.camera, OMX_StateLoaded);
-    if((r = OMX_SendCommand(ctx.render, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the render component to loaded");
-    }
-    block_until_state_changed(ctx.render, OMX_StateLoaded);
-    if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the null sink component to loaded");
-    }
-    block_until_state_changed(ctx.null_sink, OMX_StateLoaded);
+    // Flush, disable and stop all the components at once
+    teardown_component components[3];
+    memset(components, 0, sizeof(components));
+    components[0].component = ctx.cammodule_.camera;
+    components[0].name = "camera";
+    teardown_add_port(&components[0], 73, ctx.cammodule_.camera_ppBuffer_in);
+    teardown_add_port(&components[0], 70, NULL);
+    teardown_add_port(&components[0], 71, NULL);
+    components[1].component = ctx.render;
+    components[1].name = "render";
+    teardown_add_port(&components[1], 90, NULL);
+    components[2].component = ctx.null_sink;
+    components[2].name = "null sink";
+    teardown_add_port(&components[2], 240, NULL);
+    teardown_components(components, 3, TEARDOWN_TIMEOUT_MS);
 
     // Free the component handles
     if((r = OMX_FreeHandle(ctx.cammodule_.camera)) != OMX_ErrorNone) {
@@ -26,6 +26,28 @@
  * `video_encode`. H.264 encoded video is read from the buffer of `video_encode`
  * output port and dumped to `stdout`.
  *
+ * The input is headerless I420 by default. INPUT_COLOR_FORMAT below selects
+ * NV12 or YUY2 instead, and with INPUT_Y4M a YUV4MPEG2 stream is read, e.g.
+ *
+ *     $ ffmpeg -i test.mkv -f yuv4mpegpipe - | ./rpi-encode-yuv >test.h264
+ *
+ * Any number of files can be encoded with one initialised encoder by giving
+ * the input and output file pairs as arguments, or with -d an input and an
+ * output directory. Files ending in .y4m are read as YUV4MPEG2 streams, e.g.
+ *
+ *     $ ./rpi-encode-yuv a.yuv a.h264 b.y4m b.h264
+ *     $ ./rpi-encode-yuv -d clips encoded
+ *
+ * Between the files the encoder is drained with EOS and flushed, the ports
+ * are reconfigured only when the frame size or rate changes.
+ *
+ * A long raw input file can be encoded with several encoder components at
+ * once with -j. The file is split in to chunks of PARALLEL_CHUNK_FRAMES
+ * frames, each starting with an IDR frame, and the encoded chunks are
+ * concatenated in order, e.g. with two encoders
+ *
+ *     $ ./rpi-encode-yuv -j 2 long.yuv long.h264
+ *
  * Please see README.mdwn for more detailed description of this
  * OpenMAX IL demos for Raspberry Pi bundle.
  *
@@ -33,10 +55,45 @@
 
 #include "rpi-i420-framing.hpp"
 #include "rpi-video-params.hpp"
+#include "rpi-yuv-ingest.hpp"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Hard coded parameters for the input, OMX_COLOR_FormatYUV420Planar (I420),
+// OMX_COLOR_FormatYUV420SemiPlanar (NV12) or OMX_COLOR_FormatYCbYCr (YUY2)
+#define INPUT_COLOR_FORMAT              OMX_COLOR_FormatYUV420Planar
+// Read YUV4MPEG2 stream, frame size and rate come from its header
+#define INPUT_Y4M                       0
+
+// Output file name extension in directory batch mode
+#define BATCH_OUTPUT_SUFFIX             ".h264"
+
+// Length of the chunks in frames the input is split in to with -j. Each
+// chunk starts with an IDR frame, so this should be a multiple of the GOP.
+#define PARALLEL_CHUNK_FRAMES           300
+// Encoded chunks kept in memory per encoder ahead of the one being written
+#define PARALLEL_PENDING_CHUNKS         2
+
+// Exit anyway this long after an exit signal
+#define SHUTDOWN_DEADLINE_MS            2000
+// End of stream event without the flagged buffer, stop waiting after this
+#define DRAIN_IDLE_MS                   100
+// Per teardown step
+#define TEARDOWN_TIMEOUT_MS             1000
 
 // Global variable used by the signal handler and encoding loop
 static int want_quit = 0;
 
+// Input and output file pair, NULL for stdin and stdout
+typedef struct
+{
+    char *in_path;
+    char *out_path;
+    int y4m;
+} encode_job;
+
 // Our application context passed around
 // the main routine and callback handlers
 typedef struct
@@ -49,6 +106,13 @@ typedef struct
     // stdin/out
     FILE *fd_in;
     FILE *fd_out;
+
+    yuv_ingest ingest_;
+
+    // SPS/PPS of the current configuration, written in front of
+    // the following files if the encoder doesn't repeat them
+    char *codec_config;
+    size_t codec_config_len;
 } appctx;
 
 // Global signal handler for trapping SIGINT, SIGTERM, and SIGQUIT
@@ -76,6 +140,14 @@ static OMX_ERRORTYPE event_handler(
                 ctx->sync_.flushed = 1;
             }
             vcos_semaphore_post(&ctx->sync_.handler_lock);
+            omx_command_complete(hComponent, nData1, nData2);
+            break;
+        case OMX_EventBufferFlag:
+            vcos_semaphore_wait(&ctx->sync_.handler_lock);
+            if(nData1 == 201 && (nData2 & OMX_BUFFERFLAG_EOS)) {
+                ctx->encodermodule_.encoder_output_eos = 1;
+            }
+            vcos_semaphore_post(&ctx->sync_.handler_lock);
             break;
         case OMX_EventError:
             omx_die(nData1, "error event received");
@@ -115,178 +187,598 @@ static OMX_ERRORTYPE fill_output_buffer_done_handler(
     return OMX_ErrorNone;
 }
 
-int main(int argc, char **argv) {
-    bcm_host_init();
-
-    OMX_ERRORTYPE r;
-
-    if((r = OMX_Init()) != OMX_ErrorNone) {
-        omx_die(r, "OMX initalization failed");
-    }
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
 
-    // Init context
-    appctx ctx;
-    memset(&ctx, 0, sizeof(ctx));
-    if(vcos_semaphore_create(&ctx.sync_.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
-        die("Failed to create handler lock semaphore");
+static char *path_join(const char *dir, const char *name, size_t name_len, const char *suffix)
+{
+    size_t dir_len = strlen(dir);
+    char *path = malloc(dir_len + 1 + name_len + strlen(suffix) + 1);
+    if(path == NULL) {
+        die("Failed to allocate memory for file name");
     }
+    sprintf(path, "%s/%.*s%s", dir, (int)name_len, name, suffix);
+    return path;
+}
 
-    // Init component handles
-    OMX_CALLBACKTYPE callbacks;
-    memset(&ctx, 0, sizeof(callbacks));
-    callbacks.EventHandler    = event_handler;
-    callbacks.EmptyBufferDone = empty_input_buffer_done_handler;
-    callbacks.FillBufferDone  = fill_output_buffer_done_handler;
-
-    init_component_handle("video_encode", &ctx.encodermodule_.encoder, &ctx, &callbacks);
+static int is_yuv_file(const struct dirent *entry)
+{
+    return has_suffix(entry->d_name, ".yuv") || has_suffix(entry->d_name, ".y4m");
+}
 
-    say("Configuring encoder...");
-    config_omx_encoder_in_out(&ctx.encodermodule_, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE, VIDEO_BITRATE);
+// Build the list of files to encode from the command line
+static int collect_jobs(int argc, char **argv, encode_job **jobs)
+{
+    struct dirent **entries;
+    int i, count;
 
-    // Switch components to idle state
-    say("Switching state of the encoder component to idle...");
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to idle");
+    if(argc == 1) {
+        // Just use stdin for input and stdout for output
+        if((*jobs = calloc(1, sizeof(encode_job))) == NULL) {
+            die("Failed to allocate memory for the file list");
+        }
+        (*jobs)[0].y4m = INPUT_Y4M;
+        return 1;
     }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateIdle);
+    if(strcmp(argv[1], "-d") == 0) {
+        if(argc != 4) {
+            die("Usage: %s -d <input directory> <output directory>", argv[0]);
+        }
+        if((count = scandir(argv[2], &entries, is_yuv_file, alphasort)) < 0) {
+            die("Failed to read input directory %s: %s", argv[2], strerror(errno));
+        }
+        if((*jobs = calloc(count > 0 ? count : 1, sizeof(encode_job))) == NULL) {
+            die("Failed to allocate memory for the file list");
+        }
+        for(i = 0; i < count; i++) {
+            (*jobs)[i].in_path = path_join(argv[2], entries[i]->d_name, strlen(entries[i]->d_name), "");
+            (*jobs)[i].out_path = path_join(argv[3], entries[i]->d_name, strlen(entries[i]->d_name) - 4, BATCH_OUTPUT_SUFFIX);
+            (*jobs)[i].y4m = has_suffix(entries[i]->d_name, ".y4m");
+            free(entries[i]);
+        }
+        free(entries);
+        say("Found %d input files in %s", count, argv[2]);
+        return count;
+    }
+    if((argc - 1) % 2 != 0) {
+        die("Usage: %s [<input file> <output file> ...] | [-d <input directory> <output directory>]", argv[0]);
+    }
+    count = (argc - 1) / 2;
+    if((*jobs = calloc(count, sizeof(encode_job))) == NULL) {
+        die("Failed to allocate memory for the file list");
+    }
+    for(i = 0; i < count; i++) {
+        (*jobs)[i].in_path = strdup(argv[1 + i * 2]);
+        (*jobs)[i].out_path = strdup(argv[2 + i * 2]);
+        (*jobs)[i].y4m = has_suffix(argv[1 + i * 2], ".y4m") ? 1 : INPUT_Y4M;
+    }
+    return count;
+}
+
+// Enable the encoder ports and allocate their buffers
+static void enable_encoder_ports(appctx *ctx)
+{
+    OMX_ERRORTYPE r;
 
-    // Enable ports
     say("Enabling ports...");
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortEnable, 200, NULL)) != OMX_ErrorNone) {
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandPortEnable, 200, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable encoder input port 200");
     }
-    block_until_port_changed(ctx.encodermodule_.encoder, 200, OMX_TRUE);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortEnable, 201, NULL)) != OMX_ErrorNone) {
+    block_until_port_changed(ctx->encodermodule_.encoder, 200, OMX_TRUE);
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandPortEnable, 201, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable encoder output port 201");
     }
-    block_until_port_changed(ctx.encodermodule_.encoder, 201, OMX_TRUE);
+    block_until_port_changed(ctx->encodermodule_.encoder, 201, OMX_TRUE);
 
     // Allocate encoder input and output buffers
     say("Allocating buffers...");
     OMX_PARAM_PORTDEFINITIONTYPE encoder_portdef;
     OMX_INIT_STRUCTURE(encoder_portdef);
     encoder_portdef.nPortIndex = 200;
-    if((r = OMX_GetParameter(ctx.encodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+    if((r = OMX_GetParameter(ctx->encodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for encoder input port 200");
     }
-    if((r = OMX_AllocateBuffer(ctx.encodermodule_.encoder, &ctx.encodermodule_.encoder_ppBuffer_in, 200, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+    if((r = OMX_AllocateBuffer(ctx->encodermodule_.encoder, &ctx->encodermodule_.encoder_ppBuffer_in, 200, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
         omx_die(r, "Failed to allocate buffer for encoder input port 200");
     }
     OMX_INIT_STRUCTURE(encoder_portdef);
     encoder_portdef.nPortIndex = 201;
-    if((r = OMX_GetParameter(ctx.encodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+    if((r = OMX_GetParameter(ctx->encodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for encoder output port 201");
     }
-    if((r = OMX_AllocateBuffer(ctx.encodermodule_.encoder, &ctx.encodermodule_.encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+    if((r = OMX_AllocateBuffer(ctx->encodermodule_.encoder, &ctx->encodermodule_.encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
         omx_die(r, "Failed to allocate buffer for encoder output port 201");
     }
+}
 
-    // Just use stdin for input and stdout for output
-    say("Opening input and output files...");
-    ctx.fd_in = stdin;
-    ctx.fd_out = stdout;
+// Return all the buffers held by the encoder
+static void flush_encoder_ports(appctx *ctx)
+{
+    OMX_ERRORTYPE r;
 
-    // Switch state of the components prior to starting
-    // the video capture and encoding loop
-    say("Switching state of the encoder component to executing...");
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to executing");
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandFlush, 200, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to flush buffers of encoder input port 200");
     }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateExecuting);
+    block_until_flushed(&ctx->sync_);
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandFlush, 201, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to flush buffers of encoder output port 201");
+    }
+    block_until_flushed(&ctx->sync_);
+}
+
+// Disable the encoder ports and free their buffers
+static void disable_encoder_ports(appctx *ctx)
+{
+    OMX_ERRORTYPE r;
+
+    // Disable all the ports
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandPortDisable, 200, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to disable encoder input port 200");
+    }
+    block_until_port_changed(ctx->encodermodule_.encoder, 200, OMX_FALSE);
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandPortDisable, 201, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to disable encoder output port 201");
+    }
+    block_until_port_changed(ctx->encodermodule_.encoder, 201, OMX_FALSE);
+
+    // Free all the buffers
+    if((r = OMX_FreeBuffer(ctx->encodermodule_.encoder, 200, ctx->encodermodule_.encoder_ppBuffer_in)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to free buffer for encoder input port 200");
+    }
+    if((r = OMX_FreeBuffer(ctx->encodermodule_.encoder, 201, ctx->encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to free buffer for encoder output port 201");
+    }
+}
+
+// Frame layout of the encoder input port buffers
+static void get_encoder_frame_info(appctx *ctx, i420_frame_info *frame_info, i420_frame_info *buf_info)
+{
+    OMX_ERRORTYPE r;
 
     say("Configured port definition for encoder input port 200");
-    dump_port(ctx.encodermodule_.encoder, 200, OMX_FALSE);
+    dump_port(ctx->encodermodule_.encoder, 200, OMX_FALSE);
     say("Configured port definition for encoder output port 201");
-    dump_port(ctx.encodermodule_.encoder, 201, OMX_FALSE);
+    dump_port(ctx->encodermodule_.encoder, 201, OMX_FALSE);
 
-    i420_frame_info frame_info, buf_info;
-    get_i420_frame_info(encoder_portdef.format.image.nFrameWidth, encoder_portdef.format.image.nFrameHeight, encoder_portdef.format.image.nStride, encoder_portdef.format.video.nSliceHeight, &frame_info);
-    get_i420_frame_info(frame_info.buf_stride, frame_info.buf_slice_height, -1, -1, &buf_info);
+    OMX_PARAM_PORTDEFINITIONTYPE encoder_portdef;
+    OMX_INIT_STRUCTURE(encoder_portdef);
+    encoder_portdef.nPortIndex = 201;
+    if((r = OMX_GetParameter(ctx->encodermodule_.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for encoder output port 201");
+    }
+    get_i420_frame_info(encoder_portdef.format.image.nFrameWidth, encoder_portdef.format.image.nFrameHeight, encoder_portdef.format.image.nStride, encoder_portdef.format.video.nSliceHeight, frame_info);
+    get_i420_frame_info(frame_info->buf_stride, frame_info->buf_slice_height, -1, -1, buf_info);
 
-    dump_frame_info("Destination frame", &frame_info);
-    dump_frame_info("Source buffer", &buf_info);
+    dump_frame_info("Destination frame", frame_info);
+    dump_frame_info("Source buffer", buf_info);
 
-    if(ctx.encodermodule_.encoder_ppBuffer_in->nAllocLen != buf_info.size) {
-        die("Allocated encoder input port 200 buffer size %d doesn't equal to the expected buffer size %d", ctx.encodermodule_.encoder_ppBuffer_in->nAllocLen, buf_info.size);
+    if(ctx->encodermodule_.encoder_ppBuffer_in->nAllocLen != buf_info->size) {
+        die("Allocated encoder input port 200 buffer size %d doesn't equal to the expected buffer size %d", ctx->encodermodule_.encoder_ppBuffer_in->nAllocLen, buf_info->size);
     }
+}
 
-    say("Enter encode loop, press Ctrl-C to quit...");
+static void write_output(appctx *ctx, const void *data, size_t len)
+{
+    if(fwrite(data, 1, len, ctx->fd_out) != len) {
+        die("Failed to write to output file: %s", strerror(errno));
+    }
+}
 
-    int input_available = 1, frame_in = 0, frame_out = 0, i;
-    size_t input_total_read, want_read, input_read, output_written;
-    // I420 spec: U and V plane span size half of the size of the Y plane span size
-    int plane_span_y = ROUND_UP_2(frame_info.height), plane_span_uv = plane_span_y / 2;
+// Ask the encoder to make the next frame an IDR frame
+static void request_key_frame(appctx *ctx)
+{
+    OMX_ERRORTYPE r;
+    OMX_CONFIG_INTRAREFRESHVOPTYPE idr;
+    OMX_INIT_STRUCTURE(idr);
+    idr.nPortIndex = 201;
+    idr.IntraRefreshVOP = OMX_TRUE;
+    if((r = OMX_SetConfig(ctx->encodermodule_.encoder, OMX_IndexConfigVideoIntraVOPRefresh, &idr)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to request key frame on encoder output port 201");
+    }
+}
 
-    ctx.encodermodule_.encoder_input_buffer_needed = 1;
+// Configure the encoder for the frames of ctx->ingest_ and start it
+static void setup_encoder(appctx *ctx, i420_frame_info *frame_info, i420_frame_info *buf_info)
+{
+    OMX_ERRORTYPE r;
 
-    signal(SIGINT,  signal_handler);
-    signal(SIGTERM, signal_handler);
-    signal(SIGQUIT, signal_handler);
+    say("Configuring encoder...");
+    default_omx_encoder_config(&ctx->encodermodule_.config);
+    if((r = config_omx_encoder_in_out(&ctx->encodermodule_, ctx->ingest_.width, ctx->ingest_.height, yuv_ingest_framerate(&ctx->ingest_), VIDEO_BITRATE)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to configure encoder");
+    }
 
-    while(1) {
+    // Switch components to idle state
+    say("Switching state of the encoder component to idle...");
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the encoder component to idle");
+    }
+    block_until_state_changed(ctx->encodermodule_.encoder, OMX_StateIdle);
+
+    enable_encoder_ports(ctx);
+
+    // Switch state of the components prior to starting
+    // the video capture and encoding loop
+    say("Switching state of the encoder component to executing...");
+    if((r = OMX_SendCommand(ctx->encodermodule_.encoder, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to switch state of the encoder component to executing");
+    }
+    block_until_state_changed(ctx->encodermodule_.encoder, OMX_StateExecuting);
+    get_encoder_frame_info(ctx, frame_info, buf_info);
+}
+
+// Describe the encoder for teardown_components()
+static void get_encoder_teardown(appctx *ctx, teardown_component *tc)
+{
+    memset(tc, 0, sizeof(*tc));
+    tc->component = ctx->encodermodule_.encoder;
+    tc->name = "encoder";
+    teardown_add_port(tc, 200, ctx->encodermodule_.encoder_ppBuffer_in);
+    teardown_add_port(tc, 201, ctx->encodermodule_.encoder_ppBuffer_out);
+}
+
+// Encode frames from ctx->ingest_ to ctx->fd_out until the end of input,
+// max_frames frames if not negative, and drain the encoder with EOS.
+// Returns the number of frames read.
+static int encode_stream(appctx *ctx, const i420_frame_info *frame_info, const i420_frame_info *buf_info,
+        long max_frames, unsigned long long *bytes_in, unsigned long long *bytes_out)
+{
+    OMX_ERRORTYPE r;
+    OMX_BUFFERHEADERTYPE *buf;
+    int input_available = 1, eos_received = 0, need_next_buffer_to_be_filled = 1, config_written = 0;
+    int frame_in = 0, frame_out = 0;
+    yuv_ingest_status input_status;
+    int64_t eos_event_time = 0;
+
+    ctx->encodermodule_.encoder_input_buffer_needed = 1;
+    ctx->encodermodule_.encoder_output_buffer_available = 0;
+    ctx->encodermodule_.encoder_output_eos = 0;
+
+    // Loop until the encoder has passed the end of stream through,
+    // i.e. all the input frames have been encoded
+    while(!eos_received) {
+        // The end of stream goes in with the next input buffer on exit
+        // signal and the process exits within SHUTDOWN_DEADLINE_MS even
+        // if the encoder never passes it through
+        if(want_quit) {
+            set_shutdown_deadline(SHUTDOWN_DEADLINE_MS);
+        }
         // empty_input_buffer_done_handler() has marked that there's
         // a need for a buffer to be filled by us
-        if(ctx.encodermodule_.encoder_input_buffer_needed && input_available) {
-            input_total_read = 0;
-            memset(ctx.encodermodule_.encoder_ppBuffer_in->pBuffer, 0, ctx.encodermodule_.encoder_ppBuffer_in->nAllocLen);
-            // Pack Y, U, and V plane spans read from input file to the buffer
-            for(i = 0; i < 3; i++) {
-                want_read = frame_info.p_stride[i] * (i == 0 ? plane_span_y : plane_span_uv);
-                input_read = fread(
-                    ctx.encodermodule_.encoder_ppBuffer_in->pBuffer + buf_info.p_offset[i],
-                    1, want_read, ctx.fd_in);
-                input_total_read += input_read;
-                if(input_read != want_read) {
-                    ctx.encodermodule_.encoder_ppBuffer_in->nFlags = OMX_BUFFERFLAG_EOS;
-                    want_quit = 1;
-                    say("Input file EOF");
-                    break;
-                }
+        if(ctx->encodermodule_.encoder_input_buffer_needed && input_available) {
+            buf = ctx->encodermodule_.encoder_ppBuffer_in;
+            // Pack Y, U, and V plane spans read or converted from input file
+            // to the buffer, every row of the frame is overwritten
+            input_status = yuv_ingest_frame(&ctx->ingest_, buf->pBuffer, buf_info);
+            buf->nFlags = 0;
+            if(input_status == YUV_INGEST_SHORT) {
+                say("Input file EOF in the middle of frame %d, dropping the incomplete frame", frame_in + 1);
+            } else if(input_status == YUV_INGEST_EOF) {
+                say("Input file EOF");
+            } else {
+                frame_in++;
             }
-            ctx.encodermodule_.encoder_ppBuffer_in->nOffset = 0;
-            ctx.encodermodule_.encoder_ppBuffer_in->nFilledLen = (buf_info.size - frame_info.size) + input_total_read;
-            frame_in++;
-            say("Read from input file and wrote to input buffer %d/%d, frame %d", ctx.encodermodule_.encoder_ppBuffer_in->nFilledLen, ctx.encodermodule_.encoder_ppBuffer_in->nAllocLen, frame_in);
             // Mark input unavailable also if the signal handler was triggered
-            if(want_quit) {
+            if(input_status != YUV_INGEST_FRAME || want_quit || frame_in == max_frames) {
+                buf->nFlags = OMX_BUFFERFLAG_EOS;
                 input_available = 0;
             }
-            if(input_total_read > 0) {
-                ctx.encodermodule_.encoder_input_buffer_needed = 0;
-                if((r = OMX_EmptyThisBuffer(ctx.encodermodule_.encoder, ctx.encodermodule_.encoder_ppBuffer_in)) != OMX_ErrorNone) {
-                    omx_die(r, "Failed to request emptying of the input buffer on encoder input port 200");
-                }
+            buf->nOffset = 0;
+            buf->nFilledLen = input_status == YUV_INGEST_FRAME ? buf_info->size : 0;
+            if(input_status == YUV_INGEST_FRAME) {
+                *bytes_in += frame_info->size;
+            }
+            say("Read from input file and wrote to input buffer %d/%d, frame %d", buf->nFilledLen, buf->nAllocLen, frame_in);
+            // The end of stream is sent even without data to drain the encoder
+            ctx->encodermodule_.encoder_input_buffer_needed = 0;
+            if((r = OMX_EmptyThisBuffer(ctx->encodermodule_.encoder, buf)) != OMX_ErrorNone) {
+                omx_die(r, "Failed to request emptying of the input buffer on encoder input port 200");
             }
         }
         // fill_output_buffer_done_handler() has marked that there's
         // a buffer for us to flush
-        if(ctx.encodermodule_.encoder_output_buffer_available) {
-            if(ctx.encodermodule_.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+        if(ctx->encodermodule_.encoder_output_buffer_available) {
+            buf = ctx->encodermodule_.encoder_ppBuffer_out;
+            ctx->encodermodule_.encoder_output_buffer_available = 0;
+            need_next_buffer_to_be_filled = 1;
+            if(buf->nFlags & OMX_BUFFERFLAG_EOS) {
+                eos_received = 1;
+            }
+            if(buf->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+                // Keep the latest set of headers for the following streams
+                if(!config_written) {
+                    ctx->codec_config_len = 0;
+                }
+                if((ctx->codec_config = realloc(ctx->codec_config, ctx->codec_config_len + buf->nFilledLen)) == NULL) {
+                    die("Failed to allocate memory for codec config");
+                }
+                memcpy(ctx->codec_config + ctx->codec_config_len, buf->pBuffer + buf->nOffset, buf->nFilledLen);
+                ctx->codec_config_len += buf->nFilledLen;
+                config_written = 1;
+            } else if(buf->nFilledLen > 0 && !config_written) {
+                // The encoder doesn't repeat the headers after end of stream,
+                // each stream must still be decodable on its own
+                if(ctx->codec_config_len == 0) {
+                    say("No stream headers available for the output");
+                }
+                write_output(ctx, ctx->codec_config, ctx->codec_config_len);
+                *bytes_out += ctx->codec_config_len;
+                config_written = 1;
+            }
+            if(buf->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
                 frame_out++;
             }
             // Flush buffer to output file
-            output_written = fwrite(ctx.encodermodule_.encoder_ppBuffer_out->pBuffer + ctx.encodermodule_.encoder_ppBuffer_out->nOffset, 1, ctx.encodermodule_.encoder_ppBuffer_out->nFilledLen, ctx.fd_out);
-            if(output_written != ctx.encodermodule_.encoder_ppBuffer_out->nFilledLen) {
-                die("Failed to write to output file: %s", strerror(errno));
+            write_output(ctx, buf->pBuffer + buf->nOffset, buf->nFilledLen);
+            *bytes_out += buf->nFilledLen;
+            say("Read from output buffer and wrote to output file %d/%d, frame %d", buf->nFilledLen, buf->nAllocLen, frame_out);
+        }
+        // The end of stream event normally comes with the flagged buffer,
+        // don't wait for the buffer forever if it doesn't
+        if(ctx->encodermodule_.encoder_output_eos && !eos_received && !need_next_buffer_to_be_filled) {
+            if(eos_event_time == 0) {
+                eos_event_time = monotonic_time_us();
+            } else if(monotonic_time_us() - eos_event_time > DRAIN_IDLE_MS * 1000) {
+                say("End of stream event received without the buffer");
+                eos_received = 1;
             }
-            say("Read from output buffer and wrote to output file %d/%d, frame %d", ctx.encodermodule_.encoder_ppBuffer_out->nFilledLen, ctx.encodermodule_.encoder_ppBuffer_out->nAllocLen, frame_out + 1);
         }
-        if(ctx.encodermodule_.encoder_output_buffer_available || !frame_out) {
-            // Buffer flushed, request a new buffer to be filled by the encoder component
-            ctx.encodermodule_.encoder_output_buffer_available = 0;
-            if((r = OMX_FillThisBuffer(ctx.encodermodule_.encoder, ctx.encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
+        // Buffer flushed, request a new buffer to be filled by the encoder component
+        if(need_next_buffer_to_be_filled && !eos_received) {
+            need_next_buffer_to_be_filled = 0;
+            if((r = OMX_FillThisBuffer(ctx->encodermodule_.encoder, ctx->encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
                 omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
             }
         }
-        // Don't exit the loop until all the input frames have been encoded.
-        // Out frame count is larger than in frame count because 2 header
-        // frames are emitted in the beginning.
-        if(want_quit && frame_out == frame_in) {
-            break;
-        }
         // Would be better to use signaling here but hey this works too
         usleep(10);
     }
+
+    return frame_in;
+}
+
+// Run of frames of the input file encoded in to memory by one of the encoders
+typedef struct
+{
+    long first_frame;
+    int frames;
+    // Annex B stream of the chunk, written out in order by the main thread
+    char *data;
+    size_t len;
+    int done;
+    int encoder;
+    int64_t encode_time;
+} encode_chunk;
+
+typedef struct
+{
+    const char *in_path;
+    encode_chunk *chunks;
+    int chunk_count;
+    // Next chunk to be taken by an encoder and to be written out
+    int next_chunk;
+    int written;
+    // Encoded chunks may wait this far ahead of the writer
+    int max_pending;
+    int workers_running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} chunk_scheduler;
+
+typedef struct
+{
+    int id;
+    appctx ctx;
+    chunk_scheduler *sched;
+    pthread_t thread;
+    i420_frame_info frame_info;
+    i420_frame_info buf_info;
+
+    // Counters
+    int chunks;
+    unsigned long frames;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    int64_t busy_time;
+} encode_worker;
+
+// Take chunks off the scheduler and encode them with the worker's own
+// encoder until there are no more left
+static void *encode_worker_thread(void *arg)
+{
+    encode_worker *w = (encode_worker *)arg;
+    chunk_scheduler *s = w->sched;
+    encode_chunk *chunk;
+    int64_t start;
+    off_t offset;
+
+    while(1) {
+        pthread_mutex_lock(&s->lock);
+        while(!want_quit && s->next_chunk < s->chunk_count && s->next_chunk >= s->written + s->max_pending) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if(want_quit || s->next_chunk >= s->chunk_count) {
+            s->workers_running--;
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        chunk = &s->chunks[s->next_chunk++];
+        pthread_mutex_unlock(&s->lock);
+
+        say("Encoder %d: encoding frames %ld-%ld", w->id, chunk->first_frame, chunk->first_frame + chunk->frames - 1);
+        start = monotonic_time_us();
+        offset = (off_t)chunk->first_frame * w->ctx.ingest_.info.size;
+        if(fseeko(w->ctx.fd_in, offset, SEEK_SET) < 0) {
+            die("Failed to seek input file %s: %s", s->in_path, strerror(errno));
+        }
+        if((w->ctx.fd_out = open_memstream(&chunk->data, &chunk->len)) == NULL) {
+            die("Failed to open memory stream for encoder %d: %s", w->id, strerror(errno));
+        }
+        // Every chunk starts a new stream, the first one of each
+        // encoder starts with an IDR frame anyway
+        if(w->chunks > 0) {
+            request_key_frame(&w->ctx);
+        }
+        w->frames += encode_stream(&w->ctx, &w->frame_info, &w->buf_info, chunk->frames, &w->bytes_in, &w->bytes_out);
+        flush_encoder_ports(&w->ctx);
+        fclose(w->ctx.fd_out);
+        w->ctx.fd_out = NULL;
+        w->chunks++;
+        chunk->encoder = w->id;
+        chunk->encode_time = monotonic_time_us() - start;
+        w->busy_time += chunk->encode_time;
+
+        pthread_mutex_lock(&s->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return NULL;
+}
+
+// Split a raw input file in to chunks and encode them with encoder_count
+// video_encode components running at the same time
+static int encode_parallel(const char *in_path, const char *out_path, int encoder_count)
+{
+    OMX_ERRORTYPE r;
+    chunk_scheduler sched;
+    encode_worker *workers;
+    encode_chunk *chunk;
+    FILE *fd_out;
+    struct stat st;
+    size_t frame_size;
+    long frame_count;
+    int i;
+    int64_t start;
+    unsigned long long bytes_in = 0, bytes_out = 0;
+    unsigned long frames = 0;
+    int64_t busy_time = 0;
+
+    if(INPUT_Y4M || has_suffix(in_path, ".y4m")) {
+        die("Parallel encoding needs raw input frames of fixed size, not YUV4MPEG2");
+    }
+    if(encoder_count < 1) {
+        die("Invalid number of encoders %d", encoder_count);
+    }
+    if((fd_out = fopen(out_path, "w")) == NULL) {
+        die("Failed to open output file %s: %s", out_path, strerror(errno));
+    }
+
+    if((r = OMX_Init()) != OMX_ErrorNone) {
+        omx_die(r, "OMX initalization failed");
+    }
+
+    OMX_CALLBACKTYPE callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.EventHandler    = event_handler;
+    callbacks.EmptyBufferDone = empty_input_buffer_done_handler;
+    callbacks.FillBufferDone  = fill_output_buffer_done_handler;
+
+    if((workers = calloc(encoder_count, sizeof(encode_worker))) == NULL) {
+        die("Failed to allocate memory for encoders");
+    }
+    for(i = 0; i < encoder_count; i++) {
+        workers[i].id = i;
+        workers[i].sched = &sched;
+        if((workers[i].ctx.fd_in = fopen(in_path, "r")) == NULL) {
+            die("Failed to open input file %s: %s", in_path, strerror(errno));
+        }
+        yuv_ingest_init(&workers[i].ctx.ingest_, workers[i].ctx.fd_in, INPUT_COLOR_FORMAT, 0, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE);
+    }
+
+    // Chunks are cut at frame boundaries of the input file
+    frame_size = workers[0].ctx.ingest_.info.size;
+    if(fstat(fileno(workers[0].ctx.fd_in), &st) < 0) {
+        die("Failed to stat input file %s: %s", in_path, strerror(errno));
+    }
+    frame_count = st.st_size / frame_size;
+    if(frame_count == 0) {
+        die("Input file %s has no complete frames", in_path);
+    }
+    if(st.st_size % frame_size != 0) {
+        say("Ignoring %d bytes of incomplete frame at the end of %s", (int)(st.st_size % frame_size), in_path);
+    }
+
+    memset(&sched, 0, sizeof(sched));
+    sched.in_path = in_path;
+    sched.chunk_count = (frame_count + PARALLEL_CHUNK_FRAMES - 1) / PARALLEL_CHUNK_FRAMES;
+    if(encoder_count > sched.chunk_count) {
+        say("Only %d chunks of %d frames, using %d encoders instead of %d", sched.chunk_count, PARALLEL_CHUNK_FRAMES, sched.chunk_count, encoder_count);
+        for(i = sched.chunk_count; i < encoder_count; i++) {
+            yuv_ingest_destroy(&workers[i].ctx.ingest_);
+            fclose(workers[i].ctx.fd_in);
+        }
+        encoder_count = sched.chunk_count;
+    }
+    sched.max_pending = encoder_count * PARALLEL_PENDING_CHUNKS;
+    sched.workers_running = encoder_count;
+    if((sched.chunks = calloc(sched.chunk_count, sizeof(encode_chunk))) == NULL) {
+        die("Failed to allocate memory for chunks");
+    }
+    for(i = 0; i < sched.chunk_count; i++) {
+        sched.chunks[i].first_frame = (long)i * PARALLEL_CHUNK_FRAMES;
+        sched.chunks[i].frames = frame_count - sched.chunks[i].first_frame < PARALLEL_CHUNK_FRAMES ?
+            frame_count - sched.chunks[i].first_frame : PARALLEL_CHUNK_FRAMES;
+    }
+    pthread_mutex_init(&sched.lock, NULL);
+    pthread_cond_init(&sched.cond, NULL);
+    say("Encoding %ld frames of %s in %d chunks with %d encoders", frame_count, in_path, sched.chunk_count, encoder_count);
+
+    // Each encoder has its own context, buffers and callback state
+    for(i = 0; i < encoder_count; i++) {
+        if(vcos_semaphore_create(&workers[i].ctx.sync_.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
+            die("Failed to create handler lock semaphore");
+        }
+        init_component_handle("video_encode", &workers[i].ctx.encodermodule_.encoder, &workers[i].ctx, &callbacks);
+        setup_encoder(&workers[i].ctx, &workers[i].frame_info, &workers[i].buf_info);
+    }
+
+    signal(SIGINT,  signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGQUIT, signal_handler);
+
+    start = monotonic_time_us();
+    for(i = 0; i < encoder_count; i++) {
+        if(pthread_create(&workers[i].thread, NULL, encode_worker_thread, &workers[i]) != 0) {
+            die("Failed to create thread for encoder %d", i);
+        }
+    }
+
+    // Concatenate the chunks in order as they get ready
+    pthread_mutex_lock(&sched.lock);
+    while(sched.written < sched.chunk_count) {
+        chunk = &sched.chunks[sched.written];
+        if(!chunk->done) {
+            // Interrupted, no one is going to encode the rest
+            if(sched.written >= sched.next_chunk && (want_quit || sched.workers_running == 0)) {
+                break;
+            }
+            pthread_cond_wait(&sched.cond, &sched.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&sched.lock);
+        if(fwrite(chunk->data, 1, chunk->len, fd_out) != chunk->len) {
+            die("Failed to write to output file: %s", strerror(errno));
+        }
+        say("Wrote chunk %d, %d frames in %d bytes encoded by encoder %d in %.2fs",
+            sched.written, chunk->frames, chunk->len, chunk->encoder, (double)chunk->encode_time / 1000000.0);
+        free(chunk->data);
+        chunk->data = NULL;
+        pthread_mutex_lock(&sched.lock);
+        sched.written++;
+        pthread_cond_broadcast(&sched.cond);
+    }
+    pthread_mutex_unlock(&sched.lock);
+
+    for(i = 0; i < encoder_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = (double)(monotonic_time_us() - start) / 1000000.0;
     say("Cleaning up...");
 
     // Restore signal handlers
@@ -294,43 +786,202 @@ int main(int argc, char **argv) {
     signal(SIGTERM, SIG_DFL);
     signal(SIGQUIT, SIG_DFL);
 
-    // Flush the buffers on each component
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandFlush, 200, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of encoder input port 200");
+    for(i = 0; i < encoder_count; i++) {
+        say("Encoder %d: %d chunks, %lu frames in %.2fs, %.1f fps", i, workers[i].chunks, workers[i].frames,
+            (double)workers[i].busy_time / 1000000.0,
+            workers[i].busy_time > 0 ? workers[i].frames * 1000000.0 / workers[i].busy_time : 0.0);
+        frames += workers[i].frames;
+        bytes_in += workers[i].bytes_in;
+        bytes_out += workers[i].bytes_out;
+        busy_time += workers[i].busy_time;
     }
-    block_until_flushed(&ctx.sync_);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandFlush, 201, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to flush buffers of encoder output port 201");
+    // Encoding time summed over the chunks tells how long a single
+    // encoder running at the same per chunk speed would have taken
+    double speedup = elapsed > 0 ? (double)busy_time / 1000000.0 / elapsed : 0.0;
+    say("Parallel encoding stats:\n"
+        "\tEncoders:\t\t%d\n"
+        "\tChunks written:\t\t%d/%d\n"
+        "\tFrames encoded:\t\t%lu\n"
+        "\tBytes read:\t\t%llu\n"
+        "\tBytes written:\t\t%llu\n"
+        "\tElapsed time:\t\t%.2fs\n"
+        "\tThroughput:\t\t%.1f fps, %.1f MB/s\n"
+        "\tSpeedup:\t\t%.2fx, %.0f%% of %d encoders\n",
+        encoder_count, sched.written, sched.chunk_count, frames, bytes_in, bytes_out, elapsed,
+        elapsed > 0 ? frames / elapsed : 0.0,
+        elapsed > 0 ? bytes_in / elapsed / 1000000.0 : 0.0,
+        speedup, speedup * 100.0 / encoder_count, encoder_count);
+
+    // All the encoders are torn down at once
+    teardown_component *components;
+    if((components = calloc(encoder_count, sizeof(teardown_component))) == NULL) {
+        die("Failed to allocate memory for teardown");
+    }
+    for(i = 0; i < encoder_count; i++) {
+        get_encoder_teardown(&workers[i].ctx, &components[i]);
+    }
+    teardown_components(components, encoder_count, TEARDOWN_TIMEOUT_MS);
+    free(components);
+    for(i = 0; i < encoder_count; i++) {
+        if((r = OMX_FreeHandle(workers[i].ctx.encodermodule_.encoder)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to free encoder component handle");
+        }
+        vcos_semaphore_delete(&workers[i].ctx.sync_.handler_lock);
+        yuv_ingest_destroy(&workers[i].ctx.ingest_);
+        fclose(workers[i].ctx.fd_in);
+        free(workers[i].ctx.codec_config);
+    }
+    for(i = 0; i < sched.chunk_count; i++) {
+        free(sched.chunks[i].data);
     }
-    block_until_flushed(&ctx.sync_);
+    free(sched.chunks);
+    free(workers);
+    pthread_mutex_destroy(&sched.lock);
+    pthread_cond_destroy(&sched.cond);
+    fclose(fd_out);
 
-    // Disable all the ports
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortDisable, 200, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable encoder input port 200");
+    if((r = OMX_Deinit()) != OMX_ErrorNone) {
+        omx_die(r, "OMX de-initalization failed");
     }
-    block_until_port_changed(ctx.encodermodule_.encoder, 200, OMX_FALSE);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandPortDisable, 201, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to disable encoder output port 201");
+
+    say("Exit!");
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    bcm_host_init();
+
+    OMX_ERRORTYPE r;
+
+    if(argc > 1 && strcmp(argv[1], "-j") == 0) {
+        if(argc != 5) {
+            die("Usage: %s -j <number of encoders> <input file> <output file>", argv[0]);
+        }
+        return encode_parallel(argv[3], argv[4], atoi(argv[2]));
     }
-    block_until_port_changed(ctx.encodermodule_.encoder, 201, OMX_FALSE);
 
-    // Free all the buffers
-    if((r = OMX_FreeBuffer(ctx.encodermodule_.encoder, 200, ctx.encodermodule_.encoder_ppBuffer_in)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder input port 200");
+    // Files to be encoded
+    encode_job *jobs;
+    int job_count = collect_jobs(argc, argv, &jobs);
+
+    if((r = OMX_Init()) != OMX_ErrorNone) {
+        omx_die(r, "OMX initalization failed");
     }
-    if((r = OMX_FreeBuffer(ctx.encodermodule_.encoder, 201, ctx.encodermodule_.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder output port 201");
+
+    // Init context
+    appctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    if(vcos_semaphore_create(&ctx.sync_.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
+        die("Failed to create handler lock semaphore");
     }
 
-    // Transition all the components to idle and then to loaded states
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to idle");
+    // Init component handles
+    OMX_CALLBACKTYPE callbacks;
+    memset(&ctx, 0, sizeof(callbacks));
+    callbacks.EventHandler    = event_handler;
+    callbacks.EmptyBufferDone = empty_input_buffer_done_handler;
+    callbacks.FillBufferDone  = fill_output_buffer_done_handler;
+
+    init_component_handle("video_encode", &ctx.encodermodule_.encoder, &ctx, &callbacks);
+
+    i420_frame_info frame_info, buf_info;
+    int configured = 0, width = 0, height = 0, framerate = 0, job;
+    int frame_in;
+    // Aggregate counters
+    int64_t batch_start = monotonic_time_us(), file_start;
+    unsigned long total_frames = 0, files_done = 0, reconfigurations = 0;
+    unsigned long long total_bytes_in = 0, total_bytes_out = 0, bytes_out;
+
+    signal(SIGINT,  signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGQUIT, signal_handler);
+
+    for(job = 0; job < job_count && !want_quit; job++) {
+        say("Opening input and output files...");
+        if(jobs[job].in_path == NULL) {
+            ctx.fd_in = stdin;
+            ctx.fd_out = stdout;
+        } else {
+            say("Encoding %s to %s, file %d/%d", jobs[job].in_path, jobs[job].out_path, job + 1, job_count);
+            if((ctx.fd_in = fopen(jobs[job].in_path, "r")) == NULL) {
+                die("Failed to open input file %s: %s", jobs[job].in_path, strerror(errno));
+            }
+            if((ctx.fd_out = fopen(jobs[job].out_path, "w")) == NULL) {
+                die("Failed to open output file %s: %s", jobs[job].out_path, strerror(errno));
+            }
+        }
+        // Frame size and rate may come from the input stream header
+        yuv_ingest_init(&ctx.ingest_, ctx.fd_in, INPUT_COLOR_FORMAT, jobs[job].y4m, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_FRAMERATE);
+
+        if(!configured) {
+            setup_encoder(&ctx, &frame_info, &buf_info);
+            configured = 1;
+        } else if(ctx.ingest_.width != width || ctx.ingest_.height != height || yuv_ingest_framerate(&ctx.ingest_) != framerate) {
+            // Port definitions can only be changed while the ports are disabled,
+            // the component itself stays in executing state
+            say("Reconfiguring encoder from %dx%d at %d fps to %dx%d at %d fps...",
+                width, height, framerate, ctx.ingest_.width, ctx.ingest_.height, yuv_ingest_framerate(&ctx.ingest_));
+            disable_encoder_ports(&ctx);
+            if((r = config_omx_encoder_in_out(&ctx.encodermodule_, ctx.ingest_.width, ctx.ingest_.height, yuv_ingest_framerate(&ctx.ingest_), VIDEO_BITRATE)) != OMX_ErrorNone) {
+                omx_die(r, "Failed to configure encoder");
+            }
+            enable_encoder_ports(&ctx);
+            get_encoder_frame_info(&ctx, &frame_info, &buf_info);
+            // The cached headers belong to the old configuration
+            ctx.codec_config_len = 0;
+            reconfigurations++;
+        } else {
+            // Each file must start with a key frame
+            request_key_frame(&ctx);
+        }
+        width = ctx.ingest_.width;
+        height = ctx.ingest_.height;
+        framerate = yuv_ingest_framerate(&ctx.ingest_);
+
+        say("Enter encode loop, press Ctrl-C to quit...");
+
+        file_start = monotonic_time_us();
+        bytes_out = 0;
+        frame_in = encode_stream(&ctx, &frame_info, &buf_info, -1, &total_bytes_in, &bytes_out);
+
+        // Both buffers are back with us, the encoder stays in executing state
+        flush_encoder_ports(&ctx);
+
+        say("Encoded %d frames in to %llu bytes in %.2fs", frame_in, bytes_out,
+            (double)(monotonic_time_us() - file_start) / 1000000.0);
+        total_frames += frame_in;
+        total_bytes_out += bytes_out;
+        files_done++;
+        yuv_ingest_destroy(&ctx.ingest_);
+        fclose(ctx.fd_in);
+        fclose(ctx.fd_out);
     }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateIdle);
-    if((r = OMX_SendCommand(ctx.encodermodule_.encoder, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to switch state of the encoder component to loaded");
+    say("Cleaning up...");
+
+    // Restore signal handlers
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+
+    double elapsed = (double)(monotonic_time_us() - batch_start) / 1000000.0;
+    say("Batch stats:\n"
+        "\tFiles encoded:\t\t%lu/%d\n"
+        "\tReconfigurations:\t%lu\n"
+        "\tFrames encoded:\t\t%lu\n"
+        "\tBytes read:\t\t%llu\n"
+        "\tBytes written:\t\t%llu\n"
+        "\tElapsed time:\t\t%.2fs\n"
+        "\tThroughput:\t\t%.1f fps, %.1f MB/s\n",
+        files_done, job_count, reconfigurations, total_frames, total_bytes_in, total_bytes_out, elapsed,
+        elapsed > 0 ? total_frames / elapsed : 0.0,
+        elapsed > 0 ? total_bytes_in / elapsed / 1000000.0 : 0.0);
+
+    if(configured) {
+        teardown_component component;
+        get_encoder_teardown(&ctx, &component);
+        teardown_components(&component, 1, TEARDOWN_TIMEOUT_MS);
     }
-    block_until_state_changed(ctx.encodermodule_.encoder, OMX_StateLoaded);
 
     // Free the component handles
     if((r = OMX_FreeHandle(ctx.encodermodule_.encoder)) != OMX_ErrorNone) {
@@ -338,8 +989,12 @@ int main(int argc, char **argv) {
     }
 
     // Exit
-    fclose(ctx.fd_in);
-    fclose(ctx.fd_out);
+    for(job = 0; job < job_count; job++) {
+        free(jobs[job].in_path);
+        free(jobs[job].out_path);
+    }
+    free(jobs);
+    free(ctx.codec_config);
 
     vcos_semaphore_delete(&ctx.sync_.handler_lock);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
@@ -0,0 +1,104 @@
+/*
+ * Producer side of the shared memory frame bus
+ *
+ * Frames are unpacked straight in to the slots, so the bus costs no more
+ * than the single copy out of the OMX buffers regardless of the number of
+ * readers. The producer never waits for the readers, the slot holding the
+ * oldest frame is simply overwritten.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "rpi-frame-bus-publish.hpp"
+
+#define ROUND_UP_PAGE(num) (((num)+FRAME_BUS_ALIGN-1)&~(FRAME_BUS_ALIGN-1))
+
+void frame_bus_publisher_init(frame_bus_publisher *p, const char *name, int slots, const yuv_output_info *info)
+{
+    frame_bus_slot *slot;
+    int i, j;
+
+    memset(p, 0, sizeof(*p));
+    p->name = name;
+    p->info = *info;
+    // Readers take the latest frame while the next one is written
+    if(slots < 2) {
+        die("Invalid frame bus slot count %d", slots);
+    }
+
+    // Readers of an earlier bus keep their mapping and see it closed
+    shm_unlink(name);
+    if((p->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        die("Failed to create frame bus %s: %s", name, strerror(errno));
+    }
+    p->map_size = FRAME_BUS_ALIGN + (size_t)slots * ROUND_UP_PAGE(FRAME_BUS_ALIGN + info->size);
+    if(ftruncate(p->fd, p->map_size) < 0) {
+        die("Failed to resize frame bus %s to %d bytes: %s", name, p->map_size, strerror(errno));
+    }
+    if((p->map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0)) == MAP_FAILED) {
+        die("Failed to map frame bus %s: %s", name, strerror(errno));
+    }
+
+    p->header = (frame_bus_header *)p->map;
+    p->header->version = FRAME_BUS_VERSION;
+    p->header->slot_count = slots;
+    p->header->header_size = FRAME_BUS_ALIGN;
+    p->header->slot_size = ROUND_UP_PAGE(FRAME_BUS_ALIGN + info->size);
+    p->header->data_offset = FRAME_BUS_ALIGN;
+    p->header->producer_pid = getpid();
+    for(i = 0; i < slots; i++) {
+        slot = (frame_bus_slot *)(p->map + p->header->header_size + (size_t)i * p->header->slot_size);
+        memcpy(slot->fourcc, get_yuv_output_fourcc(info->format), 4);
+        slot->format = info->format;
+        slot->width = info->width;
+        slot->height = info->height;
+        slot->size = info->size;
+        for(j = 0; j < 3; j++) {
+            slot->p_offset[j] = info->p_offset[j];
+            slot->p_stride[j] = info->p_stride[j];
+        }
+    }
+    __atomic_store_n(&p->header->magic, FRAME_BUS_MAGIC, __ATOMIC_RELEASE);
+    say("Created frame bus %s of %d slots, %d bytes each", name, slots, p->header->slot_size);
+}
+
+unsigned char *frame_bus_begin(frame_bus_publisher *p)
+{
+    p->sequence++;
+    p->slot = (frame_bus_slot *)(p->map + p->header->header_size
+        + (size_t)((p->sequence - 1) % p->header->slot_count) * p->header->slot_size);
+    __atomic_store_n(&p->slot->generation, p->slot->generation + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return (unsigned char *)p->slot + p->header->data_offset;
+}
+
+void frame_bus_publish(frame_bus_publisher *p, int64_t timestamp)
+{
+    frame_bus_header *h = p->header;
+    p->slot->sequence = p->sequence;
+    p->slot->timestamp = timestamp;
+    p->slot->published = monotonic_time_us();
+    __atomic_store_n(&p->slot->generation, p->slot->generation + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->latest, p->sequence, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&h->notify, 1, __ATOMIC_SEQ_CST);
+    // Skip the system call while nobody is waiting
+    if(__atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &h->notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+void frame_bus_publisher_destroy(frame_bus_publisher *p)
+{
+    say("Published %llu frames on frame bus %s", (unsigned long long)p->sequence, p->name);
+    __atomic_store_n(&p->header->closed, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&p->header->notify, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &p->header->notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    munmap(p->map, p->map_size);
+    close(p->fd);
+    shm_unlink(p->name);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+/*
+ * Producer side of the shared memory frame bus
+ */
+#include "rpi-frame-bus.hpp"
+#include "rpi-yuv-convert.hpp"
+
+typedef struct
+{
+    const char *name;
+    int fd;
+    size_t map_size;
+    unsigned char *map;
+    frame_bus_header *header;
+    // Layout of the published frames
+    yuv_output_info info;
+    // Slot of the frame being written
+    frame_bus_slot *slot;
+    uint64_t sequence;
+} frame_bus_publisher;
+
+// Create the shared memory object name with slots frames in info layout,
+// replacing a stale one left behind by an earlier producer
+extern void frame_bus_publisher_init(frame_bus_publisher *p, const char *name, int slots, const yuv_output_info *info);
+// Start writing the next frame in the oldest slot and return its frame data
+extern unsigned char *frame_bus_begin(frame_bus_publisher *p);
+// Make the frame started above the latest one and wake up the waiting readers
+extern void frame_bus_publish(frame_bus_publisher *p, int64_t timestamp);
+// Tell the readers the bus is gone and remove the shared memory object
+extern void frame_bus_publisher_destroy(frame_bus_publisher *p);
@@ -0,0 +1,105 @@
+/*
+ * Short intro about this program:
+ *
+ * `rpi-frame-bus-read` is an example reader of the shared memory frame bus
+ * published by `rpi-camera-dump-yuv` when its FRAME_BUS is enabled. It takes
+ * the latest frame whenever one is available and dumps it to `stdout`. Any
+ * number of readers can run at the same time and none of them can stall the
+ * producer, a reader that falls behind just skips frames.
+ *
+ *     $ ./rpi-camera-dump-yuv &
+ *     $ ./rpi-frame-bus-read >test.yuv
+ *
+ * The bus name may be given as the only argument. The frames are written as
+ * they were published, the format and geometry are printed when reading
+ * starts.
+ *
+ * Please see README.mdwn for more detailed description of this
+ * OpenMAX IL demos for Raspberry Pi bundle.
+ *
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rpi-frame-bus.hpp"
+
+// How long to wait for a frame before checking for the exit signal
+#define READ_TIMEOUT_MS                 500
+// How long to wait for the producer to create the bus
+#define OPEN_RETRY_MS                   100
+
+// Global variable used by the signal handler and read loop
+static volatile sig_atomic_t want_quit = 0;
+
+// Global signal handler for trapping SIGINT, SIGTERM, and SIGQUIT
+static void signal_handler(int signal) {
+    want_quit = 1;
+}
+
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : FRAME_BUS_DEFAULT_NAME;
+    frame_bus_reader reader;
+    frame_bus_frame frame;
+    size_t written;
+    ssize_t w;
+    int r;
+
+    signal(SIGINT,  signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGQUIT, signal_handler);
+
+    fprintf(stderr, "Opening frame bus %s...\n", name);
+    while(frame_bus_reader_open(&reader, name) < 0) {
+        if(errno != ENOENT && errno != EAGAIN) {
+            fprintf(stderr, "Failed to open frame bus %s: %s\n", name, strerror(errno));
+            return 1;
+        }
+        if(want_quit) {
+            return 0;
+        }
+        usleep(OPEN_RETRY_MS * 1000);
+    }
+
+    while(!want_quit) {
+        if((r = frame_bus_reader_next(&reader, &frame, READ_TIMEOUT_MS)) < 0) {
+            fprintf(stderr, "Frame bus %s closed by the producer\n", name);
+            break;
+        }
+        if(r == 0) {
+            continue;
+        }
+        if(reader.frames == 1) {
+            fprintf(stderr, "Reading %s frames of %dx%d, %d bytes each\n",
+                frame.fourcc, frame.width, frame.height, (int)frame.size);
+        }
+        for(written = 0; written < frame.size; written += w) {
+            if((w = write(STDOUT_FILENO, frame.data + written, frame.size - written)) < 0) {
+                if(errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                fprintf(stderr, "Failed to write frame: %s\n", strerror(errno));
+                return 1;
+            }
+        }
+        // The frame is already out, just report if it got overwritten
+        if(!frame_bus_reader_check(&reader, &frame)) {
+            fprintf(stderr, "Frame %llu was overwritten while being written out\n",
+                (unsigned long long)frame.sequence);
+        }
+    }
+
+    fprintf(stderr, "Frame bus reader stats:\n"
+        "\tFrames read:\t\t%lu\n"
+        "\tFrames skipped:\t\t%lu\n"
+        "\tFrames torn:\t\t%lu\n",
+        reader.frames, reader.skipped, reader.torn);
+    frame_bus_reader_close(&reader);
+
+    return 0;
+}
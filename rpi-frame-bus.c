@@ -0,0 +1,171 @@
+/*
+ * Reader side of the shared memory frame bus
+ *
+ * The slots are protected by a seqlock: the producer makes the generation
+ * of a slot odd while writing it and even again once the frame is
+ * complete. A reader takes the generation before looking at the slot and
+ * compares it again afterwards, so frames are read in place without any
+ * locking and without ever delaying the producer.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "rpi-frame-bus.hpp"
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static frame_bus_slot *get_slot(frame_bus_reader *r, int slot)
+{
+    return (frame_bus_slot *)(r->map + r->header->header_size + (size_t)slot * r->header->slot_size);
+}
+
+int frame_bus_reader_open(frame_bus_reader *r, const char *name)
+{
+    struct stat st;
+    frame_bus_header *header;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    if((r->fd = shm_open(name, O_RDWR, 0)) < 0) {
+        return -1;
+    }
+    if(fstat(r->fd, &st) < 0) {
+        goto fail;
+    }
+    if((size_t)st.st_size < sizeof(frame_bus_header)) {
+        errno = EAGAIN;
+        goto fail;
+    }
+    r->map_size = st.st_size;
+    if((r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0)) == MAP_FAILED) {
+        r->map = NULL;
+        goto fail;
+    }
+    header = (frame_bus_header *)r->map;
+    // The producer sets the magic last
+    if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FRAME_BUS_MAGIC) {
+        errno = EAGAIN;
+        goto fail;
+    }
+    if(header->version != FRAME_BUS_VERSION
+            || header->header_size + (size_t)header->slot_count * header->slot_size > r->map_size) {
+        errno = EPROTO;
+        goto fail;
+    }
+    r->header = header;
+    return 0;
+
+fail:
+    err = errno;
+    frame_bus_reader_close(r);
+    errno = err;
+    return -1;
+}
+
+int frame_bus_reader_next(frame_bus_reader *r, frame_bus_frame *frame, int timeout_ms)
+{
+    frame_bus_header *h = r->header;
+    frame_bus_slot *slot;
+    uint64_t latest;
+    uint32_t notify, generation;
+    int64_t deadline = timeout_ms >= 0 ? now_us() + (int64_t)timeout_ms * 1000 : 0, left;
+    struct timespec ts;
+    int i;
+
+    while(1) {
+        notify = __atomic_load_n(&h->notify, __ATOMIC_ACQUIRE);
+        latest = __atomic_load_n(&h->latest, __ATOMIC_ACQUIRE);
+        if(latest > r->last_sequence) {
+            frame->slot = (latest - 1) % h->slot_count;
+            slot = get_slot(r, frame->slot);
+            generation = __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE);
+            // Already being reused for a newer frame, try again with that
+            if((generation & 1) || slot->sequence != latest) {
+                continue;
+            }
+            frame->generation = generation;
+            frame->sequence = slot->sequence;
+            frame->timestamp = slot->timestamp;
+            frame->published = slot->published;
+            frame->format = slot->format;
+            memcpy(frame->fourcc, slot->fourcc, 4);
+            frame->fourcc[4] = '\0';
+            frame->width = slot->width;
+            frame->height = slot->height;
+            frame->size = slot->size;
+            for(i = 0; i < 3; i++) {
+                frame->p_offset[i] = slot->p_offset[i];
+                frame->p_stride[i] = slot->p_stride[i];
+            }
+            frame->data = (const unsigned char *)slot + h->data_offset;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != generation) {
+                continue;
+            }
+            if(r->last_sequence > 0) {
+                r->skipped += latest - r->last_sequence - 1;
+            }
+            r->last_sequence = latest;
+            r->frames++;
+            return 1;
+        }
+
+        // The last frame is taken before reporting the producer gone
+        if(__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE)) {
+            if(__atomic_load_n(&h->latest, __ATOMIC_ACQUIRE) > r->last_sequence) {
+                continue;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+        if(timeout_ms >= 0) {
+            if((left = deadline - now_us()) <= 0) {
+                return 0;
+            }
+            ts.tv_sec = left / 1000000;
+            ts.tv_nsec = (left % 1000000) * 1000;
+        }
+        // Sleep until the producer bumps the notify word past the value
+        // seen above, a frame published in between returns immediately
+        __atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &h->notify, FUTEX_WAIT, notify, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+        __atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+int frame_bus_reader_check(frame_bus_reader *r, const frame_bus_frame *frame)
+{
+    frame_bus_slot *slot = get_slot(r, frame->slot);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != frame->generation) {
+        r->torn++;
+        return 0;
+    }
+    return 1;
+}
+
+void frame_bus_reader_close(frame_bus_reader *r)
+{
+    if(r->map != NULL) {
+        munmap(r->map, r->map_size);
+    }
+    if(r->fd >= 0) {
+        close(r->fd);
+    }
+    r->map = NULL;
+    r->header = NULL;
+    r->fd = -1;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+/*
+ * Ring of raw frames in POSIX shared memory published by a single producer
+ * and read by any number of local processes
+ *
+ * This header doesn't depend on the OpenMAX headers so that the reader side
+ * in rpi-frame-bus.c can be built in to other programs on its own. Link them
+ * with -lrt on glibc older than 2.34.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+// Name of the bus rpi-camera-dump-yuv publishes its frames on
+#define FRAME_BUS_DEFAULT_NAME  "/rpi-camera-yuv"
+
+#define FRAME_BUS_MAGIC         0x53554246      // "FBUS"
+#define FRAME_BUS_VERSION       1
+// Header, slot headers and frame data are all page aligned
+#define FRAME_BUS_ALIGN         4096
+
+// At the start of the shared memory object
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    // Offset of the first slot and distance between the slots
+    uint32_t header_size;
+    uint32_t slot_size;
+    // Offset of the frame data from the start of a slot
+    uint32_t data_offset;
+    int32_t producer_pid;
+    // Set when the producer exits, readers must reopen the bus
+    uint32_t closed;
+    // Sequence number of the latest complete frame, 0 until the first one.
+    // Frame n is in slot (n - 1) % slot_count.
+    uint64_t latest;
+    // Futex word bumped on every frame and the number of readers waiting on it
+    uint32_t notify;
+    uint32_t waiters;
+} frame_bus_header;
+
+// At the start of each slot, followed by the frame at data_offset
+typedef struct
+{
+    // Seqlock, odd while the producer is writing the slot
+    uint32_t generation;
+    // Pixel format as I420, NV12, YUY2 or GREY
+    char fourcc[4];
+    uint64_t sequence;
+    // nTimeStamp of the camera buffer, microseconds
+    int64_t timestamp;
+    // CLOCK_MONOTONIC when the frame was published, microseconds
+    int64_t published;
+    // OMX_COLOR_FORMATTYPE of the frame
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t size;
+    // Y or packed YUV plane and U, V or interleaved UV planes
+    int32_t p_offset[3];
+    int32_t p_stride[3];
+} frame_bus_slot;
+
+typedef struct
+{
+    int fd;
+    size_t map_size;
+    unsigned char *map;
+    frame_bus_header *header;
+    uint64_t last_sequence;
+
+    // Counters
+    unsigned long frames;
+    // Frames published in between the ones read
+    unsigned long skipped;
+    // Frames overwritten while being read
+    unsigned long torn;
+} frame_bus_reader;
+
+// A frame read from the bus, data points straight in to the shared memory
+typedef struct
+{
+    uint64_t sequence;
+    int64_t timestamp;
+    int64_t published;
+    uint32_t format;
+    char fourcc[5];
+    int width;
+    int height;
+    size_t size;
+    int p_offset[3];
+    int p_stride[3];
+    const unsigned char *data;
+    // Slot and its generation at the time the frame was taken
+    int slot;
+    uint32_t generation;
+} frame_bus_frame;
+
+// Map the bus published under name, returns 0 or -1 with errno set
+extern int frame_bus_reader_open(frame_bus_reader *r, const char *name);
+// Take the latest frame newer than the previous one, waiting up to timeout_ms
+// for it, or forever if negative. Returns 1 if a frame was taken, 0 on
+// timeout and -1 with errno set to EPIPE if the producer has exited.
+extern int frame_bus_reader_next(frame_bus_reader *r, frame_bus_frame *frame, int timeout_ms);
+// The producer never waits for the readers. Call this after using the frame
+// data, returns 1 if it was intact and 0 if it was overwritten meanwhile.
+extern int frame_bus_reader_check(frame_bus_reader *r, const frame_bus_frame *frame);
+extern void frame_bus_reader_close(frame_bus_reader *r);
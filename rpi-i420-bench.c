@@ -0,0 +1,107 @@
+/*
+ * Short intro about this program:
+ *
+ * `rpi-i420-bench` measures unpacking the camera buffers to I420 frames as
+ * done by `rpi-camera-dump-yuv`, comparing the generic unpack routine with
+ * the ones compiled for the fixed frame sizes in `rpi-i420-framing.c`. No
+ * camera is needed, the buffers are filled with a test pattern and the frames
+ * unpacked by both routines are compared.
+ *
+ *     $ ./rpi-i420-bench
+ *
+ * The number of frames to unpack per frame size may be given as the only
+ * argument.
+ *
+ * Please see README.mdwn for more detailed description of this
+ * OpenMAX IL demos for Raspberry Pi bundle.
+ *
+ */
+
+#include "rpi-i420-framing.hpp"
+
+// Hard coded parameters for the benchmark
+#define BENCH_FRAMES                    300
+#define BENCH_SLICE_HEIGHT              16
+
+static const int bench_sizes[][2] = {
+    { 1920, 1080 },
+    { 1280,  720 },
+    {  640,  480 },
+};
+
+// Unpack frames of all the slices, returns the time taken in microseconds
+static int64_t bench_unpack(i420_unpack_fn unpack, unsigned char *frame, const unsigned char *buf,
+    const i420_frame_info *frame_info, const i420_frame_info *buf_info, int frames)
+{
+    int64_t start = monotonic_time_us();
+    int slices = (frame_info->height + buf_info->height - 1) / buf_info->height;
+    int slice, n;
+    size_t bytes;
+
+    for(n = 0; n < frames; n++) {
+        for(slice = 0, bytes = 0; slice < slices; slice++) {
+            bytes += unpack(frame, buf, frame_info, buf_info, slice,
+                buf_info->height - (slice == slices - 1 ? frame_info->buf_extra_padding : 0));
+        }
+        if(bytes != frame_info->size) {
+            die("Unpacked %d bytes instead of the frame size %d", bytes, frame_info->size);
+        }
+    }
+    return monotonic_time_us() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : BENCH_FRAMES;
+    i420_frame_info frame_info, buf_info;
+    i420_unpack_fn unpack;
+    unsigned char *buf, *generic_frame, *specialised_frame;
+    int64_t generic_us, specialised_us;
+    size_t i;
+    int n;
+
+    if(frames <= 0) {
+        die("Invalid number of frames %s", argv[1]);
+    }
+    for(n = 0; n < sizeof(bench_sizes) / sizeof(bench_sizes[0]); n++) {
+        get_i420_frame_info(bench_sizes[n][0], bench_sizes[n][1], bench_sizes[n][0], BENCH_SLICE_HEIGHT, &frame_info);
+        get_i420_frame_info(frame_info.buf_stride, frame_info.buf_slice_height, -1, -1, &buf_info);
+        unpack = get_i420_unpack_fn(&frame_info, &buf_info);
+        if(unpack == unpack_i420_slice) {
+            say("No unpack routine compiled for %dx%d/%d frames, skipping",
+                frame_info.width, frame_info.height, BENCH_SLICE_HEIGHT);
+            continue;
+        }
+
+        buf = malloc(buf_info.size);
+        generic_frame = malloc(frame_info.size);
+        specialised_frame = malloc(frame_info.size);
+        if(buf == NULL || generic_frame == NULL || specialised_frame == NULL) {
+            die("Failed to allocate memory for %dx%d frames", frame_info.width, frame_info.height);
+        }
+        for(i = 0; i < buf_info.size; i++) {
+            buf[i] = i * 7 + (i >> 8);
+        }
+
+        // Warm up the caches and the page tables with one frame each
+        bench_unpack(unpack_i420_slice, generic_frame, buf, &frame_info, &buf_info, 1);
+        bench_unpack(unpack, specialised_frame, buf, &frame_info, &buf_info, 1);
+        if(memcmp(generic_frame, specialised_frame, frame_info.size) != 0) {
+            die("Unpack routine for %s frames doesn't match the generic one", dump_i420_unpack_fn(unpack));
+        }
+
+        generic_us = bench_unpack(unpack_i420_slice, generic_frame, buf, &frame_info, &buf_info, frames);
+        specialised_us = bench_unpack(unpack, specialised_frame, buf, &frame_info, &buf_info, frames);
+        say("%s: %d frames, generic %.1f us/frame %.0f MB/s, specialised %.1f us/frame %.0f MB/s, speedup %.2fx",
+            dump_i420_unpack_fn(unpack), frames,
+            (double)generic_us / frames, (double)frame_info.size * frames / (generic_us > 0 ? generic_us : 1),
+            (double)specialised_us / frames, (double)frame_info.size * frames / (specialised_us > 0 ? specialised_us : 1),
+            (double)generic_us / (specialised_us > 0 ? specialised_us : 1));
+
+        free(buf);
+        free(generic_frame);
+        free(specialised_frame);
+    }
+
+    return 0;
+}
@@ -4,6 +4,14 @@
 
 #include "rpi-i420-framing.hpp"
 
+// Width, height and buffer slice height of the frames the unpack routine is
+// compiled for with all the strides, offsets and copy sizes known at build
+// time. The camera buffer stride has to equal the width.
+#define I420_UNPACK_GEOMETRIES(X) \
+    X(1920, 1080, 16) \
+    X(1280,  720, 16) \
+    X( 640,  480, 16)
+
 void get_i420_frame_info(int width, int height, int buf_stride, int buf_slice_height, i420_frame_info *info)
 {
     info->p_stride[0] = ROUND_UP_4(width);
@@ -40,3 +48,91 @@ void dump_frame_info(const char *message, const i420_frame_info *info) {
             info->p_stride[0], info->p_stride[1], info->p_stride[2],
             info->p_offset[0], info->p_offset[1], info->p_offset[2]);
 }
+
+// Shared by the generic and the specialised unpack routines, inlined so
+// that the constant arguments of the latter are folded in to the copies
+static inline __attribute__((always_inline)) size_t unpack_spans(unsigned char *frame, const unsigned char *buf_start,
+    int stride_y, int stride_uv, int frame_offset_u, int frame_offset_v,
+    int buf_offset_u, int buf_offset_v, int slice_height, int slice_num, int valid_spans_y)
+{
+    // I420 spec: U and V plane span size half of the size of the Y plane span size
+    int max_spans_uv = slice_height / 2, valid_spans_uv = valid_spans_y / 2;
+    unsigned char *y = frame + slice_num * stride_y * slice_height;
+    unsigned char *u = frame + frame_offset_u + slice_num * stride_uv * max_spans_uv;
+    unsigned char *v = frame + frame_offset_v + slice_num * stride_uv * max_spans_uv;
+
+    // All but the last slice of a frame are full
+    if(valid_spans_y == slice_height) {
+        memcpy(y, buf_start, stride_y * slice_height);
+        memcpy(u, buf_start + buf_offset_u, stride_uv * max_spans_uv);
+        memcpy(v, buf_start + buf_offset_v, stride_uv * max_spans_uv);
+        return stride_y * slice_height + 2 * stride_uv * max_spans_uv;
+    }
+    // Possible padding at the end of the plane spans in the buffer isn't
+    // copied since the size is based on the valid spans of the frame
+    memcpy(y, buf_start, stride_y * valid_spans_y);
+    memcpy(u, buf_start + buf_offset_u, stride_uv * valid_spans_uv);
+    memcpy(v, buf_start + buf_offset_v, stride_uv * valid_spans_uv);
+    return stride_y * valid_spans_y + 2 * stride_uv * valid_spans_uv;
+}
+
+size_t unpack_i420_slice(unsigned char *frame, const unsigned char *buf_start,
+    const i420_frame_info *frame_info, const i420_frame_info *buf_info, int slice_num, int valid_spans_y)
+{
+    return unpack_spans(frame, buf_start, frame_info->p_stride[0], frame_info->p_stride[1],
+        frame_info->p_offset[1], frame_info->p_offset[2], buf_info->p_offset[1], buf_info->p_offset[2],
+        buf_info->height, slice_num, valid_spans_y);
+}
+
+// The buffer holds a slice of slice_height rows of the frame width
+#define DEFINE_I420_UNPACK(width, height, slice_height) \
+static size_t unpack_i420_##width##x##height##_##slice_height(unsigned char *frame, const unsigned char *buf_start, \
+    const i420_frame_info *frame_info, const i420_frame_info *buf_info, int slice_num, int valid_spans_y) \
+{ \
+    return unpack_spans(frame, buf_start, I420_STRIDE_Y(width), I420_STRIDE_UV(width), \
+        I420_OFFSET_U(width, height), I420_OFFSET_V(width, height), \
+        I420_OFFSET_U(width, slice_height), I420_OFFSET_V(width, slice_height), \
+        slice_height, slice_num, valid_spans_y); \
+}
+I420_UNPACK_GEOMETRIES(DEFINE_I420_UNPACK)
+
+typedef struct
+{
+    int width;
+    int height;
+    int slice_height;
+    const char *name;
+    i420_unpack_fn fn;
+} i420_unpack_geometry;
+
+#define I420_UNPACK_ENTRY(width, height, slice_height) \
+    { width, height, slice_height, #width "x" #height "/" #slice_height, unpack_i420_##width##x##height##_##slice_height },
+static const i420_unpack_geometry i420_unpack_geometries[] = {
+    I420_UNPACK_GEOMETRIES(I420_UNPACK_ENTRY)
+};
+
+i420_unpack_fn get_i420_unpack_fn(const i420_frame_info *frame_info, const i420_frame_info *buf_info)
+{
+    const i420_unpack_geometry *g;
+    int i;
+    for(i = 0; i < sizeof(i420_unpack_geometries) / sizeof(i420_unpack_geometries[0]); i++) {
+        g = &i420_unpack_geometries[i];
+        if(frame_info->width == g->width && frame_info->height == g->height
+                && frame_info->buf_stride == g->width && buf_info->width == g->width
+                && buf_info->height == g->slice_height) {
+            return g->fn;
+        }
+    }
+    return unpack_i420_slice;
+}
+
+const char *dump_i420_unpack_fn(i420_unpack_fn fn)
+{
+    int i;
+    for(i = 0; i < sizeof(i420_unpack_geometries) / sizeof(i420_unpack_geometries[0]); i++) {
+        if(i420_unpack_geometries[i].fn == fn) {
+            return i420_unpack_geometries[i].name;
+        }
+    }
+    return "any";
+}
@@ -21,6 +21,28 @@ typedef struct
 #define ROUND_UP_2(num) (((num)+1)&~1)
 #define ROUND_UP_4(num) (((num)+3)&~3)
 
+// Plane layout of get_i420_frame_info() as constant expressions
+#define I420_STRIDE_Y(width)            ROUND_UP_4(width)
+#define I420_STRIDE_UV(width)           ROUND_UP_4(ROUND_UP_2(width) / 2)
+#define I420_OFFSET_U(width, height)    (I420_STRIDE_Y(width) * ROUND_UP_2(height))
+#define I420_OFFSET_V(width, height)    (I420_OFFSET_U(width, height) + I420_STRIDE_UV(width) * (ROUND_UP_2(height) / 2))
+
 extern void get_i420_frame_info(int width, int height, int buf_stride, int buf_slice_height, i420_frame_info *info);
 extern void dump_frame_info(const char *message, const i420_frame_info *info);
+
+// Unpack the Y, U and V plane spans of the slice_num:th slice of a frame from
+// an OMX buffer laid out as in buf_info to the I420 frame. valid_spans_y is
+// less than the slice height in the last slice of a frame. Returns the number
+// of bytes copied.
+typedef size_t (*i420_unpack_fn)(unsigned char *frame, const unsigned char *buf_start,
+    const i420_frame_info *frame_info, const i420_frame_info *buf_info, int slice_num, int valid_spans_y);
+
+// Works for any geometry
+extern size_t unpack_i420_slice(unsigned char *frame, const unsigned char *buf_start,
+    const i420_frame_info *frame_info, const i420_frame_info *buf_info, int slice_num, int valid_spans_y);
+// Unpack routine compiled for the geometry of frame_info if it's one of
+// I420_UNPACK_GEOMETRIES, otherwise unpack_i420_slice()
+extern i420_unpack_fn get_i420_unpack_fn(const i420_frame_info *frame_info, const i420_frame_info *buf_info);
+// Name of the geometry an unpack routine is compiled for, "any" for the generic one
+extern const char *dump_i420_unpack_fn(i420_unpack_fn fn);
 extern void dump_event(OMX_HANDLETYPE hComponent, OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2);
@@ -0,0 +1,15 @@
+#pragma once
+
+typedef struct
+{
+    OMX_HANDLETYPE encoder;
+    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_in;
+    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out;
+    int encoder_input_buffer_needed;
+    int encoder_output_buffer_available;
+} OmxImageEncoderModule;
+
+// Configure image_encode to take raw frames in the given layout on input
+// port 340 and to emit JPEG of the given quality (1 .. 100) on output port 341,
+// reports and returns the first error
+extern OMX_ERRORTYPE config_omx_image_encoder(OmxImageEncoderModule *mod, OMX_U32 width, OMX_U32 height, OMX_S32 stride, OMX_U32 slice_height, OMX_U32 quality);
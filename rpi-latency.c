@@ -0,0 +1,171 @@
+/*
+ * Latency from the capture timestamp of a frame to its encoded slices
+ * having been written out
+ *
+ * The camera stamps its buffers with the VideoCore system timer (STC), a
+ * free running 1 MHz counter which is also visible to the ARM side in the
+ * peripheral address space. Reading it through /dev/mem needs root, without
+ * it the latencies are measured against CLOCK_MONOTONIC relative to the
+ * latency of the first buffer, i.e. only the variation is meaningful.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "rpi-latency.hpp"
+
+// System timer registers from the peripheral base, counter low and high words
+#define STC_OFFSET                      0x3000
+#define STC_CLO                         1
+#define STC_CHI                         2
+
+int stc_clock_open(stc_clock *c)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t base = bcm_host_get_peripheral_address() + STC_OFFSET;
+    off_t page = base & ~(off_t)(page_size - 1);
+
+    memset(c, 0, sizeof(*c));
+    if((c->fd = open("/dev/mem", O_RDONLY | O_SYNC)) < 0) {
+        return -1;
+    }
+    if((c->map = mmap(NULL, page_size, PROT_READ, MAP_SHARED, c->fd, page)) == MAP_FAILED) {
+        int err = errno;
+        close(c->fd);
+        c->map = NULL;
+        errno = err;
+        return -1;
+    }
+    c->regs = (volatile uint32_t *)((char *)c->map + (base - page));
+    return 0;
+}
+
+int64_t stc_clock_now(const stc_clock *c)
+{
+    uint32_t hi, lo;
+    // The high word may tick over in between the reads
+    do {
+        hi = c->regs[STC_CHI];
+        lo = c->regs[STC_CLO];
+    } while(hi != c->regs[STC_CHI]);
+    return ((int64_t)hi << 32) | lo;
+}
+
+void stc_clock_close(stc_clock *c)
+{
+    if(c->map != NULL) {
+        munmap(c->map, sysconf(_SC_PAGESIZE));
+        close(c->fd);
+    }
+    c->map = NULL;
+    c->regs = NULL;
+}
+
+static void latency_histogram_init(latency_histogram *h, const char *name)
+{
+    memset(h, 0, sizeof(*h));
+    h->name = name;
+    h->min_us = INT64_MAX;
+}
+
+static void latency_histogram_add(latency_histogram *h, int64_t latency_us)
+{
+    static const int64_t bounds[LATENCY_BUCKETS - 1] = LATENCY_BUCKET_BOUNDS;
+    int i;
+    for(i = 0; i < LATENCY_BUCKETS - 1 && latency_us > bounds[i]; i++);
+    h->buckets[i]++;
+    h->count++;
+    h->total_us += latency_us;
+    if(latency_us < h->min_us) {
+        h->min_us = latency_us;
+    }
+    if(latency_us > h->max_us) {
+        h->max_us = latency_us;
+    }
+}
+
+static void dump_latency_histogram(latency_histogram *h, int relative)
+{
+    static const int64_t bounds[LATENCY_BUCKETS - 1] = LATENCY_BUCKET_BOUNDS;
+    char histogram[LATENCY_BUCKETS * 48];
+    size_t len = 0;
+    int i;
+    for(i = 0; i < LATENCY_BUCKETS; i++) {
+        if(i < LATENCY_BUCKETS - 1) {
+            len += snprintf(histogram + len, sizeof(histogram) - len, "\t<= %lld us:\t\t%lu\n",
+                (long long)bounds[i], h->buckets[i]);
+        } else {
+            len += snprintf(histogram + len, sizeof(histogram) - len, "\t> %lld us:\t\t%lu\n",
+                (long long)bounds[i - 1], h->buckets[i]);
+        }
+    }
+    say("Capture to %s written latency%s:\n"
+        "\tFrames:\t\t\t%lu\n"
+        "\tMinimum:\t\t%lld us\n"
+        "\tAverage:\t\t%lld us\n"
+        "\tMaximum:\t\t%lld us\n"
+        "%s",
+        h->name, relative ? " relative to the first frame" : "", h->count,
+        (long long)(h->count > 0 ? h->min_us : 0),
+        (long long)(h->count > 0 ? h->total_us / (int64_t)h->count : 0),
+        (long long)h->max_us, histogram);
+}
+
+void capture_latency_init(capture_latency *cl)
+{
+    memset(cl, 0, sizeof(*cl));
+    if(stc_clock_open(&cl->stc) == 0) {
+        cl->use_stc = 1;
+        say("Measuring capture latency with the system timer");
+    } else {
+        say("Failed to map the system timer: %s, measuring latency relative to the first frame", strerror(errno));
+    }
+    cl->frame_start = 1;
+    latency_histogram_init(&cl->first_slice, "first slice");
+    latency_histogram_init(&cl->frame, "frame");
+}
+
+void capture_latency_add(capture_latency *cl, int64_t timestamp, OMX_U32 nFlags)
+{
+    int64_t now, latency;
+
+    // Stream headers aren't part of any frame
+    if(nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+        return;
+    }
+    // Neither are markers like end of sequence, the next buffer starts a
+    // frame whatever was written before the marker
+    if(nFlags & OMX_BUFFERFLAG_DISCONTINUITY) {
+        cl->frame_start = 1;
+        return;
+    }
+    if(cl->use_stc) {
+        now = stc_clock_now(&cl->stc);
+    } else {
+        now = monotonic_time_us();
+        if(!cl->have_offset) {
+            cl->offset = now - timestamp;
+            cl->have_offset = 1;
+        }
+        now -= cl->offset;
+    }
+    latency = now - timestamp;
+    if(cl->frame_start) {
+        latency_histogram_add(&cl->first_slice, latency);
+    }
+    cl->frame_start = (nFlags & OMX_BUFFERFLAG_ENDOFFRAME) != 0;
+    if(cl->frame_start) {
+        latency_histogram_add(&cl->frame, latency);
+    }
+}
+
+void dump_capture_latency(capture_latency *cl)
+{
+    dump_latency_histogram(&cl->first_slice, !cl->use_stc);
+    dump_latency_histogram(&cl->frame, !cl->use_stc);
+}
+
+void capture_latency_destroy(capture_latency *cl)
+{
+    stc_clock_close(&cl->stc);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+/*
+ * Latency from the capture timestamp of a frame to its encoded slices
+ * having been written out
+ */
+#include "rpi-omx-utils.hpp"
+
+// Upper bounds of the latency histogram buckets in microseconds, the last
+// bucket collects everything above
+#define LATENCY_BUCKET_BOUNDS           { 5000, 10000, 20000, 40000, 80000 }
+#define LATENCY_BUCKETS                 6
+
+// VideoCore system timer, the clock camera buffer timestamps are in
+typedef struct
+{
+    int fd;
+    void *map;
+    volatile uint32_t *regs;
+} stc_clock;
+
+typedef struct
+{
+    const char *name;
+    unsigned long count;
+    int64_t total_us;
+    int64_t min_us;
+    int64_t max_us;
+    unsigned long buckets[LATENCY_BUCKETS];
+} latency_histogram;
+
+typedef struct
+{
+    stc_clock stc;
+    int use_stc;
+    // Without the system timer the latencies are relative to the first buffer
+    int have_offset;
+    int64_t offset;
+    // Next buffer starts a new frame
+    int frame_start;
+    latency_histogram first_slice;
+    latency_histogram frame;
+} capture_latency;
+
+// Map the system timer registers from /dev/mem, returns 0 or -1 with errno set
+extern int stc_clock_open(stc_clock *c);
+extern int64_t stc_clock_now(const stc_clock *c);
+extern void stc_clock_close(stc_clock *c);
+
+extern void capture_latency_init(capture_latency *cl);
+// Called when a buffer with the given capture timestamp and flags has been
+// written, the first one of each frame and the one ending it are recorded
+extern void capture_latency_add(capture_latency *cl, int64_t timestamp, OMX_U32 nFlags);
+extern void dump_capture_latency(capture_latency *cl);
+extern void capture_latency_destroy(capture_latency *cl);
@@ -0,0 +1,304 @@
+/*
+ * Motion detection on a low resolution luma plane and
+ * gating of an encoded stream based on the detected motion
+ *
+ * The detector compares each frame against a running background in
+ * MOTION_BLOCK_SIZE x MOTION_BLOCK_SIZE blocks. The kernels use NEON when
+ * compiled for it (add -mfpu=neon to CFLAGS on Raspberry Pi 2 and newer)
+ * and SSE2 on x86, otherwise a plain C implementation is used.
+ */
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MOTION_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MOTION_USE_SSE2
+#endif
+
+#include "rpi-motion-detect.hpp"
+
+#define ROUND_UP_16(num) (((num)+15)&~15)
+
+static unsigned int sad_block_scalar(const unsigned char *cur, const unsigned char *bg, int stride)
+{
+    unsigned int sad = 0;
+    int x, y;
+    for(y = 0; y < MOTION_BLOCK_SIZE; y++) {
+        for(x = 0; x < MOTION_BLOCK_SIZE; x++) {
+            sad += abs(cur[y * stride + x] - bg[y * stride + x]);
+        }
+    }
+    return sad;
+}
+
+// SAD of each block in a band of MOTION_BLOCK_SIZE rows
+static void sad_block_row(const unsigned char *cur, const unsigned char *bg, int stride, int blocks, unsigned int *sad)
+{
+    int b = 0, y;
+#if defined(MOTION_USE_SSE2)
+    // _mm_sad_epu8 sums each 8 byte half separately, i.e. two blocks at a time
+    for(; b + 2 <= blocks; b += 2) {
+        __m128i acc = _mm_setzero_si128();
+        for(y = 0; y < MOTION_BLOCK_SIZE; y++) {
+            __m128i c = _mm_load_si128((const __m128i *)(cur + y * stride + b * MOTION_BLOCK_SIZE));
+            __m128i g = _mm_load_si128((const __m128i *)(bg + y * stride + b * MOTION_BLOCK_SIZE));
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(c, g));
+        }
+        sad[b]     = _mm_cvtsi128_si32(acc);
+        sad[b + 1] = _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    }
+#elif defined(MOTION_USE_NEON)
+    for(; b < blocks; b++) {
+        uint16x8_t acc = vdupq_n_u16(0);
+        for(y = 0; y < MOTION_BLOCK_SIZE; y++) {
+            acc = vabal_u8(acc,
+                vld1_u8(cur + y * stride + b * MOTION_BLOCK_SIZE),
+                vld1_u8(bg + y * stride + b * MOTION_BLOCK_SIZE));
+        }
+        uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(acc));
+        sad[b] = (unsigned int)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+    }
+#else
+    (void)y;
+#endif
+    for(; b < blocks; b++) {
+        sad[b] = sad_block_scalar(cur + b * MOTION_BLOCK_SIZE, bg + b * MOTION_BLOCK_SIZE, stride);
+    }
+}
+
+// Blend the current frame in to the background with equal weights
+static void update_background(unsigned char *bg, const unsigned char *cur, size_t size)
+{
+    size_t i = 0;
+#if defined(MOTION_USE_SSE2)
+    for(; i + 16 <= size; i += 16) {
+        __m128i g = _mm_load_si128((const __m128i *)(bg + i));
+        __m128i c = _mm_load_si128((const __m128i *)(cur + i));
+        _mm_store_si128((__m128i *)(bg + i), _mm_avg_epu8(g, c));
+    }
+#elif defined(MOTION_USE_NEON)
+    for(; i + 16 <= size; i += 16) {
+        vst1q_u8(bg + i, vrhaddq_u8(vld1q_u8(bg + i), vld1q_u8(cur + i)));
+    }
+#endif
+    for(; i < size; i++) {
+        bg[i] = (bg[i] + cur[i] + 1) >> 1;
+    }
+}
+
+void motion_detector_init(motion_detector *md, int width, int height, unsigned int block_threshold, int min_blocks, int background_interval)
+{
+    memset(md, 0, sizeof(*md));
+    md->width = width;
+    md->height = height;
+    md->stride = ROUND_UP_16(width);
+    md->blocks_x = width / MOTION_BLOCK_SIZE;
+    md->blocks_y = height / MOTION_BLOCK_SIZE;
+    md->block_threshold = block_threshold;
+    md->min_blocks = min_blocks;
+    md->background_interval = background_interval > 0 ? background_interval : 1;
+    if(posix_memalign((void **)&md->luma, 16, md->stride * height) != 0
+            || posix_memalign((void **)&md->background, 16, md->stride * height) != 0) {
+        die("Failed to allocate motion detector planes");
+    }
+    memset(md->luma, 0, md->stride * height);
+    memset(md->background, 0, md->stride * height);
+    say("Motion detector on %dx%d luma, %dx%d blocks of %dx%d pixels",
+        width, height, md->blocks_x, md->blocks_y, MOTION_BLOCK_SIZE, MOTION_BLOCK_SIZE);
+}
+
+int motion_detector_compare(motion_detector *md)
+{
+    unsigned int sad[md->blocks_x];
+    int bx, by, active = 0;
+    size_t band = md->stride * MOTION_BLOCK_SIZE;
+
+    for(by = 0; by < md->blocks_y; by++) {
+        sad_block_row(md->luma + by * band, md->background + by * band, md->stride, md->blocks_x, sad);
+        for(bx = 0; bx < md->blocks_x; bx++) {
+            if(sad[bx] > md->block_threshold) {
+                active++;
+            }
+        }
+    }
+    return active;
+}
+
+void motion_detector_set_background(motion_detector *md)
+{
+    memcpy(md->background, md->luma, md->stride * md->height);
+    md->have_background = 1;
+}
+
+int motion_detector_process(motion_detector *md)
+{
+    int active;
+
+    if(!md->have_background) {
+        motion_detector_set_background(md);
+        return 0;
+    }
+    active = motion_detector_compare(md);
+    md->frames++;
+    if(md->frames % md->background_interval == 0) {
+        update_background(md->background, md->luma, md->stride * md->height);
+    }
+    if(active >= md->min_blocks) {
+        md->motion_frames++;
+    }
+    return active;
+}
+
+void motion_detector_destroy(motion_detector *md)
+{
+    say("Motion detected in %lu of %lu analyzed frames", md->motion_frames, md->frames);
+    free(md->luma);
+    free(md->background);
+}
+
+void motion_gate_init(motion_gate *gate, output_queue *out, int preroll_ms, int postroll_ms)
+{
+    memset(gate, 0, sizeof(*gate));
+    gate->out = out;
+    gate->preroll_us = (int64_t)preroll_ms * 1000;
+    gate->postroll_us = (int64_t)postroll_ms * 1000;
+    gate->prev_end_of_frame = 1;
+}
+
+static void free_chunks(motion_gate *gate, motion_gate_chunk *until)
+{
+    motion_gate_chunk *chunk;
+    while(gate->head != until) {
+        chunk = gate->head;
+        gate->head = chunk->next;
+        gate->preroll_bytes -= chunk->len;
+        free(chunk);
+    }
+    if(gate->head == NULL) {
+        gate->tail = NULL;
+    }
+}
+
+static void open_gate(motion_gate *gate)
+{
+    motion_gate_chunk *chunk;
+    int64_t now = monotonic_time_us();
+    say("Motion detected, recording segment %lu with %d bytes of pre-roll",
+        gate->segments + 1, gate->preroll_bytes);
+    // Pre-roll may well be longer than the output queue, wait for the
+    // writer rather than letting the drop policy eat the segment start.
+    // This deliberately stalls the capture loop for as long as the writer
+    // takes to catch up, once per segment. The cached headers are a
+    // complete buffer, so the frame tracking of the queue starts afresh
+    // with the first pre-roll frame.
+    if(gate->codec_config_len > 0) {
+        output_queue_push_wait(gate->out, gate->codec_config, gate->codec_config_len,
+            OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_ENDOFFRAME, 0);
+    }
+    for(chunk = gate->head; chunk != NULL; chunk = chunk->next) {
+        output_queue_push_wait(gate->out, chunk->data, chunk->len, chunk->nFlags, chunk->timestamp);
+    }
+    gate->segment_start = gate->head != NULL ? gate->head->received : now;
+    free_chunks(gate, NULL);
+    gate->open = 1;
+    gate->closing = 0;
+    gate->segments++;
+}
+
+void motion_gate_update(motion_gate *gate, int motion)
+{
+    int64_t now = monotonic_time_us();
+    if(motion) {
+        gate->last_motion = now;
+        gate->closing = 0;
+        if(!gate->open) {
+            open_gate(gate);
+        }
+    } else if(gate->open && !gate->closing && now - gate->last_motion > gate->postroll_us) {
+        // Close at the next frame boundary
+        say("No motion for %d ms, ending recording segment %lu", (int)(gate->postroll_us / 1000), gate->segments);
+        gate->closing = 1;
+    }
+}
+
+void motion_gate_push(motion_gate *gate, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp)
+{
+    motion_gate_chunk *chunk, *keep, *c;
+    int64_t now = monotonic_time_us();
+    int gop_start = gate->prev_end_of_frame && (nFlags & OMX_BUFFERFLAG_SYNCFRAME);
+    int new_codec_config = !gate->prev_codec_config;
+    gate->prev_end_of_frame = nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+    gate->prev_codec_config = nFlags & OMX_BUFFERFLAG_CODECCONFIG;
+
+    // Stream headers are cached so that each segment can be decoded on its own,
+    // headers emitted again after frames replace the cached ones
+    if(nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+        if(new_codec_config) {
+            gate->codec_config_len = 0;
+        }
+        if((gate->codec_config = realloc(gate->codec_config, gate->codec_config_len + len)) == NULL) {
+            die("Failed to allocate memory for codec config");
+        }
+        memcpy(gate->codec_config + gate->codec_config_len, data, len);
+        gate->codec_config_len += len;
+        if(gate->open) {
+            output_queue_push(gate->out, data, len, nFlags, timestamp);
+        }
+        return;
+    }
+
+    if(gate->open) {
+        output_queue_push(gate->out, data, len, nFlags, timestamp);
+        if(gate->closing && (nFlags & OMX_BUFFERFLAG_ENDOFFRAME)) {
+            gate->recorded_us += now - gate->segment_start;
+            gate->open = 0;
+            gate->closing = 0;
+        }
+        return;
+    }
+
+    // Pre-roll must start with a key frame, nothing before it can be decoded
+    if(gate->head == NULL && !gop_start) {
+        return;
+    }
+    if((chunk = malloc(sizeof(motion_gate_chunk) + len)) == NULL) {
+        die("Failed to allocate memory for pre-roll");
+    }
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->nFlags = nFlags;
+    chunk->timestamp = timestamp;
+    chunk->received = now;
+    chunk->gop_start = gop_start;
+    memcpy(chunk->data, data, len);
+    if(gate->tail != NULL) {
+        gate->tail->next = chunk;
+    } else {
+        gate->head = chunk;
+    }
+    gate->tail = chunk;
+    gate->preroll_bytes += len;
+
+    // Drop the GOPs which are no longer needed to cover the pre-roll time,
+    // i.e. keep the data from the latest key frame older than the pre-roll
+    if(gop_start) {
+        keep = gate->head;
+        for(c = gate->head; c != NULL; c = c->next) {
+            if(c->gop_start && now - c->received >= gate->preroll_us) {
+                keep = c;
+            }
+        }
+        free_chunks(gate, keep);
+    }
+}
+
+void motion_gate_destroy(motion_gate *gate)
+{
+    if(gate->open) {
+        gate->recorded_us += monotonic_time_us() - gate->segment_start;
+    }
+    say("Recorded %lu motion segments, %.1fs in total", gate->segments, (double)gate->recorded_us / 1000000.0);
+    free_chunks(gate, NULL);
+    free(gate->codec_config);
+}
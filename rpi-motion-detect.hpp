@@ -0,0 +1,82 @@
+#pragma once
+
+/*
+ * Motion detection on a low resolution luma plane and
+ * gating of an encoded stream based on the detected motion
+ */
+#include "rpi-output-queue.hpp"
+
+// Block SAD is computed over MOTION_BLOCK_SIZE x MOTION_BLOCK_SIZE pixels
+#define MOTION_BLOCK_SIZE 8
+
+typedef struct
+{
+    int width;
+    int height;
+    // Row stride of luma and background planes, multiple of 16
+    int stride;
+    int blocks_x;
+    int blocks_y;
+    // Current luma frame assembled from the preview buffers
+    unsigned char *luma;
+    // Running background the current frame is compared against
+    unsigned char *background;
+    int have_background;
+    int background_interval;
+    unsigned int block_threshold;
+    int min_blocks;
+    unsigned long frames;
+    unsigned long motion_frames;
+} motion_detector;
+
+extern void motion_detector_init(motion_detector *md, int width, int height, unsigned int block_threshold, int min_blocks, int background_interval);
+// Compare md->luma against the background and update the background.
+// Returns the number of blocks exceeding the SAD threshold.
+extern int motion_detector_process(motion_detector *md);
+// Compare md->luma against the background without touching the background,
+// returns the number of blocks exceeding the SAD threshold
+extern int motion_detector_compare(motion_detector *md);
+// Replace the background with md->luma
+extern void motion_detector_set_background(motion_detector *md);
+extern void motion_detector_destroy(motion_detector *md);
+
+typedef struct motion_gate_chunk
+{
+    struct motion_gate_chunk *next;
+    size_t len;
+    OMX_U32 nFlags;
+    int64_t timestamp;
+    int64_t received;
+    int gop_start;
+    char data[];
+} motion_gate_chunk;
+
+typedef struct
+{
+    output_queue *out;
+    int64_t preroll_us;
+    int64_t postroll_us;
+    int open;
+    int closing;
+    int64_t last_motion;
+    int prev_end_of_frame;
+    // Encoded buffers kept for pre-roll while the gate is closed,
+    // always starting from the first buffer of a key frame
+    motion_gate_chunk *head;
+    motion_gate_chunk *tail;
+    size_t preroll_bytes;
+    // Latest SPS/PPS emitted in front of each recorded segment
+    char *codec_config;
+    size_t codec_config_len;
+    int prev_codec_config;
+    unsigned long segments;
+    int64_t recorded_us;
+    int64_t segment_start;
+} motion_gate;
+
+extern void motion_gate_init(motion_gate *gate, output_queue *out, int preroll_ms, int postroll_ms);
+// Feed the detector result for the latest preview frame
+extern void motion_gate_update(motion_gate *gate, int motion);
+// Feed an encoder output buffer, it's either queued for output or kept for pre-roll
+extern void motion_gate_push(motion_gate *gate, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp);
+extern void motion_gate_destroy(motion_gate *gate);
@@ -0,0 +1,252 @@
+/*
+ * Conversion of an Annex B H.264 stream to 4 byte length prefixed (AVCC)
+ * NAL units
+ *
+ * The encoder output is scanned for start codes once and each NAL unit is
+ * written as a big endian length followed by its payload. Payloads are not
+ * copied, writev(2) gathers the length headers and the spans of the input
+ * buffers. Only the beginning of a NAL unit which continues in the next
+ * buffer is copied aside until its end is known. The scanner uses NEON when
+ * compiled for it (add -mfpu=neon to CFLAGS on Raspberry Pi 2 and newer) and
+ * SSE2 on x86, otherwise a plain C implementation is used.
+ */
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NAL_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define NAL_USE_SSE2
+#endif
+
+#include "rpi-nal-framing.hpp"
+
+// Buffers after which the NAL unit at the end is known to be complete
+#define NAL_COMPLETE_FLAGS (OMX_BUFFERFLAG_ENDOFFRAME | OMX_BUFFERFLAG_ENDOFNAL | OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_EOS)
+
+size_t find_start_code(const unsigned char *data, size_t len)
+{
+    size_t i = 0;
+#if defined(NAL_USE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    int mask;
+    for(; i + 18 <= len; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+        mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+            _mm_cmpeq_epi8(b2, one)));
+        if(mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(NAL_USE_NEON)
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    for(; i + 18 <= len; i += 16) {
+        uint8x16_t m = vandq_u8(
+            vandq_u8(vceqq_u8(vld1q_u8(data + i), zero), vceqq_u8(vld1q_u8(data + i + 1), zero)),
+            vceqq_u8(vld1q_u8(data + i + 2), one));
+        uint8x8_t any = vorr_u8(vget_low_u8(m), vget_high_u8(m));
+        if(vget_lane_u64(vreinterpret_u64_u8(any), 0)) {
+            break;
+        }
+    }
+#endif
+    for(; i + 3 <= len; i++) {
+        if(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            return i;
+        }
+    }
+    return len;
+}
+
+static void writev_all(int fd, struct iovec *iov, int count)
+{
+    ssize_t r;
+    while(count > 0) {
+        if((r = writev(fd, iov, count)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            die("Failed to write NAL units: %s", strerror(errno));
+        }
+        while(count > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+}
+
+static size_t flush_batch(avcc_framer *f, int fd)
+{
+    size_t len = 0;
+    int i;
+    for(i = 0; i < f->iov_count; i++) {
+        len += f->iov[i].iov_len;
+    }
+    writev_all(fd, f->iov, f->iov_count);
+    f->iov_count = 0;
+    f->nal_count = 0;
+    f->bytes_out += len;
+    return len;
+}
+
+static void add_span(avcc_framer *f, const void *data, size_t len)
+{
+    if(len > 0) {
+        f->iov[f->iov_count].iov_base = (void *)data;
+        f->iov[f->iov_count].iov_len = len;
+        f->iov_count++;
+    }
+}
+
+// Queue a NAL unit made of the carried over prefix and a span of the
+// current buffer. Trailing zero bytes belong to the next start code.
+static size_t add_nal(avcc_framer *f, int fd, const unsigned char *prefix, size_t prefix_len, const unsigned char *span, size_t span_len)
+{
+    size_t written = 0, nal_len;
+    unsigned char *header;
+
+    while(span_len > 0 && span[span_len - 1] == 0) {
+        span_len--;
+    }
+    if(span_len == 0) {
+        while(prefix_len > 0 && prefix[prefix_len - 1] == 0) {
+            prefix_len--;
+        }
+    }
+    if((nal_len = prefix_len + span_len) == 0) {
+        return 0;
+    }
+    if(f->nal_count == AVCC_BATCH_NALS) {
+        written = flush_batch(f, fd);
+    }
+    header = f->header[f->nal_count++];
+    header[0] = (nal_len >> 24) & 0xff;
+    header[1] = (nal_len >> 16) & 0xff;
+    header[2] = (nal_len >> 8) & 0xff;
+    header[3] = nal_len & 0xff;
+    add_span(f, header, 4);
+    add_span(f, prefix, prefix_len);
+    add_span(f, span, span_len);
+    f->nals++;
+    if(prefix_len > 0) {
+        f->carried_nals++;
+    }
+    return written;
+}
+
+void avcc_framer_init(avcc_framer *f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+size_t avcc_framer_write(avcc_framer *f, int fd, const unsigned char *data, size_t len, OMX_U32 nFlags)
+{
+    const unsigned char *prefix = NULL;
+    size_t prefix_len = 0, written = 0, start = 0, sc, zeros;
+
+    f->bytes_in += len;
+    // Whatever was carried over doesn't continue in this buffer
+    if(nFlags & OMX_BUFFERFLAG_DISCONTINUITY) {
+        f->in_nal = 0;
+        f->carry_len = 0;
+        f->skipped_zeros = 0;
+    }
+
+    if(f->in_nal) {
+        prefix = f->carry;
+        prefix_len = f->carry_len;
+        // Start code split between the previous buffer and this one
+        for(zeros = 0; zeros < 2 && zeros < prefix_len && prefix[prefix_len - 1 - zeros] == 0; zeros++);
+        if(zeros == 2 && len >= 1 && data[0] == 1) {
+            start = 1;
+        } else if(zeros >= 1 && len >= 2 && data[0] == 0 && data[1] == 1) {
+            start = 2;
+        }
+        if(start > 0) {
+            written += add_nal(f, fd, prefix, prefix_len, NULL, 0);
+            prefix_len = 0;
+        }
+    } else {
+        // Skip anything before the first start code
+        if(f->skipped_zeros == 2 && len >= 1 && data[0] == 1) {
+            start = 1;
+        } else if(f->skipped_zeros >= 1 && len >= 2 && data[0] == 0 && data[1] == 1) {
+            start = 2;
+        } else if((sc = find_start_code(data, len)) < len) {
+            start = sc + 3;
+        } else {
+            for(zeros = 0; zeros < 2 && zeros < len && data[len - 1 - zeros] == 0; zeros++);
+            f->skipped_zeros = zeros == len && zeros < 2 ? f->skipped_zeros + zeros : zeros;
+            if(f->skipped_zeros > 2) {
+                f->skipped_zeros = 2;
+            }
+            return 0;
+        }
+        f->skipped_zeros = 0;
+        f->in_nal = 1;
+    }
+
+    while((sc = find_start_code(data + start, len - start)) < len - start) {
+        written += add_nal(f, fd, prefix, prefix_len, data + start, sc);
+        prefix_len = 0;
+        start += sc + 3;
+    }
+
+    if(nFlags & NAL_COMPLETE_FLAGS) {
+        written += add_nal(f, fd, prefix, prefix_len, data + start, len - start);
+        written += flush_batch(f, fd);
+        f->in_nal = 0;
+        f->carry_len = 0;
+        return written;
+    }
+
+    // The carry buffer may still be referenced by the batch
+    written += flush_batch(f, fd);
+    if(prefix_len == 0) {
+        f->carry_len = 0;
+    }
+    if(f->carry_len + len - start > f->carry_alloc_len) {
+        f->carry_alloc_len = f->carry_len + len - start;
+        if((f->carry = realloc(f->carry, f->carry_alloc_len)) == NULL) {
+            die("Failed to allocate %d bytes for NAL unit carry over", f->carry_alloc_len);
+        }
+    }
+    memcpy(f->carry + f->carry_len, data + start, len - start);
+    f->carry_len += len - start;
+    f->bytes_carried += len - start;
+    return written;
+}
+
+size_t avcc_framer_flush(avcc_framer *f, int fd)
+{
+    size_t written = 0;
+    if(f->in_nal) {
+        written += add_nal(f, fd, f->carry, f->carry_len, NULL, 0);
+        written += flush_batch(f, fd);
+        f->in_nal = 0;
+        f->carry_len = 0;
+    }
+    return written;
+}
+
+void avcc_framer_destroy(avcc_framer *f)
+{
+    say("AVCC framing stats:\n"
+        "\tNAL units:\t\t%lu\n"
+        "\tSpanning buffers:\t%lu\n"
+        "\tBytes in:\t\t%llu\n"
+        "\tBytes out:\t\t%llu\n"
+        "\tBytes carried over:\t%llu\n",
+        f->nals, f->carried_nals, f->bytes_in, f->bytes_out, f->bytes_carried);
+    free(f->carry);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ * Conversion of an Annex B H.264 stream to 4 byte length prefixed (AVCC)
+ * NAL units
+ */
+#include <sys/uio.h>
+
+#include "rpi-omx-utils.hpp"
+
+// NAL units gathered in to a single writev(2) call
+#define AVCC_BATCH_NALS 32
+
+typedef struct
+{
+    // Inside a NAL unit, i.e. the last start code has been seen
+    int in_nal;
+    // Zero bytes at the end of the data skipped while looking for a start code
+    int skipped_zeros;
+    // Beginning of the current NAL unit which started in an earlier buffer
+    unsigned char *carry;
+    size_t carry_len;
+    size_t carry_alloc_len;
+
+    // Pending writev(2), length header and up to two payload spans per NAL
+    struct iovec iov[AVCC_BATCH_NALS * 3];
+    unsigned char header[AVCC_BATCH_NALS][4];
+    int iov_count;
+    int nal_count;
+
+    // Counters
+    unsigned long nals;
+    unsigned long carried_nals;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long bytes_carried;
+} avcc_framer;
+
+extern void avcc_framer_init(avcc_framer *f);
+// Index of the first 00 00 01 start code in data or len if there's none
+extern size_t find_start_code(const unsigned char *data, size_t len);
+// Write the NAL units of an Annex B buffer to fd with length prefixes.
+// Buffer flags tell whether the last NAL unit ends with the buffer, if not
+// it's carried over to the next call. Returns the number of bytes written.
+extern size_t avcc_framer_write(avcc_framer *f, int fd, const unsigned char *data, size_t len, OMX_U32 nFlags);
+// Write out the NAL unit still carried over at the end of the stream
+extern size_t avcc_framer_flush(avcc_framer *f, int fd);
+extern void avcc_framer_destroy(avcc_framer *f);
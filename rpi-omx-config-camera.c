@@ -3,7 +3,7 @@
 #include "rpi-video-params.hpp"
 
 
-void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 cam_height, OMX_U32 cam_framerate)
+OMX_ERRORTYPE config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 cam_height, OMX_U32 cam_framerate, int ready_timeout_ms)
 {
     OMX_ERRORTYPE r;
     
@@ -22,7 +22,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     cbtype.nIndex     = OMX_IndexParamCameraDeviceNumber;
     cbtype.bEnable    = OMX_TRUE;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigRequestCallback, &cbtype)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to request camera device number parameter change callback for camera");
+        return omx_fail(r, "Failed to request camera device number parameter change callback for camera");
     }
     // Set device number, this triggers the callback configured just above
     OMX_PARAM_U32TYPE device;
@@ -30,14 +30,14 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     device.nPortIndex = OMX_ALL;
     device.nU32 = CAM_DEVICE_NUMBER;
     if((r = OMX_SetParameter(cammodule->camera, OMX_IndexParamCameraDeviceNumber, &device)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera parameter device number");
+        return omx_fail(r, "Failed to set camera parameter device number");
     }
     // Configure video format emitted by camera preview output port
     OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
     OMX_INIT_STRUCTURE(camera_portdef);
     camera_portdef.nPortIndex = 70;
     if((r = OMX_GetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for camera preview output port 70");
+        return omx_fail(r, "Failed to get port definition for camera preview output port 70");
     }
     camera_portdef.format.video.nFrameWidth  = cam_width;
     camera_portdef.format.video.nFrameHeight = cam_height;
@@ -46,7 +46,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     camera_portdef.format.video.nStride      = (camera_portdef.format.video.nFrameWidth + camera_portdef.nBufferAlignment - 1) & (~(camera_portdef.nBufferAlignment - 1));
     camera_portdef.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
     if((r = OMX_SetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set port definition for camera preview output port 70");
+        return omx_fail(r, "Failed to set port definition for camera preview output port 70");
     }
     // Configure video format emitted by camera video output port
     // Use configuration from camera preview output as basis for
@@ -54,11 +54,11 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     OMX_INIT_STRUCTURE(camera_portdef);
     camera_portdef.nPortIndex = 70;
     if((r = OMX_GetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for camera preview output port 70");
+        return omx_fail(r, "Failed to get port definition for camera preview output port 70");
     }
     camera_portdef.nPortIndex = 71;
     if((r = OMX_SetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set port definition for camera video output port 71");
+        return omx_fail(r, "Failed to set port definition for camera video output port 71");
     }
     // Configure frame rate
     OMX_CONFIG_FRAMERATETYPE framerate;
@@ -66,11 +66,11 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     framerate.nPortIndex = 70;
     framerate.xEncodeFramerate = camera_portdef.format.video.xFramerate;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigVideoFramerate, &framerate)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set framerate configuration for camera preview output port 70");
+        return omx_fail(r, "Failed to set framerate configuration for camera preview output port 70");
     }
     framerate.nPortIndex = 71;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigVideoFramerate, &framerate)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set framerate configuration for camera video output port 71");
+        return omx_fail(r, "Failed to set framerate configuration for camera video output port 71");
     }
     // Configure sharpness
     OMX_CONFIG_SHARPNESSTYPE sharpness;
@@ -78,7 +78,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     sharpness.nPortIndex = OMX_ALL;
     sharpness.nSharpness = CAM_SHARPNESS;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonSharpness, &sharpness)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera sharpness configuration");
+        return omx_fail(r, "Failed to set camera sharpness configuration");
     }
     // Configure contrast
     OMX_CONFIG_CONTRASTTYPE contrast;
@@ -86,7 +86,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     contrast.nPortIndex = OMX_ALL;
     contrast.nContrast = CAM_CONTRAST;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonContrast, &contrast)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera contrast configuration");
+        return omx_fail(r, "Failed to set camera contrast configuration");
     }
     // Configure saturation
     OMX_CONFIG_SATURATIONTYPE saturation;
@@ -94,7 +94,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     saturation.nPortIndex = OMX_ALL;
     saturation.nSaturation = CAM_SATURATION;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonSaturation, &saturation)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera saturation configuration");
+        return omx_fail(r, "Failed to set camera saturation configuration");
     }
     // Configure brightness
     OMX_CONFIG_BRIGHTNESSTYPE brightness;
@@ -102,7 +102,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     brightness.nPortIndex = OMX_ALL;
     brightness.nBrightness = CAM_BRIGHTNESS;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonBrightness, &brightness)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera brightness configuration");
+        return omx_fail(r, "Failed to set camera brightness configuration");
     }
     // Configure exposure value
     OMX_CONFIG_EXPOSUREVALUETYPE exposure_value;
@@ -112,7 +112,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     exposure_value.bAutoSensitivity = CAM_EXPOSURE_AUTO_SENSITIVITY;
     exposure_value.nSensitivity = CAM_EXPOSURE_ISO_SENSITIVITY;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonExposureValue, &exposure_value)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera exposure value configuration");
+        return omx_fail(r, "Failed to set camera exposure value configuration");
     }
     // Configure frame frame stabilisation
     OMX_CONFIG_FRAMESTABTYPE frame_stabilisation_control;
@@ -120,7 +120,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     frame_stabilisation_control.nPortIndex = OMX_ALL;
     frame_stabilisation_control.bStab = CAM_FRAME_STABILISATION;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonFrameStabilisation, &frame_stabilisation_control)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera frame frame stabilisation control configuration");
+        return omx_fail(r, "Failed to set camera frame frame stabilisation control configuration");
     }
     // Configure frame white balance control
     OMX_CONFIG_WHITEBALCONTROLTYPE white_balance_control;
@@ -128,7 +128,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     white_balance_control.nPortIndex = OMX_ALL;
     white_balance_control.eWhiteBalControl = CAM_WHITE_BALANCE_CONTROL;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonWhiteBalance, &white_balance_control)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera frame white balance control configuration");
+        return omx_fail(r, "Failed to set camera frame white balance control configuration");
     }
     // Configure image filter
     OMX_CONFIG_IMAGEFILTERTYPE image_filter;
@@ -136,7 +136,7 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     image_filter.nPortIndex = OMX_ALL;
     image_filter.eImageFilter = CAM_IMAGE_FILTER;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonImageFilter, &image_filter)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set camera image filter configuration");
+        return omx_fail(r, "Failed to set camera image filter configuration");
     }
     // Configure mirror
     OMX_MIRRORTYPE eMirror = OMX_MirrorNone;
@@ -152,11 +152,83 @@ void config_omx_camera(OmxCameraModule *cammodule, OMX_U32 cam_width, OMX_U32 ca
     mirror.nPortIndex = 71;
     mirror.eMirror = eMirror;
     if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigCommonMirror, &mirror)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set mirror configuration for camera video output port 71");
+        return omx_fail(r, "Failed to set mirror configuration for camera video output port 71");
     }
 
     // Ensure camera is ready
+    int64_t deadline = monotonic_time_us() + (int64_t)ready_timeout_ms * 1000;
     while(!cammodule->camera_ready) {
+        if(ready_timeout_ms >= 0 && monotonic_time_us() >= deadline) {
+            return omx_fail(OMX_ErrorTimeout, "Camera did not become ready in %d ms", ready_timeout_ms);
+        }
         usleep(10000);
     }
+    return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE config_omx_camera_preview(OmxCameraModule *cammodule, OMX_U32 preview_width, OMX_U32 preview_height, OMX_U32 preview_framerate)
+{
+    OMX_ERRORTYPE r;
+
+    // Reconfigure only the video format emitted by camera preview output
+    // port, camera video output port keeps the configuration copied from
+    // the preview port by config_omx_camera()
+    OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
+    OMX_INIT_STRUCTURE(camera_portdef);
+    camera_portdef.nPortIndex = 70;
+    if((r = OMX_GetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to get port definition for camera preview output port 70");
+    }
+    camera_portdef.format.video.nFrameWidth  = preview_width;
+    camera_portdef.format.video.nFrameHeight = preview_height;
+    camera_portdef.format.video.xFramerate   = preview_framerate << 16;
+    camera_portdef.format.video.nStride      = (camera_portdef.format.video.nFrameWidth + camera_portdef.nBufferAlignment - 1) & (~(camera_portdef.nBufferAlignment - 1));
+    camera_portdef.format.video.nSliceHeight = 0;
+    if((r = OMX_SetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set port definition for camera preview output port 70");
+    }
+    // Configure frame rate
+    OMX_CONFIG_FRAMERATETYPE framerate;
+    OMX_INIT_STRUCTURE(framerate);
+    framerate.nPortIndex = 70;
+    framerate.xEncodeFramerate = camera_portdef.format.video.xFramerate;
+    if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigVideoFramerate, &framerate)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set framerate configuration for camera preview output port 70");
+    }
+    return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE config_omx_camera_raw(OmxCameraModule *cammodule)
+{
+    OMX_ERRORTYPE r;
+
+    // Switch only the camera video output port to the packed sensor data,
+    // the preview output port keeps emitting YUV
+    OMX_PARAM_PORTDEFINITIONTYPE camera_portdef;
+    OMX_INIT_STRUCTURE(camera_portdef);
+    camera_portdef.nPortIndex = 71;
+    if((r = OMX_GetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to get port definition for camera video output port 71");
+    }
+    camera_portdef.format.video.eColorFormat = OMX_COLOR_FormatRawBayer10bit;
+    camera_portdef.format.video.nStride      = (camera_portdef.format.video.nFrameWidth / 4 * 5 + camera_portdef.nBufferAlignment - 1) & (~(camera_portdef.nBufferAlignment - 1));
+    if((r = OMX_SetParameter(cammodule->camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set raw Bayer port definition for camera video output port 71");
+    }
+    return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE config_omx_camera_stc_timestamps(OmxCameraModule *cammodule)
+{
+    OMX_ERRORTYPE r;
+
+    // Stamp the buffers with the VideoCore system timer so that
+    // the timestamps can be compared with the wall clock
+    OMX_CONFIG_BOOLEANTYPE stc;
+    OMX_INIT_STRUCTURE(stc);
+    stc.bEnabled = OMX_TRUE;
+    if((r = OMX_SetConfig(cammodule->camera, OMX_IndexConfigBrcmUseStc, &stc)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to enable system timer timestamps on camera");
+    }
+    return OMX_ErrorNone;
 }
@@ -2,7 +2,177 @@
 #include "rpi-video-params.hpp"
 
 
-void config_omx_encoder_out(OmxEncoderModule *encodermodule, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 stride, OMX_U32 encbitrate)
+void default_omx_encoder_config(OmxEncoderConfig *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->rate_control = VIDEO_RATE_CONTROL;
+    config->bitrate = VIDEO_BITRATE;
+    config->qp_i = VIDEO_QP_I;
+    config->qp_p = VIDEO_QP_P;
+    config->min_qp = VIDEO_MIN_QP;
+    config->max_qp = VIDEO_MAX_QP;
+    config->idr_period = VIDEO_IDR_PERIOD;
+    config->profile = VIDEO_PROFILE;
+    config->level = VIDEO_LEVEL;
+    config->intra_refresh_mbs = VIDEO_INTRA_REFRESH_MBS;
+}
+
+void dump_omx_encoder_config(const char *message, const OmxEncoderConfig *config)
+{
+    static const char *rate_controls[] = { "VBR", "CBR", "constant QP" };
+    say("%s encoder configuration:\n"
+        "\tRate control:\t\t%s\n"
+        "\tBitrate:\t\t%u\n"
+        "\tQP I/P:\t\t\t%u/%u\n"
+        "\tQP range:\t\t%u..%u\n"
+        "\tIDR period:\t\t%u\n"
+        "\tProfile/level:\t\t0x%x/0x%x\n"
+        "\tIntra refresh MBs:\t%u\n",
+        message, rate_controls[config->rate_control], config->bitrate,
+        config->qp_i, config->qp_p, config->min_qp, config->max_qp, config->idr_period,
+        config->profile, config->level, config->intra_refresh_mbs);
+}
+
+// Optional parameters the firmware may not support are only reported
+static void set_optional_parameter(OMX_HANDLETYPE encoder, OMX_INDEXTYPE index, OMX_PTR param, const char *name)
+{
+    OMX_ERRORTYPE r;
+    if((r = OMX_SetParameter(encoder, index, param)) != OMX_ErrorNone) {
+        say("Failed to set %s for encoder output port 201: error 0x%08x", name, r);
+    }
+}
+
+// Apply mod->config and read back what the firmware made of it in to mod->accepted
+static OMX_ERRORTYPE config_omx_encoder_rate_control(OmxEncoderModule *mod, OMX_U32 encbitrate)
+{
+    OMX_ERRORTYPE r;
+    OmxEncoderConfig *config = &mod->config;
+    OmxEncoderConfig *accepted = &mod->accepted;
+
+    if(config->bitrate == 0) {
+        config->bitrate = encbitrate;
+    }
+    memset(accepted, 0, sizeof(*accepted));
+    accepted->rate_control = config->rate_control;
+
+    // Configure bitrate
+    OMX_VIDEO_PARAM_BITRATETYPE bitrate;
+    OMX_INIT_STRUCTURE(bitrate);
+    switch(config->rate_control) {
+        case ENCODER_RATE_CBR:
+            bitrate.eControlRate = OMX_Video_ControlRateConstant;
+            break;
+        case ENCODER_RATE_CQP:
+            bitrate.eControlRate = OMX_Video_ControlRateDisable;
+            break;
+        default:
+            bitrate.eControlRate = OMX_Video_ControlRateVariable;
+            break;
+    }
+    bitrate.nTargetBitrate = config->rate_control == ENCODER_RATE_CQP ? 0 : config->bitrate;
+    bitrate.nPortIndex = 201;
+    if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamVideoBitrate, &bitrate)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set bitrate for encoder output port 201");
+    }
+    if((r = OMX_GetParameter(mod->encoder, OMX_IndexParamVideoBitrate, &bitrate)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to get bitrate for encoder output port 201");
+    }
+    accepted->bitrate = bitrate.nTargetBitrate;
+    accepted->rate_control = bitrate.eControlRate == OMX_Video_ControlRateConstant ? ENCODER_RATE_CBR :
+        bitrate.eControlRate == OMX_Video_ControlRateDisable ? ENCODER_RATE_CQP : ENCODER_RATE_VBR;
+
+    // Fixed quantisers without rate control
+    OMX_VIDEO_PARAM_QUANTIZATIONTYPE quantization;
+    OMX_INIT_STRUCTURE(quantization);
+    quantization.nPortIndex = 201;
+    if(config->rate_control == ENCODER_RATE_CQP) {
+        quantization.nQpI = config->qp_i;
+        quantization.nQpP = config->qp_p;
+        set_optional_parameter(mod->encoder, OMX_IndexParamVideoQuantization, &quantization, "quantization");
+    }
+    if(OMX_GetParameter(mod->encoder, OMX_IndexParamVideoQuantization, &quantization) == OMX_ErrorNone) {
+        accepted->qp_i = quantization.nQpI;
+        accepted->qp_p = quantization.nQpP;
+    }
+
+    // Bounds for the rate control
+    OMX_PARAM_U32TYPE qp;
+    OMX_INIT_STRUCTURE(qp);
+    qp.nPortIndex = 201;
+    if(config->min_qp > 0) {
+        qp.nU32 = config->min_qp;
+        set_optional_parameter(mod->encoder, OMX_IndexParamBrcmVideoEncodeMinQuant, &qp, "minimum quantiser");
+    }
+    if(OMX_GetParameter(mod->encoder, OMX_IndexParamBrcmVideoEncodeMinQuant, &qp) == OMX_ErrorNone) {
+        accepted->min_qp = qp.nU32;
+    }
+    OMX_INIT_STRUCTURE(qp);
+    qp.nPortIndex = 201;
+    if(config->max_qp > 0) {
+        qp.nU32 = config->max_qp;
+        set_optional_parameter(mod->encoder, OMX_IndexParamBrcmVideoEncodeMaxQuant, &qp, "maximum quantiser");
+    }
+    if(OMX_GetParameter(mod->encoder, OMX_IndexParamBrcmVideoEncodeMaxQuant, &qp) == OMX_ErrorNone) {
+        accepted->max_qp = qp.nU32;
+    }
+
+    // H.264 profile and level
+    OMX_VIDEO_PARAM_PROFILELEVELTYPE profile;
+    OMX_INIT_STRUCTURE(profile);
+    profile.nPortIndex = 201;
+    if(OMX_GetParameter(mod->encoder, OMX_IndexParamVideoProfileLevelCurrent, &profile) == OMX_ErrorNone
+            && (config->profile != 0 || config->level != 0)) {
+        if(config->profile != 0) {
+            profile.eProfile = config->profile;
+        }
+        if(config->level != 0) {
+            profile.eLevel = config->level;
+        }
+        set_optional_parameter(mod->encoder, OMX_IndexParamVideoProfileLevelCurrent, &profile, "profile and level");
+    }
+    if(OMX_GetParameter(mod->encoder, OMX_IndexParamVideoProfileLevelCurrent, &profile) == OMX_ErrorNone) {
+        accepted->profile = profile.eProfile;
+        accepted->level = profile.eLevel;
+    }
+
+    // Cyclic intra refresh spreads the intra coded macroblocks over
+    // the frames instead of sending them all at once in IDR frames
+    OMX_VIDEO_PARAM_INTRAREFRESHTYPE refresh;
+    OMX_INIT_STRUCTURE(refresh);
+    refresh.nPortIndex = 201;
+    if(config->intra_refresh_mbs > 0) {
+        refresh.eRefreshMode = OMX_VIDEO_IntraRefreshCyclic;
+        refresh.nCirMBs = config->intra_refresh_mbs;
+        set_optional_parameter(mod->encoder, OMX_IndexParamVideoIntraRefresh, &refresh, "intra refresh");
+    }
+    if(OMX_GetParameter(mod->encoder, OMX_IndexParamVideoIntraRefresh, &refresh) == OMX_ErrorNone) {
+        accepted->intra_refresh_mbs = refresh.nCirMBs;
+    }
+
+    // IDR period
+    OMX_VIDEO_CONFIG_AVCINTRAPERIOD period;
+    OMX_INIT_STRUCTURE(period);
+    period.nPortIndex = 201;
+    if((r = OMX_GetConfig(mod->encoder, OMX_IndexConfigVideoAVCIntraPeriod, &period)) != OMX_ErrorNone) {
+        say("Failed to get IDR period for encoder output port 201: error 0x%08x", r);
+    } else {
+        if(config->idr_period > 0) {
+            period.nIDRPeriod = config->idr_period;
+            period.nPFrames = config->idr_period - 1;
+            if((r = OMX_SetConfig(mod->encoder, OMX_IndexConfigVideoAVCIntraPeriod, &period)) != OMX_ErrorNone) {
+                say("Failed to set IDR period for encoder output port 201: error 0x%08x", r);
+            }
+            OMX_GetConfig(mod->encoder, OMX_IndexConfigVideoAVCIntraPeriod, &period);
+        }
+        accepted->idr_period = period.nIDRPeriod;
+    }
+
+    dump_omx_encoder_config("Requested", config);
+    dump_omx_encoder_config("Accepted", accepted);
+    return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE config_omx_encoder_out(OmxEncoderModule *encodermodule, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 stride, OMX_U32 encbitrate)
 {
     OMX_ERRORTYPE r;
 
@@ -18,26 +188,21 @@ void config_omx_encoder_out(OmxEncoderModule *encodermodule, OMX_U32 width, OMX_
     OMX_INIT_STRUCTURE(encoder_portdef);
     encoder_portdef.nPortIndex = 201;
     if((r = OMX_GetParameter(encodermodule->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for encoder output port 201");
+        return omx_fail(r, "Failed to get port definition for encoder output port 201");
     }
     // Copy some of the encoder output port configuration from camera output port
     encoder_portdef.format.video.nFrameWidth  = width;
     encoder_portdef.format.video.nFrameHeight = height;
-    encoder_portdef.format.video.xFramerate   = framerate;
+    encoder_portdef.format.video.xFramerate   = framerate << 16;
     encoder_portdef.format.video.nStride      = stride;
     // Which one is effective, this or the configuration just below?
     encoder_portdef.format.video.nBitrate     = encbitrate;
     if((r = OMX_SetParameter(encodermodule->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set port definition for encoder output port 201");
+        return omx_fail(r, "Failed to set port definition for encoder output port 201");
     }
-    // Configure bitrate
-    OMX_VIDEO_PARAM_BITRATETYPE bitrate;
-    OMX_INIT_STRUCTURE(bitrate);
-    bitrate.eControlRate = OMX_Video_ControlRateVariable;
-    bitrate.nTargetBitrate = encoder_portdef.format.video.nBitrate;
-    bitrate.nPortIndex = 201;
-    if((r = OMX_SetParameter(encodermodule->encoder, OMX_IndexParamVideoBitrate, &bitrate)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set bitrate for encoder output port 201");
+    // Configure bitrate, rate control and GOP structure
+    if((r = config_omx_encoder_rate_control(encodermodule, encbitrate)) != OMX_ErrorNone) {
+        return r;
     }
     // Configure format
     OMX_VIDEO_PARAM_PORTFORMATTYPE format;
@@ -45,11 +210,12 @@ void config_omx_encoder_out(OmxEncoderModule *encodermodule, OMX_U32 width, OMX_
     format.nPortIndex = 201;
     format.eCompressionFormat = OMX_VIDEO_CodingAVC;
     if((r = OMX_SetParameter(encodermodule->encoder, OMX_IndexParamVideoPortFormat, &format)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set video format for encoder output port 201");
+        return omx_fail(r, "Failed to set video format for encoder output port 201");
     }
+    return OMX_ErrorNone;
 }
 
-void config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 encbitrate)
+OMX_ERRORTYPE config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 encbitrate)
 {
     OMX_ERRORTYPE r;
 
@@ -62,7 +228,7 @@ void config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 hei
     OMX_INIT_STRUCTURE(encoder_portdef);
     encoder_portdef.nPortIndex = 200;
     if((r = OMX_GetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for encoder input port 200");
+        return omx_fail(r, "Failed to get port definition for encoder input port 200");
     }
     encoder_portdef.format.video.nFrameWidth  = width;
     encoder_portdef.format.video.nFrameHeight = height;
@@ -71,14 +237,14 @@ void config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 hei
     encoder_portdef.format.video.nStride      = (encoder_portdef.format.video.nFrameWidth + encoder_portdef.nBufferAlignment - 1) & (~(encoder_portdef.nBufferAlignment - 1));
     encoder_portdef.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
     if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set port definition for encoder input port 200");
+        return omx_fail(r, "Failed to set port definition for encoder input port 200");
     }
 
     // Copy encoder input port definition as basis encoder output port definition
     OMX_INIT_STRUCTURE(encoder_portdef);
     encoder_portdef.nPortIndex = 200;
     if((r = OMX_GetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for encoder input port 200");
+        return omx_fail(r, "Failed to get port definition for encoder input port 200");
     }
     encoder_portdef.nPortIndex = 201;
     encoder_portdef.format.video.eColorFormat = OMX_COLOR_FormatUnused;
@@ -86,16 +252,11 @@ void config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 hei
     // Which one is effective, this or the configuration just below?
     encoder_portdef.format.video.nBitrate     = encbitrate;
     if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set port definition for encoder output port 201");
+        return omx_fail(r, "Failed to set port definition for encoder output port 201");
     }
-    // Configure bitrate
-    OMX_VIDEO_PARAM_BITRATETYPE bitrate;
-    OMX_INIT_STRUCTURE(bitrate);
-    bitrate.eControlRate = OMX_Video_ControlRateVariable;
-    bitrate.nTargetBitrate = encoder_portdef.format.video.nBitrate;
-    bitrate.nPortIndex = 201;
-    if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamVideoBitrate, &bitrate)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set bitrate for encoder output port 201");
+    // Configure bitrate, rate control and GOP structure
+    if((r = config_omx_encoder_rate_control(mod, encbitrate)) != OMX_ErrorNone) {
+        return r;
     }
     // Configure format
     OMX_VIDEO_PARAM_PORTFORMATTYPE format;
@@ -103,6 +264,31 @@ void config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 hei
     format.nPortIndex = 201;
     format.eCompressionFormat = OMX_VIDEO_CodingAVC;
     if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamVideoPortFormat, &format)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to set video format for encoder output port 201");
+        return omx_fail(r, "Failed to set video format for encoder output port 201");
+    }
+    return OMX_ErrorNone;
+}
+
+OMX_ERRORTYPE config_omx_encoder_low_latency(OmxEncoderModule *mod, OMX_U32 mb_rows_per_slice)
+{
+    OMX_ERRORTYPE r;
+
+    // Emit each NAL unit, i.e. each slice, in an output buffer of its own
+    // marked with OMX_BUFFERFLAG_ENDOFNAL instead of whole frames
+    OMX_CONFIG_PORTBOOLEANTYPE nals;
+    OMX_INIT_STRUCTURE(nals);
+    nals.nPortIndex = 201;
+    nals.bEnabled = OMX_TRUE;
+    if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamBrcmNALSSeparate, &nals)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to enable separate NAL units on encoder output port 201");
+    }
+    // Split the frames in to slices of given number of macroblock rows
+    OMX_PARAM_U32TYPE rows;
+    OMX_INIT_STRUCTURE(rows);
+    rows.nPortIndex = 201;
+    rows.nU32 = mb_rows_per_slice;
+    if((r = OMX_SetConfig(mod->encoder, OMX_IndexConfigBrcmVideoEncoderMBRowsPerSlice, &rows)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set %d macroblock rows per slice on encoder output port 201", mb_rows_per_slice);
     }
+    return OMX_ErrorNone;
 }
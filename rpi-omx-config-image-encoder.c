@@ -0,0 +1,57 @@
+#include "rpi-omx-utils.hpp"
+#include "rpi-image-params.hpp"
+
+
+OMX_ERRORTYPE config_omx_image_encoder(OmxImageEncoderModule *mod, OMX_U32 width, OMX_U32 height, OMX_S32 stride, OMX_U32 slice_height, OMX_U32 quality)
+{
+    OMX_ERRORTYPE r;
+
+    say("Default port definition for image encoder input port 340");
+    dump_port(mod->encoder, 340, OMX_TRUE);
+    say("Default port definition for image encoder output port 341");
+    dump_port(mod->encoder, 341, OMX_TRUE);
+
+    // Input buffers are filled by us with the same layout the
+    // camera emits, one slice of the frame per buffer
+    OMX_PARAM_PORTDEFINITIONTYPE encoder_portdef;
+    OMX_INIT_STRUCTURE(encoder_portdef);
+    encoder_portdef.nPortIndex = 340;
+    if((r = OMX_GetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to get port definition for image encoder input port 340");
+    }
+    encoder_portdef.format.image.nFrameWidth        = width;
+    encoder_portdef.format.image.nFrameHeight       = height;
+    encoder_portdef.format.image.nStride            = stride;
+    encoder_portdef.format.image.nSliceHeight       = slice_height;
+    encoder_portdef.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+    encoder_portdef.format.image.eColorFormat       = OMX_COLOR_FormatYUV420PackedPlanar;
+    encoder_portdef.nBufferSize                     = stride * slice_height * 3 / 2;
+    if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set port definition for image encoder input port 340");
+    }
+
+    // Configure image format emitted by encoder output port
+    OMX_INIT_STRUCTURE(encoder_portdef);
+    encoder_portdef.nPortIndex = 341;
+    if((r = OMX_GetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to get port definition for image encoder output port 341");
+    }
+    encoder_portdef.format.image.nFrameWidth        = width;
+    encoder_portdef.format.image.nFrameHeight       = height;
+    encoder_portdef.format.image.nStride            = 0;
+    encoder_portdef.format.image.nSliceHeight       = 0;
+    encoder_portdef.format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
+    encoder_portdef.format.image.eColorFormat       = OMX_COLOR_FormatUnused;
+    if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set port definition for image encoder output port 341");
+    }
+    // Configure quality
+    OMX_IMAGE_PARAM_QFACTORTYPE qfactor;
+    OMX_INIT_STRUCTURE(qfactor);
+    qfactor.nPortIndex = 341;
+    qfactor.nQFactor = quality;
+    if((r = OMX_SetParameter(mod->encoder, OMX_IndexParamQFactor, &qfactor)) != OMX_ErrorNone) {
+        return omx_fail(r, "Failed to set quality factor for image encoder output port 341");
+    }
+    return OMX_ErrorNone;
+}
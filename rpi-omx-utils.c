@@ -1,4 +1,8 @@
 
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+
 #include "rpi-omx-utils.hpp"
 
 //
@@ -52,6 +56,18 @@ void omx_die(OMX_ERRORTYPE error, const char* message, ...)
     die("OMX error: %s: 0x%08x %s", str, error, e);
 }
 
+OMX_ERRORTYPE omx_fail(OMX_ERRORTYPE error, const char* message, ...)
+{
+    va_list args;
+    char str[1024];
+    memset(str, 0, sizeof(str));
+    va_start(args, message);
+    vsnprintf(str, sizeof(str), message, args);
+    va_end(args);
+    say("%s: error 0x%08x", str, error);
+    return error;
+}
+
 void dump_event(OMX_HANDLETYPE hComponent, OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2)
 {
     char *e;
@@ -229,8 +245,10 @@ void dump_port(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL dumpforma
     OMX_PARAM_PORTDEFINITIONTYPE portdef;
     OMX_INIT_STRUCTURE(portdef);
     portdef.nPortIndex = nPortIndex;
+    // Only for information, a failure here isn't worth exiting for
     if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get port definition for port %d", nPortIndex);
+        omx_fail(r, "Failed to get port definition for port %d", nPortIndex);
+        return;
     }
     dump_portdef(&portdef);
     if(dumpformats) {
@@ -252,36 +270,63 @@ void dump_port(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL dumpforma
 // Some busy loops to verify we're running in order
 void block_until_state_changed(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState)
 {
+    OMX_ERRORTYPE r;
+    if((r = wait_for_state_change(hComponent, wanted_eState, -1)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get component state");
+    }
+}
+
+void block_until_port_changed(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled)
+{
+    OMX_ERRORTYPE r;
+    if((r = wait_for_port_change(hComponent, nPortIndex, bEnabled, -1)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition");
+    }
+}
+
+OMX_ERRORTYPE wait_for_state_change(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState, int timeout_ms)
+{
+    OMX_ERRORTYPE r;
     OMX_STATETYPE eState;
-    int i = 0;
-    while(i++ == 0 || eState != wanted_eState) {
-        OMX_GetState(hComponent, &eState);
-        if(eState != wanted_eState) {
-            usleep(10000);
+    int64_t deadline = monotonic_time_us() + (int64_t)timeout_ms * 1000;
+    while(1) {
+        if((r = OMX_GetState(hComponent, &eState)) != OMX_ErrorNone) {
+            return r;
+        }
+        if(eState == wanted_eState) {
+            return OMX_ErrorNone;
         }
+        if(timeout_ms >= 0 && monotonic_time_us() >= deadline) {
+            return OMX_ErrorTimeout;
+        }
+        usleep(10000);
     }
 }
 
-void block_until_port_changed(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled)
+OMX_ERRORTYPE wait_for_port_change(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled, int timeout_ms)
 {
     OMX_ERRORTYPE r;
     OMX_PARAM_PORTDEFINITIONTYPE portdef;
+    int64_t deadline = monotonic_time_us() + (int64_t)timeout_ms * 1000;
     OMX_INIT_STRUCTURE(portdef);
     portdef.nPortIndex = nPortIndex;
-    OMX_U32 i = 0;
-    while(i++ == 0 || portdef.bEnabled != bEnabled) {
+    while(1) {
         if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
-            omx_die(r, "Failed to get port definition");
+            return r;
         }
-        if(portdef.bEnabled != bEnabled) {
-            usleep(10000);
+        if(portdef.bEnabled == bEnabled) {
+            return OMX_ErrorNone;
+        }
+        if(timeout_ms >= 0 && monotonic_time_us() >= deadline) {
+            return OMX_ErrorTimeout;
         }
+        usleep(10000);
     }
 }
 
 void block_until_flushed(appctx_sync *ctx)
 {
-    int quit;
+    int quit = 0;
     while(!quit) {
         vcos_semaphore_wait(&ctx->handler_lock);
         if(ctx->flushed) {
@@ -296,6 +341,14 @@ void block_until_flushed(appctx_sync *ctx)
 }
 
 void init_component_handle(const char *name, OMX_HANDLETYPE* hComponent, OMX_PTR pAppData, OMX_CALLBACKTYPE* callbacks)
+{
+    OMX_ERRORTYPE r;
+    if((r = try_init_component_handle(name, hComponent, pAppData, callbacks, -1)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to initialize component %s", name);
+    }
+}
+
+OMX_ERRORTYPE try_init_component_handle(const char *name, OMX_HANDLETYPE* hComponent, OMX_PTR pAppData, OMX_CALLBACKTYPE* callbacks, int timeout_ms)
 {
     OMX_ERRORTYPE r;
     char fullname[32];
@@ -306,7 +359,8 @@ void init_component_handle(const char *name, OMX_HANDLETYPE* hComponent, OMX_PTR
     strncat(fullname, name, strlen(fullname) - 1);
     say("Initializing component %s", fullname);
     if((r = OMX_GetHandle(hComponent, fullname, pAppData, callbacks)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to get handle for component %s", fullname);
+        *hComponent = NULL;
+        return omx_fail(r, "Failed to get handle for component %s", fullname);
     }
 
     // Disable ports
@@ -326,11 +380,246 @@ void init_component_handle(const char *name, OMX_HANDLETYPE* hComponent, OMX_PTR
             OMX_U32 nPortIndex;
             for(nPortIndex = ports.nStartPortNumber; nPortIndex < ports.nStartPortNumber + ports.nPorts; nPortIndex++) {
                 say("Disabling port %d of component %s", nPortIndex, fullname);
-                if((r = OMX_SendCommand(*hComponent, OMX_CommandPortDisable, nPortIndex, NULL)) != OMX_ErrorNone) {
-                    omx_die(r, "Failed to disable port %d of component %s", nPortIndex, fullname);
+                if((r = OMX_SendCommand(*hComponent, OMX_CommandPortDisable, nPortIndex, NULL)) != OMX_ErrorNone
+                        || (r = wait_for_port_change(*hComponent, nPortIndex, OMX_FALSE, timeout_ms)) != OMX_ErrorNone) {
+                    return omx_fail(r, "Failed to disable port %d of component %s", nPortIndex, fullname);
+                }
+            }
+        }
+    }
+    return OMX_ErrorNone;
+}
+
+int64_t omx_ticks_to_int64(OMX_TICKS ticks)
+{
+#ifdef OMX_SKIP64BIT
+    return ((int64_t)ticks.nHighPart << 32) | ticks.nLowPart;
+#else
+    return ticks;
+#endif
+}
+
+int64_t monotonic_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void shutdown_deadline_handler(int signal)
+{
+    static const char message[] = "Shutdown deadline passed, exiting without cleaning up\n";
+    if(write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {
+        // Nothing to be done about it
+    }
+    // VCHIQ releases the components when the process exits
+    _exit(1);
+}
+
+void set_shutdown_deadline(int ms)
+{
+    static int armed = 0;
+    struct itimerval timer;
+    if(armed || ms <= 0) {
+        return;
+    }
+    armed = 1;
+    signal(SIGALRM, shutdown_deadline_handler);
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = ms / 1000;
+    timer.it_value.tv_usec = (ms % 1000) * 1000;
+    if(setitimer(ITIMER_REAL, &timer, NULL) != 0) {
+        die("Failed to set shutdown deadline timer: %s", strerror(errno));
+    }
+    say("Exiting in %d ms at the latest", ms);
+}
+
+typedef struct
+{
+    OMX_HANDLETYPE component;
+    OMX_COMMANDTYPE cmd;
+    OMX_U32 param;
+    int done;
+} pending_command;
+
+// Shared by all the components regardless of their application context
+static pending_command pending_commands[OMX_MAX_PENDING_COMMANDS];
+static int pending_command_count = 0;
+static pthread_mutex_t pending_command_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_command_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *dump_command(OMX_COMMANDTYPE cmd)
+{
+    switch(cmd) {
+        case OMX_CommandStateSet:       return "state set";
+        case OMX_CommandFlush:          return "flush";
+        case OMX_CommandPortDisable:    return "port disable";
+        case OMX_CommandPortEnable:     return "port enable";
+        default:                        return "unknown command";
+    }
+}
+
+void omx_command_expect(OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE cmd, OMX_U32 param)
+{
+    pthread_mutex_lock(&pending_command_lock);
+    if(pending_command_count == OMX_MAX_PENDING_COMMANDS) {
+        die("Too many pending commands");
+    }
+    pending_commands[pending_command_count].component = hComponent;
+    pending_commands[pending_command_count].cmd = cmd;
+    pending_commands[pending_command_count].param = param;
+    pending_commands[pending_command_count].done = 0;
+    pending_command_count++;
+    pthread_mutex_unlock(&pending_command_lock);
+}
+
+void omx_command_send(OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE cmd, OMX_U32 param)
+{
+    OMX_ERRORTYPE r;
+    // Registered first, the completion may arrive before OMX_SendCommand() returns
+    omx_command_expect(hComponent, cmd, param);
+    if((r = OMX_SendCommand(hComponent, cmd, param, NULL)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to send %s command with parameter %d", dump_command(cmd), param);
+    }
+}
+
+void omx_command_complete(OMX_HANDLETYPE hComponent, OMX_U32 cmd, OMX_U32 param)
+{
+    int i;
+    pthread_mutex_lock(&pending_command_lock);
+    for(i = 0; i < pending_command_count; i++) {
+        // A command for all the ports may complete once or once per port
+        if(pending_commands[i].component == hComponent && pending_commands[i].cmd == cmd
+                && (pending_commands[i].param == param || param == OMX_ALL)) {
+            pending_commands[i].done = 1;
+        }
+    }
+    pthread_cond_broadcast(&pending_command_cond);
+    pthread_mutex_unlock(&pending_command_lock);
+}
+
+int omx_command_wait(int timeout_ms)
+{
+    struct timespec deadline;
+    int i, remaining, r = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pending_command_lock);
+    while(1) {
+        for(i = 0, remaining = 0; i < pending_command_count; i++) {
+            remaining += !pending_commands[i].done;
+        }
+        if(remaining == 0) {
+            break;
+        }
+        if(pthread_cond_timedwait(&pending_command_cond, &pending_command_lock, &deadline) == ETIMEDOUT) {
+            for(i = 0; i < pending_command_count; i++) {
+                if(!pending_commands[i].done) {
+                    say("Timed out waiting for %s command with parameter %d to complete", dump_command(pending_commands[i].cmd), pending_commands[i].param);
+                }
+            }
+            r = -1;
+            break;
+        }
+    }
+    pending_command_count = 0;
+    pthread_mutex_unlock(&pending_command_lock);
+    return r;
+}
+
+void teardown_add_port(teardown_component *tc, OMX_U32 nPortIndex, OMX_BUFFERHEADERTYPE *buffer)
+{
+    teardown_add_port_buffers(tc, nPortIndex, &buffer, buffer != NULL);
+}
+
+void teardown_add_port_buffers(teardown_component *tc, OMX_U32 nPortIndex, OMX_BUFFERHEADERTYPE **buffers, int count)
+{
+    if(tc->port_count == TEARDOWN_MAX_PORTS) {
+        die("Too many ports to tear down for %s", tc->name);
+    }
+    if(count > TEARDOWN_MAX_BUFFERS) {
+        die("Too many buffers to free on %s port %d", tc->name, nPortIndex);
+    }
+    tc->ports[tc->port_count] = nPortIndex;
+    memcpy(tc->buffers[tc->port_count], buffers, count * sizeof(OMX_BUFFERHEADERTYPE *));
+    tc->buffer_counts[tc->port_count] = count;
+    tc->port_count++;
+}
+
+// A component refusing a teardown command is reported and not waited for
+static int teardown_send(teardown_component *tc, OMX_COMMANDTYPE cmd, OMX_U32 param)
+{
+    OMX_ERRORTYPE r;
+    omx_command_expect(tc->component, cmd, param);
+    if((r = OMX_SendCommand(tc->component, cmd, param, NULL)) != OMX_ErrorNone) {
+        say("Failed to send %s command with parameter %d to %s: error 0x%08x", dump_command(cmd), param, tc->name, r);
+        omx_command_complete(tc->component, cmd, param);
+        return -1;
+    }
+    return 0;
+}
+
+int teardown_components(teardown_component *components, int count, int timeout_ms)
+{
+    OMX_ERRORTYPE r;
+    int64_t start = monotonic_time_us(), flushed, disabled, idle;
+    int i, j, k, status = 0;
+
+    // Flush the buffers on each component
+    for(i = 0; i < count; i++) {
+        for(j = 0; j < components[i].port_count; j++) {
+            omx_command_expect(components[i].component, OMX_CommandFlush, components[i].ports[j]);
+        }
+        if((r = OMX_SendCommand(components[i].component, OMX_CommandFlush, OMX_ALL, NULL)) != OMX_ErrorNone) {
+            say("Failed to flush buffers of %s: error 0x%08x", components[i].name, r);
+            omx_command_complete(components[i].component, OMX_CommandFlush, OMX_ALL);
+            status = -1;
+        }
+    }
+    status |= omx_command_wait(timeout_ms);
+    flushed = monotonic_time_us();
+
+    // Disable all the ports, the ports with buffers allocated
+    // don't get disabled until the buffers are freed
+    for(i = 0; i < count; i++) {
+        for(j = 0; j < components[i].port_count; j++) {
+            status |= teardown_send(&components[i], OMX_CommandPortDisable, components[i].ports[j]);
+        }
+    }
+    for(i = 0; i < count; i++) {
+        for(j = 0; j < components[i].port_count; j++) {
+            for(k = 0; k < components[i].buffer_counts[j]; k++) {
+                if((r = OMX_FreeBuffer(components[i].component, components[i].ports[j], components[i].buffers[j][k])) != OMX_ErrorNone) {
+                    say("Failed to free buffer for %s port %d: error 0x%08x", components[i].name, components[i].ports[j], r);
+                    status = -1;
                 }
-                block_until_port_changed(*hComponent, nPortIndex, OMX_FALSE);
             }
         }
     }
+    status |= omx_command_wait(timeout_ms);
+    disabled = monotonic_time_us();
+
+    // Transition all the components to idle and then to loaded states
+    for(i = 0; i < count; i++) {
+        status |= teardown_send(&components[i], OMX_CommandStateSet, OMX_StateIdle);
+    }
+    status |= omx_command_wait(timeout_ms);
+    idle = monotonic_time_us();
+    for(i = 0; i < count; i++) {
+        status |= teardown_send(&components[i], OMX_CommandStateSet, OMX_StateLoaded);
+    }
+    status |= omx_command_wait(timeout_ms);
+
+    say("Tore down %d components in %lld ms: flush %lld ms, disable %lld ms, idle %lld ms, loaded %lld ms",
+        count, (long long)(monotonic_time_us() - start) / 1000, (long long)(flushed - start) / 1000,
+        (long long)(disabled - flushed) / 1000, (long long)(idle - disabled) / 1000,
+        (long long)(monotonic_time_us() - idle) / 1000);
+    return status;
 }
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <bcm_host.h>
 
@@ -30,16 +32,31 @@
 extern void say(const char* message, ...);
 extern void die(const char* message, ...);
 extern void omx_die(OMX_ERRORTYPE error, const char* message, ...);
+// Report the error instead of exiting and return it, for the steps that are
+// retried or recovered from
+extern OMX_ERRORTYPE omx_fail(OMX_ERRORTYPE error, const char* message, ...);
 extern void dump_event(OMX_HANDLETYPE hComponent, OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2);
 extern const char* dump_compression_format(OMX_VIDEO_CODINGTYPE c);
 extern const char* dump_color_format(OMX_COLOR_FORMATTYPE c);
 extern void dump_portdef(OMX_PARAM_PORTDEFINITIONTYPE* portdef);
 extern void dump_port(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL dumpformats);
 extern void init_component_handle(const char *name, OMX_HANDLETYPE* hComponent, OMX_PTR pAppData, OMX_CALLBACKTYPE* callbacks);
+// Same as above but returns the error, waiting at most timeout_ms for each port to be disabled
+extern OMX_ERRORTYPE try_init_component_handle(const char *name, OMX_HANDLETYPE* hComponent, OMX_PTR pAppData, OMX_CALLBACKTYPE* callbacks, int timeout_ms);
+
+// Time helpers, OMX_TICKS is split in two halves when OMX_SKIP64BIT is defined
+extern int64_t omx_ticks_to_int64(OMX_TICKS ticks);
+extern int64_t monotonic_time_us(void);
+// Exit the process without cleaning up if it's still running after ms
+// milliseconds, e.g. stuck in draining the encoder. Only the first call counts.
+extern void set_shutdown_deadline(int ms);
 
 // busy loops to verify we're running in order
 extern void block_until_state_changed(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState);
 extern void block_until_port_changed(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled);
+// Same as above but return OMX_ErrorTimeout after timeout_ms, or never if negative
+extern OMX_ERRORTYPE wait_for_state_change(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState, int timeout_ms);
+extern OMX_ERRORTYPE wait_for_port_change(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled, int timeout_ms);
 
 // Our appl context passed around main routine & callback handlers
 typedef struct
@@ -49,3 +66,41 @@ typedef struct
 } appctx_sync;
 
 extern void block_until_flushed(appctx_sync *ctx);
+
+// Commands waited for through OMX_EventCmdComplete instead of polling,
+// the event handlers must pass each completion to omx_command_complete()
+#define OMX_MAX_PENDING_COMMANDS        64
+
+// Register a command whose completion is waited for by omx_command_wait(),
+// param is the port index or the state
+extern void omx_command_expect(OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE cmd, OMX_U32 param);
+// Register and send a command
+extern void omx_command_send(OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE cmd, OMX_U32 param);
+extern void omx_command_complete(OMX_HANDLETYPE hComponent, OMX_U32 cmd, OMX_U32 param);
+// Wait for all the registered commands to complete. Returns 0 or -1 if some
+// of them didn't complete in timeout_ms, they are forgotten in either case.
+extern int omx_command_wait(int timeout_ms);
+
+// A component and its enabled ports to be torn down
+#define TEARDOWN_MAX_PORTS              4
+#define TEARDOWN_MAX_BUFFERS            16                      // per port
+typedef struct
+{
+    OMX_HANDLETYPE component;
+    const char *name;
+    int port_count;
+    OMX_U32 ports[TEARDOWN_MAX_PORTS];
+    // Buffers allocated on the ports, none for tunneled ports
+    OMX_BUFFERHEADERTYPE *buffers[TEARDOWN_MAX_PORTS][TEARDOWN_MAX_BUFFERS];
+    int buffer_counts[TEARDOWN_MAX_PORTS];
+} teardown_component;
+
+// A port with a single buffer, or NULL for a tunneled port
+extern void teardown_add_port(teardown_component *tc, OMX_U32 nPortIndex, OMX_BUFFERHEADERTYPE *buffer);
+extern void teardown_add_port_buffers(teardown_component *tc, OMX_U32 nPortIndex, OMX_BUFFERHEADERTYPE **buffers, int count);
+// Flush, disable the ports, free the buffers and switch to idle and loaded
+// state all the components at once, each step waiting for the completion
+// events of all the components. The component handles are left to the caller.
+// Failures are reported and the rest carried on with, returns 0 or -1 if
+// something failed or timed out.
+extern int teardown_components(teardown_component *components, int count, int timeout_ms);
@@ -0,0 +1,344 @@
+/*
+ * Bounded output queue drained by a writer thread
+ *
+ * The capture and encoding loops must never stall in write(2), otherwise
+ * the OMX buffers aren't returned to the components in time and the
+ * pipeline backs up. Instead the loops commit their data to this queue and
+ * a separate thread writes it out. If the queue is full the configured
+ * policy decides what gets dropped and every drop is counted and reported.
+ */
+
+#include "rpi-output-queue.hpp"
+
+// Complete frames are marked with end of frame flag, codec config
+// buffers carrying SPS/PPS and markers flagged as discontinuities,
+// e.g. end of sequence, are not counted as frames
+static int is_frame(output_queue_item *item)
+{
+    return (item->nFlags & OMX_BUFFERFLAG_ENDOFFRAME)
+        && !(item->nFlags & (OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_DISCONTINUITY));
+}
+
+static double elapsed(output_queue *q)
+{
+    return (double)(monotonic_time_us() - q->start_time) / 1000000.0;
+}
+
+// Caller must hold the lock
+static void release_item(output_queue *q, output_queue_item *item)
+{
+    item->len = 0;
+    item->nFlags = 0;
+    q->pool[q->pool_count++] = item;
+}
+
+static void *output_queue_writer(void *arg)
+{
+    output_queue *q = (output_queue *)arg;
+    output_queue_item *item;
+    output_queue_write_fn write_fn;
+    output_queue_written_fn written_fn;
+    void *write_arg, *written_arg;
+    size_t written;
+    ssize_t r;
+
+    pthread_mutex_lock(&q->lock);
+    while(1) {
+        while(q->count == 0 && !q->quit) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if(q->count == 0) {
+            break;
+        }
+        item = q->ring[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        q->items_taken++;
+        write_fn = q->write_fn;
+        write_arg = q->write_arg;
+        written_fn = q->written_fn;
+        written_arg = q->written_arg;
+        // Wake up the producer if it's blocking on a full queue
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        written = 0;
+        if(write_fn != NULL) {
+            written = write_fn(write_arg, q->fd, item);
+        } else {
+            while(written < item->len) {
+                if((r = write(q->fd, item->data + written, item->len - written)) < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    die("Failed to write to %s output: %s", q->name, strerror(errno));
+                }
+                written += r;
+            }
+        }
+        if(written_fn != NULL) {
+            written_fn(written_arg, item);
+        }
+
+        pthread_mutex_lock(&q->lock);
+        q->bytes_written += written;
+        if(is_frame(item)) {
+            q->frames_written++;
+        }
+        release_item(q, item);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+void output_queue_init(output_queue *q, const char *name, int fd, int capacity, size_t item_size, output_queue_policy policy)
+{
+    int i;
+
+    memset(q, 0, sizeof(*q));
+    q->name = name;
+    q->fd = fd;
+    q->policy = policy;
+    q->item_size = item_size;
+    q->capacity = capacity;
+    q->prev_end_of_frame = 1;
+    q->start_time = monotonic_time_us();
+
+    if(capacity < 1) {
+        die("Invalid %s output queue length %d", name, capacity);
+    }
+    q->ring = calloc(capacity, sizeof(output_queue_item *));
+    q->pool = calloc(capacity + 2, sizeof(output_queue_item *));
+    if(q->ring == NULL || q->pool == NULL) {
+        die("Failed to allocate %s output queue", name);
+    }
+    for(i = 0; i < capacity + 2; i++) {
+        output_queue_item *item = calloc(1, sizeof(output_queue_item));
+        if(item == NULL || (item->data = malloc(item_size)) == NULL) {
+            die("Failed to allocate %s output queue item of %d bytes", name, item_size);
+        }
+        q->pool[q->pool_count++] = item;
+    }
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    if(pthread_create(&q->writer, NULL, output_queue_writer, q) != 0) {
+        die("Failed to create %s output writer thread", name);
+    }
+    say("Created %s output queue of %d items, %d bytes each", name, capacity, item_size);
+}
+
+void output_queue_set_writer(output_queue *q, output_queue_write_fn fn, void *arg)
+{
+    pthread_mutex_lock(&q->lock);
+    q->write_fn = fn;
+    q->write_arg = arg;
+    pthread_mutex_unlock(&q->lock);
+}
+
+void output_queue_set_written_hook(output_queue *q, output_queue_written_fn fn, void *arg)
+{
+    pthread_mutex_lock(&q->lock);
+    q->written_fn = fn;
+    q->written_arg = arg;
+    pthread_mutex_unlock(&q->lock);
+}
+
+output_queue_item *output_queue_acquire(output_queue *q)
+{
+    output_queue_item *item;
+    pthread_mutex_lock(&q->lock);
+    if(q->pool_count == 0) {
+        die("No free items in %s output queue, only one item can be acquired at a time", q->name);
+    }
+    item = q->pool[--q->pool_count];
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+static int commit_item(output_queue *q, output_queue_item *item, output_queue_policy policy)
+{
+    int queued = 1, start_of_frame;
+    unsigned long retracted;
+    output_queue_item *victim;
+
+    pthread_mutex_lock(&q->lock);
+    if(is_frame(item)) {
+        q->frames_committed++;
+    }
+    // Track the frame boundaries whatever the policy of this commit, so that
+    // items pushed with OUTPUT_QUEUE_BLOCK don't leave stale state behind for
+    // the next OUTPUT_QUEUE_DROP_GOP commit
+    start_of_frame = q->prev_end_of_frame;
+    q->prev_end_of_frame = item->nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+    if(start_of_frame) {
+        q->frame_first_item = q->items_queued;
+    }
+    switch(policy) {
+        case OUTPUT_QUEUE_BLOCK:
+            while(q->count == q->capacity) {
+                pthread_cond_wait(&q->cond, &q->lock);
+            }
+            break;
+        case OUTPUT_QUEUE_DROP_GOP:
+            // Resume at the first buffer of a key frame (or the stream
+            // headers preceding it) once the writer has caught up
+            if(q->dropping && start_of_frame
+                    && (item->nFlags & (OMX_BUFFERFLAG_SYNCFRAME | OMX_BUFFERFLAG_CODECCONFIG))
+                    && q->count < q->capacity) {
+                say("%s output queue resumed at %.3fs, timestamp %lld, %lu frames dropped",
+                    q->name, elapsed(q), (long long)item->timestamp, q->drop_span_frames);
+                q->dropping = 0;
+            }
+            if(!q->dropping && q->count == q->capacity && q->items_taken > q->frame_first_item) {
+                // The writer has already started on this frame, so it has
+                // to be finished for the output to stay decodable
+                while(q->count == q->capacity) {
+                    pthread_cond_wait(&q->cond, &q->lock);
+                }
+            }
+            if(!q->dropping && q->count == q->capacity) {
+                // Take back the leading buffers of this frame still queued
+                // so that no truncated access unit gets written
+                retracted = q->items_queued - q->frame_first_item;
+                while(q->items_queued > q->frame_first_item) {
+                    q->count--;
+                    q->items_queued--;
+                    release_item(q, q->ring[(q->head + q->count) % q->capacity]);
+                }
+                say("%s output queue full at %.3fs, timestamp %lld, dropping until next key frame, %lu buffers taken back",
+                    q->name, elapsed(q), (long long)item->timestamp, retracted);
+                q->dropping = 1;
+                q->drop_span_frames = 0;
+                q->drop_events++;
+            }
+            if(q->dropping) {
+                if(is_frame(item)) {
+                    q->frames_dropped++;
+                    q->drop_span_frames++;
+                }
+                release_item(q, item);
+                item = NULL;
+                queued = 0;
+            }
+            break;
+        case OUTPUT_QUEUE_DROP_OLDEST:
+            if(q->count == q->capacity) {
+                victim = q->ring[q->head];
+                q->head = (q->head + 1) % q->capacity;
+                q->count--;
+                q->items_taken++;
+                say("%s output queue full at %.3fs, dropped oldest frame, timestamp %lld",
+                    q->name, elapsed(q), (long long)victim->timestamp);
+                if(is_frame(victim)) {
+                    q->frames_dropped++;
+                }
+                q->drop_events++;
+                release_item(q, victim);
+                queued = 0;
+            }
+            break;
+        case OUTPUT_QUEUE_DROP_NEWEST:
+            if(q->count == q->capacity) {
+                say("%s output queue full at %.3fs, dropped newest frame, timestamp %lld",
+                    q->name, elapsed(q), (long long)item->timestamp);
+                if(is_frame(item)) {
+                    q->frames_dropped++;
+                }
+                q->drop_events++;
+                release_item(q, item);
+                item = NULL;
+                queued = 0;
+            }
+            break;
+    }
+    if(item != NULL) {
+        q->ring[(q->head + q->count) % q->capacity] = item;
+        q->count++;
+        q->items_queued++;
+        if(q->count > q->max_count) {
+            q->max_count = q->count;
+        }
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return queued;
+}
+
+int output_queue_commit(output_queue *q, output_queue_item *item)
+{
+    return commit_item(q, item, q->policy);
+}
+
+void output_queue_discard(output_queue *q, output_queue_item *item)
+{
+    pthread_mutex_lock(&q->lock);
+    release_item(q, item);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int output_queue_push(output_queue *q, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp)
+{
+    output_queue_item *item = output_queue_acquire(q);
+    if(len > q->item_size) {
+        die("Data of %d bytes doesn't fit in %s output queue item of %d bytes", len, q->name, q->item_size);
+    }
+    memcpy(item->data, data, len);
+    item->len = len;
+    item->nFlags = nFlags;
+    item->timestamp = timestamp;
+    return output_queue_commit(q, item);
+}
+
+void output_queue_push_wait(output_queue *q, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp)
+{
+    output_queue_item *item = output_queue_acquire(q);
+    if(len > q->item_size) {
+        die("Data of %d bytes doesn't fit in %s output queue item of %d bytes", len, q->name, q->item_size);
+    }
+    memcpy(item->data, data, len);
+    item->len = len;
+    item->nFlags = nFlags;
+    item->timestamp = timestamp;
+    commit_item(q, item, OUTPUT_QUEUE_BLOCK);
+}
+
+void output_queue_destroy(output_queue *q)
+{
+    int i;
+
+    pthread_mutex_lock(&q->lock);
+    q->quit = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    pthread_join(q->writer, NULL);
+
+    dump_output_queue_stats(q);
+
+    for(i = 0; i < q->pool_count; i++) {
+        free(q->pool[i]->data);
+        free(q->pool[i]);
+    }
+    free(q->pool);
+    free(q->ring);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
+
+void dump_output_queue_stats(output_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    say("%s output queue stats after %.3fs:\n"
+        "\tFrames committed:\t%lu\n"
+        "\tFrames written:\t\t%lu\n"
+        "\tFrames dropped:\t\t%lu\n"
+        "\tDrop events:\t\t%lu\n"
+        "\tBytes written:\t\t%llu\n"
+        "\tMax queue depth:\t%d/%d\n",
+        q->name, elapsed(q),
+        q->frames_committed, q->frames_written, q->frames_dropped,
+        q->drop_events, q->bytes_written, q->max_count, q->capacity);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+/*
+ * Bounded output queue drained by a writer thread
+ */
+#include <pthread.h>
+
+#include "rpi-omx-utils.hpp"
+
+// What to do when the queue is full and a new item is committed
+typedef enum
+{
+    // Wait for the writer thread, i.e. the old stalling behaviour
+    OUTPUT_QUEUE_BLOCK,
+    // Encoded streams: drop the frame being committed, including its
+    // buffers still queued, and everything after it until the start of
+    // the next key frame
+    OUTPUT_QUEUE_DROP_GOP,
+    // Raw frames: drop the oldest queued frame to make room
+    OUTPUT_QUEUE_DROP_OLDEST,
+    // Raw frames: drop the frame being committed
+    OUTPUT_QUEUE_DROP_NEWEST
+} output_queue_policy;
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    // OMX_BUFFERFLAG_DISCONTINUITY marks items that aren't part of any frame
+    OMX_U32 nFlags;
+    int64_t timestamp;
+} output_queue_item;
+
+// Writes out an item instead of plain write(2), returns the number of bytes written
+typedef size_t (*output_queue_write_fn)(void *arg, int fd, const output_queue_item *item);
+// Called by the writer thread after an item has been written
+typedef void (*output_queue_written_fn)(void *arg, const output_queue_item *item);
+
+typedef struct
+{
+    const char *name;
+    int fd;
+    output_queue_policy policy;
+    size_t item_size;
+    output_queue_write_fn write_fn;
+    void *write_arg;
+    output_queue_written_fn written_fn;
+    void *written_arg;
+
+    // Ring of items waiting to be written, capacity slots
+    output_queue_item **ring;
+    int capacity;
+    int head;
+    int count;
+    // Free items, capacity + 2 items in total so that there's always
+    // one for the writer thread and one for the producer to fill
+    output_queue_item **pool;
+    int pool_count;
+
+    // GOP dropping state, the items are numbered in the order they're
+    // queued so that the queued part of the current frame can be found
+    int dropping;
+    int prev_end_of_frame;
+    unsigned long items_queued;
+    unsigned long items_taken;
+    unsigned long frame_first_item;
+    unsigned long drop_span_frames;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+    int quit;
+    int64_t start_time;
+
+    // Counters
+    unsigned long frames_committed;
+    unsigned long frames_written;
+    unsigned long frames_dropped;
+    unsigned long drop_events;
+    unsigned long long bytes_written;
+    int max_count;
+} output_queue;
+
+extern void output_queue_init(output_queue *q, const char *name, int fd, int capacity, size_t item_size, output_queue_policy policy);
+// Use fn for writing the items, must be set before the first commit
+extern void output_queue_set_writer(output_queue *q, output_queue_write_fn fn, void *arg);
+// Call fn after each item has been written, e.g. for latency measurements
+extern void output_queue_set_written_hook(output_queue *q, output_queue_written_fn fn, void *arg);
+// Get an empty item to be filled by the producer, never blocks
+extern output_queue_item *output_queue_acquire(output_queue *q);
+// Queue the filled item for writing, applies the drop policy if the queue is
+// full. Returns 1 if the item was queued and 0 if it or an older item was dropped.
+extern int output_queue_commit(output_queue *q, output_queue_item *item);
+// Return an acquired item without writing it
+extern void output_queue_discard(output_queue *q, output_queue_item *item);
+// Copy the data to a new item and commit it
+extern int output_queue_push(output_queue *q, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp);
+// Same as above but wait for the writer instead of applying the drop policy
+extern void output_queue_push_wait(output_queue *q, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp);
+// Write out everything still queued, stop the writer thread and free the items
+extern void output_queue_destroy(output_queue *q);
+extern void dump_output_queue_stats(output_queue *q);
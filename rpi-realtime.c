@@ -0,0 +1,118 @@
+/*
+ * CPU affinity, real-time scheduling and scheduling jitter statistics
+ *
+ * The capture and encoding loops poll for the buffers filled by the OMX
+ * components. Any time the loop isn't running when a buffer arrives delays
+ * returning the buffer, so the loop can be pinned to a core of its own and
+ * run under SCHED_FIFO, and the delays are collected in to a histogram.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "rpi-realtime.hpp"
+
+void lock_memory(void)
+{
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        die("Failed to lock memory: %s", strerror(errno));
+    }
+    say("Locked all current and future pages in memory");
+}
+
+void set_thread_cpu(pthread_t thread, const char *name, int cpu)
+{
+    cpu_set_t cpus;
+    int r;
+    if(cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if((r = pthread_setaffinity_np(thread, sizeof(cpus), &cpus)) != 0) {
+        die("Failed to pin %s thread to CPU %d: %s", name, cpu, strerror(r));
+    }
+    say("Pinned %s thread to CPU %d", name, cpu);
+}
+
+void set_thread_fifo_priority(const char *name, int priority)
+{
+    struct sched_param param;
+    int r;
+    if(priority == 0) {
+        return;
+    }
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if((r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0) {
+        die("Failed to set SCHED_FIFO priority %d for %s thread: %s", priority, name, strerror(r));
+    }
+    say("Running %s thread under SCHED_FIFO with priority %d", name, priority);
+}
+
+void dump_thread_rusage(const char *name)
+{
+    struct rusage usage;
+    if(getrusage(RUSAGE_THREAD, &usage) != 0) {
+        die("Failed to get resource usage of %s thread: %s", name, strerror(errno));
+    }
+    say("%s thread resource usage:\n"
+        "\tVoluntary context switches:\t%ld\n"
+        "\tInvoluntary context switches:\t%ld\n"
+        "\tMinor page faults:\t\t%ld\n"
+        "\tMajor page faults:\t\t%ld\n",
+        name, usage.ru_nvcsw, usage.ru_nivcsw, usage.ru_minflt, usage.ru_majflt);
+}
+
+void jitter_stats_init(jitter_stats *js, const char *name, int64_t late_us)
+{
+    memset(js, 0, sizeof(*js));
+    js->name = name;
+    js->late_us = late_us;
+}
+
+void jitter_stats_add(jitter_stats *js, int64_t delay_us)
+{
+    static const int64_t bounds[JITTER_BUCKETS - 1] = JITTER_BUCKET_BOUNDS;
+    int i;
+    for(i = 0; i < JITTER_BUCKETS - 1 && delay_us > bounds[i]; i++);
+    js->buckets[i]++;
+    js->count++;
+    js->total_us += delay_us;
+    if(delay_us > js->max_us) {
+        js->max_us = delay_us;
+    }
+    if(js->late_us > 0 && delay_us > js->late_us) {
+        js->late++;
+        say("%s buffer %lu picked up %lld us after the callback", js->name, js->count, (long long)delay_us);
+    }
+}
+
+void dump_jitter_stats(jitter_stats *js)
+{
+    static const int64_t bounds[JITTER_BUCKETS - 1] = JITTER_BUCKET_BOUNDS;
+    char histogram[JITTER_BUCKETS * 48];
+    size_t len = 0;
+    int i;
+    for(i = 0; i < JITTER_BUCKETS; i++) {
+        if(i < JITTER_BUCKETS - 1) {
+            len += snprintf(histogram + len, sizeof(histogram) - len, "\t<= %lld us:\t\t%lu\n",
+                (long long)bounds[i], js->buckets[i]);
+        } else {
+            len += snprintf(histogram + len, sizeof(histogram) - len, "\t> %lld us:\t\t%lu\n",
+                (long long)bounds[i - 1], js->buckets[i]);
+        }
+    }
+    say("%s buffer scheduling jitter:\n"
+        "\tBuffers:\t\t%lu\n"
+        "\tAverage:\t\t%lld us\n"
+        "\tMaximum:\t\t%lld us\n"
+        "\tLate:\t\t\t%lu\n"
+        "%s",
+        js->name, js->count,
+        (long long)(js->count > 0 ? js->total_us / (int64_t)js->count : 0),
+        (long long)js->max_us, js->late, histogram);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+/*
+ * CPU affinity, real-time scheduling and scheduling jitter statistics
+ */
+#include <pthread.h>
+
+#include "rpi-omx-utils.hpp"
+
+// Upper bounds of the jitter histogram buckets in microseconds, the last
+// bucket collects everything above
+#define JITTER_BUCKET_BOUNDS            { 50, 200, 1000, 5000, 20000 }
+#define JITTER_BUCKETS                  6
+
+typedef struct
+{
+    const char *name;
+    // Each delay longer than this is reported as it happens
+    int64_t late_us;
+    unsigned long count;
+    unsigned long late;
+    int64_t total_us;
+    int64_t max_us;
+    unsigned long buckets[JITTER_BUCKETS];
+} jitter_stats;
+
+// Lock all current and future pages in memory
+extern void lock_memory(void);
+// Pin the thread to the CPU core unless cpu is negative
+extern void set_thread_cpu(pthread_t thread, const char *name, int cpu);
+// Switch the calling thread to SCHED_FIFO unless priority is 0
+extern void set_thread_fifo_priority(const char *name, int priority);
+// Context switches and page faults of the calling thread so far
+extern void dump_thread_rusage(const char *name);
+
+extern void jitter_stats_init(jitter_stats *js, const char *name, int64_t late_us);
+// Delay from the buffer done callback to the buffer being picked up
+extern void jitter_stats_add(jitter_stats *js, int64_t delay_us);
+extern void dump_jitter_stats(jitter_stats *js);
@@ -0,0 +1,457 @@
+/*
+ * Serving an encoded stream to local clients over a Unix domain socket
+ *
+ * Each encoder buffer is copied once in to a reference counted chunk which
+ * is then queued to every connected client. A server thread sends the
+ * queued chunks with non-blocking gathering writes, so a stuck client
+ * never holds up the encoder or the other clients. A client whose queue
+ * fills up drops everything until the next key frame, without sending the
+ * frame it was in the middle of truncated. Joining clients are
+ * sent the latest stream headers and the GOP so far, so that they can start
+ * decoding right away.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rpi-stream-server.hpp"
+
+// Chunks gathered in to a single sendmsg(2) call
+#define SEND_BATCH 64
+
+// Complete frames are marked with end of frame flag, codec config
+// buffers carrying SPS/PPS and markers flagged as discontinuities,
+// e.g. end of sequence, are not counted as frames
+static int is_frame(OMX_U32 nFlags)
+{
+    return (nFlags & OMX_BUFFERFLAG_ENDOFFRAME)
+        && !(nFlags & (OMX_BUFFERFLAG_CODECCONFIG | OMX_BUFFERFLAG_DISCONTINUITY));
+}
+
+static stream_chunk *chunk_ref(stream_chunk *chunk)
+{
+    chunk->refs++;
+    return chunk;
+}
+
+static void chunk_unref(stream_chunk *chunk)
+{
+    if(--chunk->refs == 0) {
+        free(chunk);
+    }
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        die("Failed to make file descriptor %d non-blocking: %s", fd, strerror(errno));
+    }
+}
+
+// All of the functions below are called with the lock held
+
+static void client_enqueue(stream_client *c, stream_chunk *chunk)
+{
+    c->ring[(c->head + c->count) % c->capacity] = chunk_ref(chunk);
+    c->count++;
+    c->chunks_queued++;
+}
+
+static void client_enqueue_config(stream_server *srv, stream_client *c)
+{
+    int i;
+    c->frame_first_chunk = c->chunks_queued;
+    for(i = 0; i < srv->config_count; i++) {
+        client_enqueue(c, srv->config[i]);
+    }
+    c->need_config = 0;
+}
+
+// Live chunks are limited to queue_length on top of what's left of the
+// headers and the GOP queued on join
+static int client_limit(stream_server *srv, stream_client *c)
+{
+    return srv->queue_length + (c->backlog_end > c->chunks_sent ? (int)(c->backlog_end - c->chunks_sent) : 0);
+}
+
+// Some of the current frame has been written to the socket already
+static int client_frame_started(stream_client *c)
+{
+    return c->chunks_sent > c->frame_first_chunk
+        || (c->chunks_sent == c->frame_first_chunk && c->offset > 0);
+}
+
+static void client_push(stream_server *srv, stream_client *c, stream_chunk *chunk, int start_of_frame)
+{
+    unsigned long retracted;
+
+    if(c->overflowed) {
+        return;
+    }
+    if(start_of_frame) {
+        c->frame_first_chunk = c->chunks_queued;
+    }
+    // Resume at the first buffer of a key frame or the stream headers
+    // preceding it once there's room for them
+    if(c->dropping && start_of_frame
+            && (chunk->nFlags & (OMX_BUFFERFLAG_SYNCFRAME | OMX_BUFFERFLAG_CODECCONFIG))
+            && c->count + srv->config_count < client_limit(srv, c)) {
+        say("Stream client %lu resumed at timestamp %lld", c->id, (long long)chunk->timestamp);
+        c->dropping = 0;
+        if(c->need_config && !(chunk->nFlags & OMX_BUFFERFLAG_CODECCONFIG)) {
+            client_enqueue_config(srv, c);
+        }
+    }
+    // A frame partly written already has to be finished for the stream to
+    // stay decodable, dropping starts from the next frame boundary instead
+    if(!c->dropping && c->count >= client_limit(srv, c) && (start_of_frame || !client_frame_started(c))) {
+        // Take back the leading chunks of this frame still queued so that
+        // no truncated access unit gets sent
+        retracted = c->chunks_queued - c->frame_first_chunk;
+        while(c->chunks_queued > c->frame_first_chunk) {
+            c->count--;
+            c->chunks_queued--;
+            chunk_unref(c->ring[(c->head + c->count) % c->capacity]);
+        }
+        say("Stream client %lu queue full at timestamp %lld, dropping until next key frame, %lu buffers taken back",
+            c->id, (long long)chunk->timestamp, retracted);
+        c->dropping = 1;
+        c->drop_events++;
+    }
+    if(!c->dropping && c->count == c->capacity) {
+        // Only when a single frame takes about as many buffers as the GOP
+        // cache, the client can't be served a decodable stream then
+        if(!c->overflowed) {
+            say("Stream client %lu queue overflowed in the middle of a frame at timestamp %lld",
+                c->id, (long long)chunk->timestamp);
+        }
+        c->overflowed = 1;
+        return;
+    }
+    if(c->dropping) {
+        // A client still waiting for its first key frame hasn't lost anything
+        if(!c->need_config && is_frame(chunk->nFlags)) {
+            c->frames_dropped++;
+        }
+        return;
+    }
+    client_enqueue(c, chunk);
+    if(chunk->nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+        c->need_config = 0;
+    }
+}
+
+static void release_gop(stream_server *srv)
+{
+    int i;
+    for(i = 0; i < srv->gop_count; i++) {
+        chunk_unref(srv->gop[i]);
+    }
+    srv->gop_count = 0;
+}
+
+static void disconnect_client(stream_server *srv, int i, const char *reason)
+{
+    stream_client *c = srv->clients[i];
+    say("Stream client %lu %s after %.1fs, %llu bytes sent, %lu frames dropped in %lu drop events",
+        c->id, reason, (double)(monotonic_time_us() - c->connected) / 1000000.0,
+        c->bytes_sent, c->frames_dropped, c->drop_events);
+    while(c->count > 0) {
+        chunk_unref(c->ring[c->head]);
+        c->head = (c->head + 1) % c->capacity;
+        c->count--;
+    }
+    close(c->fd);
+    free(c->ring);
+    free(c);
+    srv->clients[i] = srv->clients[--srv->client_count];
+}
+
+static void accept_client(stream_server *srv)
+{
+    stream_client *c;
+    int fd, i;
+
+    if((fd = accept(srv->listen_fd, NULL, NULL)) < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            say("Failed to accept stream client: %s", strerror(errno));
+        }
+        return;
+    }
+    if(srv->client_count == STREAM_SERVER_MAX_CLIENTS) {
+        say("Rejected stream client, already serving %d clients", srv->client_count);
+        srv->clients_rejected++;
+        close(fd);
+        return;
+    }
+    set_nonblocking(fd);
+    if((c = calloc(1, sizeof(stream_client))) == NULL) {
+        die("Failed to allocate stream client");
+    }
+    c->fd = fd;
+    c->id = ++srv->clients_total;
+    c->connected = monotonic_time_us();
+    c->capacity = srv->queue_length + srv->gop_capacity + STREAM_SERVER_MAX_CONFIG;
+    if((c->ring = calloc(c->capacity, sizeof(stream_chunk *))) == NULL) {
+        die("Failed to allocate stream client queue of %d buffers", c->capacity);
+    }
+    if(srv->gop_valid) {
+        client_enqueue_config(srv, c);
+        for(i = 0; i < srv->gop_count; i++) {
+            if(i == 0 || (srv->gop[i - 1]->nFlags & OMX_BUFFERFLAG_ENDOFFRAME)) {
+                c->frame_first_chunk = c->chunks_queued;
+            }
+            client_enqueue(c, srv->gop[i]);
+        }
+        c->backlog_end = c->chunks_queued;
+        say("Stream client %lu connected, sending headers and %d buffers of the current GOP", c->id, srv->gop_count);
+    } else {
+        c->dropping = 1;
+        c->need_config = 1;
+        say("Stream client %lu connected, waiting for the next key frame", c->id);
+    }
+    srv->clients[srv->client_count++] = c;
+}
+
+// Send as much of the queue as the socket takes without blocking
+static int send_client(stream_client *c)
+{
+    struct iovec iov[SEND_BATCH];
+    struct msghdr msg;
+    stream_chunk *chunk;
+    size_t remaining;
+    ssize_t r;
+    int i, n = c->count < SEND_BATCH ? c->count : SEND_BATCH;
+
+    for(i = 0; i < n; i++) {
+        chunk = c->ring[(c->head + i) % c->capacity];
+        iov[i].iov_base = chunk->data + (i == 0 ? c->offset : 0);
+        iov[i].iov_len = chunk->len - (i == 0 ? c->offset : 0);
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    if((r = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    c->bytes_sent += r;
+    while(c->count > 0) {
+        chunk = c->ring[c->head];
+        remaining = chunk->len - c->offset;
+        if((size_t)r < remaining) {
+            c->offset += r;
+            break;
+        }
+        r -= remaining;
+        chunk_unref(chunk);
+        c->head = (c->head + 1) % c->capacity;
+        c->count--;
+        c->chunks_sent++;
+        c->offset = 0;
+    }
+    return 0;
+}
+
+static void *stream_server_thread(void *arg)
+{
+    stream_server *srv = (stream_server *)arg;
+    struct pollfd fds[2 + STREAM_SERVER_MAX_CLIENTS];
+    stream_client *c;
+    char buf[256];
+    ssize_t r;
+    int nfds, i;
+
+    pthread_mutex_lock(&srv->lock);
+    while(!srv->quit) {
+        fds[0].fd = srv->wake_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = srv->listen_fd;
+        fds[1].events = POLLIN;
+        for(i = 0; i < srv->client_count; i++) {
+            fds[2 + i].fd = srv->clients[i]->fd;
+            fds[2 + i].events = POLLIN | (srv->clients[i]->count > 0 ? POLLOUT : 0);
+        }
+        nfds = 2 + srv->client_count;
+        pthread_mutex_unlock(&srv->lock);
+
+        if(poll(fds, nfds, -1) < 0) {
+            if(errno != EINTR) {
+                die("Failed to poll stream server sockets: %s", strerror(errno));
+            }
+            fds[0].revents = fds[1].revents = 0;
+            for(i = 2; i < nfds; i++) {
+                fds[i].revents = 0;
+            }
+        }
+
+        pthread_mutex_lock(&srv->lock);
+        if(fds[0].revents & POLLIN) {
+            while(read(srv->wake_pipe[0], buf, sizeof(buf)) > 0);
+        }
+        // Only this thread adds and removes clients, going backwards the
+        // client moved in place of a removed one has been handled already
+        for(i = nfds - 3; i >= 0; i--) {
+            c = srv->clients[i];
+            if(c->overflowed) {
+                disconnect_client(srv, i, "overflowed");
+                continue;
+            }
+            // Clients aren't expected to send anything, just notice hang ups
+            if(fds[2 + i].revents & POLLIN) {
+                r = read(c->fd, buf, sizeof(buf));
+                if(r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    disconnect_client(srv, i, "disconnected");
+                    continue;
+                }
+            }
+            if(fds[2 + i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                disconnect_client(srv, i, "disconnected");
+                continue;
+            }
+            if(c->count > 0 && (fds[2 + i].revents & POLLOUT) && send_client(c) < 0) {
+                disconnect_client(srv, i, "failed");
+            }
+        }
+        if(fds[1].revents & POLLIN) {
+            accept_client(srv);
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    return NULL;
+}
+
+void stream_server_init(stream_server *srv, const char *path, int queue_length, int gop_length)
+{
+    struct sockaddr_un addr;
+
+    memset(srv, 0, sizeof(*srv));
+    srv->path = path;
+    srv->queue_length = queue_length;
+    srv->gop_capacity = gop_length;
+    srv->prev_end_of_frame = 1;
+    if(queue_length < 1 || gop_length < 1) {
+        die("Invalid stream server queue length %d or GOP length %d", queue_length, gop_length);
+    }
+    if((srv->gop = calloc(gop_length, sizeof(stream_chunk *))) == NULL) {
+        die("Failed to allocate stream server GOP cache");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        die("Stream server socket path %s is too long", path);
+    }
+    strcpy(addr.sun_path, path);
+    // Remove the socket left behind by an earlier run
+    unlink(path);
+    if((srv->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        die("Failed to create stream server socket: %s", strerror(errno));
+    }
+    if(bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        die("Failed to bind stream server socket to %s: %s", path, strerror(errno));
+    }
+    if(listen(srv->listen_fd, STREAM_SERVER_MAX_CLIENTS) < 0) {
+        die("Failed to listen on stream server socket %s: %s", path, strerror(errno));
+    }
+    set_nonblocking(srv->listen_fd);
+    if(pipe(srv->wake_pipe) < 0) {
+        die("Failed to create stream server wake up pipe: %s", strerror(errno));
+    }
+    set_nonblocking(srv->wake_pipe[0]);
+    set_nonblocking(srv->wake_pipe[1]);
+
+    pthread_mutex_init(&srv->lock, NULL);
+    if(pthread_create(&srv->thread, NULL, stream_server_thread, srv) != 0) {
+        die("Failed to create stream server thread");
+    }
+    say("Serving stream on %s, %d buffers queued per client at most", path, queue_length);
+}
+
+void stream_server_push(stream_server *srv, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp)
+{
+    stream_chunk *chunk;
+    int i, start_of_frame, clients;
+
+    if((chunk = malloc(sizeof(stream_chunk) + len)) == NULL) {
+        die("Failed to allocate stream buffer of %d bytes", len);
+    }
+    chunk->refs = 1;
+    chunk->len = len;
+    chunk->nFlags = nFlags;
+    chunk->timestamp = timestamp;
+    memcpy(chunk->data, data, len);
+
+    pthread_mutex_lock(&srv->lock);
+    start_of_frame = srv->prev_end_of_frame;
+    srv->prev_end_of_frame = nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+    if(nFlags & OMX_BUFFERFLAG_CODECCONFIG) {
+        // A new set of headers replaces the cached one
+        if(!srv->prev_config) {
+            for(i = 0; i < srv->config_count; i++) {
+                chunk_unref(srv->config[i]);
+            }
+            srv->config_count = 0;
+        }
+        if(srv->config_count < STREAM_SERVER_MAX_CONFIG) {
+            srv->config[srv->config_count++] = chunk_ref(chunk);
+        }
+        srv->prev_config = 1;
+    } else {
+        srv->prev_config = 0;
+        if(start_of_frame && (nFlags & OMX_BUFFERFLAG_SYNCFRAME)) {
+            release_gop(srv);
+            srv->gop_valid = 1;
+        }
+        if(srv->gop_valid) {
+            if(srv->gop_count == srv->gop_capacity) {
+                say("GOP longer than %d buffers, joining stream clients wait for the next key frame", srv->gop_capacity);
+                release_gop(srv);
+                srv->gop_valid = 0;
+            } else {
+                srv->gop[srv->gop_count++] = chunk_ref(chunk);
+            }
+        }
+    }
+    for(i = 0; i < srv->client_count; i++) {
+        client_push(srv, srv->clients[i], chunk, start_of_frame);
+    }
+    clients = srv->client_count;
+    chunk_unref(chunk);
+    pthread_mutex_unlock(&srv->lock);
+
+    if(clients > 0 && write(srv->wake_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+        die("Failed to wake up stream server thread: %s", strerror(errno));
+    }
+}
+
+void stream_server_destroy(stream_server *srv)
+{
+    int i;
+
+    pthread_mutex_lock(&srv->lock);
+    srv->quit = 1;
+    pthread_mutex_unlock(&srv->lock);
+    if(write(srv->wake_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+        die("Failed to wake up stream server thread: %s", strerror(errno));
+    }
+    pthread_join(srv->thread, NULL);
+
+    while(srv->client_count > 0) {
+        disconnect_client(srv, srv->client_count - 1, "closed");
+    }
+    for(i = 0; i < srv->config_count; i++) {
+        chunk_unref(srv->config[i]);
+    }
+    release_gop(srv);
+    free(srv->gop);
+    close(srv->listen_fd);
+    close(srv->wake_pipe[0]);
+    close(srv->wake_pipe[1]);
+    unlink(srv->path);
+    pthread_mutex_destroy(&srv->lock);
+    say("Served %lu stream clients, %lu rejected", srv->clients_total, srv->clients_rejected);
+}
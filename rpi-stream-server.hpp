@@ -0,0 +1,94 @@
+#pragma once
+
+/*
+ * Serving an encoded stream to local clients over a Unix domain socket
+ */
+#include <pthread.h>
+
+#include "rpi-omx-utils.hpp"
+
+#define STREAM_SERVER_MAX_CLIENTS       16
+// Codec config buffers cached for the joining clients, i.e. SPS and PPS
+#define STREAM_SERVER_MAX_CONFIG        4
+
+// Encoder buffer shared by all the client queues
+typedef struct
+{
+    int refs;
+    size_t len;
+    OMX_U32 nFlags;
+    int64_t timestamp;
+    char data[];
+} stream_chunk;
+
+typedef struct
+{
+    int fd;
+    unsigned long id;
+    int64_t connected;
+    // Ring of chunks waiting to be sent, the first offset bytes of the
+    // head chunk have been sent already. Room for queue_length chunks
+    // besides the headers and the GOP sent on join.
+    stream_chunk **ring;
+    int capacity;
+    int head;
+    int count;
+    size_t offset;
+    // The chunks are numbered in the order they're queued so that the
+    // queued part of the current frame and the rest of the join backlog
+    // can be found
+    unsigned long chunks_queued;
+    unsigned long chunks_sent;
+    unsigned long frame_first_chunk;
+    unsigned long backlog_end;
+    // Dropping up to the next key frame
+    int dropping;
+    // The frame being sent didn't fit in the ring, disconnected by the server thread
+    int overflowed;
+    // Stream headers must be sent before the next key frame
+    int need_config;
+
+    // Counters
+    unsigned long long bytes_sent;
+    unsigned long frames_dropped;
+    unsigned long drop_events;
+} stream_client;
+
+typedef struct
+{
+    const char *path;
+    int listen_fd;
+    // Written by the producer to wake up the server thread
+    int wake_pipe[2];
+    int queue_length;
+
+    stream_client *clients[STREAM_SERVER_MAX_CLIENTS];
+    int client_count;
+
+    // Latest stream headers and the current GOP for the joining clients
+    stream_chunk *config[STREAM_SERVER_MAX_CONFIG];
+    int config_count;
+    int prev_config;
+    stream_chunk **gop;
+    int gop_count;
+    int gop_capacity;
+    int gop_valid;
+    int prev_end_of_frame;
+
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int quit;
+
+    // Counters
+    unsigned long clients_total;
+    unsigned long clients_rejected;
+} stream_server;
+
+// Listen on the socket at path, each client may have up to queue_length
+// buffers queued besides the GOP of at most gop_length buffers sent on join
+extern void stream_server_init(stream_server *srv, const char *path, int queue_length, int gop_length);
+// Queue an encoder buffer to all the clients, copied once and shared. A client
+// whose queue is full drops everything up to the next key frame.
+extern void stream_server_push(stream_server *srv, const void *data, size_t len, OMX_U32 nFlags, int64_t timestamp);
+// Disconnect the clients, stop the server thread and remove the socket
+extern void stream_server_destroy(stream_server *srv);
@@ -0,0 +1,142 @@
+/*
+ * Pool of threads unpacking camera buffers
+ *
+ * The camera fills the buffers of a frame one slice at a time and the
+ * slices land in disjoint parts of the frame, so they can be unpacked in
+ * any order on any core. Each worker returns its buffer to the camera
+ * right after copying it, which keeps the camera supplied with empty
+ * buffers while the other slices are still being copied. The capture loop
+ * only waits for the workers at the end of each frame before it's queued.
+ */
+
+#include "rpi-unpack-pool.hpp"
+
+static void *unpack_worker_thread(void *arg)
+{
+    unpack_worker *w = (unpack_worker *)arg;
+    unpack_pool *pool = w->pool;
+    unpack_job job;
+    OMX_ERRORTYPE r;
+    size_t bytes;
+    int64_t start;
+
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        while(pool->count == 0 && !pool->quit) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if(pool->count == 0) {
+            break;
+        }
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % UNPACK_POOL_MAX_JOBS;
+        pool->count--;
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+
+        start = monotonic_time_us();
+        bytes = pool->fn(pool->arg, job.buffer, job.slice_num, job.valid_spans_y);
+        if((r = OMX_FillThisBuffer(pool->component, job.buffer)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
+        }
+        w->busy_us += monotonic_time_us() - start;
+        w->slices++;
+        w->bytes += bytes;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->bytes += bytes;
+        pool->running--;
+        if(pool->count == 0 && pool->running == 0) {
+            pthread_cond_broadcast(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+void unpack_pool_init(unpack_pool *pool, int threads, OMX_HANDLETYPE component, unpack_pool_fn fn, void *arg)
+{
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    if(threads < 1 || threads > UNPACK_POOL_MAX_THREADS) {
+        die("Invalid number of unpack threads %d", threads);
+    }
+    pool->component = component;
+    pool->fn = fn;
+    pool->arg = arg;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for(i = 0; i < threads; i++) {
+        pool->workers[i].pool = pool;
+        if(pthread_create(&pool->workers[i].thread, NULL, unpack_worker_thread, &pool->workers[i]) != 0) {
+            die("Failed to create unpack thread");
+        }
+        pool->thread_count++;
+    }
+    pool->start_time = monotonic_time_us();
+    say("Unpacking camera buffers on %d threads", threads);
+}
+
+void unpack_pool_submit(unpack_pool *pool, OMX_BUFFERHEADERTYPE *buffer, int slice_num, int valid_spans_y)
+{
+    unpack_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->count == UNPACK_POOL_MAX_JOBS) {
+        die("More than %d camera buffers waiting to be unpacked", UNPACK_POOL_MAX_JOBS);
+    }
+    job = &pool->jobs[(pool->head + pool->count) % UNPACK_POOL_MAX_JOBS];
+    job->buffer = buffer;
+    job->slice_num = slice_num;
+    job->valid_spans_y = valid_spans_y;
+    pool->count++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t unpack_pool_drain(unpack_pool *pool)
+{
+    size_t bytes;
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->count > 0 || pool->running > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    bytes = pool->bytes;
+    pool->bytes = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    return bytes;
+}
+
+void unpack_pool_destroy(unpack_pool *pool)
+{
+    double elapsed = (double)(monotonic_time_us() - pool->start_time) / 1000000.0;
+    unpack_worker *w;
+    int i;
+
+    unpack_pool_drain(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    say("Unpack thread stats:");
+    for(i = 0; i < pool->thread_count; i++) {
+        w = &pool->workers[i];
+        say("\tThread %d:\t\t%lu slices, %.1f MB/s while busy, busy %.0f%%",
+            i, w->slices,
+            w->busy_us > 0 ? (double)w->bytes / w->busy_us : 0.0,
+            elapsed > 0 ? w->busy_us / elapsed / 10000.0 : 0.0);
+    }
+
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+}
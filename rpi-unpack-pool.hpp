@@ -0,0 +1,70 @@
+#pragma once
+
+/*
+ * Pool of threads unpacking camera buffers and handing each of them back
+ * to the camera as soon as its spans have been copied
+ */
+#include <pthread.h>
+
+#include "rpi-omx-utils.hpp"
+
+#define UNPACK_POOL_MAX_THREADS         4
+#define UNPACK_POOL_MAX_JOBS            16
+
+// Unpacks the slice_num:th slice of the current frame from the buffer,
+// returns the number of bytes written to the frame
+typedef size_t (*unpack_pool_fn)(void *arg, const OMX_BUFFERHEADERTYPE *buffer, int slice_num, int valid_spans_y);
+
+typedef struct
+{
+    OMX_BUFFERHEADERTYPE *buffer;
+    int slice_num;
+    int valid_spans_y;
+} unpack_job;
+
+struct unpack_pool;
+
+typedef struct
+{
+    struct unpack_pool *pool;
+    pthread_t thread;
+
+    // Counters
+    unsigned long slices;
+    unsigned long long bytes;
+    int64_t busy_us;
+} unpack_worker;
+
+typedef struct unpack_pool
+{
+    OMX_HANDLETYPE component;
+    unpack_pool_fn fn;
+    void *arg;
+
+    // Ring of buffers waiting for a worker
+    unpack_job jobs[UNPACK_POOL_MAX_JOBS];
+    int head;
+    int count;
+    // Jobs taken by the workers but not finished yet
+    int running;
+    // Bytes unpacked since the last drain
+    size_t bytes;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    unpack_worker workers[UNPACK_POOL_MAX_THREADS];
+    int thread_count;
+    int64_t start_time;
+} unpack_pool;
+
+// The buffers are handed back to component with OMX_FillThisBuffer
+extern void unpack_pool_init(unpack_pool *pool, int threads, OMX_HANDLETYPE component, unpack_pool_fn fn, void *arg);
+// Queue a buffer to be unpacked by the next free worker, never blocks as
+// long as no more than UNPACK_POOL_MAX_JOBS buffers are in flight
+extern void unpack_pool_submit(unpack_pool *pool, OMX_BUFFERHEADERTYPE *buffer, int slice_num, int valid_spans_y);
+// Wait until all the queued buffers have been unpacked and handed back,
+// returns the number of bytes unpacked since the previous drain
+extern size_t unpack_pool_drain(unpack_pool *pool);
+// Drain, stop the workers and report their throughput
+extern void unpack_pool_destroy(unpack_pool *pool);
@@ -6,6 +6,46 @@
 #define VIDEO_FRAMERATE                 25
 #define VIDEO_BITRATE                   10000000
 
+// Hard coded rate control and GOP parameters, 0 leaves the firmware default
+#define VIDEO_RATE_CONTROL              ENCODER_RATE_VBR        // encoder_rate_control
+#define VIDEO_QP_I                      0                       // ENCODER_RATE_CQP only
+#define VIDEO_QP_P                      0                       // ENCODER_RATE_CQP only
+#define VIDEO_MIN_QP                    0                       // 1 .. 51
+#define VIDEO_MAX_QP                    0                       // 1 .. 51
+#define VIDEO_IDR_PERIOD                0                       // frames
+#define VIDEO_PROFILE                   0                       // OMX_VIDEO_AVCPROFILETYPE
+#define VIDEO_LEVEL                     0                       // OMX_VIDEO_AVCLEVELTYPE
+#define VIDEO_INTRA_REFRESH_MBS         0                       // cyclic intra refresh macroblocks per frame
+
+typedef enum
+{
+    // Variable bitrate around the target
+    ENCODER_RATE_VBR = 0,
+    // Constant bitrate
+    ENCODER_RATE_CBR,
+    // Constant quantisers qp_i and qp_p, bitrate is ignored
+    ENCODER_RATE_CQP
+} encoder_rate_control;
+
+// Rate control and GOP structure of the encoder output port, zero fields
+// leave the firmware defaults in place
+typedef struct
+{
+    encoder_rate_control rate_control;
+    // Bits per second, 0 for the bitrate passed to the config function
+    OMX_U32 bitrate;
+    OMX_U32 qp_i;
+    OMX_U32 qp_p;
+    OMX_U32 min_qp;
+    OMX_U32 max_qp;
+    // Frames in between IDR frames
+    OMX_U32 idr_period;
+    OMX_U32 profile;
+    OMX_U32 level;
+    // Macroblocks refreshed per frame by cyclic intra refresh
+    OMX_U32 intra_refresh_mbs;
+} OmxEncoderConfig;
+
 typedef struct
 {
     OMX_HANDLETYPE encoder;
@@ -13,7 +53,21 @@ typedef struct
     OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out;
     int encoder_input_buffer_needed;
     int encoder_output_buffer_available;
+    // When the last output buffer was filled, CLOCK_MONOTONIC microseconds
+    int64_t encoder_output_buffer_time;
+    // OMX_EventBufferFlag with EOS has been received for the output port
+    int encoder_output_eos;
+    // Requested by the program and read back from the firmware after
+    // configuration, the firmware may round or ignore some of the values
+    OmxEncoderConfig config;
+    OmxEncoderConfig accepted;
 } OmxEncoderModule;
 
-extern void config_omx_encoder_out(OmxEncoderModule *encodermodule, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 stride, OMX_U32 bitrate);
-extern void config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 encbitrate);
+// The configuration functions report and return the first error
+extern OMX_ERRORTYPE config_omx_encoder_out(OmxEncoderModule *encodermodule, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 stride, OMX_U32 bitrate);
+extern OMX_ERRORTYPE config_omx_encoder_in_out(OmxEncoderModule *mod, OMX_U32 width, OMX_U32 height, OMX_U32 framerate, OMX_U32 encbitrate);
+// Fill in the hard coded VIDEO_* rate control and GOP parameters
+extern void default_omx_encoder_config(OmxEncoderConfig *config);
+extern void dump_omx_encoder_config(const char *message, const OmxEncoderConfig *config);
+// Slices of mb_rows_per_slice macroblock rows, each one in a buffer of its own
+extern OMX_ERRORTYPE config_omx_encoder_low_latency(OmxEncoderModule *mod, OMX_U32 mb_rows_per_slice);
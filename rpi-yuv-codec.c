@@ -0,0 +1,319 @@
+/*
+ * Lossless band codec of the compressed YUV dumps
+ *
+ * A band is coded row by row. The first row of a band is predicted from
+ * the left neighbour only so that the bands can be coded and decoded in
+ * parallel, the rest use the median of the left, upper and upper left
+ * neighbours. The residuals are zigzag mapped to bytes and Rice coded in
+ * groups of RICE_GROUP with a 3 bit parameter in front of each group.
+ * Residuals too large for the parameter are escaped and stored as is, so a
+ * band never grows much before it's stored raw instead.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "rpi-yuv-codec.hpp"
+
+#define RICE_GROUP      16
+// Quotient of an escaped residual
+#define RICE_ESCAPE     8
+
+typedef struct
+{
+    unsigned char *p;
+    uint64_t acc;
+    int bits;
+} bit_writer;
+
+typedef struct
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t acc;
+    int bits;
+    // Zero bytes loaded past the end
+    int padding;
+} bit_reader;
+
+// At most 16 bits at a time, flushed 32 bits at a time
+static inline void put_bits(bit_writer *w, uint32_t value, int n)
+{
+    w->acc |= (uint64_t)value << w->bits;
+    w->bits += n;
+    if(w->bits >= 32) {
+        w->p[0] = (unsigned char)w->acc;
+        w->p[1] = (unsigned char)(w->acc >> 8);
+        w->p[2] = (unsigned char)(w->acc >> 16);
+        w->p[3] = (unsigned char)(w->acc >> 24);
+        w->p += 4;
+        w->acc >>= 32;
+        w->bits -= 32;
+    }
+}
+
+static inline void flush_bits(bit_writer *w)
+{
+    while(w->bits > 0) {
+        *w->p++ = (unsigned char)w->acc;
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+}
+
+static inline void refill(bit_reader *r)
+{
+    while(r->bits <= 56) {
+        if(r->p < r->end) {
+            r->acc |= (uint64_t)*r->p++ << r->bits;
+        } else {
+            r->padding++;
+        }
+        r->bits += 8;
+    }
+}
+
+static inline uint32_t get_bits(bit_reader *r, int n)
+{
+    uint32_t value = (uint32_t)r->acc & ((1u << n) - 1);
+    r->acc >>= n;
+    r->bits -= n;
+    return value;
+}
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Median of a, b and a + b - c without branches
+static inline int median_edge(int a, int b, int c)
+{
+    return MAX(MIN(a, b), MIN(MAX(a, b), a + b - c));
+}
+
+static inline unsigned char zigzag(int residual)
+{
+    int d = (signed char)residual;
+    return (unsigned char)(((unsigned int)d << 1) ^ (d >> 7));
+}
+
+static inline int unzigzag(unsigned char v)
+{
+    return (v >> 1) ^ -(v & 1);
+}
+
+// Residuals of a row, up is NULL on the first row of a band
+static void predict_row(const unsigned char *row, const unsigned char *up, int width, int step, unsigned char *res)
+{
+    int x;
+
+    if(up == NULL) {
+        for(x = 0; x < step && x < width; x++) {
+            res[x] = zigzag(row[x] - 128);
+        }
+        for(; x < width; x++) {
+            res[x] = zigzag(row[x] - row[x - step]);
+        }
+    } else {
+        for(x = 0; x < step && x < width; x++) {
+            res[x] = zigzag(row[x] - up[x]);
+        }
+        for(; x < width; x++) {
+            res[x] = zigzag(row[x] - median_edge(row[x - step], up[x], up[x - step]));
+        }
+    }
+}
+
+static void reconstruct_row(unsigned char *row, const unsigned char *up, int width, int step, const unsigned char *res)
+{
+    int x;
+
+    if(up == NULL) {
+        for(x = 0; x < step && x < width; x++) {
+            row[x] = 128 + unzigzag(res[x]);
+        }
+        for(; x < width; x++) {
+            row[x] = row[x - step] + unzigzag(res[x]);
+        }
+    } else {
+        for(x = 0; x < step && x < width; x++) {
+            row[x] = up[x] + unzigzag(res[x]);
+        }
+        for(; x < width; x++) {
+            row[x] = median_edge(row[x - step], up[x], up[x - step]) + unzigzag(res[x]);
+        }
+    }
+}
+
+// Code of each residual for each Rice parameter, length in the upper 16 bits
+static uint32_t rice_codes[8][256];
+
+static void init_rice_codes(void)
+{
+    uint32_t v, q;
+    int k;
+
+    for(k = 0; k < 8; k++) {
+        for(v = 0; v < 256; v++) {
+            q = v >> k;
+            if(q < RICE_ESCAPE) {
+                rice_codes[k][v] = ((q + 1 + k) << 16) | ((1u << q) - 1) | ((v & ((1u << k) - 1)) << (q + 1));
+            } else {
+                rice_codes[k][v] = ((RICE_ESCAPE + 8) << 16) | ((1u << RICE_ESCAPE) - 1) | (v << RICE_ESCAPE);
+            }
+        }
+    }
+}
+
+static void encode_group(bit_writer *w, const unsigned char *res, int n)
+{
+    const uint32_t *codes;
+    uint32_t sum = 0;
+    int i, k;
+
+    for(i = 0; i < n; i++) {
+        sum += res[i];
+    }
+    // 2^k about the mean of the residuals
+    for(k = 0; k < 7 && ((uint32_t)n << (k + 1)) <= sum; k++);
+    put_bits(w, k, 3);
+    codes = rice_codes[k];
+    for(i = 0; i < n; i++) {
+        put_bits(w, codes[res[i]] & 0xffff, codes[res[i]] >> 16);
+    }
+}
+
+static void decode_group(bit_reader *r, unsigned char *res, int n)
+{
+    uint32_t q;
+    int i, k;
+
+    refill(r);
+    k = get_bits(r, 3);
+    for(i = 0; i < n; i++) {
+        if(r->bits < 32) {
+            refill(r);
+        }
+        q = __builtin_ctzll(~r->acc);
+        if(q < RICE_ESCAPE) {
+            get_bits(r, q + 1);
+            res[i] = (q << k) | get_bits(r, k);
+        } else {
+            get_bits(r, RICE_ESCAPE);
+            res[i] = get_bits(r, 8);
+        }
+    }
+}
+
+int yuv_codec_get_planes(const yuv_codec_frame_header *header, yuv_codec_plane *planes)
+{
+    int width = header->width, height = header->height, chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+    int i, count;
+
+    if(memcmp(header->fourcc, "I420", 4) == 0) {
+        planes[0] = (yuv_codec_plane){ 0, 0, width, height, 1 };
+        planes[1] = (yuv_codec_plane){ 0, 0, chroma_width, chroma_height, 1 };
+        planes[2] = (yuv_codec_plane){ 0, 0, chroma_width, chroma_height, 1 };
+        count = 3;
+    } else if(memcmp(header->fourcc, "NV12", 4) == 0) {
+        planes[0] = (yuv_codec_plane){ 0, 0, width, height, 1 };
+        planes[1] = (yuv_codec_plane){ 0, 0, chroma_width * 2, chroma_height, 2 };
+        count = 2;
+    } else if(memcmp(header->fourcc, "YUY2", 4) == 0) {
+        planes[0] = (yuv_codec_plane){ 0, 0, chroma_width * 4, height, 4 };
+        count = 1;
+    } else if(memcmp(header->fourcc, "GREY", 4) == 0) {
+        planes[0] = (yuv_codec_plane){ 0, 0, width, height, 1 };
+        count = 1;
+    } else {
+        return 0;
+    }
+    for(i = 0; i < count; i++) {
+        planes[i].offset = header->p_offset[i];
+        planes[i].stride = header->p_stride[i];
+    }
+    return count;
+}
+
+int yuv_codec_count_bands(const yuv_codec_plane *planes, int plane_count, int band_rows)
+{
+    int i, bands = 0;
+
+    for(i = 0; i < plane_count; i++) {
+        bands += (planes[i].rows + band_rows - 1) / band_rows;
+    }
+    return bands;
+}
+
+void yuv_codec_get_band(const yuv_codec_plane *planes, int plane_count, int band_rows, int band, int *plane, int *first_row, int *rows)
+{
+    int i, bands;
+
+    for(i = 0; i < plane_count - 1; i++) {
+        bands = (planes[i].rows + band_rows - 1) / band_rows;
+        if(band < bands) {
+            break;
+        }
+        band -= bands;
+    }
+    *plane = i;
+    *first_row = band * band_rows;
+    *rows = planes[i].rows - *first_row < band_rows ? planes[i].rows - *first_row : band_rows;
+}
+
+uint32_t yuv_codec_encode_band(const unsigned char *src, int stride, int width, int rows, int step, unsigned char *dst)
+{
+    unsigned char res[width];
+    const unsigned char *row, *up;
+    bit_writer w = { dst, 0, 0 };
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    size_t size;
+    int x, y;
+
+    pthread_once(&once, init_rice_codes);
+    for(y = 0; y < rows; y++) {
+        row = src + (size_t)y * stride;
+        up = y > 0 ? row - stride : NULL;
+        predict_row(row, up, width, step, res);
+        for(x = 0; x < width; x += RICE_GROUP) {
+            encode_group(&w, res + x, width - x < RICE_GROUP ? width - x : RICE_GROUP);
+        }
+    }
+    flush_bits(&w);
+    size = w.p - dst;
+
+    if(size >= (size_t)width * rows) {
+        for(y = 0; y < rows; y++) {
+            memcpy(dst + (size_t)y * width, src + (size_t)y * stride, width);
+        }
+        return YUV_CODEC_BAND_RAW | (uint32_t)(width * rows);
+    }
+    return (uint32_t)size;
+}
+
+int yuv_codec_decode_band(const unsigned char *src, uint32_t band_size, unsigned char *dst, int stride, int width, int rows, int step)
+{
+    unsigned char res[width];
+    unsigned char *row, *up;
+    bit_reader r = { src, src + (band_size & ~YUV_CODEC_BAND_RAW), 0, 0, 0 };
+    int x, y;
+
+    if(band_size & YUV_CODEC_BAND_RAW) {
+        if((band_size & ~YUV_CODEC_BAND_RAW) != (uint32_t)(width * rows)) {
+            return -1;
+        }
+        for(y = 0; y < rows; y++) {
+            memcpy(dst + (size_t)y * stride, src + (size_t)y * width, width);
+        }
+        return 0;
+    }
+    for(y = 0; y < rows; y++) {
+        row = dst + (size_t)y * stride;
+        up = y > 0 ? row - stride : NULL;
+        for(x = 0; x < width; x += RICE_GROUP) {
+            decode_group(&r, res + x, width - x < RICE_GROUP ? width - x : RICE_GROUP);
+        }
+        reconstruct_row(row, up, width, step, res);
+    }
+    // Anything taken from past the end means the band was cut short
+    return r.bits >= r.padding * 8 ? 0 : -1;
+}
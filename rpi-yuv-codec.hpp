@@ -0,0 +1,95 @@
+#pragma once
+
+/*
+ * Lossless compression of raw YUV frames and the container they're
+ * written in by rpi-camera-dump-yuv
+ *
+ * The planes are cut in to bands of rows compressed independently of each
+ * other. Each pixel is predicted from its neighbours with the median edge
+ * detector of LOCO-I and the residuals are Rice coded in groups of 16 with
+ * the parameter picked per group.
+ *
+ * The container is a sequence of frames, each a yuv_codec_frame_header
+ * followed by the compressed sizes of the bands and the bands themselves,
+ * ended by an index of the frames. The last 8 bytes of the file are the
+ * offset of the index. Everything is little endian.
+ *
+ * This header doesn't depend on the OpenMAX headers so that the decoder
+ * can be built on its own.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define YUV_CODEC_MAGIC         0x5a565559      // "YUVZ"
+#define YUV_CODEC_INDEX_MAGIC   0x49565559      // "YUVI"
+#define YUV_CODEC_VERSION       1
+// Set in the band size if the band is stored as is
+#define YUV_CODEC_BAND_RAW      0x80000000u
+
+// Upper bound of the compressed size of a band of rows x width bytes
+#define YUV_CODEC_BAND_BOUND(width, rows) ((size_t)(width) * (rows) * 3 + 64)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    // Pixel format as I420, NV12, YUY2 or GREY
+    char fourcc[4];
+    uint32_t width;
+    uint32_t height;
+    // Size of the raw frame, the padding between the rows isn't stored
+    uint32_t size;
+    // Y or packed YUV plane and U, V or interleaved UV planes
+    int32_t p_offset[3];
+    int32_t p_stride[3];
+    // Rows of a plane per band
+    uint32_t band_rows;
+    uint32_t band_count;
+    // Bytes of the band sizes and the bands following the header
+    uint32_t payload_size;
+    uint32_t frame_index;
+    // nTimeStamp of the camera buffer, microseconds
+    int64_t timestamp;
+} yuv_codec_frame_header;
+
+// At the offset given by the last 8 bytes of the file,
+// followed by frame_count entries
+typedef struct
+{
+    uint32_t magic;
+    uint32_t frame_count;
+} yuv_codec_index_header;
+
+typedef struct
+{
+    // Offset of the frame header from the start of the file
+    uint64_t offset;
+    int64_t timestamp;
+} yuv_codec_index_entry;
+
+// A plane of the frame as compressed, in bytes
+typedef struct
+{
+    int offset;
+    int stride;
+    int width;
+    int rows;
+    // Distance to the previous byte of the same component on a row
+    int step;
+} yuv_codec_plane;
+
+// Planes of the frame described by the header, returns their number
+// or 0 if the pixel format isn't known
+extern int yuv_codec_get_planes(const yuv_codec_frame_header *header, yuv_codec_plane *planes);
+// Number of bands of the planes with band_rows rows each
+extern int yuv_codec_count_bands(const yuv_codec_plane *planes, int plane_count, int band_rows);
+// Plane and first row of the nth band
+extern void yuv_codec_get_band(const yuv_codec_plane *planes, int plane_count, int band_rows, int band, int *plane, int *first_row, int *rows);
+
+// Compress rows x width bytes at src, returns the compressed size or
+// YUV_CODEC_BAND_RAW | size if it didn't get any smaller and was copied
+// as is. dst must hold YUV_CODEC_BAND_BOUND(width, rows) bytes.
+extern uint32_t yuv_codec_encode_band(const unsigned char *src, int stride, int width, int rows, int step, unsigned char *dst);
+// Decompress a band of the given band size, returns 0 on success and -1 if
+// the data is corrupted
+extern int yuv_codec_decode_band(const unsigned char *src, uint32_t band_size, unsigned char *dst, int stride, int width, int rows, int step);
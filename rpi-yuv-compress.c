@@ -0,0 +1,219 @@
+/*
+ * Lossless compression of raw frames on a pool of worker threads
+ *
+ * Runs as the writer of the output queue, so the capture loop only ever
+ * unpacks and commits frames as before. For each frame the writer thread
+ * hands out the bands of the planes to the workers, waits for all of them
+ * and writes out the frame header, the band sizes and the bands. The
+ * offsets of the frames are collected for the index written at the end.
+ */
+
+#include "rpi-yuv-compress.hpp"
+
+static void write_all(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    ssize_t r;
+
+    while(len > 0) {
+        if((r = write(fd, p, len)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            die("Failed to write compressed output: %s", strerror(errno));
+        }
+        p += r;
+        len -= r;
+    }
+}
+
+static void *yuv_compress_worker_thread(void *arg)
+{
+    yuv_compress_worker *w = (yuv_compress_worker *)arg;
+    yuv_compressor *c = w->c;
+    const yuv_codec_plane *plane;
+    int band, plane_num, first_row, rows;
+    int64_t start;
+
+    pthread_mutex_lock(&c->lock);
+    while(1) {
+        while(!c->quit && c->next_band >= c->band_count) {
+            pthread_cond_wait(&c->work, &c->lock);
+        }
+        if(c->quit) {
+            break;
+        }
+        band = c->next_band++;
+        pthread_mutex_unlock(&c->lock);
+
+        start = monotonic_time_us();
+        yuv_codec_get_band(c->planes, c->plane_count, c->header.band_rows, band, &plane_num, &first_row, &rows);
+        plane = &c->planes[plane_num];
+        c->band_sizes[band] = yuv_codec_encode_band(c->frame + plane->offset + (size_t)first_row * plane->stride,
+            plane->stride, plane->width, rows, plane->step, c->band_data[band]);
+        w->busy_us += monotonic_time_us() - start;
+        w->bands++;
+        w->bytes_in += (size_t)plane->width * rows;
+        w->bytes_out += c->band_sizes[band] & ~YUV_CODEC_BAND_RAW;
+
+        pthread_mutex_lock(&c->lock);
+        if(++c->bands_done == c->band_count) {
+            pthread_cond_signal(&c->done);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+void yuv_compressor_init(yuv_compressor *c, const yuv_output_info *info, int threads, int band_rows)
+{
+    int i, plane, first_row, rows;
+
+    memset(c, 0, sizeof(*c));
+    if(threads < 1 || threads > YUV_COMPRESS_MAX_THREADS) {
+        die("Invalid number of compression threads %d", threads);
+    }
+    c->header.magic = YUV_CODEC_MAGIC;
+    c->header.version = YUV_CODEC_VERSION;
+    memcpy(c->header.fourcc, get_yuv_output_fourcc(info->format), 4);
+    c->header.width = info->width;
+    c->header.height = info->height;
+    c->header.size = info->size;
+    for(i = 0; i < 3; i++) {
+        c->header.p_offset[i] = info->p_offset[i];
+        c->header.p_stride[i] = info->p_stride[i];
+    }
+    c->header.band_rows = band_rows;
+    c->plane_count = yuv_codec_get_planes(&c->header, c->planes);
+    c->band_count = yuv_codec_count_bands(c->planes, c->plane_count, band_rows);
+    c->header.band_count = c->band_count;
+
+    c->band_data = calloc(c->band_count, sizeof(unsigned char *));
+    c->band_sizes = calloc(c->band_count, sizeof(uint32_t));
+    if(c->band_data == NULL || c->band_sizes == NULL) {
+        die("Failed to allocate compressed bands");
+    }
+    for(i = 0; i < c->band_count; i++) {
+        yuv_codec_get_band(c->planes, c->plane_count, band_rows, i, &plane, &first_row, &rows);
+        if((c->band_data[i] = malloc(YUV_CODEC_BAND_BOUND(c->planes[plane].width, rows))) == NULL) {
+            die("Failed to allocate compressed band of %d rows", rows);
+        }
+    }
+
+    // Nothing to take until the first frame
+    c->next_band = c->band_count;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work, NULL);
+    pthread_cond_init(&c->done, NULL);
+    for(i = 0; i < threads; i++) {
+        c->workers[i].c = c;
+        if(pthread_create(&c->workers[i].thread, NULL, yuv_compress_worker_thread, &c->workers[i]) != 0) {
+            die("Failed to create compression thread");
+        }
+        c->thread_count++;
+    }
+    c->start_time = monotonic_time_us();
+    say("Compressing %.4s frames of %dx%d in %d bands of %d rows on %d threads",
+        c->header.fourcc, info->width, info->height, c->band_count, band_rows, threads);
+}
+
+size_t yuv_compressor_write(void *arg, int fd, const output_queue_item *item)
+{
+    yuv_compressor *c = (yuv_compressor *)arg;
+    size_t payload = 0;
+    int i;
+
+    if(item->len != c->header.size) {
+        die("Frame of %d bytes to compress doesn't match the frame size %d", item->len, c->header.size);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->frame = (const unsigned char *)item->data;
+    c->bands_done = 0;
+    c->next_band = 0;
+    pthread_cond_broadcast(&c->work);
+    while(c->bands_done < c->band_count) {
+        pthread_cond_wait(&c->done, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    for(i = 0; i < c->band_count; i++) {
+        payload += c->band_sizes[i] & ~YUV_CODEC_BAND_RAW;
+    }
+    payload += c->band_count * sizeof(uint32_t);
+    c->header.payload_size = payload;
+    c->header.frame_index = c->frames;
+    c->header.timestamp = item->timestamp;
+
+    if(c->frames == c->index_capacity) {
+        c->index_capacity = c->index_capacity > 0 ? c->index_capacity * 2 : 1024;
+        if((c->index = realloc(c->index, c->index_capacity * sizeof(yuv_codec_index_entry))) == NULL) {
+            die("Failed to allocate frame index of %d frames", c->index_capacity);
+        }
+    }
+    c->index[c->frames].offset = c->offset;
+    c->index[c->frames].timestamp = item->timestamp;
+
+    write_all(fd, &c->header, sizeof(c->header));
+    write_all(fd, c->band_sizes, c->band_count * sizeof(uint32_t));
+    for(i = 0; i < c->band_count; i++) {
+        write_all(fd, c->band_data[i], c->band_sizes[i] & ~YUV_CODEC_BAND_RAW);
+    }
+
+    c->frames++;
+    c->bytes_in += item->len;
+    c->bytes_out += sizeof(c->header) + payload;
+    c->offset += sizeof(c->header) + payload;
+    return sizeof(c->header) + payload;
+}
+
+void yuv_compressor_destroy(yuv_compressor *c, int fd)
+{
+    yuv_codec_index_header index;
+    double elapsed = (double)(monotonic_time_us() - c->start_time) / 1000000.0;
+    yuv_compress_worker *w;
+    int i;
+
+    index.magic = YUV_CODEC_INDEX_MAGIC;
+    index.frame_count = c->frames;
+    write_all(fd, &index, sizeof(index));
+    write_all(fd, c->index, c->frames * sizeof(yuv_codec_index_entry));
+    write_all(fd, &c->offset, sizeof(c->offset));
+
+    pthread_mutex_lock(&c->lock);
+    c->quit = 1;
+    pthread_cond_broadcast(&c->work);
+    pthread_mutex_unlock(&c->lock);
+    for(i = 0; i < c->thread_count; i++) {
+        pthread_join(c->workers[i].thread, NULL);
+    }
+
+    say("Compression stats:\n"
+        "\tFrames compressed:\t%lu\n"
+        "\tRaw bytes:\t\t%llu\n"
+        "\tCompressed bytes:\t%llu\n"
+        "\tCompression ratio:\t%.2f\n"
+        "\tRaw throughput:\t\t%.1f MB/s",
+        c->frames, c->bytes_in, c->bytes_out,
+        c->bytes_out > 0 ? (double)c->bytes_in / c->bytes_out : 0.0,
+        elapsed > 0 ? c->bytes_in / elapsed / 1000000.0 : 0.0);
+    for(i = 0; i < c->thread_count; i++) {
+        w = &c->workers[i];
+        say("\tThread %d:\t\t%lu bands, ratio %.2f, %.1f MB/s while busy, busy %.0f%%",
+            i, w->bands,
+            w->bytes_out > 0 ? (double)w->bytes_in / w->bytes_out : 0.0,
+            w->busy_us > 0 ? (double)w->bytes_in / w->busy_us : 0.0,
+            elapsed > 0 ? w->busy_us / elapsed / 10000.0 : 0.0);
+    }
+
+    for(i = 0; i < c->band_count; i++) {
+        free(c->band_data[i]);
+    }
+    free(c->band_data);
+    free(c->band_sizes);
+    free(c->index);
+    pthread_cond_destroy(&c->work);
+    pthread_cond_destroy(&c->done);
+    pthread_mutex_destroy(&c->lock);
+}
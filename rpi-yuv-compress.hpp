@@ -0,0 +1,69 @@
+#pragma once
+
+/*
+ * Lossless compression of raw frames on a pool of worker threads as the
+ * writer of an output queue, see rpi-yuv-codec.hpp for the format
+ */
+#include <pthread.h>
+
+#include "rpi-output-queue.hpp"
+#include "rpi-yuv-convert.hpp"
+#include "rpi-yuv-codec.hpp"
+
+#define YUV_COMPRESS_MAX_THREADS        8
+
+struct yuv_compressor;
+
+typedef struct
+{
+    struct yuv_compressor *c;
+    pthread_t thread;
+
+    // Counters
+    unsigned long bands;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    int64_t busy_us;
+} yuv_compress_worker;
+
+typedef struct yuv_compressor
+{
+    yuv_codec_frame_header header;
+    yuv_codec_plane planes[3];
+    int plane_count;
+    int band_count;
+    // Compressed bands of the current frame
+    unsigned char **band_data;
+    uint32_t *band_sizes;
+
+    // Frame being compressed, bands up to next_band are taken by the workers
+    const unsigned char *frame;
+    int next_band;
+    int bands_done;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    yuv_compress_worker workers[YUV_COMPRESS_MAX_THREADS];
+    int thread_count;
+
+    // Frame index written at the end
+    yuv_codec_index_entry *index;
+    int index_capacity;
+    uint64_t offset;
+
+    // Counters
+    unsigned long frames;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    int64_t start_time;
+} yuv_compressor;
+
+// Compress frames of the given layout cut in to bands of band_rows rows
+// on threads worker threads
+extern void yuv_compressor_init(yuv_compressor *c, const yuv_output_info *info, int threads, int band_rows);
+// output_queue_write_fn compressing and writing the frame
+extern size_t yuv_compressor_write(void *arg, int fd, const output_queue_item *item);
+// Write the frame index to fd after the writer thread is gone, stop the
+// workers and report the compression ratio and the throughput per worker
+extern void yuv_compressor_destroy(yuv_compressor *c, int fd);
@@ -0,0 +1,230 @@
+/*
+ * Conversion of I420 frame slices to other output pixel formats
+ *
+ * The converters read the plane spans straight from the OMX buffer and
+ * write the target layout, so the frame is touched only once. Interleaving
+ * is done with NEON when compiled for it (add -mfpu=neon to CFLAGS on
+ * Raspberry Pi 2 and newer) and SSE2 on x86.
+ */
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERT_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONVERT_USE_SSE2
+#endif
+
+#include "rpi-yuv-convert.hpp"
+
+// Write n pairs of U and V samples as UVUV...
+static void interleave_uv(unsigned char *dst, const unsigned char *u, const unsigned char *v, int n)
+{
+    int i = 0;
+#if defined(CONVERT_USE_SSE2)
+    for(; i + 16 <= n; i += 16) {
+        __m128i mu = _mm_loadu_si128((const __m128i *)(u + i));
+        __m128i mv = _mm_loadu_si128((const __m128i *)(v + i));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i),      _mm_unpacklo_epi8(mu, mv));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(mu, mv));
+    }
+#elif defined(CONVERT_USE_NEON)
+    for(; i + 16 <= n; i += 16) {
+        uint8x16x2_t uv;
+        uv.val[0] = vld1q_u8(u + i);
+        uv.val[1] = vld1q_u8(v + i);
+        vst2q_u8(dst + 2 * i, uv);
+    }
+#endif
+    for(; i < n; i++) {
+        dst[2 * i]     = u[i];
+        dst[2 * i + 1] = v[i];
+    }
+}
+
+// Write n pixels of Y with the U and V samples shared by pixel pairs as YUYV...
+static void interleave_yuyv(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int n)
+{
+    int i = 0;
+#if defined(CONVERT_USE_SSE2)
+    for(; i + 16 <= n; i += 16) {
+        __m128i my = _mm_loadu_si128((const __m128i *)(y + i));
+        __m128i uv = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i *)(u + i / 2)),
+            _mm_loadl_epi64((const __m128i *)(v + i / 2)));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i),      _mm_unpacklo_epi8(my, uv));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(my, uv));
+    }
+#elif defined(CONVERT_USE_NEON)
+    for(; i + 16 <= n; i += 16) {
+        uint8x8x2_t my = vld2_u8(y + i);
+        uint8x8x4_t yuyv;
+        yuyv.val[0] = my.val[0];
+        yuyv.val[1] = vld1_u8(u + i / 2);
+        yuyv.val[2] = my.val[1];
+        yuyv.val[3] = vld1_u8(v + i / 2);
+        vst4_u8(dst + 2 * i, yuyv);
+    }
+#endif
+    for(; i + 1 < n; i += 2) {
+        dst[2 * i]     = y[i];
+        dst[2 * i + 1] = u[i / 2];
+        dst[2 * i + 2] = y[i + 1];
+        dst[2 * i + 3] = v[i / 2];
+    }
+    if(i < n) {
+        dst[2 * i]     = y[i];
+        dst[2 * i + 1] = u[i / 2];
+    }
+}
+
+// Plane layout follows video-info.c of gstreamer-plugins-base like
+// get_i420_frame_info() does
+void get_yuv_output_info(OMX_COLOR_FORMATTYPE format, int width, int height, yuv_output_info *info)
+{
+    i420_frame_info i420;
+
+    memset(info, 0, sizeof(*info));
+    info->format = format;
+    info->width = width;
+    info->height = height;
+    switch(format) {
+        case OMX_COLOR_FormatYUV420Planar:
+            get_i420_frame_info(width, height, -1, -1, &i420);
+            memcpy(info->p_offset, i420.p_offset, sizeof(info->p_offset));
+            memcpy(info->p_stride, i420.p_stride, sizeof(info->p_stride));
+            info->size = i420.size;
+            break;
+        case OMX_COLOR_FormatYUV420SemiPlanar:
+            info->p_stride[0] = ROUND_UP_4(width);
+            info->p_stride[1] = info->p_stride[0];
+            info->p_offset[1] = info->p_stride[0] * ROUND_UP_2(height);
+            info->size = info->p_offset[1] + info->p_stride[1] * (ROUND_UP_2(height) / 2);
+            break;
+        case OMX_COLOR_FormatYCbYCr:
+            info->p_stride[0] = ROUND_UP_4(ROUND_UP_2(width) * 2);
+            info->size = info->p_stride[0] * height;
+            break;
+        case OMX_COLOR_FormatL8:
+            info->p_stride[0] = ROUND_UP_4(width);
+            info->size = info->p_stride[0] * height;
+            break;
+        default:
+            die("Unsupported output color format %s", dump_color_format(format));
+    }
+}
+
+const char *get_yuv_output_fourcc(OMX_COLOR_FORMATTYPE format)
+{
+    switch(format) {
+        case OMX_COLOR_FormatYUV420Planar:
+            return "I420";
+        case OMX_COLOR_FormatYUV420SemiPlanar:
+            return "NV12";
+        case OMX_COLOR_FormatYCbYCr:
+            return "YUY2";
+        case OMX_COLOR_FormatL8:
+            return "GREY";
+        default:
+            die("Unsupported output color format %s", dump_color_format(format));
+    }
+    return NULL;
+}
+
+void dump_yuv_output_info(const char *message, const yuv_output_info *info) {
+    say("%s output info:\n"
+        "\tFormat:\t\t\t%s\n"
+        "\tWidth:\t\t\t%d\n"
+        "\tHeight:\t\t\t%d\n"
+        "\tSize:\t\t\t%d\n"
+        "\tPlane strides:\t\t%d %d %d\n"
+        "\tPlane offsets:\t\t%d %d %d\n"
+        "\tCrop offset:\t\t%d,%d\n",
+            message, dump_color_format(info->format),
+            info->width, info->height, info->size,
+            info->p_stride[0], info->p_stride[1], info->p_stride[2],
+            info->p_offset[0], info->p_offset[1], info->p_offset[2],
+            info->crop_x, info->crop_y);
+}
+
+void crop_yuv_output_info(yuv_output_info *info, int source_width, int source_height, int x, int y, int width, int height)
+{
+    if((x | y | width | height) & 1) {
+        die("Crop rectangle %dx%d at %d,%d isn't aligned to chroma subsampling", width, height, x, y);
+    }
+    if(x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > source_width || y + height > source_height) {
+        die("Crop rectangle %dx%d at %d,%d doesn't fit in %dx%d frame", width, height, x, y, source_width, source_height);
+    }
+    get_yuv_output_info(info->format, width, height, info);
+    info->crop_x = x;
+    info->crop_y = y;
+}
+
+// Range [*begin, *end) of the rows of a slice of a plane starting at
+// frame row first with rows rows that are inside the crop rectangle
+static void crop_rows(int first, int rows, int crop_y, int height, int *begin, int *end)
+{
+    *begin = crop_y > first ? crop_y - first : 0;
+    *end = crop_y + height - first < rows ? crop_y + height - first : rows;
+}
+
+size_t convert_i420_slice(const yuv_output_info *info, const unsigned char *buf_start, const i420_frame_info *buf_info, int src_row, int valid_rows, unsigned char *dst)
+{
+    // Offsets of the crop rectangle in each source plane
+    const unsigned char *y = buf_start + buf_info->p_offset[0] + info->crop_x;
+    const unsigned char *u = buf_start + buf_info->p_offset[1] + info->crop_x / 2;
+    const unsigned char *v = buf_start + buf_info->p_offset[2] + info->crop_x / 2;
+    int height_uv = ROUND_UP_2(info->height) / 2, width_uv = ROUND_UP_2(info->width) / 2;
+    int dst_row = src_row - info->crop_y, dst_row_uv = dst_row / 2;
+    int row, begin, end, begin_uv, end_uv;
+    size_t written = 0;
+
+    crop_rows(src_row, valid_rows, info->crop_y, info->height, &begin, &end);
+    crop_rows(src_row / 2, valid_rows / 2, info->crop_y / 2, height_uv, &begin_uv, &end_uv);
+    if(end <= begin) {
+        return 0;
+    }
+
+    switch(info->format) {
+        case OMX_COLOR_FormatYUV420Planar:
+            for(row = begin; row < end; row++) {
+                memcpy(dst + (dst_row + row) * info->p_stride[0], y + row * buf_info->p_stride[0], info->width);
+            }
+            for(row = begin_uv; row < end_uv; row++) {
+                memcpy(dst + info->p_offset[1] + (dst_row_uv + row) * info->p_stride[1], u + row * buf_info->p_stride[1], width_uv);
+                memcpy(dst + info->p_offset[2] + (dst_row_uv + row) * info->p_stride[2], v + row * buf_info->p_stride[2], width_uv);
+            }
+            written = (end - begin) * info->p_stride[0] + (end_uv - begin_uv) * (info->p_stride[1] + info->p_stride[2]);
+            break;
+        case OMX_COLOR_FormatYUV420SemiPlanar:
+            for(row = begin; row < end; row++) {
+                memcpy(dst + (dst_row + row) * info->p_stride[0], y + row * buf_info->p_stride[0], info->width);
+            }
+            for(row = begin_uv; row < end_uv; row++) {
+                interleave_uv(dst + info->p_offset[1] + (dst_row_uv + row) * info->p_stride[1],
+                    u + row * buf_info->p_stride[1], v + row * buf_info->p_stride[2], width_uv);
+            }
+            written = (end - begin) * info->p_stride[0] + (end_uv - begin_uv) * info->p_stride[1];
+            break;
+        case OMX_COLOR_FormatYCbYCr:
+            // Each chroma row is shared by two rows of pixels
+            for(row = begin; row < end; row++) {
+                interleave_yuyv(dst + (dst_row + row) * info->p_stride[0],
+                    y + row * buf_info->p_stride[0],
+                    u + (row / 2) * buf_info->p_stride[1],
+                    v + (row / 2) * buf_info->p_stride[2],
+                    info->width);
+            }
+            written = (end - begin) * info->p_stride[0];
+            break;
+        case OMX_COLOR_FormatL8:
+            for(row = begin; row < end; row++) {
+                memcpy(dst + (dst_row + row) * info->p_stride[0], y + row * buf_info->p_stride[0], info->width);
+            }
+            written = (end - begin) * info->p_stride[0];
+            break;
+        default:
+            die("Unsupported output color format %s", dump_color_format(info->format));
+    }
+    return written;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+/*
+ * Conversion of I420 frame slices to other output pixel formats
+ */
+#include "rpi-i420-framing.hpp"
+
+typedef struct
+{
+    // One of OMX_COLOR_FormatYUV420Planar (I420), OMX_COLOR_FormatYUV420SemiPlanar (NV12),
+    // OMX_COLOR_FormatYCbYCr (YUY2) or OMX_COLOR_FormatL8 (GRAY8)
+    OMX_COLOR_FORMATTYPE format;
+    int width;
+    int height;
+    size_t size;
+    // Y or packed YUV plane and U, V or interleaved UV planes
+    int p_offset[3];
+    int p_stride[3];
+    // Top left corner of the output frame in the source frame
+    int crop_x;
+    int crop_y;
+} yuv_output_info;
+
+extern void get_yuv_output_info(OMX_COLOR_FORMATTYPE format, int width, int height, yuv_output_info *info);
+// Restrict the output to a rectangle of the source frame of source_width x source_height,
+// the corner and the size must be even to keep the chroma samples intact
+extern void crop_yuv_output_info(yuv_output_info *info, int source_width, int source_height, int x, int y, int width, int height);
+// Four character code of the format as I420, NV12, YUY2 or GREY
+extern const char *get_yuv_output_fourcc(OMX_COLOR_FORMATTYPE format);
+extern void dump_yuv_output_info(const char *message, const yuv_output_info *info);
+// Convert the planes of an OMX buffer holding the Y rows starting at src_row
+// of the frame in buf_info layout in to the frame at dst in one pass. Only the
+// rows and columns inside the crop rectangle are touched. Returns the number
+// of bytes written to the frame.
+extern size_t convert_i420_slice(const yuv_output_info *info, const unsigned char *buf_start, const i420_frame_info *buf_info, int src_row, int valid_rows, unsigned char *dst);
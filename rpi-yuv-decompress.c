@@ -0,0 +1,192 @@
+/*
+ * Short intro about this program:
+ *
+ * `rpi-yuv-decompress` decodes the losslessly compressed frames written by
+ * `rpi-camera-dump-yuv` when its COMPRESS is enabled back to raw frames.
+ * The compressed stream is read from `stdin` and the frames are written to
+ * `stdout` exactly as `rpi-camera-dump-yuv` would have written them.
+ *
+ *     $ ./rpi-camera-dump-yuv >test.yuvz
+ *     $ ./rpi-yuv-decompress <test.yuvz >test.yuv
+ *
+ * With `-l` as the only argument the frames are just listed with their
+ * timestamps and compression ratios instead of being written out.
+ *
+ * Please see README.mdwn for more detailed description of this
+ * OpenMAX IL demos for Raspberry Pi bundle.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpi-yuv-codec.hpp"
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int read_all(void *data, size_t len)
+{
+    return len == 0 || fread(data, len, 1, stdin) == 1;
+}
+
+static int check_index(const yuv_codec_index_entry *offsets, unsigned long frames)
+{
+    yuv_codec_index_header header;
+    yuv_codec_index_entry entry;
+    uint64_t index_offset;
+    unsigned long i;
+
+    // The magic is already read
+    if(!read_all(&header.frame_count, sizeof(header.frame_count))) {
+        fprintf(stderr, "Frame index cut short\n");
+        return 0;
+    }
+    if(header.frame_count != frames) {
+        fprintf(stderr, "Frame index has %u frames instead of %lu\n", header.frame_count, frames);
+        return 0;
+    }
+    for(i = 0; i < frames; i++) {
+        if(!read_all(&entry, sizeof(entry))) {
+            fprintf(stderr, "Frame index cut short\n");
+            return 0;
+        }
+        if(entry.offset != offsets[i].offset || entry.timestamp != offsets[i].timestamp) {
+            fprintf(stderr, "Frame index entry %lu doesn't match frame at offset %llu\n",
+                i, (unsigned long long)offsets[i].offset);
+            return 0;
+        }
+    }
+    if(!read_all(&index_offset, sizeof(index_offset))) {
+        fprintf(stderr, "Frame index offset missing\n");
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int list = argc > 1 && strcmp(argv[1], "-l") == 0;
+    yuv_codec_frame_header header;
+    yuv_codec_plane planes[3];
+    yuv_codec_index_entry *offsets = NULL;
+    unsigned char *payload = NULL, *frame = NULL, *band;
+    uint32_t *band_sizes;
+    size_t payload_capacity = 0, frame_capacity = 0;
+    uint64_t offset = 0;
+    unsigned long frames = 0, offsets_capacity = 0;
+    unsigned long long bytes_in = 0, bytes_out = 0;
+    int64_t start = now_us(), decode_us = 0, t;
+    int plane_count, band_num, plane, first_row, rows, indexed = 0;
+
+    while(read_all(&header.magic, sizeof(header.magic))) {
+        if(header.magic == YUV_CODEC_INDEX_MAGIC) {
+            if(!check_index(offsets, frames)) {
+                return 1;
+            }
+            indexed = 1;
+            break;
+        }
+        if(header.magic != YUV_CODEC_MAGIC
+                || !read_all((char *)&header + sizeof(header.magic), sizeof(header) - sizeof(header.magic))) {
+            fprintf(stderr, "No compressed frame at offset %llu\n", (unsigned long long)offset);
+            return 1;
+        }
+        if(header.version != YUV_CODEC_VERSION
+                || (plane_count = yuv_codec_get_planes(&header, planes)) == 0
+                || header.band_rows == 0
+                || header.band_count != yuv_codec_count_bands(planes, plane_count, header.band_rows)
+                || header.payload_size < header.band_count * sizeof(uint32_t)) {
+            fprintf(stderr, "Unsupported compressed frame %u at offset %llu\n",
+                header.frame_index, (unsigned long long)offset);
+            return 1;
+        }
+
+        if(header.payload_size > payload_capacity) {
+            payload_capacity = header.payload_size;
+            if((payload = realloc(payload, payload_capacity)) == NULL) {
+                fprintf(stderr, "Failed to allocate %u bytes\n", header.payload_size);
+                return 1;
+            }
+        }
+        if(header.size > frame_capacity) {
+            frame_capacity = header.size;
+            if((frame = realloc(frame, frame_capacity)) == NULL) {
+                fprintf(stderr, "Failed to allocate %u bytes\n", header.size);
+                return 1;
+            }
+        }
+        if(frames == offsets_capacity) {
+            offsets_capacity = offsets_capacity > 0 ? offsets_capacity * 2 : 1024;
+            if((offsets = realloc(offsets, offsets_capacity * sizeof(yuv_codec_index_entry))) == NULL) {
+                fprintf(stderr, "Failed to allocate frame index\n");
+                return 1;
+            }
+        }
+        if(!read_all(payload, header.payload_size)) {
+            fprintf(stderr, "Compressed frame %u cut short\n", header.frame_index);
+            return 1;
+        }
+        offsets[frames].offset = offset;
+        offsets[frames].timestamp = header.timestamp;
+
+        if(list) {
+            printf("%u %lld %u %.2f\n", header.frame_index, (long long)header.timestamp,
+                header.payload_size, (double)header.size / (sizeof(header) + header.payload_size));
+        } else {
+            t = now_us();
+            // Padding between the rows isn't stored
+            memset(frame, 0, header.size);
+            band_sizes = (uint32_t *)payload;
+            band = payload + header.band_count * sizeof(uint32_t);
+            for(band_num = 0; band_num < header.band_count; band_num++) {
+                yuv_codec_get_band(planes, plane_count, header.band_rows, band_num, &plane, &first_row, &rows);
+                if(band + (band_sizes[band_num] & ~YUV_CODEC_BAND_RAW) > payload + header.payload_size
+                        || planes[plane].offset + (size_t)(first_row + rows - 1) * planes[plane].stride + planes[plane].width > header.size
+                        || yuv_codec_decode_band(band, band_sizes[band_num],
+                            frame + planes[plane].offset + (size_t)first_row * planes[plane].stride,
+                            planes[plane].stride, planes[plane].width, rows, planes[plane].step) < 0) {
+                    fprintf(stderr, "Band %d of compressed frame %u is corrupted\n", band_num, header.frame_index);
+                    return 1;
+                }
+                band += band_sizes[band_num] & ~YUV_CODEC_BAND_RAW;
+            }
+            decode_us += now_us() - t;
+            if(fwrite(frame, header.size, 1, stdout) != 1) {
+                fprintf(stderr, "Failed to write frame: %s\n", strerror(errno));
+                return 1;
+            }
+        }
+
+        frames++;
+        offset += sizeof(header) + header.payload_size;
+        bytes_in += sizeof(header) + header.payload_size;
+        bytes_out += header.size;
+    }
+    if(!indexed) {
+        fprintf(stderr, "Frame index missing, the stream was cut short\n");
+    }
+
+    fprintf(stderr, "Decompression stats:\n"
+        "\tFrames:\t\t\t%lu\n"
+        "\tCompressed bytes:\t%llu\n"
+        "\tRaw bytes:\t\t%llu\n"
+        "\tCompression ratio:\t%.2f\n"
+        "\tDecoding throughput:\t%.1f MB/s\n"
+        "\tTime elapsed:\t\t%.1f s\n",
+        frames, bytes_in, bytes_out,
+        bytes_in > 0 ? (double)bytes_out / bytes_in : 0.0,
+        decode_us > 0 ? (double)bytes_out / decode_us : 0.0,
+        (now_us() - start) / 1000000.0);
+    free(payload);
+    free(frame);
+    free(offsets);
+
+    return indexed ? 0 : 1;
+}
@@ -0,0 +1,327 @@
+/*
+ * Reading raw YUV input in to PackedPlanar encoder input buffers
+ *
+ * Planar input is read straight in to the buffer. Interleaved input is read
+ * a few rows at a time in to a small staging area and split in to the Y, U,
+ * and V planes of the buffer from there. The deinterleaving is done with
+ * NEON when compiled for it (add -mfpu=neon to CFLAGS on Raspberry Pi 2 and
+ * newer) and SSE2 on x86.
+ */
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define INGEST_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define INGEST_USE_SSE2
+#endif
+
+#include "rpi-yuv-ingest.hpp"
+
+// Rows of interleaved input converted at a time, must be even
+#define INGEST_STAGING_ROWS 16
+
+// Split n UVUV... pairs in to U and V
+static void deinterleave_uv(unsigned char *u, unsigned char *v, const unsigned char *uv, int n)
+{
+    int i = 0;
+#if defined(INGEST_USE_SSE2)
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    for(; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(uv + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(uv + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(u + i), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+        _mm_storeu_si128((__m128i *)(v + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#elif defined(INGEST_USE_NEON)
+    for(; i + 16 <= n; i += 16) {
+        uint8x16x2_t s = vld2q_u8(uv + 2 * i);
+        vst1q_u8(u + i, s.val[0]);
+        vst1q_u8(v + i, s.val[1]);
+    }
+#endif
+    for(; i < n; i++) {
+        u[i] = uv[2 * i];
+        v[i] = uv[2 * i + 1];
+    }
+}
+
+// Split two rows of n YUYV... pixels in to two Y rows and one U and V row,
+// the chroma of the rows is averaged
+static void deinterleave_yuyv_pair(unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v,
+        const unsigned char *s0, const unsigned char *s1, int n)
+{
+    int i = 0;
+#if defined(INGEST_USE_SSE2)
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    for(; i + 16 <= n; i += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(s0 + 2 * i));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(s0 + 2 * i + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(s1 + 2 * i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(s1 + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(y0 + i), _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(b0, mask)));
+        _mm_storeu_si128((__m128i *)(y1 + i), _mm_packus_epi16(_mm_and_si128(a1, mask), _mm_and_si128(b1, mask)));
+        // UVUV... of both rows averaged
+        __m128i c = _mm_avg_epu8(
+            _mm_packus_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(b0, 8)),
+            _mm_packus_epi16(_mm_srli_epi16(a1, 8), _mm_srli_epi16(b1, 8)));
+        __m128i cu = _mm_and_si128(c, mask);
+        __m128i cv = _mm_srli_epi16(c, 8);
+        _mm_storel_epi64((__m128i *)(u + i / 2), _mm_packus_epi16(cu, cu));
+        _mm_storel_epi64((__m128i *)(v + i / 2), _mm_packus_epi16(cv, cv));
+    }
+#elif defined(INGEST_USE_NEON)
+    for(; i + 16 <= n; i += 16) {
+        uint8x8x4_t p0 = vld4_u8(s0 + 2 * i);
+        uint8x8x4_t p1 = vld4_u8(s1 + 2 * i);
+        uint8x8x2_t r0 = { { p0.val[0], p0.val[2] } };
+        uint8x8x2_t r1 = { { p1.val[0], p1.val[2] } };
+        vst2_u8(y0 + i, r0);
+        vst2_u8(y1 + i, r1);
+        vst1_u8(u + i / 2, vrhadd_u8(p0.val[1], p1.val[1]));
+        vst1_u8(v + i / 2, vrhadd_u8(p0.val[3], p1.val[3]));
+    }
+#endif
+    for(; i < n; i += 2) {
+        y0[i] = s0[2 * i];
+        y1[i] = s1[2 * i];
+        if(i + 1 < n) {
+            y0[i + 1] = s0[2 * i + 2];
+            y1[i + 1] = s1[2 * i + 2];
+        }
+        u[i / 2] = (s0[2 * i + 1] + s1[2 * i + 1] + 1) >> 1;
+        v[i / 2] = (s0[2 * i + 3] + s1[2 * i + 3] + 1) >> 1;
+    }
+}
+
+// Read rows of row_size bytes with src_stride spacing in the input in to
+// rows with dst_stride spacing, in one go when there's no padding to skip
+static size_t read_rows(yuv_ingest *ing, unsigned char *dst, int dst_stride, int src_stride, int row_size, int rows)
+{
+    size_t total = 0, r;
+    int row;
+    if(dst_stride == src_stride) {
+        return fread(dst, 1, (size_t)src_stride * rows, ing->fd);
+    }
+    for(row = 0; row < rows; row++) {
+        r = fread(dst + row * dst_stride, 1, row_size, ing->fd);
+        total += r;
+        if(r != row_size) {
+            break;
+        }
+        if(src_stride > row_size && fseek(ing->fd, src_stride - row_size, SEEK_CUR) != 0) {
+            // Not seekable, e.g. a pipe
+            char skip[src_stride - row_size];
+            if(fread(skip, 1, src_stride - row_size, ing->fd) != src_stride - row_size) {
+                break;
+            }
+        }
+        total += src_stride - row_size;
+    }
+    return total;
+}
+
+static void parse_y4m_header(yuv_ingest *ing)
+{
+    char header[256], *token, *save = NULL;
+    int c, len = 0;
+
+    while((c = fgetc(ing->fd)) != EOF && c != '\n') {
+        if(len == sizeof(header) - 1) {
+            die("YUV4MPEG2 stream header too long");
+        }
+        header[len++] = c;
+    }
+    header[len] = '\0';
+    if(strncmp(header, "YUV4MPEG2 ", 10) != 0) {
+        die("Input isn't a YUV4MPEG2 stream");
+    }
+    for(token = strtok_r(header + 10, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save)) {
+        switch(token[0]) {
+            case 'W':
+                ing->width = atoi(token + 1);
+                break;
+            case 'H':
+                ing->height = atoi(token + 1);
+                break;
+            case 'F':
+                if(sscanf(token + 1, "%d:%d", &ing->framerate_num, &ing->framerate_den) != 2
+                        || ing->framerate_num <= 0 || ing->framerate_den <= 0) {
+                    die("Invalid YUV4MPEG2 frame rate %s", token + 1);
+                }
+                break;
+            case 'C':
+                // 8-bit 4:2:0 only, the chroma siting variants don't matter
+                if(strcmp(token + 1, "420") != 0 && strcmp(token + 1, "420jpeg") != 0
+                        && strcmp(token + 1, "420mpeg2") != 0 && strcmp(token + 1, "420paldv") != 0) {
+                    die("Unsupported YUV4MPEG2 color space %s, only 8-bit 4:2:0 is supported", token + 1);
+                }
+                break;
+            default:
+                // Interlacing, aspect ratio and comments don't matter
+                break;
+        }
+    }
+    if(ing->width <= 0 || ing->height <= 0) {
+        die("YUV4MPEG2 stream header doesn't specify the frame size");
+    }
+}
+
+void yuv_ingest_init(yuv_ingest *ing, FILE *fd, OMX_COLOR_FORMATTYPE format, int y4m, int width, int height, int framerate)
+{
+    memset(ing, 0, sizeof(*ing));
+    ing->fd = fd;
+    ing->format = y4m ? OMX_COLOR_FormatYUV420Planar : format;
+    ing->y4m = y4m;
+    ing->width = width;
+    ing->height = height;
+    ing->framerate_num = framerate;
+    ing->framerate_den = 1;
+    if(y4m) {
+        parse_y4m_header(ing);
+    }
+    if(ing->format == OMX_COLOR_FormatL8) {
+        die("Unsupported input color format %s", dump_color_format(ing->format));
+    }
+    get_yuv_output_info(ing->format, ing->width, ing->height, &ing->info);
+    if(y4m) {
+        // YUV4MPEG2 frames have no padding
+        ing->info.p_stride[0] = ing->width;
+        ing->info.p_stride[1] = ing->info.p_stride[2] = (ing->width + 1) / 2;
+        ing->info.p_offset[1] = ing->width * ing->height;
+        ing->info.p_offset[2] = ing->info.p_offset[1] + ing->info.p_stride[1] * ((ing->height + 1) / 2);
+        ing->info.size = ing->info.p_offset[2] + ing->info.p_stride[2] * ((ing->height + 1) / 2);
+    }
+    if(ing->format != OMX_COLOR_FormatYUV420Planar) {
+        ing->staging_rows = INGEST_STAGING_ROWS;
+        if((ing->staging = malloc((size_t)ing->info.p_stride[0] * ing->staging_rows)) == NULL) {
+            die("Failed to allocate input staging rows");
+        }
+    }
+    say("Reading %s%dx%d input at %d/%d fps:",
+        y4m ? "YUV4MPEG2 " : "", ing->width, ing->height, ing->framerate_num, ing->framerate_den);
+    dump_yuv_output_info("Input frame", &ing->info);
+}
+
+int yuv_ingest_framerate(const yuv_ingest *ing)
+{
+    return (ing->framerate_num + ing->framerate_den / 2) / ing->framerate_den;
+}
+
+static yuv_ingest_status ingest_i420(yuv_ingest *ing, unsigned char *buf, const i420_frame_info *buf_info)
+{
+    size_t want, got;
+    int i, rows, row_size;
+    for(i = 0; i < 3; i++) {
+        rows     = i == 0 ? ing->height : ROUND_UP_2(ing->height) / 2;
+        row_size = i == 0 ? ing->width : ROUND_UP_2(ing->width) / 2;
+        want = (size_t)ing->info.p_stride[i] * rows;
+        got = read_rows(ing, buf + buf_info->p_offset[i], buf_info->p_stride[i], ing->info.p_stride[i], row_size, rows);
+        if(got != want) {
+            return i == 0 && got == 0 ? YUV_INGEST_EOF : YUV_INGEST_SHORT;
+        }
+    }
+    return YUV_INGEST_FRAME;
+}
+
+static yuv_ingest_status ingest_nv12(yuv_ingest *ing, unsigned char *buf, const i420_frame_info *buf_info)
+{
+    size_t want, got;
+    int rows_uv = ROUND_UP_2(ing->height) / 2, width_uv = ROUND_UP_2(ing->width) / 2;
+    int row = 0, rows, r;
+
+    want = (size_t)ing->info.p_stride[0] * ing->height;
+    got = read_rows(ing, buf + buf_info->p_offset[0], buf_info->p_stride[0], ing->info.p_stride[0], ing->width, ing->height);
+    if(got != want) {
+        return got == 0 ? YUV_INGEST_EOF : YUV_INGEST_SHORT;
+    }
+    while(row < rows_uv) {
+        rows = rows_uv - row < ing->staging_rows ? rows_uv - row : ing->staging_rows;
+        want = (size_t)ing->info.p_stride[1] * rows;
+        got = fread(ing->staging, 1, want, ing->fd);
+        if(got != want) {
+            return YUV_INGEST_SHORT;
+        }
+        for(r = 0; r < rows; r++) {
+            deinterleave_uv(
+                buf + buf_info->p_offset[1] + (row + r) * buf_info->p_stride[1],
+                buf + buf_info->p_offset[2] + (row + r) * buf_info->p_stride[2],
+                ing->staging + r * ing->info.p_stride[1], width_uv);
+        }
+        row += rows;
+    }
+    return YUV_INGEST_FRAME;
+}
+
+static yuv_ingest_status ingest_yuy2(yuv_ingest *ing, unsigned char *buf, const i420_frame_info *buf_info)
+{
+    size_t want, got;
+    int row = 0, rows, r;
+    const unsigned char *s0, *s1;
+
+    while(row < ing->height) {
+        rows = ing->height - row < ing->staging_rows ? ing->height - row : ing->staging_rows;
+        want = (size_t)ing->info.p_stride[0] * rows;
+        got = fread(ing->staging, 1, want, ing->fd);
+        if(got != want) {
+            return row == 0 && got == 0 ? YUV_INGEST_EOF : YUV_INGEST_SHORT;
+        }
+        for(r = 0; r < rows; r += 2) {
+            // The last row of odd height frame is paired with itself
+            s0 = ing->staging + r * ing->info.p_stride[0];
+            s1 = r + 1 < rows ? s0 + ing->info.p_stride[0] : s0;
+            deinterleave_yuyv_pair(
+                buf + buf_info->p_offset[0] + (row + r) * buf_info->p_stride[0],
+                buf + buf_info->p_offset[0] + (row + r + (s1 != s0)) * buf_info->p_stride[0],
+                buf + buf_info->p_offset[1] + ((row + r) / 2) * buf_info->p_stride[1],
+                buf + buf_info->p_offset[2] + ((row + r) / 2) * buf_info->p_stride[2],
+                s0, s1, ing->width);
+        }
+        row += rows;
+    }
+    return YUV_INGEST_FRAME;
+}
+
+yuv_ingest_status yuv_ingest_frame(yuv_ingest *ing, unsigned char *buf, const i420_frame_info *buf_info)
+{
+    char header[256];
+    yuv_ingest_status status;
+
+    if(ing->y4m) {
+        // Each frame is preceded by a FRAME header line
+        if(fgets(header, sizeof(header), ing->fd) == NULL) {
+            return YUV_INGEST_EOF;
+        }
+        if(strncmp(header, "FRAME", 5) != 0) {
+            die("Invalid YUV4MPEG2 frame header after frame %lu", ing->frames);
+        }
+    }
+    switch(ing->format) {
+        case OMX_COLOR_FormatYUV420Planar:
+            status = ingest_i420(ing, buf, buf_info);
+            break;
+        case OMX_COLOR_FormatYUV420SemiPlanar:
+            status = ingest_nv12(ing, buf, buf_info);
+            break;
+        case OMX_COLOR_FormatYCbYCr:
+            status = ingest_yuy2(ing, buf, buf_info);
+            break;
+        default:
+            die("Unsupported input color format %s", dump_color_format(ing->format));
+            return YUV_INGEST_EOF;
+    }
+    // A FRAME header without the frame is as good as a short frame
+    if(ing->y4m && status == YUV_INGEST_EOF) {
+        status = YUV_INGEST_SHORT;
+    }
+    if(status == YUV_INGEST_FRAME) {
+        ing->frames++;
+    }
+    return status;
+}
+
+void yuv_ingest_destroy(yuv_ingest *ing)
+{
+    say("Read %lu input frames", ing->frames);
+    free(ing->staging);
+}
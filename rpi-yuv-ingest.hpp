@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Reading raw YUV input in to PackedPlanar encoder input buffers
+ */
+#include "rpi-yuv-convert.hpp"
+
+typedef struct
+{
+    FILE *fd;
+    // Payload format, one of the formats supported by get_yuv_output_info()
+    // except OMX_COLOR_FormatL8, always I420 for YUV4MPEG2 input
+    OMX_COLOR_FORMATTYPE format;
+    // Frames are in YUV4MPEG2 stream
+    int y4m;
+    int width;
+    int height;
+    int framerate_num;
+    int framerate_den;
+    // Layout of the frames in the input
+    yuv_output_info info;
+    // A few rows of interleaved input waiting for conversion
+    unsigned char *staging;
+    int staging_rows;
+    unsigned long frames;
+} yuv_ingest;
+
+// Outcome of reading a frame
+typedef enum
+{
+    // Nothing left in the input
+    YUV_INGEST_EOF,
+    // The input ended in the middle of the frame
+    YUV_INGEST_SHORT,
+    // Whole frame read
+    YUV_INGEST_FRAME
+} yuv_ingest_status;
+
+// Raw input of given format and frame size or YUV4MPEG2 stream, in which case
+// the frame size and frame rate are read from the stream header in fd
+extern void yuv_ingest_init(yuv_ingest *ing, FILE *fd, OMX_COLOR_FORMATTYPE format, int y4m, int width, int height, int framerate);
+// Frame rate rounded to integer
+extern int yuv_ingest_framerate(const yuv_ingest *ing);
+// Read the next frame in to the buffer in buf_info layout. The buffer holds
+// a whole frame of buf_info->size bytes only if YUV_INGEST_FRAME is returned.
+extern yuv_ingest_status yuv_ingest_frame(yuv_ingest *ing, unsigned char *buf, const i420_frame_info *buf_info);
+extern void yuv_ingest_destroy(yuv_ingest *ing);
@@ -0,0 +1,182 @@
+/*
+ * Power of two downscaling of I420 frames slice by slice
+ *
+ * Each slice of the frame is downscaled while it's still hot in the cache
+ * from unpacking it. The rows of a block are summed vertically in to a
+ * row of 16 bit accumulators, adjacent accumulators are then summed
+ * pairwise as many times as the factor requires and the result is rounded
+ * back to 8 bits. NEON is used when compiled for it (add -mfpu=neon to
+ * CFLAGS on Raspberry Pi 2 and newer) and SSE2 on x86.
+ */
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCALE_USE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCALE_USE_SSE2
+#endif
+
+#include "rpi-yuv-scale.hpp"
+
+// acc[i] += src[i]
+static void accumulate_row(uint16_t *acc, const unsigned char *src, int n)
+{
+    int i = 0;
+#if defined(SCALE_USE_SSE2)
+    __m128i zero = _mm_setzero_si128();
+    for(; i + 16 <= n; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(acc + i + 8));
+        _mm_storeu_si128((__m128i *)(acc + i),     _mm_add_epi16(lo, _mm_unpacklo_epi8(s, zero)));
+        _mm_storeu_si128((__m128i *)(acc + i + 8), _mm_add_epi16(hi, _mm_unpackhi_epi8(s, zero)));
+    }
+#elif defined(SCALE_USE_NEON)
+    for(; i + 16 <= n; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        vst1q_u16(acc + i,     vaddw_u8(vld1q_u16(acc + i),     vget_low_u8(s)));
+        vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(s)));
+    }
+#endif
+    for(; i < n; i++) {
+        acc[i] += src[i];
+    }
+}
+
+// acc[i] = acc[2 * i] + acc[2 * i + 1] for i < n / 2, in place
+static void sum_pairs(uint16_t *acc, int n)
+{
+    int i = 0;
+#if defined(SCALE_USE_SSE2)
+    __m128i ones = _mm_set1_epi16(1);
+    for(; i + 8 <= n / 2; i += 8) {
+        // Sums are at most 64 * 255 so signed 16 bit arithmetic is fine
+        __m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(acc + 2 * i)), ones);
+        __m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(acc + 2 * i + 8)), ones);
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_packs_epi32(a, b));
+    }
+#elif defined(SCALE_USE_NEON)
+    for(; i + 8 <= n / 2; i += 8) {
+        uint16x8x2_t v = vld2q_u16(acc + 2 * i);
+        vst1q_u16(acc + i, vaddq_u16(v.val[0], v.val[1]));
+    }
+#endif
+    for(; i < n / 2; i++) {
+        acc[i] = acc[2 * i] + acc[2 * i + 1];
+    }
+}
+
+// dst[i] = round(acc[i] / (1 << shift))
+static void store_row(unsigned char *dst, const uint16_t *acc, int n, int shift)
+{
+    int i = 0;
+    uint16_t round = (1 << shift) >> 1;
+#if defined(SCALE_USE_SSE2)
+    __m128i r = _mm_set1_epi16(round);
+    __m128i s = _mm_cvtsi32_si128(shift);
+    for(; i + 16 <= n; i += 16) {
+        __m128i lo = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(acc + i)), r), s);
+        __m128i hi = _mm_srl_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(acc + i + 8)), r), s);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(SCALE_USE_NEON)
+    int16x8_t s = vdupq_n_s16(-shift);
+    uint16x8_t r = vdupq_n_u16(round);
+    for(; i + 16 <= n; i += 16) {
+        uint16x8_t lo = vshlq_u16(vaddq_u16(vld1q_u16(acc + i), r), s);
+        uint16x8_t hi = vshlq_u16(vaddq_u16(vld1q_u16(acc + i + 8), r), s);
+        vst1q_u8(dst + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+    }
+#endif
+    for(; i < n; i++) {
+        dst[i] = (acc[i] + round) >> shift;
+    }
+}
+
+// Downscale rows of one plane, the last block of the plane may be
+// short in which case its last row is repeated
+static void downscale_plane(i420_downscaler *ds,
+        const unsigned char *src, int src_stride, int src_width, int rows,
+        unsigned char *dst, int dst_stride, int dst_rows)
+{
+    int factor = 1 << ds->shift;
+    int out_width = src_width >> ds->shift;
+    int y, k, x, r;
+
+    for(y = 0; y * factor < rows && y < dst_rows; y++) {
+        memset(ds->acc, 0, src_width * sizeof(uint16_t));
+        if(ds->filter == DOWNSCALE_FILTER_BOX || factor == 2) {
+            for(k = 0; k < factor; k++) {
+                r = y * factor + k < rows ? y * factor + k : rows - 1;
+                accumulate_row(ds->acc, src + r * src_stride, src_width);
+            }
+            for(k = 0; k < ds->shift; k++) {
+                sum_pairs(ds->acc, src_width >> k);
+            }
+            store_row(dst + y * dst_stride, ds->acc, out_width, 2 * ds->shift);
+        } else {
+            for(k = factor / 2 - 1; k <= factor / 2; k++) {
+                r = y * factor + k < rows ? y * factor + k : rows - 1;
+                accumulate_row(ds->acc, src + r * src_stride, src_width);
+            }
+            // Only the two center columns of each block are needed
+            for(x = 0; x < out_width; x++) {
+                ds->acc[x] = ds->acc[x * factor + factor / 2 - 1] + ds->acc[x * factor + factor / 2];
+            }
+            store_row(dst + y * dst_stride, ds->acc, out_width, 2);
+        }
+    }
+}
+
+void i420_downscaler_init(i420_downscaler *ds, int width, int height, int slice_height, int shift, downscale_filter filter, int gray)
+{
+    int factor = 1 << shift;
+
+    memset(ds, 0, sizeof(*ds));
+    if(shift < 1 || shift > 3) {
+        die("Unsupported downscaling factor %d, only 2, 4 and 8 are supported", factor);
+    }
+    // Blocks must not cross the slices, the last one may be short though
+    if(width % (2 * factor) != 0 || slice_height % (2 * factor) != 0) {
+        die("Frame width %d and slice height %d must be divisible by %d for downscaling by %d",
+            width, slice_height, 2 * factor, factor);
+    }
+    ds->src_width = width;
+    ds->shift = shift;
+    ds->filter = filter;
+    ds->gray = gray;
+    get_i420_frame_info(width >> shift, (height + factor - 1) >> shift, -1, -1, &ds->info);
+    if(gray) {
+        ds->info.size = ds->info.p_offset[1];
+    }
+    if(posix_memalign((void **)&ds->acc, 16, width * sizeof(uint16_t)) != 0) {
+        die("Failed to allocate downscaling accumulator");
+    }
+    say("Downscaling %dx%d by %d with %s filter to %dx%d %s, %d bytes per frame",
+        width, height, factor, filter == DOWNSCALE_FILTER_BOX ? "box" : "bilinear",
+        ds->info.width, ds->info.height, gray ? "gray" : "I420", ds->info.size);
+}
+
+void i420_downscale_slice(i420_downscaler *ds, const unsigned char *buf_start, const i420_frame_info *buf_info, int src_row, int valid_rows, unsigned char *dst)
+{
+    int i, planes = ds->gray ? 1 : 3;
+    int dst_rows_y = ds->info.height, dst_rows_uv = ROUND_UP_2(ds->info.height) / 2;
+    int src_width, rows, dst_row, dst_rows;
+
+    for(i = 0; i < planes; i++) {
+        // Chroma planes have half the rows and columns
+        src_width = i == 0 ? ds->src_width : ds->src_width / 2;
+        rows      = i == 0 ? valid_rows : valid_rows / 2;
+        dst_row   = (i == 0 ? src_row : src_row / 2) >> ds->shift;
+        dst_rows  = (i == 0 ? dst_rows_y : dst_rows_uv) - dst_row;
+        downscale_plane(ds,
+            buf_start + buf_info->p_offset[i], buf_info->p_stride[i], src_width, rows,
+            dst + ds->info.p_offset[i] + dst_row * ds->info.p_stride[i], ds->info.p_stride[i], dst_rows);
+    }
+}
+
+void i420_downscaler_destroy(i420_downscaler *ds)
+{
+    free(ds->acc);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * Power of two downscaling of I420 frames slice by slice
+ */
+#include "rpi-i420-framing.hpp"
+
+typedef enum
+{
+    // Average of all the factor x factor source pixels
+    DOWNSCALE_FILTER_BOX,
+    // Interpolated at the center of the source block, i.e. average of
+    // the 2x2 source pixels there, much cheaper for the larger factors
+    DOWNSCALE_FILTER_BILINEAR
+} downscale_filter;
+
+typedef struct
+{
+    int src_width;
+    // Downscaling factor is 1 << shift
+    int shift;
+    downscale_filter filter;
+    // Emit only the Y plane
+    int gray;
+    // Layout of the downscaled frame
+    i420_frame_info info;
+    // Row of vertical sums for the widest plane
+    uint16_t *acc;
+} i420_downscaler;
+
+// Frame of width x height unpacked from slices of slice_height rows
+extern void i420_downscaler_init(i420_downscaler *ds, int width, int height, int slice_height, int shift, downscale_filter filter, int gray);
+// Downscale the planes of an OMX buffer holding the Y rows starting at
+// src_row of the frame in buf_info layout in to the frame at dst
+extern void i420_downscale_slice(i420_downscaler *ds, const unsigned char *buf_start, const i420_frame_info *buf_info, int src_row, int valid_rows, unsigned char *dst);
+extern void i420_downscaler_destroy(i420_downscaler *ds);